@@ -0,0 +1,154 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+
+/* Accept/dispatch latency of the server with many live connections.
+ *
+ * It opens idle connections to a running server (as many 'ts -w' or queued
+ * clients would), and at some levels measures the time to connect, send a
+ * GET_VERSION and receive the VERSION answer on a fresh connection.
+ *
+ * Usage: start a server (ts -S 1), then
+ *   bench_connections [live_connections] [samples]
+ * TS_SOCKET is honoured as in ts. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+#include "../main.h"
+
+static struct sockaddr_un addr;
+
+static void init_addr() {
+    const char *tmpdir;
+    const char *sock = getenv("TS_SOCKET");
+
+    addr.sun_family = AF_UNIX;
+    if (sock != NULL) {
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+        return;
+    }
+    tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+        tmpdir = "/tmp";
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/socket-ts.%u",
+             tmpdir, (unsigned int) getuid());
+}
+
+static int open_conn() {
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1)
+        return -1;
+    if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* One connect + GET_VERSION + VERSION round-trip, in microseconds */
+static double roundtrip() {
+    struct Msg m;
+    double t0 = now_us();
+    int s = open_conn();
+    int res;
+
+    if (s == -1) {
+        perror("connect");
+        exit(1);
+    }
+    memset(&m, 0, sizeof(m));
+    m.type = GET_VERSION;
+    send(s, &m, sizeof(m), 0);
+    res = recv(s, &m, sizeof(m), MSG_WAITALL);
+    if (res != sizeof(m) || m.type != VERSION) {
+        fprintf(stderr, "Unexpected answer from the server\n");
+        exit(1);
+    }
+    t0 = now_us() - t0;
+    close(s);
+    return t0;
+}
+
+static void measure(int live, int samples) {
+    double *t = malloc(samples * sizeof(double));
+    double sum = 0;
+    int i;
+
+    for (i = 0; i < samples; ++i) {
+        t[i] = roundtrip();
+        sum += t[i];
+    }
+    qsort(t, samples, sizeof(double), cmp_double);
+    printf("%8i %10.1f %10.1f %10.1f %10.1f\n", live, sum / samples,
+           t[samples / 2], t[(int) (samples * 0.99)], t[samples - 1]);
+    free(t);
+}
+
+int main(int argc, char **argv) {
+    int target = argc > 1 ? atoi(argv[1]) : 10000;
+    int samples = argc > 2 ? atoi(argv[2]) : 1000;
+    int *conns;
+    int live = 0;
+    int next_level = 0;
+    struct rlimit rlim;
+
+    if (samples < 1)
+        samples = 1;
+
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    rlim.rlim_cur = rlim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlim);
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    if (rlim.rlim_cur != RLIM_INFINITY && (rlim_t) target + 16 > rlim.rlim_cur) {
+        target = rlim.rlim_cur - 16;
+        fprintf(stderr, "Open files limited to %i connections\n", target);
+    }
+
+    init_addr();
+    conns = malloc((target + 1) * sizeof(int));
+
+    printf("%8s %10s %10s %10s %10s  (microseconds)\n",
+           "live", "mean", "p50", "p99", "max");
+    while (1) {
+        if (live == next_level) {
+            measure(live, samples);
+            if (live >= target)
+                break;
+            next_level = next_level ? next_level * 10 : 10;
+            if (next_level > target)
+                next_level = target;
+        }
+        conns[live] = open_conn();
+        if (conns[live] == -1) {
+            perror("connect");
+            return 1;
+        }
+        ++live;
+    }
+
+    while (live > 0)
+        close(conns[--live]);
+    free(conns);
+    return 0;
+}
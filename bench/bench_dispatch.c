@@ -0,0 +1,150 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+
+/* Time to full utilization after the slots are raised.
+ *
+ * With one slot, it queues as many jobs as slots to raise to; the first
+ * one runs. Then it sends SET_MAX_SLOTS, and measures the time until all
+ * run. Each job writes its pid to a file as it starts, and sleeps: the
+ * file is what tells how many run, so the server gets no other message
+ * that could make it look at the queue again. The jobs are run by their
+ * ts clients, or with 'exec' by the server (--server_exec). It gives up
+ * after 10 seconds. At the end it kills the jobs and stops the server.
+ *
+ * Usage: bench_dispatch ts_binary [slots] [exec]
+ * with TS_SOCKET for a server of its own, e.g.
+ *   TS_SOCKET=/tmp/bench.socket bench_dispatch ./ts 64 exec */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../main.h"
+
+static const char *ts;
+static char started[100];
+
+static int open_conn() {
+    struct sockaddr_un addr;
+    const char *sock = getenv("TS_SOCKET");
+    int s;
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1 || connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+    return s;
+}
+
+static void run_ts(const char *args) {
+    char cmd[1000];
+
+    snprintf(cmd, sizeof(cmd), "%s %s > /dev/null", ts, args);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Failed: %s\n", cmd);
+        exit(1);
+    }
+}
+
+/* Jobs that started, by the lines of the file */
+static int count_started() {
+    FILE *f = fopen(started, "r");
+    int lines = 0;
+    int c;
+
+    if (f == NULL)
+        return 0;
+    while ((c = getc(f)) != EOF)
+        if (c == '\n')
+            ++lines;
+    fclose(f);
+    return lines;
+}
+
+static void kill_started() {
+    FILE *f = fopen(started, "r");
+    int pid;
+
+    if (f == NULL)
+        return;
+    while (fscanf(f, "%i", &pid) == 1)
+        kill(pid, SIGTERM);
+    fclose(f);
+}
+
+static double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+int main(int argc, char **argv) {
+    int slots = argc > 2 ? atoi(argv[2]) : 32;
+    int exec = argc > 3 && strcmp(argv[3], "exec") == 0;
+    char args[300];
+    struct Msg m;
+    double t0, t;
+    int running = 0;
+    int s;
+    int i;
+
+    if (argc < 2 || getenv("TS_SOCKET") == NULL || slots < 2) {
+        fprintf(stderr, "usage: TS_SOCKET=... %s ts [slots] [exec]\n", argv[0]);
+        return 1;
+    }
+    ts = argv[1];
+    snprintf(started, sizeof(started), "/tmp/bench_dispatch.%i", (int) getpid());
+    unlink(started);
+
+    run_ts("-S 1");
+    snprintf(args, sizeof(args), "%s-n sh -c 'echo $$ >> %s; exec sleep 600'",
+             exec ? "--server_exec " : "", started);
+    for (i = 0; i < slots; ++i)
+        run_ts(args);
+    while (count_started() < 1)
+        usleep(1000);
+    /* Nothing else going on in the server */
+    usleep(100000);
+
+    memset(&m, 0, sizeof(m));
+    m.type = SET_MAX_SLOTS;
+    m.u.max_slots = slots;
+    s = open_conn();
+    t0 = now_ms();
+    if (send(s, &m, sizeof(m), 0) != sizeof(m)) {
+        perror("send");
+        return 1;
+    }
+    close(s);
+
+    do {
+        running = count_started();
+        t = now_ms();
+        if (running < slots)
+            usleep(200);
+    } while (running < slots && t - t0 < 10000);
+
+    if (running < slots)
+        printf("%i slots, %s jobs: %i running after %.0f ms\n", slots,
+               exec ? "server_exec" : "client", running, t - t0);
+    else
+        printf("%i slots, %s jobs: all running in %.2f ms\n", slots,
+               exec ? "server_exec" : "client", t - t0);
+
+    kill_started();
+    run_ts("-K");
+    unlink(started);
+    return 0;
+}
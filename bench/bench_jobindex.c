@@ -0,0 +1,117 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+
+/* Cost of finding a job by jobid, as 'ts -s N', 'ts -i N' or 'ts -w N' do.
+ *
+ * For queues from 100 to 1M jobs, it fills the jobid index of jobs.c the way
+ * the server does (increasing jobids, the oldest ones removed as they leave
+ * the finished list), and measures random lookups. The walk of a singly
+ * linked list, which the server did before, is shown for comparison while
+ * it is cheap enough to run.
+ *
+ * Usage: bench_jobindex [max_jobs] [lookups] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "../main.h"
+
+/* intmap.c only needs error() */
+void error(const char *str, ...) {
+    va_list ap;
+
+    va_start(ap, str);
+    vfprintf(stderr, str, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static struct Job *list_find(struct Job *first, int jobid) {
+    struct Job *p = first;
+
+    while (p != 0 && p->jobid != jobid)
+        p = p->next;
+    return p;
+}
+
+static void measure(int n, int lookups) {
+    struct Intmap index;
+    struct Job *jobs = calloc(n, sizeof(struct Job));
+    int *keys = malloc(lookups * sizeof(int));
+    int churn = n / 10;
+    long found = 0;
+    double t0, t_index, t_list = -1;
+    int i;
+
+    intmap_init(&index);
+
+    /* Some jobs came and went before the current ones */
+    for (i = 0; i < churn; ++i)
+        intmap_put(&index, i, &jobs[i]);
+    for (i = 0; i < churn; ++i)
+        intmap_del(&index, i);
+
+    for (i = 0; i < n; ++i) {
+        jobs[i].jobid = churn + i;
+        jobs[i].next = (i + 1 < n) ? &jobs[i + 1] : 0;
+        intmap_put(&index, jobs[i].jobid, &jobs[i]);
+    }
+
+    for (i = 0; i < lookups; ++i)
+        keys[i] = churn + rand() % n;
+
+    t0 = now_ns();
+    for (i = 0; i < lookups; ++i)
+        found += intmap_get(&index, keys[i]) != 0;
+    t_index = (now_ns() - t0) / lookups;
+
+    if (found != lookups) {
+        fprintf(stderr, "The index lost jobs\n");
+        exit(1);
+    }
+
+    if (n <= 100000) {
+        int list_lookups = lookups / (n / 100 + 1);
+
+        t0 = now_ns();
+        for (i = 0; i < list_lookups; ++i)
+            found += list_find(jobs, keys[i]) != 0;
+        t_list = (now_ns() - t0) / list_lookups;
+    }
+
+    if (t_list >= 0)
+        printf("%8i %12.1f %12.1f\n", n, t_index, t_list);
+    else
+        printf("%8i %12.1f %12s\n", n, t_index, "-");
+
+    intmap_free(&index);
+    free(keys);
+    free(jobs);
+}
+
+int main(int argc, char **argv) {
+    int max = argc > 1 ? atoi(argv[1]) : 1000000;
+    int lookups = argc > 2 ? atoi(argv[2]) : 1000000;
+    int n;
+
+    if (lookups < 1)
+        lookups = 1;
+
+    srand(1);
+    printf("%8s %12s %12s  (ns per lookup)\n", "jobs", "index", "list walk");
+    for (n = 100; n <= max; n *= 10)
+        measure(n, lookups);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+
+/* Time for a server to come back from its journal.
+ *
+ * It queues jobs in batches, as 'ts --batch' does, behind a long job that
+ * takes the only slot, so each one is a record in the journal. Then it
+ * stops the server and starts it again, which replays the snapshot and
+ * the journal before it answers. It prints the time of that start, and
+ * that of a start without anything to replay.
+ *
+ * Usage: bench_journal ts_binary [jobs]
+ * with TS_SOCKET and TS_JOURNAL for a server of its own, e.g.
+ *   export TS_SOCKET=/tmp/bench.socket TS_JOURNAL=/tmp/bench.journal
+ *   bench_journal ./ts 1000000
+ * It removes the journal before and after. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../main.h"
+
+enum {
+    BATCH = 10000
+};
+
+static const char *ts;
+
+static int open_conn() {
+    struct sockaddr_un addr;
+    const char *sock = getenv("TS_SOCKET");
+    int s;
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1 || connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+    return s;
+}
+
+static double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static void send_all(int s, const void *data, int bytes) {
+    if (bytes > 0 && send(s, data, bytes, 0) != bytes) {
+        perror("send");
+        exit(1);
+    }
+}
+
+static void run_ts(const char *args) {
+    char cmd[1000];
+
+    snprintf(cmd, sizeof(cmd), "%s %s > /dev/null", ts, args);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Failed: %s\n", cmd);
+        exit(1);
+    }
+}
+
+/* 'count' jobs in one NEWJOB_BATCH */
+static void submit_batch(int s, int first, int count, char *payload) {
+    static const char argv[] = "true";
+    static const char cwd[] = "/";
+    struct Msg m;
+    int pos = 0;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        struct Batchjob b;
+        char command[40];
+
+        snprintf(command, sizeof(command), "true %i", first + i);
+        memset(&b, 0, sizeof(b));
+        b.command_size = strlen(command) + 1;
+        b.argv_size = sizeof(argv);
+        b.num_slots = 1;
+        memcpy(payload + pos, &b, sizeof(b));
+        pos += sizeof(b);
+        memcpy(payload + pos, command, b.command_size);
+        pos += b.command_size;
+        memcpy(payload + pos, argv, sizeof(argv));
+        pos += sizeof(argv);
+    }
+
+    memset(&m, 0, sizeof(m));
+    m.type = NEWJOB_BATCH;
+    m.u.newjob.store_output = 1;
+    m.u.newjob.should_keep_finished = 1;
+    m.u.newjob.cwd_size = sizeof(cwd);
+    m.u.newjob.batch_count = count;
+    m.u.newjob.batch_size = pos;
+    send_all(s, &m, sizeof(m));
+    send_all(s, cwd, sizeof(cwd));
+    send_all(s, payload, pos);
+
+    if (recv(s, &m, sizeof(m), MSG_WAITALL) != sizeof(m) || m.type != NEWJOB_OK) {
+        fprintf(stderr, "Unexpected answer from the server\n");
+        exit(1);
+    }
+}
+
+static long long file_size(const char *path) {
+    struct stat st;
+
+    return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+static void remove_journal(const char *journal) {
+    char snap[1000];
+
+    snprintf(snap, sizeof(snap), "%s.snap", journal);
+    unlink(journal);
+    unlink(snap);
+}
+
+int main(int argc, char **argv) {
+    const char *journal = getenv("TS_JOURNAL");
+    int jobs = argc > 2 ? atoi(argv[2]) : 1000000;
+    char *payload;
+    char snap[1000];
+    double t0, t_replay, t_empty;
+    int s;
+    int i;
+
+    if (argc < 2 || journal == NULL || getenv("TS_SOCKET") == NULL) {
+        fprintf(stderr, "usage: TS_SOCKET=... TS_JOURNAL=... %s ts [jobs]\n",
+                argv[0]);
+        return 1;
+    }
+    ts = argv[1];
+    snprintf(snap, sizeof(snap), "%s.snap", journal);
+    remove_journal(journal);
+
+    payload = malloc(BATCH * (sizeof(struct Batchjob) + 60));
+    run_ts("-S 1");
+    run_ts("--server_exec sleep 600");
+    s = open_conn();
+    for (i = 0; i < jobs; i += BATCH)
+        submit_batch(s, i, jobs - i < BATCH ? jobs - i : BATCH, payload);
+    close(s);
+    run_ts("-K");
+
+    printf("%i jobs: journal %lld bytes, snapshot %lld bytes\n", jobs,
+           file_size(journal), file_size(snap));
+
+    /* The server starts with the first client */
+    t0 = now_ms();
+    run_ts("-S 1");
+    t_replay = now_ms() - t0;
+    run_ts("-K");
+
+    remove_journal(journal);
+    t0 = now_ms();
+    run_ts("-S 1");
+    t_empty = now_ms() - t0;
+    run_ts("-K");
+    remove_journal(journal);
+
+    printf("start with the journal: %.1f ms; without anything to replay: %.1f ms\n",
+           t_replay, t_empty);
+    free(payload);
+    return 0;
+}
@@ -0,0 +1,166 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+
+/* Time to get the list of a long queue, as 'ts -l' does.
+ *
+ * It queues jobs as 'ts --server_exec' does, half of them with a label,
+ * and then asks for the list several times, each on a new connection. It
+ * prints the time from the request until the server closes the connection
+ * after the last line: the rendering and the transfer of the list. Then
+ * it does the same with the poll of a dashboard: the running jobs, as JSON.
+ *
+ * Usage: start a server and keep its slot busy, so the queue doesn't drain:
+ *   ts -S 1; ts sleep 600
+ *   bench_list [jobs] [samples]
+ *   ts -K
+ * TS_SOCKET is honoured as in ts. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../main.h"
+
+static int open_conn() {
+    struct sockaddr_un addr;
+    const char *sock = getenv("TS_SOCKET");
+    int s;
+
+    addr.sun_family = AF_UNIX;
+    if (sock != NULL)
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+    else {
+        const char *tmpdir = getenv("TMPDIR");
+        if (tmpdir == NULL)
+            tmpdir = "/tmp";
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/socket-ts.%u",
+                 tmpdir, (unsigned int) getuid());
+    }
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1 || connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+    return s;
+}
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void send_all(int s, const void *data, int bytes) {
+    if (bytes > 0 && send(s, data, bytes, 0) != bytes) {
+        perror("send");
+        exit(1);
+    }
+}
+
+static void submit(int s, int n) {
+    static const char argv[] = "sleep\0" "10";
+    static const char cwd[] = "/";
+    char command[40];
+    char label[40];
+    struct Msg m;
+
+    snprintf(command, sizeof(command), "sleep %i", n);
+    snprintf(label, sizeof(label), "label-%i", n);
+
+    memset(&m, 0, sizeof(m));
+    m.type = NEWJOB;
+    m.u.newjob.command_size = strlen(command) + 1;
+    m.u.newjob.label_size = (n % 2) ? strlen(label) + 1 : 0;
+    m.u.newjob.store_output = 1;
+    m.u.newjob.num_slots = 1;
+    m.u.newjob.wait_free_gpus = 1;
+    m.u.newjob.server_exec = 1;
+    m.u.newjob.argv_size = sizeof(argv);
+    m.u.newjob.cwd_size = sizeof(cwd);
+
+    send_all(s, &m, sizeof(m));
+    send_all(s, command, m.u.newjob.command_size);
+    send_all(s, label, m.u.newjob.label_size);
+    send_all(s, argv, sizeof(argv));
+    send_all(s, cwd, sizeof(cwd));
+
+    if (recv(s, &m, sizeof(m), MSG_WAITALL) != sizeof(m) || m.type != NEWJOB_OK) {
+        fprintf(stderr, "Unexpected answer from the server\n");
+        exit(1);
+    }
+}
+
+/* Bytes of the list */
+static long list(char *buffer, int size, const struct List_filter *f) {
+    struct Msg m;
+    long total = 0;
+    int s = open_conn();
+    int res;
+
+    memset(&m, 0, sizeof(m));
+    m.type = LIST;
+    m.u.list = *f;
+    m.u.list.term_width = 80;
+    send_all(s, &m, sizeof(m));
+
+    while ((res = recv(s, buffer, size, 0)) > 0)
+        total += res;
+    close(s);
+    return total;
+}
+
+static void measure(const char *name, const struct List_filter *f,
+                    int samples, char *buffer, int size) {
+    double best = -1, sum = 0;
+    long bytes = 0;
+    int i;
+
+    for (i = 0; i < samples; ++i) {
+        double t0 = now_ms(), t;
+
+        bytes = list(buffer, size, f);
+        t = now_ms() - t0;
+        sum += t;
+        if (best < 0 || t < best)
+            best = t;
+    }
+    printf("%s, %ld bytes: %.2f ms mean, %.2f ms best per list\n",
+           name, bytes, sum / samples, best);
+}
+
+int main(int argc, char **argv) {
+    int jobs = argc > 1 ? atoi(argv[1]) : 100000;
+    int samples = argc > 2 ? atoi(argv[2]) : 10;
+    char *buffer = malloc(1 << 20);
+    struct List_filter all, running;
+    int s;
+    int i;
+
+    if (samples < 1)
+        samples = 1;
+
+    s = open_conn();
+    for (i = 0; i < jobs; ++i)
+        submit(s, i);
+    close(s);
+
+    memset(&all, 0, sizeof(all));
+    running = all;
+    running.states = 1 << RUNNING;
+    running.format = LIST_JSON;
+
+    printf("%i jobs\n", jobs);
+    measure("all", &all, samples, buffer, 1 << 20);
+    measure("running, json", &running, samples, buffer, 1 << 20);
+    free(buffer);
+    return 0;
+}
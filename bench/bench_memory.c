@@ -0,0 +1,210 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+
+/* Memory of the server for each queued job.
+ *
+ * It queues an array of jobs in batches, as 'ts --batch' does, behind a
+ * long job that takes the only slot. They all have the same label, the
+ * environment of this process, and one of a hundred commands. It prints
+ * the resident memory of the server before and after, and per job.
+ *
+ * Usage: bench_memory ts_binary [jobs]
+ * with TS_SOCKET for a server of its own, e.g.
+ *   TS_SOCKET=/tmp/bench.socket bench_memory ./ts 200000
+ * The long job tells the pid of the server. It stops the server at the end. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../main.h"
+
+enum {
+    BATCH = 1000
+};
+
+extern char **environ;
+
+static const char *ts;
+
+static int open_conn() {
+    struct sockaddr_un addr;
+    const char *sock = getenv("TS_SOCKET");
+    int s;
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1 || connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+    return s;
+}
+
+static void send_all(int s, const void *data, int bytes) {
+    if (bytes > 0 && send(s, data, bytes, 0) != bytes) {
+        perror("send");
+        exit(1);
+    }
+}
+
+static void run_ts(const char *args, char *out, int out_size) {
+    char cmd[1000];
+    FILE *f;
+
+    snprintf(cmd, sizeof(cmd), "%s %s", ts, args);
+    f = popen(cmd, "r");
+    if (f == NULL || (out && fgets(out, out_size, f) == NULL)) {
+        fprintf(stderr, "Failed: %s\n", cmd);
+        exit(1);
+    }
+    pclose(f);
+}
+
+/* The environment, packed as the client sends it */
+static char *pack_environ(int *size) {
+    char *packed;
+    int pos = 0;
+    int i;
+
+    *size = 0;
+    for (i = 0; environ[i] != NULL; ++i)
+        *size += strlen(environ[i]) + 1;
+    packed = malloc(*size);
+    for (i = 0; environ[i] != NULL; ++i) {
+        strcpy(packed + pos, environ[i]);
+        pos += strlen(environ[i]) + 1;
+    }
+    return packed;
+}
+
+static void submit_batch(int s, int first, int count, char *payload,
+                         const char *envp, int envp_size) {
+    static const char cwd[] = "/home/user/experiments";
+    static const char label[] = "sweep";
+    struct Msg m;
+    int pos = 0;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        struct Batchjob b;
+        char command[60];
+
+        snprintf(command, sizeof(command), "python train.py --lr 0.00%02i",
+                 (first + i) % 100);
+        memset(&b, 0, sizeof(b));
+        b.command_size = strlen(command) + 1;
+        b.argv_size = b.command_size;
+        b.label_size = sizeof(label);
+        b.num_slots = 1;
+        memcpy(payload + pos, &b, sizeof(b));
+        pos += sizeof(b);
+        memcpy(payload + pos, command, b.command_size);
+        pos += b.command_size;
+        memcpy(payload + pos, command, b.argv_size);
+        pos += b.argv_size;
+        memcpy(payload + pos, label, sizeof(label));
+        pos += sizeof(label);
+    }
+
+    memset(&m, 0, sizeof(m));
+    m.type = NEWJOB_BATCH;
+    m.u.newjob.store_output = 1;
+    m.u.newjob.should_keep_finished = 1;
+    m.u.newjob.envp_size = envp_size;
+    m.u.newjob.cwd_size = sizeof(cwd);
+    m.u.newjob.batch_count = count;
+    m.u.newjob.batch_size = pos;
+    send_all(s, &m, sizeof(m));
+    send_all(s, envp, envp_size);
+    send_all(s, cwd, sizeof(cwd));
+    send_all(s, payload, pos);
+
+    if (recv(s, &m, sizeof(m), MSG_WAITALL) != sizeof(m) || m.type != NEWJOB_OK) {
+        fprintf(stderr, "Unexpected answer from the server\n");
+        exit(1);
+    }
+}
+
+static long rss_kb(int pid) {
+    char path[100];
+    char line[200];
+    long kb = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%i/status", pid);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+int main(int argc, char **argv) {
+    int jobs = argc > 2 ? atoi(argv[2]) : 200000;
+    char line[PATH_MAX];
+    char *payload;
+    char *envp;
+    int envp_size;
+    long before, after;
+    int pid = 0;
+    FILE *f;
+    int s;
+    int i;
+
+    if (argc < 2 || getenv("TS_SOCKET") == NULL) {
+        fprintf(stderr, "usage: TS_SOCKET=... %s ts [jobs]\n", argv[0]);
+        return 1;
+    }
+    ts = argv[1];
+
+    /* Its output tells the pid of the server, its parent */
+    run_ts("-S 1", NULL, 0);
+    run_ts("--server_exec sh -c 'echo $PPID; exec sleep 600'", NULL, 0);
+    sleep(1);
+    run_ts("-o 0", line, sizeof(line));
+    line[strcspn(line, "\n")] = '\0';
+    f = fopen(line, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s\n", line);
+        return 1;
+    }
+    /* After the line with the command */
+    while (pid == 0 && fgets(line, sizeof(line), f) != NULL)
+        sscanf(line, "%i", &pid);
+    fclose(f);
+    if (pid == 0) {
+        fprintf(stderr, "Cannot read the pid of the server\n");
+        return 1;
+    }
+
+    envp = pack_environ(&envp_size);
+    payload = malloc(BATCH * (sizeof(struct Batchjob) + 200));
+    before = rss_kb(pid);
+    s = open_conn();
+    for (i = 0; i < jobs; i += BATCH)
+        submit_batch(s, i, jobs - i < BATCH ? jobs - i : BATCH, payload,
+                     envp, envp_size);
+    close(s);
+    after = rss_kb(pid);
+
+    printf("%i jobs, environment of %i bytes: rss %ld KB -> %ld KB, %.0f bytes/job\n",
+           jobs, envp_size, before, after, (after - before) * 1024.0 / jobs);
+
+    run_ts("-K", NULL, 0);
+    free(payload);
+    free(envp);
+    return 0;
+}
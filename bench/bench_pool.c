@@ -0,0 +1,212 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+
+/* Memory of the jobs under churn, with malloc and with pool.c.
+ *
+ * Each cycle queues a number of jobs with what the server allocates for
+ * them: the struct Job, its command, label, dependencies, GPU ids and
+ * exec info, plus the output filename, which stays malloc'd. Then all finish and ts -C clears them, but for one in a
+ * hundred that goes on running through the next cycles. It prints the
+ * RSS and the calls to malloc after each cycle, and the RSS once the long
+ * ones end too, for each way; each runs in a process of its own.
+ *
+ * Usage: bench_pool [jobs] [cycles] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../main.h"
+
+/* pool.c only needs error() */
+void error(const char *str, ...) {
+    va_list ap;
+
+    va_start(ap, str);
+    vfprintf(stderr, str, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static int use_pool;
+static long long mallocs;
+
+static void *job_alloc(int size) {
+    if (use_pool)
+        return pool_alloc(size);
+    ++mallocs;
+    return malloc(size);
+}
+
+static char *job_copy(const char *data, int size) {
+    char *str = job_alloc(size + 1);
+
+    memcpy(str, data, size);
+    str[size] = '\0';
+    return str;
+}
+
+static void job_free(void *ptr) {
+    if (use_pool)
+        pool_free(ptr);
+    else
+        free(ptr);
+}
+
+static char *heap_copy(const char *str) {
+    char *copy = malloc(strlen(str) + 1);
+
+    ++mallocs;
+    strcpy(copy, str);
+    return copy;
+}
+
+static struct Job *new_job(int jobid, const char *envp, int envp_size) {
+    struct Job *p = job_alloc(sizeof(*p));
+    struct Execinfo *e = job_alloc(sizeof(*e));
+    char text[200];
+    int n;
+
+    memset(p, 0, sizeof(*p));
+    p->jobid = jobid;
+    n = snprintf(text, sizeof(text), "./train --seed %i --epochs %i",
+                 jobid, 10 + jobid % 90);
+    p->command = job_copy(text, n);
+    if (jobid % 3 == 0) {
+        n = snprintf(text, sizeof(text), "sweep-%i", jobid % 50);
+        p->label = job_copy(text, n);
+    }
+    if (jobid % 4 == 0) {
+        p->depend_on_size = 1 + jobid % 3;
+        p->depend_on = job_alloc(p->depend_on_size * sizeof(struct Interval));
+    }
+    p->num_gpus = jobid % 2;
+    p->gpu_ids = job_alloc((p->num_gpus + 1) * sizeof(int));
+
+    e->argv_size = strlen(p->command) + 1;
+    e->argv = job_copy(p->command, e->argv_size);
+    e->envp_size = envp_size;
+    e->envp = job_copy(envp, envp_size);
+    e->cwd = job_copy("/home/user/experiments", 22);
+    e->logfile = 0;
+    p->exec = e;
+
+    /* As it runs and finishes */
+    snprintf(text, sizeof(text), "/tmp/ts-out.%06i", jobid);
+    p->output_filename = heap_copy(text);
+    return p;
+}
+
+static void free_job(struct Job *p) {
+    free(p->output_filename);
+    job_free(p->command);
+    job_free(p->label);
+    job_free(p->depend_on);
+    job_free(p->gpu_ids);
+    job_free(p->exec->argv);
+    job_free(p->exec->envp);
+    job_free(p->exec->cwd);
+    job_free(p->exec);
+    job_free(p);
+}
+
+static long rss_kb() {
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size = 0, resident = 0;
+
+    if (f == NULL)
+        return -1;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+        resident = -1;
+    fclose(f);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static void run(int jobs, int cycles) {
+    struct Job **running = malloc(jobs * sizeof(*running));
+    struct Job **kept = 0;
+    char envp[2000];
+    int nkept = 0;
+    int jobid = 0;
+    int cycle;
+    int i;
+
+    /* An environment as TS_ENV would send, of varied sizes */
+    memset(envp, 'x', sizeof(envp));
+
+    printf("%s:\n", use_pool ? "pool" : "malloc");
+    for (cycle = 0; cycle < cycles; ++cycle) {
+        double t0 = now_ms();
+        int slabs = 0, slabs_made = 0;
+
+        for (i = 0; i < jobs; ++i, ++jobid)
+            running[i] = new_job(jobid, envp, 500 + jobid % 1500);
+
+        /* ts -C, but for the long ones */
+        kept = realloc(kept, (nkept + jobs / 100 + 1) * sizeof(*kept));
+        for (i = 0; i < jobs; ++i) {
+            if (i % 100 == 99)
+                kept[nkept++] = running[i];
+            else
+                free_job(running[i]);
+        }
+        /* The oldest of the long ones end */
+        if (nkept > jobs / 25) {
+            int old = nkept - jobs / 25;
+
+            for (i = 0; i < old; ++i)
+                free_job(kept[i]);
+            memmove(kept, kept + old, (nkept - old) * sizeof(*kept));
+            nkept -= old;
+        }
+
+        if (use_pool)
+            pool_stats(&slabs, &slabs_made);
+        printf("  cycle %2i: rss %7ld KB, %9lld mallocs, %4i slabs (%i made), %.0f ms\n",
+               cycle, rss_kb(), mallocs + slabs_made, slabs, slabs_made,
+               now_ms() - t0);
+    }
+
+    /* The long ones end too, and ts -C */
+    for (i = 0; i < nkept; ++i)
+        free_job(kept[i]);
+    printf("  all cleared: rss %7ld KB\n", rss_kb());
+    fflush(stdout);
+    free(running);
+    free(kept);
+}
+
+int main(int argc, char **argv) {
+    int jobs = argc > 1 ? atoi(argv[1]) : 200000;
+    int cycles = argc > 2 ? atoi(argv[2]) : 10;
+    int mode;
+
+    printf("%i jobs a cycle, %i cycles\n", jobs, cycles);
+    fflush(stdout);
+    for (mode = 0; mode < 2; ++mode) {
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            use_pool = mode;
+            run(jobs, cycles);
+            exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,208 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+
+/* Scheduling latency with a long queue that cannot run.
+ *
+ * The server looks for a job to run after every message it handles. This
+ * sets up 2 slots, one of them taken by a long job, and queues jobs that
+ * can't start: half of them need 2 slots, the other half depend on the
+ * long job. At some queue lengths up to the given one, it measures the
+ * round trip of a GET_VERSION, which includes that scheduling pass. At the
+ * end it prints the time per job taken by the submissions, half of which
+ * add a dependent to the same job.
+ *
+ * Usage: bench_schedule [queued_jobs] [samples]
+ * It starts nothing: run it against a fresh server of its own, e.g.
+ *   export TS_SOCKET=/tmp/bench.socket; ts -S 2; bench_schedule 100000
+ * and it shuts that server down at the end. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../main.h"
+
+static struct sockaddr_un addr;
+
+static void init_addr() {
+    const char *tmpdir;
+    const char *sock = getenv("TS_SOCKET");
+
+    addr.sun_family = AF_UNIX;
+    if (sock != NULL) {
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+        return;
+    }
+    tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+        tmpdir = "/tmp";
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/socket-ts.%u",
+             tmpdir, (unsigned int) getuid());
+}
+
+static int open_conn() {
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (s == -1 || connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+    return s;
+}
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void send_all(int s, const void *data, int bytes) {
+    if (bytes > 0 && send(s, data, bytes, 0) != bytes) {
+        perror("send");
+        exit(1);
+    }
+}
+
+static void recv_answer(int s, struct Msg *m, enum MsgTypes type) {
+    if (recv(s, m, sizeof(*m), MSG_WAITALL) != sizeof(*m) || m->type != type) {
+        fprintf(stderr, "Unexpected answer from the server\n");
+        exit(1);
+    }
+}
+
+/* As 'ts --server_exec [-N slots] [-D depend] cmd'; argv is packed as
+ * "sleep\0" "3600\0" */
+static int submit(int s, const char *cmd, const char *argv, int argv_size,
+                  int slots, int depend) {
+    static const char cwd[] = "/";
+    int size = strlen(cmd) + 1;
+    struct Msg m;
+
+    memset(&m, 0, sizeof(m));
+    m.type = NEWJOB;
+    m.u.newjob.command_size = size;
+    m.u.newjob.num_slots = slots;
+    m.u.newjob.depend_on_size = depend >= 0 ? 1 : 0;
+    m.u.newjob.wait_free_gpus = 1;
+    m.u.newjob.server_exec = 1;
+    m.u.newjob.argv_size = argv_size;
+    m.u.newjob.cwd_size = sizeof(cwd);
+
+    send_all(s, &m, sizeof(m));
+    if (depend >= 0) {
+        int one = 1;
+        send_all(s, &one, sizeof(int));
+        send_all(s, &depend, sizeof(int));
+    }
+    send_all(s, cmd, size);
+    send_all(s, argv, argv_size);
+    send_all(s, cwd, sizeof(cwd));
+
+    recv_answer(s, &m, NEWJOB_OK);
+    return m.u.jobid;
+}
+
+static void measure(int s, int queued, int samples) {
+    double *t = malloc(samples * sizeof(double));
+    double sum = 0;
+    struct Msg m;
+    int i;
+
+    for (i = 0; i < samples; ++i) {
+        double t0 = now_us();
+
+        memset(&m, 0, sizeof(m));
+        m.type = GET_VERSION;
+        send_all(s, &m, sizeof(m));
+        recv_answer(s, &m, VERSION);
+        t[i] = now_us() - t0;
+        sum += t[i];
+    }
+    qsort(t, samples, sizeof(double), cmp_double);
+    printf("%8i %10.1f %10.1f %10.1f\n", queued, sum / samples,
+           t[samples / 2], t[(int) (samples * 0.99)]);
+    free(t);
+}
+
+int main(int argc, char **argv) {
+    int target = argc > 1 ? atoi(argv[1]) : 100000;
+    int samples = argc > 2 ? atoi(argv[2]) : 1000;
+    int queued = 0;
+    int next_level = 0;
+    int blocker;
+    double submit_time = 0;
+    struct Msg m;
+    int s;
+
+    if (samples < 1)
+        samples = 1;
+
+    init_addr();
+    s = open_conn();
+
+    memset(&m, 0, sizeof(m));
+    m.type = SET_MAX_SLOTS;
+    m.u.max_slots = 2;
+    send_all(s, &m, sizeof(m));
+
+    blocker = submit(s, "sleep 3600", "sleep\0" "3600", 11, 1, -1);
+
+    printf("%8s %10s %10s %10s  (microseconds per message)\n",
+           "queued", "mean", "p50", "p99");
+    while (1) {
+        if (queued == next_level) {
+            measure(s, queued, samples);
+            if (queued >= target)
+                break;
+            next_level = next_level ? next_level * 10 : 1000;
+            if (next_level > target)
+                next_level = target;
+        }
+        {
+            double t0 = now_us();
+
+            if (queued % 2)
+                submit(s, "true", "true", 5, 2, -1);
+            else
+                submit(s, "true", "true", 5, 1, blocker);
+            submit_time += now_us() - t0;
+        }
+        ++queued;
+    }
+
+    if (queued > 0)
+        printf("submission: %.1f microseconds per job\n", submit_time / queued);
+
+    /* The pid of the long job, to end it after the server */
+    memset(&m, 0, sizeof(m));
+    m.type = ASK_OUTPUT;
+    m.u.jobid = blocker;
+    send_all(s, &m, sizeof(m));
+    recv_answer(s, &m, ANSWER_OUTPUT);
+
+    {
+        int pid = m.u.output.pid;
+
+        memset(&m, 0, sizeof(m));
+        m.type = KILL_SERVER;
+        send_all(s, &m, sizeof(m));
+        close(s);
+        if (pid > 0)
+            kill(pid, SIGTERM);
+    }
+    return 0;
+}
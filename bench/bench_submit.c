@@ -0,0 +1,120 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+
+/* Cost of enqueuing many jobs into a long queue.
+ *
+ * It submits jobs as 'ts --server_exec' does, over one connection, and
+ * prints the time per job for each tenth of them. With a linear time
+ * enqueue the figure stays flat as the queue grows.
+ *
+ * Usage: start a server and keep its slot busy, so the queue doesn't drain:
+ *   ts -S 1; ts sleep 600
+ *   bench_submit [jobs]
+ *   ts -K
+ * TS_SOCKET is honoured as in ts. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../main.h"
+
+static int open_conn() {
+    struct sockaddr_un addr;
+    const char *sock = getenv("TS_SOCKET");
+    int s;
+
+    addr.sun_family = AF_UNIX;
+    if (sock != NULL)
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+    else {
+        const char *tmpdir = getenv("TMPDIR");
+        if (tmpdir == NULL)
+            tmpdir = "/tmp";
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/socket-ts.%u",
+                 tmpdir, (unsigned int) getuid());
+    }
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1 || connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+    return s;
+}
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void send_all(int s, const void *data, int bytes) {
+    if (bytes > 0 && send(s, data, bytes, 0) != bytes) {
+        perror("send");
+        exit(1);
+    }
+}
+
+static void submit(int s) {
+    static const char command[] = "true";
+    static const char argv[] = "true";
+    static const char cwd[] = "/";
+    struct Msg m;
+
+    memset(&m, 0, sizeof(m));
+    m.type = NEWJOB;
+    m.u.newjob.command_size = sizeof(command);
+    m.u.newjob.store_output = 0;
+    m.u.newjob.should_keep_finished = 0;
+    m.u.newjob.num_slots = 1;
+    m.u.newjob.wait_free_gpus = 1;
+    m.u.newjob.server_exec = 1;
+    m.u.newjob.argv_size = sizeof(argv);
+    m.u.newjob.cwd_size = sizeof(cwd);
+
+    send_all(s, &m, sizeof(m));
+    send_all(s, command, sizeof(command));
+    send_all(s, argv, sizeof(argv));
+    send_all(s, cwd, sizeof(cwd));
+
+    if (recv(s, &m, sizeof(m), MSG_WAITALL) != sizeof(m) || m.type != NEWJOB_OK) {
+        fprintf(stderr, "Unexpected answer from the server\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv) {
+    int jobs = argc > 1 ? atoi(argv[1]) : 100000;
+    int step;
+    int s;
+    int i;
+    double t0, start;
+
+    if (jobs < 10)
+        jobs = 10;
+    step = jobs / 10;
+
+    s = open_conn();
+    printf("%10s %12s  (microseconds per job)\n", "queued", "enqueue");
+    start = t0 = now_s();
+    for (i = 1; i <= jobs; ++i) {
+        submit(s);
+        if (i % step == 0) {
+            double t = now_s();
+            printf("%10i %12.2f\n", i, (t - t0) * 1e6 / step);
+            t0 = t;
+        }
+    }
+    printf("total %.2fs, %.0f jobs/s\n", now_s() - start, jobs / (now_s() - start));
+    close(s);
+    return 0;
+}
@@ -11,9 +11,22 @@
 #include <sys/socket.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "main.h"
 
+extern char **environ;
+
+/* Agreed with the server in c_check_version() */
+static int server_framing;
+
+/* Below this, sending the environments again costs less than asking the
+ * server whether it has them */
+enum {
+    DATA_QUERY_MIN = 8 * 1024
+};
+
 static void c_end_of_job(const struct Result *res);
 
 static void c_wait_job_send();
@@ -53,14 +66,139 @@ char *build_command_string() {
     return commandstring;
 }
 
+/* The strings one after the other, each with its null */
+static char *pack_strings(char **array, int num, int *size) {
+    char *packed;
+    int i, pos;
+
+    *size = 0;
+    for (i = 0; i < num; ++i)
+        *size += strlen(array[i]) + 1;
+
+    packed = (char *) malloc(*size + 1);
+    if (packed == 0)
+        error("Cannot allocate %i bytes for the strings", *size);
+
+    pos = 0;
+    for (i = 0; i < num; ++i) {
+        strcpy(packed + pos, array[i]);
+        pos += strlen(array[i]) + 1;
+    }
+    return packed;
+}
+
+static char *get_cwd() {
+    int size = 256;
+    char *dir = 0;
+
+    while (1) {
+        dir = (char *) realloc(dir, size);
+        if (dir == 0)
+            error("Cannot allocate %i bytes for the working directory", size);
+        if (getcwd(dir, size) != 0)
+            return dir;
+        if (errno != ERANGE)
+            error("Cannot get the working directory");
+        size *= 2;
+    }
+}
+
+/* Each id of the ranges of the dependencies, for a server that doesn't
+ * know DEPEND_RANGE */
+static void expand_ranges(int **depend_on, int *size) {
+    int *ids;
+    long long count = 0;
+    int i, n;
+
+    if (server_framing >= FRAMING_RANGES)
+        return;
+    for (i = 0; i < *size; ++i) {
+        if ((*depend_on)[i] == DEPEND_RANGE && i + 3 < *size) {
+            count += ((*depend_on)[i + 2] - (*depend_on)[i + 1]) / (*depend_on)[i + 3] + 1;
+            i += 3;
+        } else
+            ++count;
+    }
+    if (count == *size)
+        return;
+    if (count > MAX_FRAME_SIZE / (int) sizeof(int))
+        error("Too many dependencies for this server: %lld", count);
+
+    ids = (int *) malloc(count * sizeof(int));
+    if (ids == 0)
+        error("Cannot allocate %lld dependencies", count);
+    n = 0;
+    for (i = 0; i < *size; ++i) {
+        if ((*depend_on)[i] == DEPEND_RANGE && i + 3 < *size) {
+            int id;
+
+            for (id = (*depend_on)[i + 1]; id <= (*depend_on)[i + 2];
+                 id += (*depend_on)[i + 3])
+                ids[n++] = id;
+            i += 3;
+        } else
+            ids[n++] = (*depend_on)[i];
+    }
+    free(*depend_on);
+    *depend_on = ids;
+    *size = n;
+}
+
+/* The environment and the envp of a job, by their hash, to the server.
+ * Those it has already are not sent again: their sizes become -1 */
+static void query_known(const char *env, int *env_size,
+                        const char *envp, int *envp_size) {
+    struct Msg m = default_msg();
+    int res;
+
+    if (server_framing < FRAMING_DATA_QUERY
+        || *env_size + *envp_size < DATA_QUERY_MIN)
+        return;
+
+    m.type = DATA_QUERY;
+    m.u.data.hash[DATA_ENV] = intern_hash(env, *env_size);
+    m.u.data.size[DATA_ENV] = *env_size;
+    m.u.data.hash[DATA_ENVP] = intern_hash(envp, *envp_size);
+    m.u.data.size[DATA_ENVP] = *envp_size;
+    send_msg(server_socket, &m);
+
+    res = recv_msg(server_socket, &m);
+    if (res == -1 || m.type != DATA_KNOWN)
+        error("Error getting the data known by the server");
+    if (m.u.data.size[DATA_ENV] > 0)
+        *env_size = -1;
+    if (m.u.data.size[DATA_ENVP] > 0)
+        *envp_size = -1;
+}
+
+/* The resources of --res, for the job that comes next */
+static void send_job_resources() {
+    struct Msg m = default_msg();
+
+    if (command_line.resources == 0)
+        return;
+    if (server_framing < FRAMING_RESOURCES)
+        error("The server does not know the resources of the jobs. "
+              "Restart it or ts --upgrade");
+
+    m.type = JOB_RESOURCES;
+    m.u.size = strlen(command_line.resources) + 1;
+    send_msg(server_socket, &m);
+    send_bytes(server_socket, command_line.resources, m.u.size);
+}
+
 void c_new_job() {
     struct Msg m = default_msg();
     char *new_command;
     char *myenv;
+    char *exec_argv = 0;
+    char *exec_envp = 0;
+    char *exec_cwd = 0;
 
     m.type = NEWJOB;
 
     new_command = build_command_string();
+    expand_ranges(&command_line.depend_on, &command_line.depend_on_size);
 
     myenv = get_environment();
 
@@ -80,9 +218,36 @@ void c_new_job() {
     m.u.newjob.command_size = strlen(new_command) + 1; /* add null */
     m.u.newjob.wait_enqueuing = command_line.wait_enqueuing;
     m.u.newjob.num_slots = command_line.num_slots;
+    m.u.newjob.priority = command_line.priority;
+    m.runtime = command_line.runtime;
     m.u.newjob.gpus = command_line.gpus;
     m.u.newjob.wait_free_gpus = command_line.wait_free_gpus;
 
+    /* The server will run the job itself */
+    if (command_line.server_exec) {
+        int nenv;
+
+        for (nenv = 0; environ[nenv] != 0; ++nenv)
+            ;
+        exec_argv = pack_strings(command_line.command.array,
+                                 command_line.command.num, &m.u.newjob.argv_size);
+        exec_envp = pack_strings(environ, nenv, &m.u.newjob.envp_size);
+        exec_cwd = get_cwd();
+        m.u.newjob.server_exec = 1;
+        m.u.newjob.cwd_size = strlen(exec_cwd) + 1; /* add null */
+        if (command_line.logfile)
+            m.u.newjob.logfile_size = strlen(command_line.logfile) + 1;
+        else
+            m.u.newjob.logfile_size = 0;
+        m.u.newjob.gzip = command_line.gzip;
+        m.u.newjob.stderr_apart = command_line.stderr_apart;
+        m.u.newjob.send_output_by_mail = command_line.send_output_by_mail;
+        m.u.newjob.require_elevel = command_line.require_elevel;
+    }
+
+    query_known(myenv, &m.u.newjob.env_size, exec_envp, &m.u.newjob.envp_size);
+    send_job_resources();
+
     /* Send the message */
     send_msg(server_socket, &m);
 
@@ -103,8 +268,18 @@ void c_new_job() {
     /* Send the environment */
     send_bytes(server_socket, myenv, m.u.newjob.env_size);
 
+    if (command_line.server_exec) {
+        send_bytes(server_socket, exec_argv, m.u.newjob.argv_size);
+        send_bytes(server_socket, exec_envp, m.u.newjob.envp_size);
+        send_bytes(server_socket, exec_cwd, m.u.newjob.cwd_size);
+        send_bytes(server_socket, command_line.logfile, m.u.newjob.logfile_size);
+    }
+
     free(new_command);
     free(myenv);
+    free(exec_argv);
+    free(exec_envp);
+    free(exec_cwd);
     free(command_line.depend_on);
 }
 
@@ -125,6 +300,247 @@ int c_wait_newjob_ok() {
     return m.u.jobid;
 }
 
+/* The jobs of 'ts --batch' go to the server in messages of up to this many */
+enum {
+    BATCH_MAX_JOBS = 1000
+};
+
+struct Batch {
+    char *data;
+    int size;
+    int alloc;
+    int count;
+};
+
+static void batch_append(struct Batch *b, const void *data, int size) {
+    if (size == 0)
+        return;
+    if (b->size + size > b->alloc) {
+        while (b->size + size > b->alloc)
+            b->alloc = b->alloc ? 2 * b->alloc : 4096;
+        b->data = (char *) realloc(b->data, b->alloc);
+        if (b->data == 0)
+            error("Cannot allocate %i bytes for the batch", b->alloc);
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+/* A whole line of f, without the newline; 0 at the end of the file */
+static char *read_line(FILE *f, char **buf, int *alloc) {
+    int len = 0;
+
+    while (1) {
+        if (*alloc - len < 2) {
+            *alloc = *alloc ? 2 * *alloc : 1024;
+            *buf = (char *) realloc(*buf, *alloc);
+            if (*buf == 0)
+                error("Cannot allocate %i bytes for a line of the batch", *alloc);
+        }
+        if (fgets(*buf + len, *alloc - len, f) == 0)
+            return len > 0 ? *buf : 0;
+        len += strlen(*buf + len);
+        if ((*buf)[len - 1] == '\n') {
+            (*buf)[len - 1] = '\0';
+            return *buf;
+        }
+    }
+}
+
+/* The next word of the line, or 0 */
+static char *next_word(char **line) {
+    char *word;
+
+    while (**line == ' ' || **line == '\t')
+        ++*line;
+    if (**line == '\0')
+        return 0;
+    word = *line;
+    while (**line != '\0' && **line != ' ' && **line != '\t')
+        ++*line;
+    if (**line != '\0')
+        *(*line)++ = '\0';
+    return word;
+}
+
+/* A line is [-d] [-D id,...] [-W id,...] [-L label] [-N num] [-G num] [--]
+ * and the command, which the server runs with sh -c */
+static void batch_add_line(struct Batch *b, char *line, int lineno) {
+    struct Batchjob j;
+    char *word;
+    char *label = command_line.label;
+    int *depend_on = 0;
+    int ndepend = 0;
+    char *argv[3];
+    char *exec_argv;
+
+    memset(&j, 0, sizeof(j));
+    j.num_slots = command_line.num_slots;
+    j.gpus = command_line.gpus;
+
+    while (*line == ' ' || *line == '\t')
+        ++line;
+    while (line[0] == '-') {
+        char *arg = 0;
+
+        word = next_word(&line);
+        if (strcmp(word, "--") == 0)
+            break;
+        if (strcmp(word, "-d") != 0) {
+            arg = next_word(&line);
+            if (arg == 0)
+                error("Option %s without argument, in the line %i of the batch",
+                      word, lineno);
+        }
+        if (strcmp(word, "-d") == 0) {
+            free(depend_on);
+            depend_on = (int *) malloc(sizeof(int));
+            depend_on[0] = -1;
+            ndepend = 1;
+        } else if (strcmp(word, "-D") == 0 || strcmp(word, "-W") == 0) {
+            free(depend_on);
+            depend_on = (int *) malloc(2 * (strlen(arg) + 1) * sizeof(int));
+            ndepend = parse_depends(arg, depend_on);
+            if (ndepend < 0)
+                error("Wrong range of job ids in the line %i of the batch", lineno);
+            expand_ranges(&depend_on, &ndepend);
+            j.require_elevel = word[1] == 'W';
+        } else if (strcmp(word, "-L") == 0)
+            label = arg;
+        else if (strcmp(word, "-N") == 0) {
+            j.num_slots = atoi(arg);
+            if (j.num_slots <= 0)
+                error("Wrong number of slots in the line %i of the batch", lineno);
+#ifndef CPU
+        } else if (strcmp(word, "-G") == 0) {
+            j.gpus = atoi(arg);
+            if (j.gpus < 0)
+                error("Wrong number of GPUs in the line %i of the batch", lineno);
+#endif
+        } else
+            error("Wrong option %s in the line %i of the batch", word, lineno);
+        while (*line == ' ' || *line == '\t')
+            ++line;
+    }
+    if (*line == '\0')
+        error("No command in the line %i of the batch", lineno);
+
+    argv[0] = "/bin/sh";
+    argv[1] = "-c";
+    argv[2] = line;
+    exec_argv = pack_strings(argv, 3, &j.argv_size);
+    j.command_size = strlen(line) + 1;
+    j.label_size = label ? strlen(label) + 1 : 0;
+    j.depend_on_size = ndepend;
+
+    batch_append(b, &j, sizeof(j));
+    batch_append(b, depend_on, ndepend * sizeof(int));
+    batch_append(b, line, j.command_size);
+    batch_append(b, exec_argv, j.argv_size);
+    batch_append(b, label, j.label_size);
+    ++b->count;
+
+    free(depend_on);
+    free(exec_argv);
+}
+
+/* Send the jobs gathered, and print their ids */
+static void batch_send(struct Batch *b, const char *env, const char *envp,
+                       int envp_size, const char *cwd) {
+    struct Msg m = default_msg();
+    int first;
+    int i;
+
+    m.type = NEWJOB_BATCH;
+    m.u.newjob.env_size = env ? strlen(env) + 1 : 0;
+    m.u.newjob.store_output = command_line.store_output;
+    m.u.newjob.should_keep_finished = command_line.should_keep_finished;
+    m.u.newjob.server_exec = 1;
+    m.u.newjob.envp_size = envp_size;
+    m.u.newjob.cwd_size = strlen(cwd) + 1;
+    m.u.newjob.logfile_size = command_line.logfile ? strlen(command_line.logfile) + 1 : 0;
+    m.u.newjob.gzip = command_line.gzip;
+    m.u.newjob.stderr_apart = command_line.stderr_apart;
+    m.u.newjob.send_output_by_mail = command_line.send_output_by_mail;
+    m.u.newjob.priority = command_line.priority;
+    m.runtime = command_line.runtime;
+    m.u.newjob.batch_count = b->count;
+    m.u.newjob.batch_size = b->size;
+
+    query_known(env, &m.u.newjob.env_size, envp, &m.u.newjob.envp_size);
+    send_job_resources();
+
+    send_msg(server_socket, &m);
+    send_bytes(server_socket, env, m.u.newjob.env_size);
+    send_bytes(server_socket, envp, m.u.newjob.envp_size);
+    send_bytes(server_socket, cwd, m.u.newjob.cwd_size);
+    send_bytes(server_socket, command_line.logfile, m.u.newjob.logfile_size);
+    send_bytes(server_socket, b->data, b->size);
+
+    first = c_wait_newjob_ok();
+    if (first == -1)
+        error("The server did not queue the batch");
+    if (command_line.store_output)
+        for (i = 0; i < b->count; ++i)
+            printf("%i\n", first + i);
+
+    b->size = 0;
+    b->count = 0;
+}
+
+/* Queue the jobs of a file, one per line, to be run by the server */
+void c_queue_batch() {
+    struct Batch b = { 0, 0, 0, 0 };
+    FILE *f;
+    char *env;
+    char *envp;
+    int envp_size;
+    char *cwd;
+    char *line = 0;
+    int line_alloc = 0;
+    int lineno = 0;
+    int nenv;
+
+    if (strcmp(command_line.batch_file, "-") == 0)
+        f = stdin;
+    else {
+        f = fopen(command_line.batch_file, "r");
+        if (f == 0)
+            error("Cannot open the batch file %s", command_line.batch_file);
+    }
+
+    /* The same for all the jobs */
+    env = get_environment();
+    for (nenv = 0; environ[nenv] != 0; ++nenv)
+        ;
+    envp = pack_strings(environ, nenv, &envp_size);
+    cwd = get_cwd();
+
+    while (read_line(f, &line, &line_alloc) != 0) {
+        char *p = line;
+
+        ++lineno;
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        if (*p == '\0' || *p == '#')
+            continue;
+        batch_add_line(&b, p, lineno);
+        if (b.count == BATCH_MAX_JOBS)
+            batch_send(&b, env, envp, envp_size, cwd);
+    }
+    if (b.count > 0)
+        batch_send(&b, env, envp, envp_size, cwd);
+    fflush(stdout);
+
+    if (f != stdin)
+        fclose(f);
+    free(line);
+    free(b.data);
+    free(env);
+    free(envp);
+    free(cwd);
+}
+
 int c_wait_server_commands() {
     struct Msg m = default_msg();
     int res;
@@ -179,7 +595,8 @@ void c_wait_server_lines() {
     struct Msg m = default_msg();
     int res;
 
-    while (1) {
+    /* In v1 the server closes the connection after the last line */
+    while (!msg_frame_done(server_socket)) {
         res = recv_msg(server_socket, &m);
         if (res == -1)
             error("Error in wait_server_lines");
@@ -202,8 +619,13 @@ void c_list_jobs() {
     struct Msg m = default_msg();
 
     m.type = LIST;
-    m.u.term_width = term_width;
+    m.u.list = command_line.list;
+    m.u.list.term_width = term_width;
+    if (command_line.label)
+        m.u.list.label_size = strlen(command_line.label) + 1;
     send_msg(server_socket, &m);
+    if (command_line.label)
+        send_bytes(server_socket, command_line.label, m.u.list.label_size);
 }
 
 void c_list_gpu_jobs() {
@@ -220,6 +642,9 @@ void c_check_version() {
     m.type = GET_VERSION;
     /* Double send, so an old ts will answer for sure at least once */
     send_msg(server_socket, &m);
+    /* The 2nd asks for frames; a server that doesn't know them
+     * answers framing 0 */
+    m.u.version.framing = FRAMING_RESOURCES;
     send_msg(server_socket, &m);
 
     /* Set up a 2 second timeout to receive the
@@ -228,18 +653,22 @@ void c_check_version() {
     res = recv_msg(server_socket, &m);
     if (res == -1)
         error("Error calling recv_msg in c_check_version");
-    if (m.type != VERSION || m.u.version != PROTOCOL_VERSION) {
+    if (m.type != VERSION || m.u.version.version != PROTOCOL_VERSION) {
         printf("Wrong server version. Received %i, expecting %i\n",
-               m.u.version, PROTOCOL_VERSION);
+               m.u.version.version, PROTOCOL_VERSION);
 
         error("Wrong server version. Received %i, expecting %i",
-              m.u.version, PROTOCOL_VERSION);
+              m.u.version.version, PROTOCOL_VERSION);
     }
 
     /* Receive also the 2nd send_msg if we got the right version */
     res = recv_msg(server_socket, &m);
     if (res == -1)
         error("Error calling the 2nd recv_msg in c_check_version");
+    if (m.type == VERSION && m.u.version.framing >= FRAMING_FRAMES) {
+        server_framing = m.u.version.framing;
+        msg_set_framed(server_socket);
+    }
 }
 
 void c_show_info() {
@@ -251,7 +680,8 @@ void c_show_info() {
 
     send_msg(server_socket, &m);
 
-    while (1) {
+    /* In v1 the server closes the connection after the last line */
+    while (!msg_frame_done(server_socket)) {
         res = recv_msg(server_socket, &m);
         if (res == -1)
             error("Error in wait_server_lines");
@@ -278,7 +708,7 @@ void c_show_info() {
             fflush(stdout);
             buffer = (char *) malloc(DSIZE);
             do {
-                res = recv(server_socket, buffer, DSIZE, 0);
+                res = recv_stream(server_socket, buffer, DSIZE);
                 if (res > 0)
                     write(1, buffer, res);
             } while (res > 0);
@@ -327,6 +757,9 @@ void c_send_runjob_ok(const char *ofname, int pid) {
     /* Send the filename */
     if (command_line.store_output)
         send_bytes(server_socket, ofname, m.u.output.ofilename_size);
+
+    /* Nothing is read until the job ends */
+    msg_flush(server_socket);
 }
 
 static void c_end_of_job(const struct Result *res) {
@@ -475,7 +908,7 @@ void c_kill_all_jobs() {
         case COUNT_RUNNING:
             for (int i = 0; i < m.u.count_running; ++i) {
                 int pid;
-                res = recv(server_socket, &pid, sizeof(int), 0);
+                res = recv_bytes(server_socket, (char *) &pid, sizeof(int));
                 if (res != sizeof(int))
                     error("Error in receiving PID kill_all");
                 kill(-pid, SIGTERM);
@@ -564,6 +997,8 @@ static void c_wait_running_job_send() {
     m.type = WAIT_RUNNING_JOB;
     m.u.jobid = command_line.jobid;
     send_msg(server_socket, &m);
+    /* tail_file() waits for the answer with select() */
+    msg_flush(server_socket);
 }
 
 /* Returns the errorlevel */
@@ -716,6 +1151,104 @@ void c_swap_jobs() {
     return;
 }
 
+void c_set_priority() {
+    struct Msg m = default_msg();
+    int res;
+    char *string = 0;
+
+    if (server_framing < FRAMING_PRIORITY)
+        error("The server does not know the priorities of the jobs. "
+              "Restart it or ts --upgrade");
+
+    /* Send the request */
+    m.type = SET_PRIORITY;
+    m.u.priority.jobid = command_line.jobid;
+    m.u.priority.priority = command_line.priority;
+    send_msg(server_socket, &m);
+
+    /* Receive the answer */
+    res = recv_msg(server_socket, &m);
+    if (res != sizeof(m))
+        error("Error in set_priority");
+    switch (m.type) {
+        case SET_PRIORITY_OK:
+            return;
+            /* WILL NOT GO FURTHER */
+        case LIST_LINE: /* Only ONE line accepted */
+            string = (char *) malloc(m.u.size);
+            res = recv_bytes(server_socket, string, m.u.size);
+            if (res != m.u.size)
+                error("Error in set_priority - line size");
+            fprintf(stderr, "Error in the request: %s",
+                    string);
+            free(string);
+            exit(-1);
+            /* WILL NOT GO FURTHER */
+        default:
+            warning("Wrong internal message in set_priority");
+    }
+}
+
+/* Also before queuing a job, with --max_running */
+void c_set_label_limit() {
+    struct Msg m = default_msg();
+    int res;
+
+    if (server_framing < FRAMING_LABEL_LIMIT)
+        error("The server does not know the limits of the labels. "
+              "Restart it or ts --upgrade");
+
+    /* Send the request */
+    m.type = SET_LABEL_LIMIT;
+    m.u.label_limit.max_running = command_line.max_running;
+    m.u.label_limit.label_size = strlen(command_line.label) + 1;
+    send_msg(server_socket, &m);
+    send_bytes(server_socket, command_line.label, m.u.label_limit.label_size);
+
+    /* Receive the answer */
+    res = recv_msg(server_socket, &m);
+    if (res != sizeof(m) || m.type != SET_LABEL_LIMIT_OK)
+        error("Error in set_label_limit");
+}
+
+void c_set_resources() {
+    struct Msg m = default_msg();
+    int res;
+    char *string = 0;
+
+    if (server_framing < FRAMING_RESOURCES)
+        error("The server does not know the resources of the jobs. "
+              "Restart it or ts --upgrade");
+
+    /* Send the request */
+    m.type = SET_RESOURCES;
+    m.u.size = strlen(command_line.resources) + 1;
+    send_msg(server_socket, &m);
+    send_bytes(server_socket, command_line.resources, m.u.size);
+
+    /* Receive the answer */
+    res = recv_msg(server_socket, &m);
+    if (res != sizeof(m))
+        error("Error in set_resources");
+    switch (m.type) {
+        case SET_RESOURCES_OK:
+            return;
+            /* WILL NOT GO FURTHER */
+        case LIST_LINE: /* Only ONE line accepted */
+            string = (char *) malloc(m.u.size);
+            res = recv_bytes(server_socket, string, m.u.size);
+            if (res != m.u.size)
+                error("Error in set_resources - line size");
+            fprintf(stderr, "Error in the request: %s",
+                    string);
+            free(string);
+            exit(-1);
+            /* WILL NOT GO FURTHER */
+        default:
+            warning("Wrong internal message in set_resources");
+    }
+}
+
 void c_get_count_running() {
     struct Msg m = default_msg();
     int res;
@@ -931,3 +1464,21 @@ void c_set_logdir() {
     send_msg(server_socket, &m);
     send_bytes(server_socket, command_line.label, m.u.size);
 }
+
+/* The server executes the ts of argv0 in its place */
+void c_upgrade_server(const char *argv0) {
+    struct Msg m = default_msg();
+    char exe[PATH_MAX];
+    int res;
+
+    res = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (res > 0)
+        exe[res] = '\0';
+    else if (realpath(argv0, exe) == 0)
+        error("Cannot find the path of %s", argv0);
+
+    m.type = UPGRADE;
+    m.u.size = strlen(exe) + 1;
+    send_msg(server_socket, &m);
+    send_bytes(server_socket, exe, m.u.size);
+}
@@ -155,7 +155,12 @@ void error(const char *str, ...)
 
     if (process_type == CLIENT)
     {
-        vfprintf(stderr, str, ap);
+        va_list copy;
+
+        /* ap goes on to the error file */
+        va_copy(copy, ap);
+        vfprintf(stderr, str, copy);
+        va_end(copy);
         fputc('\n', stderr);
     }
 
@@ -173,7 +178,11 @@ void debug(const char *str, ...)
 
     if (process_type == CLIENT)
     {
-        vfprintf(stderr, str, ap);
+        va_list copy;
+
+        va_copy(copy, ap);
+        vfprintf(stderr, str, copy);
+        va_end(copy);
         fputc('\n', stderr);
     }
 
@@ -112,7 +112,7 @@ void create_closed_read_on(int dest) {
 }
 
 /* This will close fd_out and fd_in in the parent */
-static void run_gzip(int fd_out, int fd_in) {
+void run_gzip(int fd_out, int fd_in) {
     int pid;
     pid = fork();
 
@@ -148,6 +148,7 @@ static void run_child(int fd_send_filename, const char* tmpdir) {
 
     for (int i = 0; i < command_line.command.num; cmdLen += strlen(command_line.command.array[i++]) + 1);
     cmd = malloc(cmdLen * sizeof(char) + 1);
+    cmd[0] = '\0';
     for (int i = 0; i < command_line.command.num; i++) {
         strcat(cmd, command_line.command.array[i]);
         strcat(cmd, " ");
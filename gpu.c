@@ -64,6 +64,10 @@ static int getVisibleGpus(int *visibility) {
     return num_total_gpus;
 }
 
+int getTotalGpus() {
+    return num_total_gpus;
+}
+
 int * getGpuList(int *num) {
     int *gpuList, *visible;
     int i, count = 0;
@@ -0,0 +1,384 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "main.h"
+
+/* With TS_HISTORY, the finished jobs that leave the list of the server
+ * (TS_MAXFINISHED and the like, or ts -C) are still there for ts -i, -s,
+ * -w, -o..., and for the dependencies on them, from two files:
+ *  - TS_HISTORY, where a record of each is appended,
+ *  - TS_HISTORY.idx, with the jobid, errorlevel, end time and offset of
+ *    each record, in the same order.
+ * The server keeps the index in memory, sorted by jobid, 16 bytes a job.
+ * A record is only read when asked for. Whatever the crash, the index is
+ * rebuilt from the records that are whole. */
+
+/* Before each record. Then come the ranges of the dependencies, the GPU
+ * ids, and the strings with their null: command, label, environment and
+ * output filename */
+struct History_header {
+    int size; /* Of the record, header included */
+    int jobid;
+    int state;
+    int store_output;
+    int num_slots;
+    int num_gpus;
+    int pid;
+    int depend_on_size;
+    int gpu_ids_size;
+    int command_size;
+    int label_size;
+    int env_size;
+    int output_size;
+    struct Result result;
+    struct timeval enqueue_time;
+    struct timeval start_time;
+    struct timeval end_time;
+};
+
+struct History_index {
+    int jobid;
+    int errorlevel;
+    long long offset;
+    long long end_time;
+};
+
+struct History_entry {
+    int jobid;
+    int errorlevel;
+    long long offset;
+};
+
+static struct {
+    int fd; /* -1 without history */
+    int idx_fd;
+    char *path;
+    long long size; /* Of the records that are whole */
+    struct History_entry *entries; /* By jobid */
+    int count;
+    int alloc;
+    char *buf; /* A record being written or read */
+    int buf_alloc;
+    struct Job job; /* The last one read */
+    int no_gpus;
+} history = { -1, -1, 0, 0, 0, 0, 0, 0, 0, { 0 }, 0 };
+
+static void reserve(int size) {
+    if (size <= history.buf_alloc)
+        return;
+    while (history.buf_alloc < size)
+        history.buf_alloc = history.buf_alloc ? 2 * history.buf_alloc : 4096;
+    history.buf = (char *) realloc(history.buf, history.buf_alloc);
+    if (history.buf == 0)
+        error("Cannot allocate %i bytes for the history", history.buf_alloc);
+}
+
+static int write_all(int fd, const char *data, int size) {
+    while (size > 0) {
+        int res = write(fd, data, size);
+
+        if (res == -1)
+            return -1;
+        data += res;
+        size -= res;
+    }
+    return 0;
+}
+
+/* The place of jobid in the entries, or where it would go */
+static int find_entry(int jobid) {
+    int low = 0;
+    int high = history.count;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+
+        if (history.entries[mid].jobid < jobid)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/* The jobs leave in about the order of their ids, so it goes near the end */
+static void add_entry(int jobid, int errorlevel, long long offset) {
+    int i = find_entry(jobid);
+
+    if (i == history.count || history.entries[i].jobid != jobid) {
+        if (history.count == history.alloc) {
+            history.alloc = history.alloc ? 2 * history.alloc : 1024;
+            history.entries = (struct History_entry *)
+                realloc(history.entries, history.alloc * sizeof(*history.entries));
+            if (history.entries == 0)
+                error("Cannot allocate the index of %i jobs of the history",
+                      history.alloc);
+        }
+        memmove(history.entries + i + 1, history.entries + i,
+                (history.count - i) * sizeof(*history.entries));
+        ++history.count;
+    }
+    /* A job twice, after a crash, is as written the last time */
+    history.entries[i].jobid = jobid;
+    history.entries[i].errorlevel = errorlevel;
+    history.entries[i].offset = offset;
+}
+
+static int read_header(long long offset, struct History_header *h) {
+    if (pread(history.fd, h, sizeof(*h), offset) != (int) sizeof(*h))
+        return -1;
+    if (h->size < (int) sizeof(*h) || offset + h->size > history.size)
+        return -1;
+    return 0;
+}
+
+static void write_index(const struct History_header *h, long long offset) {
+    struct History_index x;
+
+    x.jobid = h->jobid;
+    x.errorlevel = h->result.errorlevel;
+    x.offset = offset;
+    x.end_time = h->end_time.tv_sec;
+    if (write_all(history.idx_fd, (const char *) &x, sizeof(x)) == -1)
+        warning("Cannot write to the index of the history %s", history.path);
+}
+
+/* The index in memory; and in the file, for the records after it */
+static void load_index() {
+    struct History_header h;
+    struct History_index x;
+    struct stat st;
+    long long offset = 0;
+    long long idx_size = 0;
+    long long pos;
+
+    if (fstat(history.fd, &st) == -1)
+        error("Cannot stat the history %s", history.path);
+    history.size = st.st_size;
+
+    /* Each entry, if its record is whole */
+    while (pread(history.idx_fd, &x, sizeof(x), idx_size) == (int) sizeof(x)
+           && x.offset == offset && read_header(offset, &h) == 0) {
+        add_entry(x.jobid, x.errorlevel, x.offset);
+        offset += h.size;
+        idx_size += sizeof(x);
+    }
+    if (ftruncate(history.idx_fd, idx_size) == -1)
+        error("Cannot truncate the index of the history %s", history.path);
+
+    /* The records that were not in the index yet */
+    for (pos = offset; read_header(pos, &h) == 0; pos += h.size) {
+        write_index(&h, pos);
+        add_entry(h.jobid, h.result.errorlevel, pos);
+    }
+    if (pos < history.size) {
+        warning("The history %s ends in %lld bytes that don't make a record",
+                history.path, history.size - pos);
+        if (ftruncate(history.fd, pos) == -1)
+            error("Cannot truncate the history %s", history.path);
+        history.size = pos;
+    }
+}
+
+static int open_file(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+
+    if (fd == -1)
+        error("Cannot open the history file %s", path);
+    /* The jobs forked from this server must not inherit it */
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+void history_open() {
+    const char *name;
+    char *idx_path;
+
+    name = getenv("TS_HISTORY");
+    if (name == NULL || name[0] == '\0' || history.fd != -1)
+        return;
+
+    history.path = strdup(name);
+    idx_path = (char *) malloc(strlen(name) + sizeof(".idx"));
+    if (history.path == 0 || idx_path == 0)
+        error("Cannot allocate the names of the history files");
+    sprintf(idx_path, "%s.idx", name);
+
+    history.fd = open_file(history.path);
+    history.idx_fd = open_file(idx_path);
+    free(idx_path);
+    load_index();
+}
+
+static void append(const void *data, int size, int *pos) {
+    if (size <= 0)
+        return;
+    memcpy(history.buf + *pos, data, size);
+    *pos += size;
+}
+
+static int string_size(const char *str) {
+    return str ? strlen(str) + 1 : 0;
+}
+
+/* p, finished, leaves the list of the server */
+void history_add(const struct Job *p) {
+    struct History_header h;
+    int pos = 0;
+
+    if (history.fd == -1)
+        return;
+
+    memset(&h, 0, sizeof(h));
+    h.jobid = p->jobid;
+    h.state = p->state;
+    h.store_output = p->store_output;
+    h.num_slots = p->num_slots;
+    h.num_gpus = p->num_gpus;
+    h.pid = p->pid;
+    h.depend_on_size = p->depend_on_size;
+    h.gpu_ids_size = p->gpu_ids ? p->num_gpus : 0;
+    h.command_size = string_size(p->command);
+    h.label_size = string_size(p->label);
+    h.env_size = string_size(p->env);
+    h.output_size = string_size(p->output_filename);
+    h.result = p->result;
+    h.enqueue_time = p->info.enqueue_time;
+    h.start_time = p->info.start_time;
+    h.end_time = p->info.end_time;
+    h.size = sizeof(h) + h.depend_on_size * sizeof(struct Interval)
+             + h.gpu_ids_size * sizeof(int) + h.command_size + h.label_size
+             + h.env_size + h.output_size;
+
+    reserve(h.size);
+    append(&h, sizeof(h), &pos);
+    append(p->depend_on, h.depend_on_size * sizeof(struct Interval), &pos);
+    append(p->gpu_ids, h.gpu_ids_size * sizeof(int), &pos);
+    append(p->command, h.command_size, &pos);
+    append(p->label, h.label_size, &pos);
+    append(p->env, h.env_size, &pos);
+    append(p->output_filename, h.output_size, &pos);
+
+    if (write_all(history.fd, history.buf, h.size) == -1) {
+        warning("Cannot write the job %i to the history %s", p->jobid,
+                history.path);
+        /* Not a piece of it before the next one */
+        if (ftruncate(history.fd, history.size) == -1)
+            error("Cannot truncate the history %s", history.path);
+        return;
+    }
+    write_index(&h, history.size);
+    add_entry(h.jobid, h.result.errorlevel, history.size);
+    history.size += h.size;
+}
+
+/* Whether jobid is in the history, and how it ended */
+int history_errorlevel(int jobid, int *errorlevel) {
+    int i = find_entry(jobid);
+
+    if (i == history.count || history.entries[i].jobid != jobid)
+        return 0;
+    *errorlevel = history.entries[i].errorlevel;
+    return 1;
+}
+
+/* How many jobs of the range d are in the history; the sum of their
+ * absolute error levels goes to *errorlevels */
+int history_range(const struct Interval *d, int *errorlevels) {
+    int i = find_entry(d->first);
+    int found = 0;
+
+    *errorlevels = 0;
+    for (; i < history.count && history.entries[i].jobid <= d->last; ++i) {
+        if ((history.entries[i].jobid - d->first) % d->step != 0)
+            continue;
+        *errorlevels += abs(history.entries[i].errorlevel);
+        ++found;
+    }
+    return found;
+}
+
+/* The string of size bytes at *pos, or null if size is 0 */
+static char *take_string(int size, int *pos) {
+    char *str;
+
+    if (size <= 0)
+        return 0;
+    str = history.buf + *pos;
+    *pos += size;
+    str[size - 1] = '\0';
+    return str;
+}
+
+/* The job as it left the list, read from the file. It is valid until the
+ * next call, and not in any list */
+struct Job *history_get(int jobid) {
+    struct History_header h;
+    struct Job *p = &history.job;
+    int i = find_entry(jobid);
+    int pos;
+
+    if (i == history.count || history.entries[i].jobid != jobid)
+        return 0;
+    if (read_header(history.entries[i].offset, &h) == -1
+        || h.depend_on_size < 0 || h.gpu_ids_size < 0 || h.command_size <= 0
+        || h.size != (long long) sizeof(h)
+                     + h.depend_on_size * (long long) sizeof(struct Interval)
+                     + h.gpu_ids_size * (long long) sizeof(int)
+                     + h.command_size + h.label_size + h.env_size + h.output_size) {
+        warning("Wrong record of the job %i in the history %s", jobid,
+                history.path);
+        return 0;
+    }
+    reserve(h.size);
+    if (pread(history.fd, history.buf, h.size, history.entries[i].offset) != h.size) {
+        warning("Cannot read the job %i from the history %s", jobid,
+                history.path);
+        return 0;
+    }
+
+    memset(p, 0, sizeof(*p));
+    p->jobid = h.jobid;
+    p->state = h.state;
+    p->store_output = h.store_output;
+    p->num_slots = h.num_slots;
+    p->num_gpus = h.num_gpus;
+    p->pid = h.pid;
+    p->ready_index = -1;
+    p->result = h.result;
+    p->info.enqueue_time = h.enqueue_time;
+    p->info.start_time = h.start_time;
+    p->info.end_time = h.end_time;
+
+    pos = sizeof(h);
+    p->depend_on_size = h.depend_on_size;
+    if (h.depend_on_size > 0)
+        p->depend_on = (struct Interval *) (history.buf + pos);
+    pos += h.depend_on_size * sizeof(struct Interval);
+    history.no_gpus = -1;
+    p->gpu_ids = h.gpu_ids_size > 0 ? (int *) (history.buf + pos) : &history.no_gpus;
+    pos += h.gpu_ids_size * sizeof(int);
+    p->command = take_string(h.command_size, &pos);
+    p->label = take_string(h.label_size, &pos);
+    p->env = take_string(h.env_size, &pos);
+    p->output_filename = take_string(h.output_size, &pos);
+    return p;
+}
+
+/* Above all the jobids in the history */
+int history_next_jobid() {
+    if (history.count == 0)
+        return 0;
+    return history.entries[history.count - 1].jobid + 1;
+}
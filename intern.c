@@ -0,0 +1,205 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "main.h"
+
+/* One copy of each command, label and environment, however many jobs have
+ * it: the jobs of an array share their label, and often their command, and
+ * all those of a shell share its environment (TS_ENV and that of
+ * server_exec). Each string counts the jobs that have it, and it is freed
+ * with the last one.
+ * The table is of open addressing with linear probing, as intmap.c, by a
+ * 64 bit hash of the bytes. With the size, the hash is also the name of
+ * the data for the clients: they ask whether the server has it before
+ * sending it (DATA_QUERY). The strings are in the memory of the jobs
+ * (pool.c). */
+
+enum {
+    INTERN_MIN_SIZE = 64
+};
+
+struct Interned {
+    int refs;
+    int size; /* Without the '\0' added */
+    unsigned long long hash;
+    char text[];
+};
+
+static struct Interned **table;
+static int table_size;
+static int table_count;
+
+/* FNV-1a, of 64 bits */
+unsigned long long intern_hash(const char *data, int size) {
+    unsigned long long h = 14695981039346656037ull;
+    int i;
+
+    for (i = 0; i < size; ++i) {
+        h ^= (unsigned char) data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static struct Interned *interned_of(const char *str) {
+    return (struct Interned *) (str - offsetof(struct Interned, text));
+}
+
+static void table_insert(struct Interned *s) {
+    unsigned int i = (unsigned int) s->hash & (table_size - 1);
+
+    while (table[i] != 0)
+        i = (i + 1) & (table_size - 1);
+    table[i] = s;
+    ++table_count;
+}
+
+static void table_resize(int newsize) {
+    struct Interned **old = table;
+    int oldsize = table_size;
+    int i;
+
+    table = (struct Interned **) calloc(newsize, sizeof(*table));
+    if (table == 0)
+        error("Cannot allocate the table of %i strings", newsize);
+    table_size = newsize;
+    table_count = 0;
+
+    for (i = 0; i < oldsize; ++i)
+        if (old[i] != 0)
+            table_insert(old[i]);
+
+    free(old);
+}
+
+static struct Interned *table_find(unsigned long long hash, int size,
+                                   const char *data) {
+    struct Interned *s;
+    unsigned int i;
+
+    if (table_count == 0)
+        return 0;
+    i = (unsigned int) hash & (table_size - 1);
+    while ((s = table[i]) != 0) {
+        if (s->hash == hash && s->size == size
+            && (data == 0 || memcmp(s->text, data, size) == 0))
+            return s;
+        i = (i + 1) & (table_size - 1);
+    }
+    return 0;
+}
+
+/* The shared copy of the size bytes of data, and a '\0' after them;
+ * null if data is. It must be given back with intern_release() */
+char *intern_bytes(const char *data, int size) {
+    unsigned long long hash;
+    struct Interned *s;
+
+    if (data == 0)
+        return 0;
+    hash = intern_hash(data, size);
+    s = table_find(hash, size, data);
+    if (s != 0) {
+        ++s->refs;
+        return s->text;
+    }
+
+    /* Keep the load under 1/2, so the probe sequences stay short */
+    if (2 * (table_count + 1) > table_size)
+        table_resize(table_size ? 2 * table_size : INTERN_MIN_SIZE);
+
+    s = (struct Interned *) pool_alloc(sizeof(*s) + size + 1);
+    s->refs = 1;
+    s->hash = hash;
+    s->size = size;
+    memcpy(s->text, data, size);
+    s->text[size] = '\0';
+    table_insert(s);
+    return s->text;
+}
+
+/* The same for a string, up to size bytes or its '\0' */
+char *intern(const char *data, int size) {
+    const char *end;
+
+    if (data == 0)
+        return 0;
+    end = memchr(data, '\0', size);
+    if (end != 0)
+        size = end - data;
+    return intern_bytes(data, size);
+}
+
+/* What intern_bytes() gave of the data of that hash and size, if the
+ * server has it, with one more reference; or null */
+char *intern_find(unsigned long long hash, int size) {
+    struct Interned *s = table_find(hash, size, 0);
+
+    if (s == 0)
+        return 0;
+    ++s->refs;
+    return s->text;
+}
+
+/* One more reference to str */
+char *intern_ref(char *str) {
+    if (str != 0)
+        ++interned_of(str)->refs;
+    return str;
+}
+
+int intern_size(const char *str) {
+    return str ? interned_of(str)->size : 0;
+}
+
+/* What intern_hash() gave for str */
+unsigned long long intern_hash_of(const char *str) {
+    return interned_of(str)->hash;
+}
+
+void intern_release(char *str) {
+    struct Interned *s;
+    unsigned int mask;
+    unsigned int i, j;
+
+    if (str == 0)
+        return;
+    s = interned_of(str);
+    if (--s->refs > 0)
+        return;
+
+    mask = table_size - 1;
+    i = (unsigned int) s->hash & mask;
+    while (table[i] != s)
+        i = (i + 1) & mask;
+
+    /* Shift back the entries of the run that would not be found anymore */
+    j = i;
+    while (1) {
+        unsigned int home;
+
+        j = (j + 1) & mask;
+        if (table[j] == 0)
+            break;
+        home = (unsigned int) table[j]->hash & mask;
+        /* Move j to the hole at i unless its home lies cyclically in (i, j] */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i] = 0;
+    --table_count;
+    pool_free(s);
+
+    /* Give the memory back after a big queue is cleared */
+    if (table_size > INTERN_MIN_SIZE && 8 * table_count < table_size)
+        table_resize(table_size / 2);
+}
@@ -0,0 +1,133 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+
+/* Open addressing with linear probing, from non negative int keys to
+ * non null pointers. A null value marks an empty bucket, and removals
+ * shift the following entries back, so there are no tombstones and
+ * lookups never get slower after many removals. */
+
+enum {
+    INTMAP_MIN_SIZE = 64
+};
+
+static unsigned int bucket_of(const struct Intmap *m, int key) {
+    /* Fibonacci hashing: the top bits of the product depend on all the
+     * bits of the key, so consecutive jobids spread evenly and keys that
+     * differ only in their high bits don't pile up in one bucket */
+    return ((unsigned int) key * 2654435769u) >> m->shift;
+}
+
+void intmap_init(struct Intmap *m) {
+    m->entries = 0;
+    m->size = 0;
+    m->shift = 0;
+    m->count = 0;
+}
+
+void intmap_free(struct Intmap *m) {
+    free(m->entries);
+    intmap_init(m);
+}
+
+static void intmap_insert(struct Intmap *m, int key, void *value) {
+    unsigned int i = bucket_of(m, key);
+
+    while (m->entries[i].value != 0) {
+        if (m->entries[i].key == key) {
+            m->entries[i].value = value;
+            return;
+        }
+        i = (i + 1) & (m->size - 1);
+    }
+    m->entries[i].key = key;
+    m->entries[i].value = value;
+    ++m->count;
+}
+
+static void intmap_resize(struct Intmap *m, int newsize) {
+    struct Intmap_entry *old = m->entries;
+    int oldsize = m->size;
+    int i;
+
+    m->entries = (struct Intmap_entry *) calloc(newsize, sizeof(*m->entries));
+    if (m->entries == 0)
+        error("Cannot allocate the index of %i entries", newsize);
+    m->size = newsize;
+    m->shift = 32;
+    while ((1 << (32 - m->shift)) < newsize)
+        --m->shift;
+    m->count = 0;
+
+    for (i = 0; i < oldsize; ++i)
+        if (old[i].value != 0)
+            intmap_insert(m, old[i].key, old[i].value);
+
+    free(old);
+}
+
+void *intmap_get(const struct Intmap *m, int key) {
+    unsigned int i;
+
+    if (m->count == 0)
+        return 0;
+
+    i = bucket_of(m, key);
+    while (m->entries[i].value != 0) {
+        if (m->entries[i].key == key)
+            return m->entries[i].value;
+        i = (i + 1) & (m->size - 1);
+    }
+    return 0;
+}
+
+void intmap_put(struct Intmap *m, int key, void *value) {
+    /* Keep the load under 1/2, so the probe sequences stay short */
+    if (2 * (m->count + 1) > m->size)
+        intmap_resize(m, m->size ? 2 * m->size : INTMAP_MIN_SIZE);
+    intmap_insert(m, key, value);
+}
+
+void intmap_del(struct Intmap *m, int key) {
+    unsigned int mask;
+    unsigned int i, j;
+
+    if (m->count == 0)
+        return;
+
+    mask = m->size - 1;
+    i = bucket_of(m, key);
+    while (m->entries[i].value != 0 && m->entries[i].key != key)
+        i = (i + 1) & mask;
+    if (m->entries[i].value == 0)
+        return; /* Not there */
+
+    /* Shift back the entries of the run that would not be found anymore */
+    j = i;
+    while (1) {
+        unsigned int home;
+
+        j = (j + 1) & mask;
+        if (m->entries[j].value == 0)
+            break;
+        home = bucket_of(m, m->entries[j].key);
+        /* Move j to the hole at i unless its home lies cyclically in (i, j] */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            m->entries[i] = m->entries[j];
+            i = j;
+        }
+    }
+    m->entries[i].value = 0;
+    --m->count;
+
+    /* Give the memory back after a big queue is cleared */
+    if (m->size > INTMAP_MIN_SIZE && 8 * m->count < m->size)
+        intmap_resize(m, m->size / 2);
+}
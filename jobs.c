@@ -11,6 +11,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
+#include <signal.h>
 #include <sys/socket.h>
 
 #include "main.h"
@@ -19,15 +20,36 @@
 int busy_slots = 0;
 int max_slots = 1;
 
+/* A client waiting for a job to finish. It is in two doubly linked
+ * chains: that of the waiters of the job and that of the socket */
 struct Notify {
     int socket;
     int jobid;
-    struct Notify *next;
+    int request_id; /* Of the WAITJOB, for framed connections */
+    struct Notify *next_of_job;
+    struct Notify *prev_of_job;
+    struct Notify *next_of_socket;
+    struct Notify *prev_of_socket;
 };
 
 /* Globals */
+/* Doubly linked, with the tails to append in O(1) */
 static struct Job *firstjob = 0;
+static struct Job *lastjob = 0;
 static struct Job *first_finished_job = 0;
+static struct Job *last_finished_job = 0;
+static int count_finished_jobs = 0;
+/* Jobs of both lists in each state; see set_job_state() */
+static int jobs_in_state[HOLDING_CLIENT + 1];
+/* Jobs in the queue that keep a ts client connected (not server_exec) */
+static int client_jobs = 0;
+/* Places in the queue: new jobs go last, urgent ones first */
+static int next_queue_pos = 0;
+static int first_queue_pos = 0;
+/* No ready job fits in this many free slots or less; see next_run_jobs() */
+static int nothing_fits_slots = 0;
+/* All the jobs of both lists, by jobid */
+static struct Intmap job_index;
 static int jobids = 0;
 /* This is used for dependencies from jobs
  * already out of the queue */
@@ -36,12 +58,17 @@ static int last_errorlevel = 0; /* Before the first job, let's consider
 /* We need this to handle well "-d" after a "-nf" run */
 static int last_finished_jobid;
 
-static struct Notify *first_notify = 0;
+/* The first of each chain of waiters, by jobid and by socket */
+static struct Intmap notify_by_job;
+static struct Intmap notify_by_socket;
 
 /* server will access them */
 int max_jobs;
 
 static struct Job *get_job(int jobid);
+static struct Job *get_job_or_history(int jobid);
+static void notify_waiters(const struct Job *j);
+static void unready(struct Job *p);
 
 void notify_errorlevel(struct Job *p);
 
@@ -58,18 +85,30 @@ static void shuffle(int *array, size_t n) {
     }
 }
 
-static void destroy_job(struct Job* p) {
+/* What can change after the job is queued is malloc'd; the rest is in
+ * the memory of the jobs, see pool.c */
+static void free_job(struct Job *p) {
     free(p->notify_errorlevel_to);
-    free(p->command);
     free(p->output_filename);
-    pinfo_free(&p->info);
-    free(p->depend_on);
-    free(p->label);
-    free(p->gpu_ids);
-    free(p);
+    intern_release(p->command);
+    pool_free(p->depend_on);
+    intern_release(p->label);
+    intern_release(p->env);
+    intern_release(p->resources);
+    pool_free(p->res);
+    pool_free(p->gpu_ids);
+    server_exec_free(p->exec);
+    pool_free(p);
+}
+
+static void destroy_job(struct Job* p) {
+    unready(p);
+    intmap_del(&job_index, p->jobid);
+    --jobs_in_state[p->state];
+    free_job(p);
 }
 
-static void send_list_line(int s, const char *str) {
+void send_list_line(int s, const char *str) {
     struct Msg m = default_msg();
 
     /* Message */
@@ -100,30 +139,51 @@ static void send_swap_jobs_ok(int s) {
     send_msg(s, &m);
 }
 
-static struct Job *find_previous_job(const struct Job *final) {
-    struct Job *p;
+static void list_append(struct Job **first, struct Job **last, struct Job *p) {
+    p->prev = *last;
+    p->next = 0;
+    if (*last)
+        (*last)->next = p;
+    else
+        *first = p;
+    *last = p;
+}
 
-    /* Show Queued or Running jobs */
-    p = firstjob;
-    while (p != 0) {
-        if (p->next == final)
-            return p;
-        p = p->next;
-    }
+/* 'after' must be in the list */
+static void list_insert_after(struct Job **last, struct Job *after, struct Job *p) {
+    p->prev = after;
+    p->next = after->next;
+    if (after->next)
+        after->next->prev = p;
+    else
+        *last = p;
+    after->next = p;
+}
 
-    return 0;
+static void list_unlink(struct Job **first, struct Job **last, struct Job *p) {
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        *first = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    else
+        *last = p->prev;
+    p->next = 0;
+    p->prev = 0;
+}
+
+static int job_in_finished_list(const struct Job *p) {
+    return p->state == FINISHED || p->state == SKIPPED;
 }
 
+/* Queued or Running jobs */
 static struct Job *findjob(int jobid) {
     struct Job *p;
 
-    /* Show Queued or Running jobs */
-    p = firstjob;
-    while (p != 0) {
-        if (p->jobid == jobid)
-            return p;
-        p = p->next;
-    }
+    p = (struct Job *) intmap_get(&job_index, jobid);
+    if (p != 0 && !job_in_finished_list(p))
+        return p;
 
     return 0;
 }
@@ -145,45 +205,327 @@ static struct Job *findjob_holding_client() {
 static struct Job *find_finished_job(int jobid) {
     struct Job *p;
 
-    /* Show Queued or Running jobs */
-    p = first_finished_job;
-    while (p != 0) {
-        if (p->jobid == jobid)
-            return p;
-        p = p->next;
+    p = (struct Job *) intmap_get(&job_index, jobid);
+    if (p != 0 && job_in_finished_list(p))
+        return p;
+
+    return 0;
+}
+
+/* The running jobs, for the reservation of the backfill. As many as
+ * the slots, or a few more: they are looked for one by one */
+static struct Job **running_jobs;
+static int running_count;
+static int running_alloc;
+
+static void running_add(struct Job *p) {
+    if (running_count == running_alloc) {
+        running_alloc = running_alloc ? 2 * running_alloc : 64;
+        running_jobs = (struct Job **) realloc(running_jobs,
+                        running_alloc * sizeof(*running_jobs));
+        if (running_jobs == 0)
+            error("Cannot allocate memory for %i running jobs", running_alloc);
+    }
+    running_jobs[running_count++] = p;
+}
+
+static void running_remove(struct Job *p) {
+    int i;
+
+    for (i = 0; i < running_count; ++i)
+        if (running_jobs[i] == p) {
+            running_jobs[i] = running_jobs[--running_count];
+            return;
+        }
+}
+
+/* What the server keeps of each label: the limit of its running jobs, and
+ * the time the last of them took, for the backfill of those that don't
+ * tell theirs. By the hash of the label, and the next free key on a
+ * collision; they stay, as the labels are few */
+struct Label {
+    char *label;
+    int max_running; /* 0 for no limit */
+    int running; /* Along with busy_slots */
+    int runtime; /* Seconds; -1 if none ended yet */
+    struct Parked parked; /* Its ready jobs, while it runs its max */
+    struct Label *next;
+};
+
+static struct Intmap label_index;
+static struct Label *first_label;
+
+static struct Label *get_label(char *label, int create) {
+    struct Label *l;
+    int key = (int) (intern_hash_of(label) & 0x7fffffff);
+
+    while ((l = (struct Label *) intmap_get(&label_index, key)) != 0) {
+        if (l->label == label)
+            return l;
+        key = (key + 1) & 0x7fffffff;
+    }
+    if (!create)
+        return 0;
+
+    l = (struct Label *) malloc(sizeof(*l));
+    if (l == 0)
+        error("Cannot allocate memory for the label %s", label);
+    l->label = intern_ref(label);
+    l->max_running = 0;
+    l->running = 0;
+    l->runtime = -1;
+    l->parked.first = 0;
+    l->parked.last = 0;
+    l->next = first_label;
+    first_label = l;
+    intmap_put(&label_index, key, l);
+    return l;
+}
+
+/* p, ready, waits in the list instead of the ready queue. The list goes
+ * in the run order; the jobs mostly come in it, from the ready queue */
+static void park(struct Job *p, struct Parked *list) {
+    struct Job *q = list->first;
+
+    if (list->last != 0 && readyq_before(list->last, p))
+        q = 0;
+    else
+        while (q != 0 && readyq_before(q, p))
+            q = q->park_next;
+
+    /* Before q, or last */
+    p->parked_on = list;
+    p->park_next = q;
+    p->park_prev = q ? q->park_prev : list->last;
+    if (p->park_prev)
+        p->park_prev->park_next = p;
+    else
+        list->first = p;
+    if (q)
+        q->park_prev = p;
+    else
+        list->last = p;
+}
+
+static void unpark(struct Job *p) {
+    struct Parked *list = p->parked_on;
+
+    if (list == 0)
+        return;
+    if (p->park_prev)
+        p->park_prev->park_next = p->park_next;
+    else
+        list->first = p->park_next;
+    if (p->park_next)
+        p->park_next->park_prev = p->park_prev;
+    else
+        list->last = p->park_prev;
+    p->parked_on = 0;
+    p->park_prev = 0;
+    p->park_next = 0;
+}
+
+static void make_ready(struct Job *p) {
+    readyq_add(p);
+    /* It may fit where the others didn't */
+    if (p->num_slots <= nothing_fits_slots)
+        nothing_fits_slots = p->num_slots - 1;
+}
+
+/* Out of the ready queue, or of the list it waits in */
+static void unready(struct Job *p) {
+    readyq_remove(p);
+    unpark(p);
+}
+
+/* The first count jobs of the list back to the ready queue; all if -1 */
+static void wake(struct Parked *list, int count) {
+    while (list->first != 0 && count-- != 0) {
+        struct Job *p = list->first;
+
+        unpark(p);
+        make_ready(p);
     }
+}
+
+/* As many of the jobs of the label as it may run more */
+static void wake_label(struct Label *l) {
+    if (l->max_running == 0)
+        wake(&l->parked, -1);
+    else if (l->running < l->max_running)
+        wake(&l->parked, l->max_running - l->running);
+}
+
+static long long amount_of(const struct Job *p, int resource) {
+    int i;
 
+    for (i = 0; i < p->res_size; ++i)
+        if (p->res[i].resource == resource)
+            return p->res[i].amount;
     return 0;
 }
 
-static int count_not_finished_jobs() {
-    int count = 0;
-    struct Job *p;
+/* The jobs that wait for the resource, in their order, while they fit in
+ * what is free of it. Those that need more than all of it stay */
+static void wake_resource(int resource) {
+    struct Parked *list = resources_waiting(resource);
+    long long room = resources_room(resource);
+    struct Job *p = list->first;
 
-    /* Show Queued or Running jobs */
-    p = firstjob;
+    if (room == -1) {
+        wake(list, -1);
+        return;
+    }
     while (p != 0) {
-        ++count;
-        p = p->next;
+        struct Job *next = p->park_next;
+        long long amount = amount_of(p, resource);
+
+        if (amount > room) {
+            if (amount <= resources_capacity(resource))
+                break;
+        } else {
+            room -= amount;
+            unpark(p);
+            make_ready(p);
+        }
+        p = next;
     }
-    return count;
 }
 
-static void add_notify_errorlevel_to(struct Job *job, int jobid) {
-    int *p;
-    int newsize = (job->notify_errorlevel_to_size + 1)
-                  * sizeof(int);
-    p = (int *) realloc(job->notify_errorlevel_to,
-                        newsize);
+/* p takes its slots, or gives them back */
+static void add_busy(const struct Job *p, int sign) {
+    int i;
 
-    if (p == 0)
-        error("Cannot allocate more memory for notify_errorlist_to for jobid %i,"
-              " having already %i elements",
-              job->jobid, job->notify_errorlevel_to_size);
+    busy_slots += sign * p->num_slots;
+    if (p->label != 0) {
+        struct Label *l = get_label(p->label, 1);
+
+        l->running += sign;
+        if (sign < 0)
+            wake_label(l);
+    }
+    resources_take(p->res, p->res_size, sign);
+    if (sign < 0)
+        for (i = 0; i < p->res_size; ++i)
+            wake_resource(p->res[i].resource);
+}
+
+static int label_full(char *label) {
+    const struct Label *l = get_label(label, 0);
+
+    return l != 0 && l->max_running > 0 && l->running >= l->max_running;
+}
+
+/* The limit of the label, and in *running its jobs running; 0 if none */
+int label_max_running(char *label, int *running) {
+    const struct Label *l = get_label(label, 0);
+
+    if (l == 0)
+        return 0;
+    *running = l->running;
+    return l->max_running;
+}
+
+static void set_label_runtime(const struct Job *p) {
+    if (p->label == 0 || p->info.start_time.tv_sec == 0)
+        return;
+    get_label(p->label, 1)->runtime =
+        p->info.end_time.tv_sec - p->info.start_time.tv_sec;
+}
+
+/* Seconds p should take to run: those told, or those of the last job of
+ * its label. -1 if not known */
+static int expected_runtime(const struct Job *p) {
+    const struct Label *l;
+
+    if (p->runtime > 0)
+        return p->runtime;
+    if (p->label == 0 || (l = get_label(p->label, 0)) == 0)
+        return -1;
+    return l->runtime;
+}
+
+/* Put p in the ready queue, or take it out, after a change that may matter */
+static void update_ready(struct Job *p) {
+    if ((p->state == QUEUED || p->state == ALLOCATING)
+        && p->unmet_dependencies == 0) {
+        if (p->ready_index == -1 && p->parked_on == 0)
+            make_ready(p);
+    } else
+        unready(p);
+}
+
+/* After a change of the place of p in the run order. The backfill may keep
+ * the slots for another job now. If it waits for a label or a resource,
+ * the next pass puts it where it goes */
+static void ready_moved(struct Job *p) {
+    if (p->parked_on != 0) {
+        unpark(p);
+        make_ready(p);
+    }
+    readyq_moved(p);
+    nothing_fits_slots = 0;
+}
+
+static void set_job_state(struct Job *p, enum Jobstate state) {
+    if (p->state == RUNNING && state != RUNNING)
+        running_remove(p);
+    else if (p->state != RUNNING && state == RUNNING)
+        running_add(p);
+    --jobs_in_state[p->state];
+    ++jobs_in_state[state];
+    p->state = state;
+    update_ready(p);
+}
+
+/* Out of the queue list, to be destroyed or to go to the finished list */
+static void unlink_queued_job(struct Job *p) {
+    unready(p);
+    list_unlink(&firstjob, &lastjob, p);
+    if (p->exec == 0)
+        --client_jobs;
+}
+
+/* The dependent waits for job, which will notify it when leaving the queue */
+static void add_notify_errorlevel_to(struct Job *job, struct Job *dependent) {
+    if (job->notify_errorlevel_to_size == job->notify_errorlevel_to_alloc) {
+        int *p;
+        int newalloc = job->notify_errorlevel_to_alloc ?
+                       2 * job->notify_errorlevel_to_alloc : 4;
+
+        p = (int *) realloc(job->notify_errorlevel_to, newalloc * sizeof(int));
+        if (p == 0)
+            error("Cannot allocate more memory for notify_errorlist_to for jobid %i,"
+                  " having already %i elements",
+                  job->jobid, job->notify_errorlevel_to_size);
+        job->notify_errorlevel_to = p;
+        job->notify_errorlevel_to_alloc = newalloc;
+    }
+
+    job->notify_errorlevel_to[job->notify_errorlevel_to_size++] = dependent->jobid;
+    ++dependent->unmet_dependencies;
+}
+
+/* Tell the jobs depending on p that it left the queue. Those with no
+ * other dependency left become ready */
+static void release_dependents(struct Job *p, int errorlevel) {
+    int i;
+
+    for (i = 0; i < p->notify_errorlevel_to_size; ++i) {
+        struct Job *notified;
+        notified = get_job(p->notify_errorlevel_to[i]);
+        if (notified) {
+            notified->dependency_errorlevel += errorlevel;
+            --notified->unmet_dependencies;
+            update_ready(notified);
+        }
+    }
 
-    job->notify_errorlevel_to = p;
-    job->notify_errorlevel_to_size += 1;
-    job->notify_errorlevel_to[job->notify_errorlevel_to_size - 1] = jobid;
+    /* Only once, even if p is removed after it finished */
+    free(p->notify_errorlevel_to);
+    p->notify_errorlevel_to = 0;
+    p->notify_errorlevel_to_size = 0;
+    p->notify_errorlevel_to_alloc = 0;
 }
 
 void s_kill_all_jobs(int s) {
@@ -194,45 +536,23 @@ void s_kill_all_jobs(int s) {
     p = firstjob;
     while (p != 0) {
         if (p->state == RUNNING)
-            send(s, &p->pid, sizeof(int), 0);
+            send_bytes(s, (const char *) &p->pid, sizeof(int));
 
         p = p->next;
     }
 }
 
 void s_count_running_jobs(int s) {
-    int count = 0;
-    struct Job *p;
     struct Msg m = default_msg();
 
-    /* Count running jobs */
-    p = firstjob;
-    while (p != 0) {
-        if (p->state == RUNNING)
-            ++count;
-
-        p = p->next;
-    }
-
     /* Message */
     m.type = COUNT_RUNNING;
-    m.u.count_running = count;
+    m.u.count_running = jobs_in_state[RUNNING];
     send_msg(s, &m);
 }
 
 int s_count_allocating_jobs() {
-    int count = 0;
-    struct Job *p;
-
-    /* Count running jobs */
-    p = firstjob;
-    while (p != 0) {
-        if (p->state == ALLOCATING)
-            count++;
-
-        p = p->next;
-    }
-    return count;
+    return jobs_in_state[ALLOCATING];
 }
 
 void s_send_label(int s, int jobid) {
@@ -241,22 +561,14 @@ void s_send_label(int s, int jobid) {
 
     if (jobid == -1) {
         /* Find the last job added */
-        p = firstjob;
-
-        if (p != 0)
-            while (p->next != 0)
-                p = p->next;
+        p = lastjob;
 
         /* Look in finished jobs if needed */
-        if (p == 0) {
-            p = first_finished_job;
-            if (p != 0)
-                while (p->next != 0)
-                    p = p->next;
-        }
+        if (p == 0)
+            p = last_finished_job;
 
     } else {
-        p = get_job(jobid);
+        p = get_job_or_history(jobid);
     }
 
     if (p == 0) {
@@ -282,22 +594,14 @@ void s_send_cmd(int s, int jobid) {
 
     if (jobid == -1) {
         /* Find the last job added */
-        p = firstjob;
-
-        if (p != 0)
-            while (p->next != 0)
-                p = p->next;
+        p = lastjob;
 
         /* Look in finished jobs if needed */
-        if (p == 0) {
-            p = first_finished_job;
-            if (p != 0)
-                while (p->next != 0)
-                    p = p->next;
-        }
+        if (p == 0)
+            p = last_finished_job;
 
     } else {
-        p = get_job(jobid);
+        p = get_job_or_history(jobid);
     }
 
     if (p == 0) {
@@ -317,15 +621,18 @@ void s_mark_job_running(int jobid) {
     p = findjob(jobid);
     if (!p)
         error("Cannot mark the jobid %i RUNNING.", jobid);
-    p->state = RUNNING;
+    set_job_state(p, RUNNING);
 }
 
 /* -1 means nothing awaken, otherwise returns the jobid awaken */
 int wake_hold_client() {
     struct Job *p;
+
+    if (jobs_in_state[HOLDING_CLIENT] == 0)
+        return -1;
     p = findjob_holding_client();
     if (p) {
-        p->state = (p->num_gpus) ? ALLOCATING : QUEUED;
+        set_job_state(p, (p->num_gpus) ? ALLOCATING : QUEUED);
         return p->jobid;
     }
     return -1;
@@ -356,85 +663,207 @@ const char *jstate2string(enum Jobstate s) {
     return jobstate;
 }
 
-void s_list(int s) {
-    struct Job *p;
-    char *buffer;
+/* All the lines rendered go in one LIST_LINE */
+static void send_list_text(int s) {
+    struct Msg m = default_msg();
+    const char *text;
+    int size;
 
-    /* Times:   0.00/0.00/0.00 - 4+4+4+2 = 14*/
-    buffer = joblist_headers();
-    send_list_line(s, buffer);
-    free(buffer);
+    text = joblist_text(&size);
 
-    /* Show Queued or Running jobs */
-    p = firstjob;
-    while (p != 0) {
-        if (p->state != HOLDING_CLIENT) {
-            buffer = joblist_line(p);
-            send_list_line(s, buffer);
-            free(buffer);
-        }
-        p = p->next;
+    m.type = LIST_LINE;
+    m.u.size = size + 1;
+
+    send_msg(s, &m);
+    send_bytes(s, text, m.u.size);
+}
+
+static int list_filter_match(const struct Job *p, const struct List_filter *f,
+                             const char *label) {
+    if (p->jobid < f->first_jobid)
+        return 0;
+    if (f->end_jobid && p->jobid >= f->end_jobid)
+        return 0;
+    if (f->since && p->info.enqueue_time.tv_sec < f->since)
+        return 0;
+    if (f->until && p->info.enqueue_time.tv_sec >= f->until)
+        return 0;
+    if (label && (p->label == 0 || strcmp(p->label, label) != 0))
+        return 0;
+    return 1;
+}
+
+/* Only the jobs that pass the filter are rendered, and only from 'offset'
+ * up to 'limit' of them */
+void s_list(int s, const struct List_filter *f, const char *label) {
+    struct Job *lists[2];
+    struct Job *p;
+    int skip = f->offset;
+    int left = f->limit > 0 ? f->limit : -1;
+    int to_see = -1; /* Jobs in the states asked, not seen yet */
+    int i;
+
+    if (f->states) {
+        to_see = 0;
+        for (i = QUEUED; i <= HOLDING_CLIENT; ++i)
+            if (f->states & (1 << i))
+                to_see += jobs_in_state[i];
     }
 
-    p = first_finished_job;
+    joblist_clear();
+
+    if (f->format == LIST_TSV)
+        joblist_add_tsv_header();
+    else if (f->format == LIST_TEXT)
+        /* Times:   0.00/0.00/0.00 - 4+4+4+2 = 14*/
+        joblist_add_headers();
+
+    /* Queued or Running jobs, and then the Finished ones */
+    lists[0] = firstjob;
+    lists[1] = first_finished_job;
+    for (i = 0; i < 2 && left != 0 && to_see != 0; ++i) {
+        for (p = lists[i]; p != 0 && left != 0 && to_see != 0; p = p->next) {
+            if (f->states) {
+                if (!(f->states & (1 << p->state)))
+                    continue;
+                --to_see;
+            }
+            if (p->state == HOLDING_CLIENT || !list_filter_match(p, f, label))
+                continue;
+            if (skip > 0) {
+                --skip;
+                continue;
+            }
 
-    /* Show Finished jobs */
-    while (p != 0) {
-        buffer = joblist_line(p);
-        send_list_line(s, buffer);
-        free(buffer);
-        p = p->next;
+            if (f->format == LIST_TSV)
+                joblist_add_tsv(p);
+            else if (f->format == LIST_JSON)
+                joblist_add_json(p);
+            else
+                joblist_add_line(p);
+            --left;
+        }
     }
+
+    send_list_text(s);
 }
 
 #ifndef CPU
 void s_list_gpu(int s) {
     struct Job *p = firstjob;
-    char* buffer;
 
-    buffer = jobgpulist_header();
-    send_list_line(s, buffer);
+    joblist_clear();
+    jobgpulist_add_header();
     while (p != 0) {
-        if (p->state == RUNNING && p->num_gpus) {
-            buffer = jobgpulist_line(p);
-            send_list_line(s, buffer);
-            free(buffer);
-        }
+        if (p->state == RUNNING && p->num_gpus)
+            jobgpulist_add_line(p);
         p = p->next;
     }
+
+    send_list_text(s);
 }
 #endif
 
 static void init_job(struct Job *p) {
     p->next = 0;
+    p->prev = 0;
+    p->state = QUEUED;
+    p->ready_index = -1;
+    p->parked_on = 0;
+    p->park_prev = 0;
+    p->park_next = 0;
+    p->pid = 0;
+    p->result = default_result();
     p->output_filename = 0;
     p->command = 0;
     p->depend_on = 0;
     p->depend_on_size = 0;
     p->gpu_ids = 0;
     p->label = 0;
+    p->env = 0;
     p->notify_errorlevel_to_size = 0;
+    p->notify_errorlevel_to_alloc = 0;
     p->notify_errorlevel_to = 0;
+    p->unmet_dependencies = 0;
     p->dependency_errorlevel = 0;
+    p->exec = 0;
+    p->priority = 0;
+    p->waiting_since = time(NULL);
+    p->runtime = 0;
+    p->resources = 0;
+    p->res = 0;
+    p->res_size = 0;
     pinfo_init(&p->info);
 }
 
 static struct Job *newjobptr() {
     struct Job *p;
 
-    if (firstjob == 0) {
-        firstjob = (struct Job *) malloc(sizeof(*firstjob));
-        init_job(firstjob);
-        return firstjob;
-    }
+    p = (struct Job *) pool_alloc(sizeof(*p));
+    init_job(p);
+    p->queue_pos = next_queue_pos++;
+    list_append(&firstjob, &lastjob, p);
+    ++jobs_in_state[p->state];
+    return p;
+}
 
-    p = firstjob;
-    while (p->next != 0)
-        p = p->next;
+/* All of p in a record of the journal, to be rebuilt by restore_job() */
+static void journal_job(int type, const struct Job *p) {
+    const struct Execinfo *e = p->exec;
+
+    if (!journal_active())
+        return;
 
-    p->next = (struct Job *) malloc(sizeof(*p));
-    init_job(p->next);
-    return p->next;
+    journal_begin(type);
+    journal_int(p->jobid);
+    journal_int(p->state);
+    journal_data(&p->result, sizeof(p->result));
+    journal_int(p->pid);
+    journal_int(p->store_output);
+    journal_int(p->should_keep_finished);
+    journal_int(p->num_slots);
+    journal_int(p->num_gpus);
+    journal_int(p->wait_free_gpus);
+    journal_bytes((const char *) p->gpu_ids,
+                  p->gpu_ids ? p->num_gpus * sizeof(int) : 0);
+    journal_bytes(0, 0); /* The ids of older servers; the ranges go last */
+    journal_int(p->dependency_errorlevel);
+    journal_string(p->command);
+    journal_string(p->label);
+    journal_string(p->output_filename);
+    journal_bytes(0, 0); /* The info text of older servers */
+    journal_data(&p->info.enqueue_time, sizeof(p->info.enqueue_time));
+    journal_data(&p->info.start_time, sizeof(p->info.start_time));
+    journal_data(&p->info.end_time, sizeof(p->info.end_time));
+    journal_int(e != 0);
+    if (e != 0) {
+        journal_bytes(e->argv, e->argv_size);
+        journal_bytes(e->envp, e->envp_size);
+        journal_string(e->cwd);
+        journal_string(e->logfile);
+        journal_int(e->gzip);
+        journal_int(e->stderr_apart);
+        journal_int(e->send_output_by_mail);
+        journal_int(e->require_elevel);
+    }
+    /* Last, as the records of older servers have it in the info */
+    journal_bytes(p->env, intern_size(p->env));
+    journal_bytes((const char *) p->depend_on,
+                  p->depend_on_size * sizeof(struct Interval));
+    journal_int(p->priority);
+    journal_data(&p->waiting_since, sizeof(p->waiting_since));
+    journal_int(p->runtime);
+    journal_bytes(p->resources, intern_size(p->resources));
+    journal_end();
+}
+
+static void journal_start(const struct Job *p) {
+    journal_begin(JR_START);
+    journal_int(p->jobid);
+    journal_int(p->pid);
+    journal_string(p->output_filename);
+    journal_data(&p->info.start_time, sizeof(p->info.start_time));
+    journal_end();
 }
 
 /* Returns -1 if no last job id found */
@@ -468,210 +897,664 @@ static int find_last_stored_jobid_finished() {
     return last_jobid;
 }
 
+/* p waits for the job jobid, if it is in the queue; otherwise it takes its
+ * result. This error level is used internally to decide whether a job
+ * should be run or not, so it only matters whether it is 0 or not: summing
+ * the absolute error levels of all dependencies is sufficient */
+static void depend_on_job(struct Job *p, int jobid) {
+    struct Job *depended_job;
+    struct Job *parent;
+    int errorlevel;
+
+    depended_job = findjob(jobid);
+    if (depended_job != 0) {
+        add_notify_errorlevel_to(depended_job, p);
+        return;
+    }
+    parent = find_finished_job(jobid);
+    if (parent)
+        p->dependency_errorlevel += abs(parent->result.errorlevel);
+    else if (history_errorlevel(jobid, &errorlevel))
+        p->dependency_errorlevel += abs(errorlevel);
+    else
+        /* We consider as if the job not found didn't finish well */
+        p->dependency_errorlevel += 1;
+}
+
+/* Whether the range d has jobid */
+static int interval_has(const struct Interval *d, int jobid) {
+    return jobid >= d->first && jobid <= d->last
+        && (jobid - d->first) % d->step == 0;
+}
+
+/* p waits for the jobs of the range d still in the queue; how many. A range
+ * need not be made of jobs (-D 0-1000000): when it has more ids than the
+ * server has jobs, the queue is walked instead of the ids */
+static int wait_for_range(struct Job *p, const struct Interval *d) {
+    struct Job *depended_job;
+    int waited = 0;
+    int id;
+
+    if ((d->last - d->first) / d->step < job_index.count) {
+        for (id = d->first; ; id += d->step) {
+            depended_job = findjob(id);
+            if (depended_job != 0) {
+                add_notify_errorlevel_to(depended_job, p);
+                ++waited;
+            }
+            if (id > d->last - d->step)
+                break;
+        }
+        return waited;
+    }
+    for (depended_job = firstjob; depended_job != 0;
+         depended_job = depended_job->next)
+        if (depended_job != p && interval_has(d, depended_job->jobid)) {
+            add_notify_errorlevel_to(depended_job, p);
+            ++waited;
+        }
+    return waited;
+}
+
+/* p depends on each job of the range d, as with depend_on_job(). For a
+ * range with more ids than the server has jobs, those not in the queue are
+ * taken from the finished list and the history, and any id left counts as
+ * a job that didn't finish well */
+static void depend_on_range(struct Job *p, const struct Interval *d) {
+    struct Job *parent;
+    int ids = (d->last - d->first) / d->step + 1;
+    int found;
+    int errorlevels;
+    int id;
+
+    if (ids <= job_index.count) {
+        for (id = d->first; ; id += d->step) {
+            depend_on_job(p, id);
+            if (id > d->last - d->step)
+                break;
+        }
+        return;
+    }
+    found = wait_for_range(p, d);
+    for (parent = first_finished_job; parent != 0; parent = parent->next)
+        if (interval_has(d, parent->jobid)) {
+            p->dependency_errorlevel += abs(parent->result.errorlevel);
+            ++found;
+        }
+    found += history_range(d, &errorlevels);
+    p->dependency_errorlevel += errorlevels;
+    if (found < ids)
+        p->dependency_errorlevel += 1;
+}
+
+/* The last job asked with -d: that in the queue, or the last finished */
+static void depend_on_last(struct Job *p, struct Interval *d) {
+    /* As we already have 'p' in the queue,
+     * neglect it during the find_last_jobid_in_queue() */
+    d->first = find_last_jobid_in_queue(p->jobid);
+
+    /* We don't trust the last jobid in the queue (running or queued)
+     * if it's not the last added job. In that case, let
+     * the next control flow handle it as if it could not
+     * do_depend on any still queued job. */
+    if (last_finished_jobid > d->first)
+        d->first = -1;
+
+    /* If it's queued still without result, let it know
+     * its result to p when it finishes. */
+    if (d->first != -1) {
+        struct Job *depended_job;
+        depended_job = findjob(d->first);
+        if (depended_job != 0)
+            add_notify_errorlevel_to(depended_job, p);
+        else
+            warning("The jobid %i is queued to do_depend on the jobid %i"
+                    " suddenly non existent in the queue", p->jobid, d->first);
+    } else /* Otherwise take the finished job, or the last_errorlevel */
+    {
+        int ljobid = find_last_stored_jobid_finished();
+        d->first = ljobid;
+
+        /* If we have a newer result stored, use it */
+        /* NOTE:
+         *   Reading this now, I don't know how ljobid can be
+         *   greater than last_finished_jobid */
+        if (last_finished_jobid < ljobid) {
+            struct Job *parent;
+            parent = find_finished_job(ljobid);
+            if (!parent)
+                error("jobid %i suddenly disappeared from the finished list",
+                      ljobid);
+            p->dependency_errorlevel += abs(parent->result.errorlevel);
+        } else
+            p->dependency_errorlevel += abs(last_errorlevel);
+    }
+    d->last = d->first;
+    d->step = 1;
+}
+
+/* The dependencies asked for p, as received: -1 means the last job added,
+ * and DEPEND_RANGE starts a range. They are kept as ranges; what counts
+ * for the scheduler is unmet_dependencies */
+static void set_dependencies(struct Job *p, const int *depend_on, int ndepend) {
+    int nranges = 0;
+    int idx = 0;
+    int i;
+
+    for (i = 0; i < ndepend; ++i) {
+        if (depend_on[i] == DEPEND_RANGE)
+            i += 3;
+        ++nranges;
+    }
+    if (nranges == 0)
+        return;
+    p->depend_on = (struct Interval *) pool_alloc(nranges * sizeof(struct Interval));
+
+    for (i = 0; i < ndepend; i++) {
+        struct Interval *d = &p->depend_on[idx];
+
+        if (depend_on[i] == DEPEND_RANGE) {
+            if (i + 3 >= ndepend)
+                break;
+            d->first = depend_on[i + 1];
+            d->last = depend_on[i + 2];
+            d->step = depend_on[i + 3];
+            i += 3;
+            if (d->first < 0 || d->step < 1)
+                continue;
+            /* filter out dependencies that are current jobs */
+            if (d->last >= p->jobid)
+                d->last = p->jobid - 1;
+            if (d->last < d->first)
+                continue;
+            d->last = d->first + (d->last - d->first) / d->step * d->step;
+            depend_on_range(p, d);
+        } else if (depend_on[i] == -1)
+            depend_on_last(p, d);
+        else {
+            /* filter out dependencies that are current jobs */
+            if (depend_on[i] >= p->jobid)
+                continue;
+            /* The user decided what's the job this new job depends on */
+            d->first = d->last = depend_on[i];
+            d->step = 1;
+            depend_on_job(p, d->first);
+        }
+        idx++;
+    }
+    p->depend_on_size = idx;
+
+    /* if dependency list is empty after removing invalid dependencies, make it independent */
+    if (p->depend_on_size == 0) {
+        pool_free(p->depend_on);
+        p->depend_on = 0;
+    }
+}
+
+/* Receive a string of the given size, if not 0 */
+static char *recv_string(int s, int size) {
+    char *str;
+
+    if (size <= 0)
+        return 0;
+    str = (char *) malloc(size + 1);
+    if (str == 0)
+        error("Cannot allocate %i bytes for a new job", size);
+    if (recv_bytes(s, str, size) == -1)
+        error("wrong bytes received");
+    str[size] = '\0';
+    return str;
+}
+
+/* The environment or the envp of a new job, shared (intern.c). With the
+ * size -1 the client didn't send it, as the server has it: it is the one
+ * its DATA_QUERY pinned */
+static char *recv_data(int s, int size, int which) {
+    char *str;
+    char *data;
+
+    if (size == -1)
+        return conn_take_known(s, which);
+    str = recv_string(s, size);
+    data = intern_bytes(str, size);
+    free(str);
+    return data;
+}
+
 /* Returns job id or -1 on error */
 int s_newjob(int s, struct Msg *m) {
     struct Job *p;
-    int res;
+    char *str;
 
     p = newjobptr();
+    /* Jobs run by the server don't hold a connection, so they don't count */
+    if (!m->u.newjob.server_exec)
+        ++client_jobs;
 
     p->jobid = jobids++;
+    intmap_put(&job_index, p->jobid, p);
 
     /* GPUs */
     p->num_gpus = m->u.newjob.gpus;
-    if (count_not_finished_jobs() < max_jobs)
-        p->state = (p->num_gpus) ? ALLOCATING : QUEUED;
-    else
-        p->state = HOLDING_CLIENT;
-
     p->wait_free_gpus = m->u.newjob.wait_free_gpus;
-    if (!p->wait_free_gpus)
-        p->gpu_ids = recv_ints(s, &p->num_gpus);
-    else {
-        p->gpu_ids = (int *) malloc((p->num_gpus + 1) * sizeof(int));
+    if (!p->wait_free_gpus) {
+        int *gpu_ids = recv_ints(s, &p->num_gpus);
+
+        if (p->num_gpus > 0) {
+            p->gpu_ids = (int *) pool_alloc(p->num_gpus * sizeof(int));
+            memcpy(p->gpu_ids, gpu_ids, p->num_gpus * sizeof(int));
+        }
+        free(gpu_ids);
+    } else {
+        p->gpu_ids = (int *) pool_alloc((p->num_gpus + 1) * sizeof(int));
         memset(p->gpu_ids, -1, (p->num_gpus + 1) * sizeof(int));
     }
 
     p->num_slots = m->u.newjob.num_slots;
     p->store_output = m->u.newjob.store_output;
     p->should_keep_finished = m->u.newjob.should_keep_finished;
+    p->priority = m->u.newjob.priority;
+    p->runtime = m->runtime;
+    p->resources = conn_take_resources(s);
+    p->res = resources_of(p->resources, &p->res_size);
 
-    /* this error level here is used internally to decide whether a job should be run or not
-     * so it only matters whether the error level is 0 or not.
-     * thus, summing the absolute error levels of all dependencies is sufficient.*/
     if (m->u.newjob.depend_on_size) {
         int *depend_on;
-        depend_on = recv_ints(s, &p->depend_on_size);
+        int ndepend;
 
-        /* Depend on the last queued job. */
-        int idx = 0;
-        for (int i = 0; i < p->depend_on_size; i++) {
-            /* filter out dependencies that are current jobs */
-            if (depend_on[i] >= p->jobid)
-                continue;
-
-            p->depend_on = (int*) realloc(p->depend_on, (idx + 1) * sizeof(int));
-            /* As we already have 'p' in the queue,
-             * neglect it during the find_last_jobid_in_queue() */
-            if (depend_on[i] == -1) {
-                p->depend_on[idx] = find_last_jobid_in_queue(p->jobid);
-
-                /* We don't trust the last jobid in the queue (running or queued)
-                 * if it's not the last added job. In that case, let
-                 * the next control flow handle it as if it could not
-                 * do_depend on any still queued job. */
-                if (last_finished_jobid > p->depend_on[idx])
-                    p->depend_on[idx] = -1;
-
-                /* If it's queued still without result, let it know
-                 * its result to p when it finishes. */
-                if (p->depend_on[idx] != -1) {
-                    struct Job *depended_job;
-                    depended_job = findjob(p->depend_on[idx]);
-                    if (depended_job != 0)
-                        add_notify_errorlevel_to(depended_job, p->jobid);
-                    else
-                        warning("The jobid %i is queued to do_depend on the jobid %i"
-                                " suddenly non existent in the queue", p->jobid,
-                                p->depend_on[idx]);
-                } else /* Otherwise take the finished job, or the last_errorlevel */
-                {
-                    if (depend_on[i] == -1) {
-                        int ljobid = find_last_stored_jobid_finished();
-                        p->depend_on[idx] = ljobid;
-
-                        /* If we have a newer result stored, use it */
-                        /* NOTE:
-                         *   Reading this now, I don't know how ljobid can be
-                         *   greater than last_finished_jobid */
-                        if (last_finished_jobid < ljobid) {
-                            struct Job *parent;
-                            parent = find_finished_job(ljobid);
-                            if (!parent)
-                                error("jobid %i suddenly disappeared from the finished list",
-                                      ljobid);
-                            p->dependency_errorlevel += abs(parent->result.errorlevel);
-                        } else
-                            p->dependency_errorlevel += abs(last_errorlevel);
-                    }
-                }
-            } else {
-                /* The user decided what's the job this new job depends on */
-                struct Job *depended_job;
-                p->depend_on[idx] = depend_on[i];
-                depended_job = findjob(p->depend_on[idx]);
-
-                if (depended_job != 0)
-                    add_notify_errorlevel_to(depended_job, p->jobid);
-                else {
-                    struct Job *parent;
-                    parent = find_finished_job(p->depend_on[idx]);
-                    if (parent) {
-                        p->dependency_errorlevel += abs(parent->result.errorlevel);
-                    } else {
-                        /* We consider as if the job not found
-                           didn't finish well */
-                        p->dependency_errorlevel += 1;
-                    }
-                }
-            }
-            idx++;
-        }
+        depend_on = recv_ints(s, &ndepend);
+        set_dependencies(p, depend_on, ndepend);
         free(depend_on);
-        p->depend_on_size = idx;
     }
 
-    /* if dependency list is empty after removing invalid dependencies, make it independent */
-    if (p->depend_on_size == 0)
-        p->depend_on = 0;
+    /* load the command */
+    str = recv_string(s, m->u.newjob.command_size);
+    p->command = intern(str, m->u.newjob.command_size);
+    free(str);
+
+    /* load the label */
+    str = recv_string(s, m->u.newjob.label_size);
+    p->label = intern(str, m->u.newjob.label_size);
+    free(str);
+
+    /* Only now it can tell whether the job is ready: the ready queue and
+     * the limit of the label look at the label */
+    if (m->u.newjob.server_exec || client_jobs < max_jobs)
+        set_job_state(p, (p->num_gpus) ? ALLOCATING : QUEUED);
+    else
+        set_job_state(p, HOLDING_CLIENT);
 
     pinfo_set_enqueue_time(&p->info);
 
-    /* load the command */
-    p->command = malloc(m->u.newjob.command_size);
-    if (p->command == 0)
-        error("Cannot allocate memory in s_newjob command_size (%i)",
-              m->u.newjob.command_size);
-    res = recv_bytes(s, p->command, m->u.newjob.command_size);
-    if (res == -1)
-        error("wrong bytes received");
+    /* load the environment, for the info */
+    p->env = recv_data(s, m->u.newjob.env_size, DATA_ENV);
 
-    /* load the label */
-    if (m->u.newjob.label_size > 0) {
-        char *ptr;
-        ptr = (char *) malloc(m->u.newjob.label_size);
-        if (ptr == 0)
-            error("Cannot allocate memory in s_newjob label_size(%i)",
-                  m->u.newjob.label_size);
-        res = recv_bytes(s, ptr, m->u.newjob.label_size);
-        if (res == -1)
+    /* What the server needs to run it */
+    if (m->u.newjob.server_exec) {
+        struct Execinfo *e;
+
+        e = (struct Execinfo *) pool_alloc(sizeof(*e));
+        e->argv_size = m->u.newjob.argv_size;
+        e->argv = (char *) pool_alloc(e->argv_size + 1);
+        e->cwd = (char *) pool_alloc(m->u.newjob.cwd_size + 1);
+        e->logfile = 0;
+        if (recv_bytes(s, e->argv, e->argv_size) == -1)
             error("wrong bytes received");
-        p->label = ptr;
-    }
-
-    /* load the info */
-    if (m->u.newjob.env_size > 0) {
-        char *ptr;
-        ptr = (char *) malloc(m->u.newjob.env_size);
-        if (ptr == 0)
-            error("Cannot allocate memory in s_newjob env_size(%i)",
-                  m->u.newjob.env_size);
-        res = recv_bytes(s, ptr, m->u.newjob.env_size);
-        if (res == -1)
+        e->envp = recv_data(s, m->u.newjob.envp_size, DATA_ENVP);
+        if (e->envp == 0)
+            e->envp = intern_bytes("", 0);
+        e->envp_size = intern_size(e->envp);
+        if (recv_bytes(s, e->cwd, m->u.newjob.cwd_size) == -1)
             error("wrong bytes received");
-        pinfo_addinfo(&p->info, m->u.newjob.env_size + 100,
-                      "Environment:\n%s", ptr);
-        free(ptr);
+        if (m->u.newjob.logfile_size > 0) {
+            e->logfile = (char *) pool_alloc(m->u.newjob.logfile_size);
+            if (recv_bytes(s, e->logfile, m->u.newjob.logfile_size) == -1)
+                error("wrong bytes received");
+        }
+        e->gzip = m->u.newjob.gzip;
+        e->stderr_apart = m->u.newjob.stderr_apart;
+        e->send_output_by_mail = m->u.newjob.send_output_by_mail;
+        e->require_elevel = m->u.newjob.require_elevel;
+        p->exec = e;
     }
+    journal_job(JR_NEW, p);
     return p->jobid;
 }
 
+/* The bytes after the header b of a job in a batch, if they are in room
+ * and the job is sane; else -1 */
+static int batchjob_size(const struct Batchjob *b, int room) {
+    int size = 0;
+
+    if (b->depend_on_size < 0 || b->command_size <= 0 || b->argv_size <= 0
+        || b->label_size < 0 || b->num_slots <= 0)
+        return -1;
+#ifndef CPU
+    if (b->gpus < 0 || b->gpus > getTotalGpus())
+        return -1;
+#else
+    if (b->gpus != 0)
+        return -1;
+#endif
+    if (b->depend_on_size > room / (int) sizeof(int))
+        return -1;
+    size += b->depend_on_size * sizeof(int);
+    if (b->command_size > room - size)
+        return -1;
+    size += b->command_size;
+    if (b->argv_size > room - size)
+        return -1;
+    size += b->argv_size;
+    if (b->label_size > room - size)
+        return -1;
+    return size + b->label_size;
+}
+
+/* Whether the batch has batch_count jobs that are all sane */
+static int batch_ok(const char *payload, int batch_size, int batch_count) {
+    int pos = 0;
+    int i;
+
+    if (batch_count <= 0 || payload == 0)
+        return 0;
+    for (i = 0; i < batch_count; ++i) {
+        struct Batchjob b;
+        int size;
+
+        if ((int) sizeof(b) > batch_size - pos)
+            return 0;
+        memcpy(&b, payload + pos, sizeof(b));
+        pos += sizeof(b);
+        size = batchjob_size(&b, batch_size - pos);
+        if (size == -1)
+            return 0;
+        pos += size;
+    }
+    return 1;
+}
+
+/* Many server_exec jobs in one message, as 'ts --batch' sends them: all
+ * of them, or none if any is wrong. Returns the jobid of the first; the
+ * rest follow it. -1 on error */
+int s_newjob_batch(int s, struct Msg *m) {
+    char *env, *envp, *cwd, *logfile;
+    char *resources = conn_take_resources(s);
+    char *payload;
+    int first_jobid = -1;
+    int pos = 0;
+    int i;
+
+    env = recv_data(s, m->u.newjob.env_size, DATA_ENV);
+    envp = recv_data(s, m->u.newjob.envp_size, DATA_ENVP);
+    if (envp == 0)
+        envp = intern_bytes("", 0);
+    cwd = recv_string(s, m->u.newjob.cwd_size);
+    logfile = recv_string(s, m->u.newjob.logfile_size);
+    payload = recv_string(s, m->u.newjob.batch_size);
+    if (!batch_ok(payload, m->u.newjob.batch_size, m->u.newjob.batch_count)) {
+        warning("Wrong batch of %i jobs", m->u.newjob.batch_count);
+        m->u.newjob.batch_count = 0;
+    }
+
+    for (i = 0; i < m->u.newjob.batch_count; ++i) {
+        struct Batchjob b;
+        struct Execinfo *e;
+        struct Job *p;
+        const char *data;
+        int *depend_on;
+
+        /* batch_ok() checked it all */
+        memcpy(&b, payload + pos, sizeof(b));
+        data = payload + pos + sizeof(b);
+        pos += sizeof(b) + batchjob_size(&b, m->u.newjob.batch_size - pos
+                                             - (int) sizeof(b));
+
+        p = newjobptr();
+        p->jobid = jobids++;
+        intmap_put(&job_index, p->jobid, p);
+        if (first_jobid == -1)
+            first_jobid = p->jobid;
+
+        p->num_gpus = b.gpus;
+        p->wait_free_gpus = 1;
+        p->gpu_ids = (int *) pool_alloc((p->num_gpus + 1) * sizeof(int));
+        memset(p->gpu_ids, -1, (p->num_gpus + 1) * sizeof(int));
+
+        p->num_slots = b.num_slots;
+        p->store_output = m->u.newjob.store_output;
+        p->should_keep_finished = m->u.newjob.should_keep_finished;
+        p->priority = m->u.newjob.priority;
+        p->runtime = m->runtime;
+        p->resources = intern_ref(resources);
+        p->res = resources_of(p->resources, &p->res_size);
+
+        if (b.depend_on_size > 0) {
+            depend_on = (int *) malloc(b.depend_on_size * sizeof(int));
+            if (depend_on == 0)
+                error("Cannot allocate memory for %i dependencies", b.depend_on_size);
+            memcpy(depend_on, data, b.depend_on_size * sizeof(int));
+            set_dependencies(p, depend_on, b.depend_on_size);
+            free(depend_on);
+            data += b.depend_on_size * sizeof(int);
+        }
+
+        p->command = intern(data, b.command_size);
+        data += b.command_size;
+
+        e = (struct Execinfo *) pool_alloc(sizeof(*e));
+        e->argv_size = b.argv_size;
+        e->argv = pool_copy(data, b.argv_size);
+        data += b.argv_size;
+        e->envp = intern_ref(envp);
+        e->envp_size = intern_size(envp);
+        e->cwd = pool_copy(cwd ? cwd : "", m->u.newjob.cwd_size);
+        e->logfile = logfile ? pool_copy(logfile, m->u.newjob.logfile_size) : 0;
+        e->gzip = m->u.newjob.gzip;
+        e->stderr_apart = m->u.newjob.stderr_apart;
+        e->send_output_by_mail = m->u.newjob.send_output_by_mail;
+        e->require_elevel = b.require_elevel;
+        p->exec = e;
+
+        if (b.label_size > 0)
+            p->label = intern(data, b.label_size);
+
+        set_job_state(p, (p->num_gpus) ? ALLOCATING : QUEUED);
+        pinfo_set_enqueue_time(&p->info);
+
+        p->env = intern_ref(env);
+        journal_job(JR_NEW, p);
+    }
+
+    intern_release(env);
+    intern_release(envp);
+    intern_release(resources);
+    free(cwd);
+    free(logfile);
+    free(payload);
+    return first_jobid;
+}
+
 /* This assumes the jobid exists */
 void s_removejob(int jobid) {
     struct Job *p;
-    struct Job *newnext;
 
-    if (firstjob->jobid == jobid) {
-        struct Job *newfirst;
+    p = findjob(jobid);
+    if (p == 0)
+        error("Job to be removed not found. jobid=%i", jobid);
 
-        /* First job is to be removed */
-        newfirst = firstjob->next;
-        destroy_job(firstjob);
-        firstjob = newfirst;
-        return;
+    journal_begin(JR_DROP);
+    journal_int(jobid);
+    journal_end();
+
+    unlink_queued_job(p);
+
+    /* The jobs depending on it don't have to wait for it anymore */
+    release_dependents(p, 0);
+    destroy_job(p);
+}
+
+/* The ready jobs looked at and left in a pass of next_run_jobs() */
+static struct Job **skipped_jobs;
+static int skipped_jobs_alloc;
+
+static void add_skipped_job(struct Job *p, int *nskipped) {
+    if (*nskipped == skipped_jobs_alloc) {
+        skipped_jobs_alloc = skipped_jobs_alloc ? 2 * skipped_jobs_alloc : 64;
+        skipped_jobs = (struct Job **) realloc(skipped_jobs,
+                        skipped_jobs_alloc * sizeof(*skipped_jobs));
+        if (skipped_jobs == 0)
+            error("Cannot allocate memory for %i skipped jobs", skipped_jobs_alloc);
     }
+    skipped_jobs[(*nskipped)++] = p;
+}
 
-    p = firstjob;
-    /* Not first job */
-    while (p->next != 0) {
-        if (p->next->jobid == jobid)
-            break;
-        p = p->next;
+/* The jobs to start in a pass of next_run_jobs() */
+static int *run_jobids;
+static int run_jobids_alloc;
+
+static void add_run_job(const struct Job *p, int *nrun) {
+    if (*nrun == run_jobids_alloc) {
+        run_jobids_alloc = run_jobids_alloc ? 2 * run_jobids_alloc : 64;
+        run_jobids = (int *) realloc(run_jobids,
+                        run_jobids_alloc * sizeof(*run_jobids));
+        if (run_jobids == 0)
+            error("Cannot allocate memory for %i jobs to run", run_jobids_alloc);
     }
-    if (p->next == 0)
-        error("Job to be removed not found. jobid=%i", jobid);
+    run_jobids[(*nrun)++] = p->jobid;
+}
+
+/* The first ready job that doesn't fit in the free slots keeps those it
+ * needs for when it would start, from the times the running jobs should
+ * end (EASY backfill). Until then, the jobs after it only start if they
+ * should end before it (the shadow time), or if they take slots it won't
+ * need then (the extra slots) */
+struct Reservation {
+    struct Job *job; /* 0 if none */
+    time_t shadow; /* 0 if it is not known when it starts */
+    int extra;
+};
+
+struct Running_end {
+    time_t end; /* 0 if not known */
+    int num_slots;
+};
 
-    newnext = p->next->next;
+static struct Running_end *running_ends;
+static int running_ends_alloc;
 
-    destroy_job(p->next);
-    p->next = newnext;
+static int cmp_running_end(const void *a, const void *b) {
+    const struct Running_end *ea = (const struct Running_end *) a;
+    const struct Running_end *eb = (const struct Running_end *) b;
+
+    if (ea->end == eb->end)
+        return 0;
+    if (ea->end == 0)
+        return 1;
+    if (eb->end == 0)
+        return -1;
+    return ea->end < eb->end ? -1 : 1;
 }
 
-/* -1 if no one should be run. */
-int next_run_job() {
+static void add_running_end(const struct Job *p, time_t now, int *nends) {
+    struct Running_end *e;
+    int runtime = expected_runtime(p);
+
+    if (*nends == running_ends_alloc) {
+        running_ends_alloc = running_ends_alloc ? 2 * running_ends_alloc : 64;
+        running_ends = (struct Running_end *) realloc(running_ends,
+                        running_ends_alloc * sizeof(*running_ends));
+        if (running_ends == 0)
+            error("Cannot allocate memory for %i running jobs", running_ends_alloc);
+    }
+    e = &running_ends[(*nends)++];
+    e->num_slots = p->num_slots;
+    e->end = 0;
+    if (runtime >= 0) {
+        /* Those started in this pass, or not told started yet, from now */
+        time_t start = p->info.start_time.tv_sec;
+
+        e->end = (start != 0 && start < now ? start : now) + runtime;
+        /* Late, it may end at any time */
+        if (e->end < now)
+            e->end = now;
+    }
+}
+
+static void reserve(struct Reservation *r, struct Job *p, int free_slots,
+                    const int *jobids, int nrun, time_t now) {
+    int nends = 0;
+    int i;
+
+    r->job = p;
+    r->shadow = 0;
+    r->extra = 0;
+    for (i = 0; i < running_count; ++i)
+        add_running_end(running_jobs[i], now, &nends);
+    for (i = 0; i < nrun; ++i)
+        add_running_end(get_job(jobids[i]), now, &nends);
+    qsort(running_ends, nends, sizeof(*running_ends), cmp_running_end);
+
+    for (i = 0; i < nends; ++i) {
+        free_slots += running_ends[i].num_slots;
+        if (running_ends[i].end != 0 && free_slots >= p->num_slots) {
+            r->shadow = running_ends[i].end;
+            r->extra = free_slots - p->num_slots;
+            return;
+        }
+    }
+    /* Not known when: only the slots it won't need even when all end */
+    if (free_slots > p->num_slots)
+        r->extra = free_slots - p->num_slots;
+}
+
+/* Whether p can start now without making the reserved job wait more. If
+ * so, it takes the extra slots it needs */
+static int backfills(struct Reservation *r, const struct Job *p, time_t now) {
+    int runtime = expected_runtime(p);
+
+    if (runtime >= 0 && r->shadow != 0 && now + runtime <= r->shadow)
+        return 1;
+    if (p->num_slots <= r->extra) {
+        r->extra -= p->num_slots;
+        return 1;
+    }
+    return 0;
+}
+
+/* Whether no job left in the ready queue can backfill */
+static int backfill_over(const struct Reservation *r) {
+    return r->job != 0 && r->extra == 0
+           && (r->shadow == 0 || readyq_timed() == 0);
+}
+
+/* All the jobs that fit in the free slots now, in the queue order, with
+ * their slots (and GPUs) taken, but for those the backfill keeps for a
+ * wider job before them. Their ids are in *jobids, until the next call.
+ * Returns how many, 0 if no one should be run. */
+int next_run_jobs(const int **jobids) {
     struct Job *p;
+    struct Reservation reservation = { 0 };
+    time_t now = time(NULL);
+    int nskipped = 0;
+    int nrun = 0;
+    int resource;
+    int i;
 
-    const int free_slots = max_slots - busy_slots;
+    int free_slots = max_slots - busy_slots;
 
     /* busy_slots may be bigger than the maximum slots,
      * if the user was running many jobs, and suddenly
      * trimmed the maximum slots down. */
     if (free_slots <= 0)
-        return -1;
+        return 0;
 
     /* If there are no jobs to run... */
-    if (firstjob == 0)
-        return -1;
+    if (readyq_size() == 0)
+        return 0;
+
+    /* Nothing that became ready since the last pass fits either */
+    if (free_slots <= nothing_fits_slots)
+        return 0;
 
 #ifndef CPU
     /* Query GPUs */
@@ -679,120 +1562,201 @@ int next_run_job() {
     int *freeGpuList = getGpuList(&numFree);
 #endif
 
-    /* Look for a runnable task */
-    p = firstjob;
-    while (p != 0) {
-        if (p->state == QUEUED || p->state == ALLOCATING) {
+    /* Look for runnable tasks, in the queue order, until the slots are
+     * full. The ready queue only has queued jobs whose dependencies
+     * finished */
+    while (free_slots > 0 && !backfill_over(&reservation)
+           && (p = readyq_pop()) != 0) {
+        /* Its label runs as many as it may: it waits for one of them to
+         * end, and the rest go on */
+        if (p->label != 0 && label_full(p->label)) {
+            park(p, &get_label(p->label, 0)->parked);
+            continue;
+        }
+        /* Or for what there is of a resource */
+        if ((resource = resources_short(p->res, p->res_size)) != -1) {
+            park(p, resources_waiting(resource));
+            continue;
+        }
+        if (free_slots < p->num_slots) {
+            /* Those that could never run don't keep slots */
+            if (reservation.job == 0 && p->num_slots <= max_slots)
+                reserve(&reservation, p, free_slots, run_jobids, nrun, now);
+            add_skipped_job(p, &nskipped);
+            continue;
+        }
+        if (reservation.job != 0 && !backfills(&reservation, p, now)) {
+            add_skipped_job(p, &nskipped);
+            continue;
+        }
 #ifndef CPU
-            if (p->num_gpus && p->wait_free_gpus) {
-                if (numFree < p->num_gpus) {
-                    /* if fewer GPUs than required then next */
-                    p = p->next;
-                    continue;
-                }
-                shuffle(freeGpuList, numFree);
-
-                /* We have to check whether some GPUs are used by other jobs, but their RAMs are still free
-                 * These GPUs should not be used.*/
-                int i = 0, j = 0;
-                /* loop until all GPUs required can be found, or there are enough GPUs */
-                int *gpu_ids = (int*) malloc(p->num_gpus * sizeof(int));
-                while (i < p->num_gpus && j < numFree) {
-                    /* if the prospective GPUs are in used, select the next one */
-                    if (!isInUse(freeGpuList[j]))
-                        gpu_ids[i++] = freeGpuList[j];
-                    j++;
-                }
-                /* some GPUs might already be claimed by other jobs, but the system still reports as free -> skip */
-                if (i < p->num_gpus) {
-                    p = p->next;
-                    free(gpu_ids);
-                    continue;
-                }
-                memcpy(p->gpu_ids, gpu_ids, p->num_gpus * sizeof(int));
+        if (p->num_gpus && p->wait_free_gpus) {
+            if (numFree < p->num_gpus) {
+                /* if fewer GPUs than required then next */
+                add_skipped_job(p, &nskipped);
+                continue;
+            }
+            shuffle(freeGpuList, numFree);
+
+            /* We have to check whether some GPUs are used by other jobs, but their RAMs are still free
+             * These GPUs should not be used. Those of the jobs taken
+             * before in this pass are in use already */
+            int i = 0, j = 0;
+            /* loop until all GPUs required can be found, or there are enough GPUs */
+            int *gpu_ids = (int*) malloc(p->num_gpus * sizeof(int));
+            while (i < p->num_gpus && j < numFree) {
+                /* if the prospective GPUs are in used, select the next one */
+                if (!isInUse(freeGpuList[j]))
+                    gpu_ids[i++] = freeGpuList[j];
+                j++;
+            }
+            /* some GPUs might already be claimed by other jobs, but the system still reports as free -> skip */
+            if (i < p->num_gpus) {
+                add_skipped_job(p, &nskipped);
                 free(gpu_ids);
+                continue;
             }
+            memcpy(p->gpu_ids, gpu_ids, p->num_gpus * sizeof(int));
+            free(gpu_ids);
+        }
+        if (p->num_gpus)
+            broadcastUsedGpus(p->num_gpus, p->gpu_ids);
 #endif
 
-            if (p->depend_on_size) {
-                int ready = 1;
-                for (int i = 0; i < p->depend_on_size; i++) {
-                    struct Job *do_depend_job = get_job(p->depend_on[i]);
-                    /* We won't try to run any job do_depending on an unfinished
-                     * job */
-                    if (do_depend_job != NULL &&
-                        (do_depend_job->state == QUEUED || do_depend_job->state == RUNNING ||
-                        do_depend_job->state == ALLOCATING)) {
-                        /* Next try */
-                        p = p->next;
-                        ready = 0;
-                        break;
-                    }
-                }
-                if (ready != 1)
-                    continue;
-            }
+        add_busy(p, 1);
+        free_slots -= p->num_slots;
+        add_run_job(p, &nrun);
+    }
 
-            if (free_slots >= p->num_slots) {
-                busy_slots = busy_slots + p->num_slots;
-#ifndef CPU
-                if (p->num_gpus)
-                    broadcastUsedGpus(p->num_gpus, p->gpu_ids);
+    /* Back to the ready queue, as they were */
+    for (i = 0; i < nskipped; ++i)
+        readyq_add(skipped_jobs[i]);
 
-                free(freeGpuList);
-#endif
-                return p->jobid;
-            }
-        }
-        p = p->next;
-    }
+    /* The free GPUs change behind our back; the slots don't */
+    if (jobs_in_state[ALLOCATING] == 0)
+        nothing_fits_slots = free_slots;
 #ifndef CPU
     free(freeGpuList);
 #endif
-    return -1;
+    *jobids = run_jobids;
+    return nrun;
+}
+
+/* Kept finished: at most max_finished jobs, and, if not 0, of those
+ * memory estimated by job_memory() and ended less than those seconds ago.
+ * Read once, by s_finished_init(); until then (the journal being read)
+ * nothing is dropped */
+static int max_finished = -1;
+static long long max_finished_memory = 0;
+static long long max_finished_age = 0;
+static long long finished_memory = 0;
+
+/* A number, with one of the suffixes and its factor */
+static long long env_amount(const char *name, const char *suffixes,
+                            const long long *factors) {
+    const char *value = getenv(name);
+    const char *suffix;
+    char *end;
+    long long amount;
+
+    if (value == NULL || value[0] == '\0')
+        return 0;
+    amount = strtoll(value, &end, 10);
+    if (*end != '\0') {
+        suffix = strchr(suffixes, *end);
+        if (suffix == NULL || end[1] != '\0') {
+            warning("Wrong value of %s: %s", name, value);
+            return 0;
+        }
+        amount *= factors[suffix - suffixes];
+    }
+    return amount > 0 ? amount : 0;
 }
 
-/* Returns 1000 if no limit, The limit otherwise. */
-static int get_max_finished_jobs() {
-    char *limit;
+/* What the job takes apart from what it shares with others (command,
+ * label, environments) */
+static long long job_memory(const struct Job *p) {
+    long long size = sizeof(*p);
 
-    limit = getenv("TS_MAXFINISHED");
-    if (limit == NULL)
-        return 1000;
-    return abs(atoi(limit));
+    size += p->depend_on_size * sizeof(struct Interval);
+    size += p->res_size * sizeof(struct Res_amount);
+    if (p->gpu_ids)
+        size += p->num_gpus * sizeof(int);
+    if (p->output_filename)
+        size += strlen(p->output_filename) + 1;
+    if (p->exec)
+        size += sizeof(*p->exec) + p->exec->argv_size
+                + strlen(p->exec->cwd) + 1;
+    return size;
 }
 
-/* Add the job to the finished queue. */
-static void new_finished_job(struct Job *j) {
-    struct Job *p;
-    int count, max;
+static void destroy_finished_job(struct Job *j);
 
-    max = get_max_finished_jobs();
-    count = 0;
+static int too_many_finished() {
+    struct timeval now;
 
-    if (first_finished_job == 0 && count < max) {
-        first_finished_job = j;
-        first_finished_job->next = 0;
+    if (count_finished_jobs > max_finished)
+        return 1;
+    if (max_finished_memory > 0 && finished_memory > max_finished_memory)
+        return 1;
+    if (max_finished_age > 0) {
+        gettimeofday(&now, NULL);
+        if (now.tv_sec - first_finished_job->info.end_time.tv_sec >= max_finished_age)
+            return 1;
+    }
+    return 0;
+}
+
+/* Drop the oldest finished jobs over the limits, to the history if any.
+ * The last one stays, for -d and the like */
+static void trim_finished() {
+    if (max_finished == -1)
         return;
+    while (first_finished_job != last_finished_job && too_many_finished()) {
+        history_add(first_finished_job);
+        destroy_finished_job(first_finished_job);
     }
+}
 
-    ++count;
+/* Add the job to the finished queue. */
+static void new_finished_job(struct Job *j) {
+    list_append(&first_finished_job, &last_finished_job, j);
+    ++count_finished_jobs;
+    finished_memory += job_memory(j);
 
-    p = first_finished_job;
-    while (p->next != 0) {
-        p = p->next;
-        ++count;
-    }
+    trim_finished();
+}
 
-    /* If too many jobs, wipe out the first */
-    if (count >= max) {
-        struct Job *tmp;
-        tmp = first_finished_job;
-        first_finished_job = first_finished_job->next;
-        destroy_job(tmp);
-    }
-    p->next = j;
-    p->next->next = 0;
+static void unlink_finished_job(struct Job *j) {
+    list_unlink(&first_finished_job, &last_finished_job, j);
+    --count_finished_jobs;
+    finished_memory -= job_memory(j);
+}
+
+/* Once the jobs of the last server are back */
+void s_finished_init() {
+    static const long long time_factors[] = {60, 3600, 24 * 3600};
+    static const long long memory_factors[] = {1024, 1024 * 1024,
+                                               1024 * 1024 * 1024};
+    char *limit;
+
+    limit = getenv("TS_MAXFINISHED");
+    max_finished = limit != NULL ? abs(atoi(limit)) : 1000;
+    max_finished_age = env_amount("TS_MAXFINISHED_AGE", "mhd", time_factors);
+    max_finished_memory = env_amount("TS_MAXFINISHED_MEM", "KMG", memory_factors);
+
+    history_open();
+    /* No new job takes the id of one in the history */
+    if (history_next_jobid() > jobids)
+        jobids = history_next_jobid();
+
+    trim_finished();
+}
+
+/* Each round of the server, for TS_MAXFINISHED_AGE */
+void s_expire_finished() {
+    if (max_finished_age > 0)
+        trim_finished();
 }
 
 static int job_is_in_state(int jobid, enum Jobstate state) {
@@ -815,28 +1779,12 @@ int job_is_holding_client(int jobid) {
 }
 
 static int in_notify_list(int jobid) {
-    struct Notify *n, *tmp;
-
-    n = first_notify;
-    while (n != 0) {
-        tmp = n;
-        n = n->next;
-        if (tmp->jobid == jobid)
-            return 1;
-    }
-    return 0;
+    return intmap_get(&notify_by_job, jobid) != 0;
 }
 
-void job_finished(const struct Result *result, int jobid) {
-    struct Job *p;
-
-    if (busy_slots <= 0)
-        error("Wrong state in the server. busy_slots = %i instead of greater than 0", busy_slots);
-
-    p = findjob(jobid);
-    if (p == 0)
-        error("on jobid %i finished, it doesn't exist", jobid);
-
+/* At end_time, or now if null */
+static void finish_job(struct Job *p, const struct Result *result,
+                       const struct timeval *end_time) {
 #ifndef CPU
     /* Recycle GPUs */
     broadcastFreeGpus(p->num_gpus, p->gpu_ids);
@@ -846,53 +1794,50 @@ void job_finished(const struct Result *result, int jobid) {
      * we call this to clean up the jobs list in case of the client closing the
      * connection. */
     if (p->state == RUNNING)
-        busy_slots = busy_slots - p->num_slots;
+        add_busy(p, -1);
 
     /* Mark state */
     if (result->skipped)
-        p->state = SKIPPED;
+        set_job_state(p, SKIPPED);
     else
-        p->state = FINISHED;
+        set_job_state(p, FINISHED);
     p->result = *result;
     last_finished_jobid = p->jobid;
     notify_errorlevel(p);
-    pinfo_set_end_time(&p->info);
-
-    if (p->result.died_by_signal)
-        pinfo_addinfo(&p->info, 100, "Exit status: killed by signal %i\n", p->result.signal);
+    if (end_time != 0)
+        p->info.end_time = *end_time;
     else
-        pinfo_addinfo(&p->info, 100, "Exit status: died with exit code %i\n", p->result.errorlevel);
+        pinfo_set_end_time(&p->info);
+    if (!result->skipped && !result->died_by_signal)
+        set_label_runtime(p);
+
+    journal_begin(JR_FINISH);
+    journal_int(p->jobid);
+    journal_data(&p->result, sizeof(p->result));
+    journal_data(&p->info.end_time, sizeof(p->info.end_time));
+    journal_end();
+
+    /* Remove it from the run queue */
+    unlink_queued_job(p);
+
+    /* Add it to the finished queue (maybe temporarily) */
+    if (p->should_keep_finished || in_notify_list(p->jobid))
+        new_finished_job(p);
+    else
+        destroy_job(p);
+}
 
-    /* Find the pointing node, to
-     * update it removing the finished job. */
-    {
-        struct Job **jpointer = 0;
-        struct Job *newfirst = p->next;
-        if (firstjob == p)
-            jpointer = &firstjob;
-        else {
-            struct Job *p2;
-            p2 = firstjob;
-            while (p2 != 0) {
-                if (p2->next == p) {
-                    jpointer = &(p2->next);
-                    break;
-                }
-                p2 = p2->next;
-            }
-        }
+void job_finished(const struct Result *result, int jobid) {
+    struct Job *p;
 
-        /* Add it to the finished queue (maybe temporarily) */
-        if (p->should_keep_finished || in_notify_list(p->jobid))
-            new_finished_job(p);
+    if (busy_slots <= 0)
+        error("Wrong state in the server. busy_slots = %i instead of greater than 0", busy_slots);
 
-        /* Remove it from the run queue */
-        if (jpointer == 0)
-            error("Cannot remove a finished job from the "
-                  "queue list (jobid=%i)", p->jobid);
+    p = findjob(jobid);
+    if (p == 0)
+        error("on jobid %i finished, it doesn't exist", jobid);
 
-        *jpointer = newfirst;
-    }
+    finish_job(p, result, 0);
 }
 
 void s_clear_finished() {
@@ -901,29 +1846,94 @@ void s_clear_finished() {
     if (first_finished_job == 0)
         return;
 
+    journal_begin(JR_CLEAR);
+    journal_end();
+
     p = first_finished_job;
     first_finished_job = 0;
+    last_finished_job = 0;
+    count_finished_jobs = 0;
+    finished_memory = 0;
+
+    while (p != 0) {
+        struct Job *tmp;
+        tmp = p->next;
+        history_add(p);
+        destroy_job(p);
+        p = tmp;
+    }
+}
+
+void s_process_runjob_ok(int jobid, char *oname, int pid) {
+    struct Job *p;
+    p = findjob(jobid);
+    if (p == 0)
+        error("Job %i already run not found on runjob_ok", jobid);
+    if (p->state != RUNNING)
+        error("Job %i not running, but %i on runjob_ok", jobid,
+              p->state);
+
+    p->pid = pid;
+    p->output_filename = oname;
+    pinfo_set_start_time(&p->info);
+    journal_start(p);
+}
+
+int job_is_server_exec(int jobid) {
+    struct Job *p;
+
+    p = findjob(jobid);
+    return p != 0 && p->exec != 0;
+}
+
+/* The server side of RUNJOB/RUNJOB_OK, for jobs without a client */
+void s_exec_job(int jobid) {
+    struct Job *p;
+
+    p = findjob(jobid);
+    if (p == 0)
+        error("Job %i was expected to run", jobid);
+
+    /* As the client does, on a dependency that didn't end well */
+    if (p->depend_on_size && p->exec->require_elevel
+        && p->dependency_errorlevel != 0) {
+        struct Result r = default_result();
+
+        r.errorlevel = -1;
+        r.skipped = 1;
+        p->pid = -1;
+        pinfo_set_start_time(&p->info);
+        job_finished(&r, jobid);
+        check_notify_list(jobid);
+        return;
+    }
+
+    p->pid = server_exec_fork(p, &p->output_filename);
+    pinfo_set_start_time(&p->info);
+    if (p->pid != -1)
+        journal_start(p);
+    else {
+        struct Result r = default_result();
 
-    while (p != 0) {
-        struct Job *tmp;
-        tmp = p->next;
-        destroy_job(p);
-        p = tmp;
+        r.errorlevel = -1;
+        job_finished(&r, jobid);
+        check_notify_list(jobid);
     }
 }
 
-void s_process_runjob_ok(int jobid, char *oname, int pid) {
+void s_exec_job_finished(int jobid, const struct Result *result) {
     struct Job *p;
+
     p = findjob(jobid);
-    if (p == 0)
-        error("Job %i already run not found on runjob_ok", jobid);
-    if (p->state != RUNNING)
-        error("Job %i not running, but %i on runjob_ok", jobid,
-              p->state);
+    if (p == 0) {
+        warning("Job %i finished, but it is not in the queue", jobid);
+        return;
+    }
 
-    p->pid = pid;
-    p->output_filename = oname;
-    pinfo_set_start_time(&p->info);
+    server_exec_notify(p, result->errorlevel);
+    job_finished(result, jobid);
+    /* For the dependencies */
+    check_notify_list(jobid);
 }
 
 void s_send_runjob(int s, int jobid) {
@@ -951,6 +1961,8 @@ void s_send_runjob(int s, int jobid) {
 void s_job_info(int s, int jobid) {
     struct Job *p = 0;
     struct Msg m = default_msg();
+    const char *text;
+    int size;
 
     if (jobid == -1) {
         /* This means that we want the job info of the running task, or that
@@ -961,25 +1973,14 @@ void s_job_info(int s, int jobid) {
                 error("Internal state WAITING, but job not run."
                       "firstjob = %x", firstjob);
         } else {
-            p = first_finished_job;
+            p = last_finished_job;
             if (p == 0) {
                 send_list_line(s, "No jobs.\n");
                 return;
             }
-            while (p->next != 0)
-                p = p->next;
         }
     } else {
-        p = firstjob;
-        while (p != 0 && p->jobid != jobid)
-            p = p->next;
-
-        /* Look in finished jobs if needed */
-        if (p == 0) {
-            p = first_finished_job;
-            while (p != 0 && p->jobid != jobid)
-                p = p->next;
-        }
+        p = get_job_or_history(jobid);
     }
 
     if (p == 0) {
@@ -989,41 +1990,14 @@ void s_job_info(int s, int jobid) {
         return;
     }
 
+    /* Rendered now, from the fields of the job, and sent at once */
+    joblist_clear();
+    joblist_add_info(p);
+    text = joblist_text(&size);
+
     m.type = INFO_DATA;
     send_msg(s, &m);
-    pinfo_dump(&p->info, s);
-    fd_nprintf(s, 100, "Command: ");
-    if (p->depend_on) {
-        fd_nprintf(s, 100, "[%i,", p->depend_on[0]);
-        for (int i = 1; i < p->depend_on_size; i++)
-            fd_nprintf(s, 100, ",%i", p->depend_on[i]);
-        fd_nprintf(s, 100, "]&& ");
-    }
-    write(s, p->command, strlen(p->command));
-    fd_nprintf(s, 100, "\n");
-    fd_nprintf(s, 100, "Slots required: %i\n", p->num_slots);
-#ifndef CPU
-    fd_nprintf(s, 100, "GPUs required: %d\n", p->num_gpus);
-    fd_nprintf(s, 100, "GPU IDs: %s\n", ints_to_chars(
-            p->gpu_ids, p->num_gpus ? p->num_gpus : 1, ","));
-#endif
-    fd_nprintf(s, 100, "Enqueue time: %s",
-               ctime(&p->info.enqueue_time.tv_sec));
-    if (p->state == RUNNING) {
-        fd_nprintf(s, 100, "Start time: %s",
-                   ctime(&p->info.start_time.tv_sec));
-        float t = pinfo_time_until_now(&p->info);
-        char *unit = time_rep(&t);
-        fd_nprintf(s, 100, "Time running: %f%s\n", t, unit);
-    } else if (p->state == FINISHED) {
-        fd_nprintf(s, 100, "Start time: %s",
-                   ctime(&p->info.start_time.tv_sec));
-        fd_nprintf(s, 100, "End time: %s",
-                   ctime(&p->info.end_time.tv_sec));
-        float t = pinfo_time_run(&p->info);
-        char *unit = time_rep(&t);
-        fd_nprintf(s, 100, "Time run: %f%s\n", t, unit);
-    }
+    send_bytes(s, text, size);
 }
 
 void s_send_last_id(int s) {
@@ -1047,16 +2021,14 @@ void s_send_output(int s, int jobid) {
                 error("Internal state WAITING, but job not run."
                       "firstjob = %x", firstjob);
         } else {
-            p = first_finished_job;
+            p = last_finished_job;
             if (p == 0) {
                 send_list_line(s, "No jobs.\n");
                 return;
             }
-            while (p->next != 0)
-                p = p->next;
         }
     } else {
-        p = get_job(jobid);
+        p = get_job_or_history(jobid);
         if (p != 0 && p->state != RUNNING
             && p->state != FINISHED
             && p->state != SKIPPED)
@@ -1097,17 +2069,30 @@ void s_send_output(int s, int jobid) {
 }
 
 void notify_errorlevel(struct Job *p) {
-    int i;
-
     last_errorlevel = p->result.errorlevel;
+    release_dependents(p, abs(p->result.errorlevel));
+}
 
-    for (i = 0; i < p->notify_errorlevel_to_size; ++i) {
-        struct Job *notified;
-        notified = get_job(p->notify_errorlevel_to[i]);
-        if (notified) {
-            notified->dependency_errorlevel += abs(p->result.errorlevel);
-        }
-    }
+static void remove_job(struct Job *p) {
+    journal_begin(JR_REMOVE);
+    journal_int(p->jobid);
+    journal_end();
+
+    /* Update the list pointers, while the state tells which list */
+    if (job_in_finished_list(p))
+        unlink_finished_job(p);
+    else
+        unlink_queued_job(p);
+
+    /* Tricks for the check_notify_list */
+    set_job_state(p, FINISHED);
+    p->result.errorlevel = -1;
+    notify_errorlevel(p);
+
+    /* Notify the clients in wait_job */
+    notify_waiters(p);
+
+    destroy_job(p);
 }
 
 /* jobid is input/output. If the input is -1, it's changed to the jobid
@@ -1115,47 +2100,14 @@ void notify_errorlevel(struct Job *p) {
 int s_remove_job(int s, int *jobid) {
     struct Job *p = 0;
     struct Msg m = default_msg();
-    struct Job *before_p = 0;
 
     if (*jobid == -1) {
         /* Find the last job added */
-        p = firstjob;
-        if (p != 0) {
-            while (p->next != 0) {
-                before_p = p;
-                p = p->next;
-            }
-        } else {
-            /* last 'finished' */
-            p = first_finished_job;
-            if (p) {
-                while (p->next != 0) {
-                    before_p = p;
-                    p = p->next;
-                }
-            }
-        }
+        p = lastjob;
+        if (p == 0)
+            p = last_finished_job; /* last 'finished' */
     } else {
-        p = firstjob;
-        if (p != 0) {
-            while (p->next != 0 && p->jobid != *jobid) {
-                before_p = p;
-                p = p->next;
-            }
-        }
-
-        /* If not found, look in the 'finished' list */
-        if (p == 0 || p->jobid != *jobid) {
-            p = first_finished_job;
-            if (p != 0) {
-                while (p->next != 0 && p->jobid != *jobid) {
-                    before_p = p;
-                    p = p->next;
-                }
-                if (p->jobid != *jobid)
-                    p = 0;
-            }
-        }
+        p = get_job(*jobid);
     }
 
     if (p == 0 || p->state == RUNNING || p == firstjob) {
@@ -1171,47 +2123,57 @@ int s_remove_job(int s, int *jobid) {
     /* Return the jobid found */
     *jobid = p->jobid;
 
-    /* Tricks for the check_notify_list */
-    p->state = FINISHED;
-    p->result.errorlevel = -1;
-    notify_errorlevel(p);
-
-    /* Notify the clients in wait_job */
-    check_notify_list(m.u.jobid);
-
-    /* Update the list pointers */
-    if (p == first_finished_job)
-        first_finished_job = p->next;
-    else
-        before_p->next = p->next;
-
-    destroy_job(p);
+    remove_job(p);
 
     m.type = REMOVEJOB_OK;
     send_msg(s, &m);
     return 1;
 }
 
-static void add_to_notify_list(int s, int jobid) {
-    struct Notify *n;
+static void add_to_notify_list(int s, int jobid, int request_id) {
     struct Notify *new;
 
     new = (struct Notify *) malloc(sizeof(*new));
+    if (new == 0)
+        error("Cannot allocate memory for a waiter of the job %i", jobid);
 
     new->socket = s;
     new->jobid = jobid;
-    new->next = 0;
-
-    n = first_notify;
-    if (n == 0) {
-        first_notify = new;
-        return;
-    }
-
-    while (n->next != 0)
-        n = n->next;
+    new->request_id = request_id;
+
+    new->prev_of_job = 0;
+    new->next_of_job = intmap_get(&notify_by_job, jobid);
+    if (new->next_of_job != 0)
+        new->next_of_job->prev_of_job = new;
+    intmap_put(&notify_by_job, jobid, new);
+
+    new->prev_of_socket = 0;
+    new->next_of_socket = intmap_get(&notify_by_socket, s);
+    if (new->next_of_socket != 0)
+        new->next_of_socket->prev_of_socket = new;
+    intmap_put(&notify_by_socket, s, new);
+}
+
+static void remove_from_notify_list(struct Notify *n) {
+    if (n->prev_of_job != 0)
+        n->prev_of_job->next_of_job = n->next_of_job;
+    else if (n->next_of_job != 0)
+        intmap_put(&notify_by_job, n->jobid, n->next_of_job);
+    else
+        intmap_del(&notify_by_job, n->jobid);
+    if (n->next_of_job != 0)
+        n->next_of_job->prev_of_job = n->prev_of_job;
+
+    if (n->prev_of_socket != 0)
+        n->prev_of_socket->next_of_socket = n->next_of_socket;
+    else if (n->next_of_socket != 0)
+        intmap_put(&notify_by_socket, n->socket, n->next_of_socket);
+    else
+        intmap_del(&notify_by_socket, n->socket);
+    if (n->next_of_socket != 0)
+        n->next_of_socket->prev_of_socket = n->prev_of_socket;
 
-    n->next = new;
+    free(n);
 }
 
 static void send_waitjob_ok(int s, int errorlevel) {
@@ -1238,78 +2200,63 @@ get_job(int jobid) {
     return 0;
 }
 
+/* For what only reads the job: it may have left for the history */
+static struct Job *get_job_or_history(int jobid) {
+    struct Job *j;
+
+    j = get_job(jobid);
+    if (j != NULL)
+        return j;
+
+    return history_get(jobid);
+}
+
 /* Don't complain, if the socket doesn't exist */
 void s_remove_notification(int s) {
     struct Notify *n;
-    struct Notify *previous;
-    n = first_notify;
-    while (n != 0 && n->socket != s)
-        n = n->next;
-    if (n == 0 || n->socket != s)
-        return;
 
-    /* Remove the notification */
-    previous = first_notify;
-    if (n == previous) {
-        first_notify = n->next;
-        free(n);
-        return;
-    }
+    while ((n = intmap_get(&notify_by_socket, s)) != 0)
+        remove_from_notify_list(n);
+}
 
-    /* if not the first... */
-    while (previous->next != n)
-        previous = previous->next;
+/* Send the result of j to all its waiters */
+static void notify_waiters(const struct Job *j) {
+    struct Notify *n;
 
-    previous->next = n->next;
-    free(n);
+    while ((n = intmap_get(&notify_by_job, j->jobid)) != 0) {
+        conn_frame_begin(n->socket);
+        send_waitjob_ok(n->socket, j->result.errorlevel);
+        conn_frame_end(n->socket, n->request_id);
+        remove_from_notify_list(n);
+    }
 }
 
 static void destroy_finished_job(struct Job *j) {
-    if (j == first_finished_job)
-        first_finished_job = j->next;
-    else {
-        struct Job *i;
-        for (i = first_finished_job; i != 0; ++i) {
-            if (i->next == j) {
-                i->next = j->next;
-                break;
-            }
-        }
-        if (i == 0) {
-            error("Cannot destroy the expected job %i", j->jobid);
-        }
-    }
+    journal_begin(JR_FORGET);
+    journal_int(j->jobid);
+    journal_end();
+
+    unlink_finished_job(j);
 
     destroy_job(j);
 }
 
 /* This is called when a job finishes */
 void check_notify_list(int jobid) {
-    struct Notify *n, *tmp;
     struct Job *j;
 
-    n = first_notify;
-    while (n != 0) {
-        tmp = n;
-        n = n->next;
-        if (tmp->jobid == jobid) {
-            j = get_job(jobid);
-            /* If the job finishes, notify the waiter */
-            if (j->state == FINISHED || j->state == SKIPPED) {
-                send_waitjob_ok(tmp->socket, j->result.errorlevel);
-                /* We want to get the next Nofity* before we remove
-                 * the actual 'n'. As s_remove_notification() simply
-                 * removes the element from the linked list, we can
-                 * safely follow on the list from n->next. */
-                s_remove_notification(tmp->socket);
-
-                /* Remove the jobs that were temporarily in the finished list,
-                 * just for their notifiers. */
-                if (!in_notify_list(jobid) && !j->should_keep_finished) {
-                    destroy_finished_job(j);
-                }
-            }
-        }
+    if (!in_notify_list(jobid))
+        return;
+
+    j = get_job(jobid);
+    /* If the job finishes, notify the waiters */
+    if (j != 0 && (j->state == FINISHED || j->state == SKIPPED)) {
+        notify_waiters(j);
+
+        /* Remove the jobs that were temporarily in the finished list,
+         * just for their notifiers. */
+        if (!j->should_keep_finished)
+            destroy_finished_job(j);
     }
 }
 
@@ -1318,30 +2265,13 @@ void s_wait_job(int s, int jobid) {
 
     if (jobid == -1) {
         /* Find the last job added */
-        p = firstjob;
-
-        if (p != 0)
-            while (p->next != 0)
-                p = p->next;
+        p = lastjob;
 
         /* Look in finished jobs if needed */
-        if (p == 0) {
-            p = first_finished_job;
-            if (p != 0)
-                while (p->next != 0)
-                    p = p->next;
-        }
+        if (p == 0)
+            p = last_finished_job;
     } else {
-        p = firstjob;
-        while (p != 0 && p->jobid != jobid)
-            p = p->next;
-
-        /* Look in finished jobs if needed */
-        if (p == 0) {
-            p = first_finished_job;
-            while (p != 0 && p->jobid != jobid)
-                p = p->next;
-        }
+        p = get_job_or_history(jobid);
     }
 
     if (p == 0) {
@@ -1357,7 +2287,7 @@ void s_wait_job(int s, int jobid) {
     if (p->state == FINISHED || p->state == SKIPPED) {
         send_waitjob_ok(s, p->result.errorlevel);
     } else
-        add_to_notify_list(s, p->jobid);
+        add_to_notify_list(s, p->jobid, conn_request_id(s));
 }
 
 void s_wait_running_job(int s, int jobid) {
@@ -1374,25 +2304,14 @@ void s_wait_running_job(int s, int jobid) {
                 error("Internal state WAITING, but job not run."
                       "firstjob = %x", firstjob);
         } else {
-            p = first_finished_job;
+            p = last_finished_job;
             if (p == 0) {
                 send_list_line(s, "No jobs.\n");
                 return;
             }
-            while (p->next != 0)
-                p = p->next;
         }
     } else {
-        p = firstjob;
-        while (p != 0 && p->jobid != jobid)
-            p = p->next;
-
-        /* Look in finished jobs if needed */
-        if (p == 0) {
-            p = first_finished_job;
-            while (p != 0 && p->jobid != jobid)
-                p = p->next;
-        }
+        p = get_job_or_history(jobid);
     }
 
     if (p == 0) {
@@ -1408,13 +2327,16 @@ void s_wait_running_job(int s, int jobid) {
     if (p->state == FINISHED || p->state == SKIPPED) {
         send_waitjob_ok(s, p->result.errorlevel);
     } else
-        add_to_notify_list(s, p->jobid);
+        add_to_notify_list(s, p->jobid, conn_request_id(s));
 }
 
 void s_set_max_slots(int new_max_slots) {
-    if (new_max_slots > 0)
+    if (new_max_slots > 0) {
         max_slots = new_max_slots;
-    else
+        journal_begin(JR_SLOTS);
+        journal_int(max_slots);
+        journal_end();
+    } else
         warning("Received new_max_slots=%i", new_max_slots);
 }
 
@@ -1428,21 +2350,31 @@ void s_get_max_slots(int s) {
     send_msg(s, &m);
 }
 
+/* Right after the first one */
+static void move_urgent(struct Job *p) {
+    journal_begin(JR_URGENT);
+    journal_int(p->jobid);
+    journal_end();
+
+    list_unlink(&firstjob, &lastjob, p);
+    list_insert_after(&lastjob, firstjob, p);
+    /* First among those of its priority, with the aging of the first */
+    if (p->waiting_since > firstjob->waiting_since)
+        p->waiting_since = firstjob->waiting_since;
+    p->queue_pos = --first_queue_pos;
+    ready_moved(p);
+    firstjob->queue_pos = --first_queue_pos;
+    ready_moved(firstjob);
+}
+
 void s_move_urgent(int s, int jobid) {
     struct Job *p = 0;
-    struct Job *tmp1;
 
     if (jobid == -1) {
         /* Find the last job added */
-        p = firstjob;
-
-        if (p != 0)
-            while (p->next != 0)
-                p = p->next;
+        p = lastjob;
     } else {
-        p = firstjob;
-        while (p != 0 && p->jobid != jobid)
-            p = p->next;
+        p = findjob(jobid);
     }
 
     if (p == 0 || firstjob->next == 0) {
@@ -1455,18 +2387,54 @@ void s_move_urgent(int s, int jobid) {
         return;
     }
 
-    /* Interchange the pointers */
-    tmp1 = find_previous_job(p);
-    tmp1->next = p->next;
-    p->next = firstjob->next;
-    firstjob->next = p;
+    if (p != firstjob)
+        move_urgent(p);
     send_urgent_ok(s);
 }
 
+/* None is the first, so both have a prev */
+static void swap_jobs(struct Job *p1, struct Job *p2) {
+    struct Job *prev1, *prev2;
+    time_t tmp_since;
+    int tmp_pos;
+
+    journal_begin(JR_SWAP);
+    journal_int(p1->jobid);
+    journal_int(p2->jobid);
+    journal_end();
+
+    if (p2->next == p1) {
+        struct Job *tmp = p1;
+        p1 = p2;
+        p2 = tmp;
+    }
+    prev1 = p1->prev;
+    prev2 = p2->prev;
+    list_unlink(&firstjob, &lastjob, p2);
+    if (prev2 == p1) {
+        /* Neighbours: p2 goes just before p1 */
+        list_insert_after(&lastjob, prev1, p2);
+    } else {
+        list_unlink(&firstjob, &lastjob, p1);
+        list_insert_after(&lastjob, prev1, p2);
+        list_insert_after(&lastjob, prev2, p1);
+    }
+    /* Their places in the run order too: priority and aging */
+    tmp_pos = p1->queue_pos;
+    p1->queue_pos = p2->queue_pos;
+    p2->queue_pos = tmp_pos;
+    tmp_pos = p1->priority;
+    p1->priority = p2->priority;
+    p2->priority = tmp_pos;
+    tmp_since = p1->waiting_since;
+    p1->waiting_since = p2->waiting_since;
+    p2->waiting_since = tmp_since;
+    ready_moved(p1);
+    ready_moved(p2);
+}
+
 void s_swap_jobs(int s, int jobid1, int jobid2) {
     struct Job *p1, *p2;
-    struct Job *prev1, *prev2;
-    struct Job *tmp;
 
     p1 = findjob(jobid1);
     p2 = findjob(jobid2);
@@ -1478,18 +2446,108 @@ void s_swap_jobs(int s, int jobid1, int jobid2) {
         return;
     }
 
-    /* Interchange the pointers */
-    prev1 = find_previous_job(p1);
-    prev2 = find_previous_job(p2);
-    prev1->next = p2;
-    prev2->next = p1;
-    tmp = p1->next;
-    p1->next = p2->next;
-    p2->next = tmp;
+    /* Interchange the places */
+    if (p1 != p2)
+        swap_jobs(p1, p2);
 
     send_swap_jobs_ok(s);
 }
 
+static void set_priority(struct Job *p, int priority) {
+    journal_begin(JR_PRIORITY);
+    journal_int(p->jobid);
+    journal_int(priority);
+    journal_end();
+
+    p->priority = priority;
+    ready_moved(p);
+}
+
+void s_set_priority(int s, int jobid, int priority) {
+    struct Msg m = default_msg();
+    struct Job *p;
+
+    if (jobid == -1)
+        p = lastjob;
+    else
+        p = findjob(jobid);
+
+    if (p == 0) {
+        char tmp[50];
+        if (jobid == -1)
+            sprintf(tmp, "The last job cannot be given a priority.\n");
+        else
+            sprintf(tmp, "The job %i cannot be given a priority.\n", jobid);
+        send_list_line(s, tmp);
+        return;
+    }
+
+    set_priority(p, priority);
+
+    m.type = SET_PRIORITY_OK;
+    send_msg(s, &m);
+}
+
+static void set_label_limit(char *label, int max_running) {
+    struct Label *l = get_label(label, 1);
+
+    journal_begin(JR_LABEL_LIMIT);
+    journal_bytes(label, intern_size(label));
+    journal_int(max_running);
+    journal_end();
+
+    l->max_running = max_running;
+    /* Its jobs may run now */
+    wake_label(l);
+    nothing_fits_slots = 0;
+}
+
+static void set_resources(const char *spec) {
+    int i;
+
+    if (!resources_set(spec))
+        return;
+    journal_begin(JR_RESOURCES);
+    journal_string(spec);
+    journal_end();
+    for (i = 0; i < resources_count(); ++i)
+        wake_resource(i);
+    nothing_fits_slots = 0;
+}
+
+void s_set_resources(int s, int size) {
+    struct Msg m = default_msg();
+    char *spec;
+
+    spec = recv_string(s, size);
+    if (spec == 0 || !resources_check(spec)) {
+        send_list_line(s, "Wrong resources: name=amount,... as mem=16G,license=1.\n");
+        free(spec);
+        return;
+    }
+    set_resources(spec);
+    free(spec);
+
+    m.type = SET_RESOURCES_OK;
+    send_msg(s, &m);
+}
+
+void s_set_label_limit(int s, int max_running, int label_size) {
+    struct Msg m = default_msg();
+    char *str;
+    char *label;
+
+    str = recv_string(s, label_size);
+    label = intern(str, label_size);
+    free(str);
+    if (label != 0)
+        set_label_limit(label, max_running > 0 ? max_running : 0);
+    intern_release(label);
+
+    m.type = SET_LABEL_LIMIT_OK;
+    send_msg(s, &m);
+}
+
 static void send_state(int s, enum Jobstate state) {
     struct Msg m = default_msg();
 
@@ -1504,22 +2562,14 @@ void s_send_state(int s, int jobid) {
 
     if (jobid == -1) {
         /* Find the last job added */
-        p = firstjob;
-
-        if (p != 0)
-            while (p->next != 0)
-                p = p->next;
+        p = lastjob;
 
         /* Look in finished jobs if needed */
-        if (p == 0) {
-            p = first_finished_job;
-            if (p != 0)
-                while (p->next != 0)
-                    p = p->next;
-        }
+        if (p == 0)
+            p = last_finished_job;
 
     } else {
-        p = get_job(jobid);
+        p = get_job_or_history(jobid);
     }
 
     if (p == 0) {
@@ -1549,6 +2599,7 @@ static void dump_job_struct(FILE *out, const struct Job *p) {
     fprintf(out, "    store_output %i\n", p->store_output);
     fprintf(out, "    pid %i\n", p->pid);
     fprintf(out, "    should_keep_finished %i\n", p->should_keep_finished);
+    fprintf(out, "    server_exec %i\n", p->exec != 0);
 }
 
 void dump_jobs_struct(FILE *out) {
@@ -1575,51 +2626,59 @@ static void dump_notify_struct(FILE *out, const struct Notify *n) {
     fprintf(out, "    socket \"%i\"\n", n->socket);
 }
 
-void dump_notifies_struct(FILE *out) {
+static void dump_job_notifies(FILE *out, const struct Job *p) {
     const struct Notify *n;
 
-    fprintf(out, "New_notifies\n");
-
-    n = first_notify;
+    n = intmap_get(&notify_by_job, p->jobid);
     while (n != 0) {
         dump_notify_struct(out, n);
-        n = n->next;
+        n = n->next_of_job;
     }
 }
 
+void dump_notifies_struct(FILE *out) {
+    const struct Job *p;
+
+    fprintf(out, "New_notifies\n");
+
+    /* Only the jobs in the lists have waiters */
+    for (p = firstjob; p != 0; p = p->next)
+        dump_job_notifies(out, p);
+    for (p = first_finished_job; p != 0; p = p->next)
+        dump_job_notifies(out, p);
+}
+
 void joblist_dump(int fd) {
     struct Job *p;
-    char *buffer;
+    const char *text;
+    int size;
 
-    buffer = joblistdump_headers();
-    write(fd, buffer, strlen(buffer));
-    free(buffer);
+    joblist_clear();
+    joblistdump_add_headers();
 
     /* We reuse the headers from the list */
-    buffer = joblist_headers();
-    write(fd, "# ", 2);
-    write(fd, buffer, strlen(buffer));
+    joblist_add("# ");
+    joblist_add_headers();
 
     /* Show Finished jobs */
     p = first_finished_job;
     while (p != 0) {
-        buffer = joblist_line(p);
-        write(fd, "# ", 2);
-        write(fd, buffer, strlen(buffer));
-        free(buffer);
+        joblist_add("# ");
+        joblist_add_line(p);
         p = p->next;
     }
 
-    write(fd, "\n", 1);
+    joblist_add("\n");
 
     /* Show Queued or Running jobs */
     p = firstjob;
     while (p != 0) {
-        buffer = joblistdump_torun(p);
-        write(fd, buffer, strlen(buffer));
-        free(buffer);
+        joblistdump_add_torun(p);
         p = p->next;
     }
+
+    text = joblist_text(&size);
+    send_bytes(fd, text, size);
 }
 
 void s_get_env(int s, int size) {
@@ -1688,3 +2747,353 @@ void s_set_logdir(const char* path) {
     logdir = realloc(logdir, strlen(path) + 1);
     strcpy(logdir, path);
 }
+
+/* A job from what journal_job() wrote, in its list. It waits for no
+ * dependency yet, and it is not ready: see link_job() */
+static struct Job *restore_job(struct Journal_reader *r) {
+    struct Job *p;
+    struct Execinfo *e = 0;
+    const char *data;
+    const int *ids;
+    char *gpu_ids;
+    int size;
+    int state;
+    int i;
+
+    p = (struct Job *) pool_alloc(sizeof(*p));
+    init_job(p);
+
+    p->jobid = jr_int(r);
+    state = jr_int(r);
+    jr_data(r, &p->result, sizeof(p->result));
+    p->pid = jr_int(r);
+    p->store_output = jr_int(r);
+    p->should_keep_finished = jr_int(r);
+    p->num_slots = jr_int(r);
+    p->num_gpus = jr_int(r);
+    p->wait_free_gpus = jr_int(r);
+    gpu_ids = jr_bytes(r, &size);
+    if (p->num_gpus >= 0 && size <= p->num_gpus * (int) sizeof(int)) {
+        /* Those not known yet are -1, as in s_newjob() */
+        p->gpu_ids = (int *) pool_alloc((p->num_gpus + 1) * sizeof(int));
+        memcpy(p->gpu_ids, gpu_ids, size);
+        memset((char *) p->gpu_ids + size, -1,
+               (p->num_gpus + 1) * sizeof(int) - size);
+    }
+    free(gpu_ids);
+    /* Older servers kept each id */
+    ids = (const int *) jr_view(r, &size);
+    if (size > 0) {
+        p->depend_on_size = size / sizeof(int);
+        p->depend_on = (struct Interval *)
+            pool_alloc(p->depend_on_size * sizeof(struct Interval));
+        for (i = 0; i < p->depend_on_size; ++i) {
+            memcpy(&p->depend_on[i].first, ids + i, sizeof(int));
+            p->depend_on[i].last = p->depend_on[i].first;
+            p->depend_on[i].step = 1;
+        }
+    }
+    p->dependency_errorlevel = jr_int(r);
+    data = jr_view(r, &size);
+    p->command = intern(data, size);
+    data = jr_view(r, &size);
+    p->label = intern(data, size);
+    p->output_filename = jr_string(r);
+    jr_view(r, &size); /* The info text of older servers */
+    jr_data(r, &p->info.enqueue_time, sizeof(p->info.enqueue_time));
+    jr_data(r, &p->info.start_time, sizeof(p->info.start_time));
+    jr_data(r, &p->info.end_time, sizeof(p->info.end_time));
+    if (jr_int(r)) {
+        e = (struct Execinfo *) pool_alloc(sizeof(*e));
+        e->argv = jr_pool_bytes(r, &e->argv_size);
+        data = jr_view(r, &e->envp_size);
+        e->envp = intern_bytes(data, e->envp_size);
+        e->cwd = jr_pool_string(r);
+        e->logfile = jr_pool_string(r);
+        e->gzip = jr_int(r);
+        e->stderr_apart = jr_int(r);
+        e->send_output_by_mail = jr_int(r);
+        e->require_elevel = jr_int(r);
+        p->exec = e;
+    }
+    if (r->pos < r->size) {
+        data = jr_view(r, &size);
+        p->env = intern_bytes(data, size);
+    }
+    if (r->pos < r->size) {
+        data = jr_view(r, &size);
+        if (size > 0) {
+            p->depend_on = (struct Interval *) pool_copy(data, size);
+            p->depend_on_size = size / sizeof(struct Interval);
+        }
+    }
+    p->waiting_since = p->info.enqueue_time.tv_sec;
+    if (r->pos < r->size) {
+        p->priority = jr_int(r);
+        jr_data(r, &p->waiting_since, sizeof(p->waiting_since));
+    }
+    if (r->pos < r->size)
+        p->runtime = jr_int(r);
+    if (r->pos < r->size) {
+        data = jr_view(r, &size);
+        p->resources = intern_bytes(data, size);
+        p->res = resources_of(p->resources, &p->res_size);
+    }
+
+    if (r->error || p->command == 0 || state < QUEUED || state > HOLDING_CLIENT
+        || intmap_get(&job_index, p->jobid) != 0
+        || (e != 0 && (e->argv == 0 || e->envp == 0 || e->cwd == 0))) {
+        r->error = 1;
+        free_job(p);
+        return 0;
+    }
+
+    p->state = state;
+    if (job_in_finished_list(p)) {
+        list_append(&first_finished_job, &last_finished_job, p);
+        ++count_finished_jobs;
+        finished_memory += job_memory(p);
+    } else {
+        p->queue_pos = next_queue_pos++;
+        list_append(&firstjob, &lastjob, p);
+        if (p->exec == 0)
+            ++client_jobs;
+        if (p->state == RUNNING) {
+            add_busy(p, 1);
+            running_add(p);
+#ifndef CPU
+            if (p->num_gpus)
+                broadcastUsedGpus(p->num_gpus, p->gpu_ids);
+#endif
+        }
+    }
+    ++jobs_in_state[p->state];
+    intmap_put(&job_index, p->jobid, p);
+    if (p->jobid >= jobids)
+        jobids = p->jobid + 1;
+    return p;
+}
+
+/* A queued job of the journal waits for its dependencies still queued */
+static void link_job(struct Job *p) {
+    int i;
+
+    for (i = 0; i < p->depend_on_size; ++i) {
+        const struct Interval *d = &p->depend_on[i];
+
+        if (d->first < 0 || d->step < 1)
+            continue;
+        wait_for_range(p, d);
+    }
+    update_ready(p);
+}
+
+/* Do again what a record of the journal tells, as when it was written */
+void s_journal_apply(int type, struct Journal_reader *r) {
+    struct Job *p, *p2;
+    struct Result result;
+    struct timeval t;
+    char *ofname;
+    int jobid, jobid2, pid;
+    int priority, max_running;
+    int s, request_id;
+    const char *data;
+    char *label, *spec;
+    int size;
+
+    switch (type) {
+        case JR_STATE:
+            max_slots = jr_int(r);
+            jobids = jr_int(r);
+            last_errorlevel = jr_int(r);
+            last_finished_jobid = jr_int(r);
+            break;
+        case JR_JOB:
+            restore_job(r);
+            break;
+        case JR_LINK:
+            for (p = firstjob; p != 0; p = p->next)
+                link_job(p);
+            break;
+        case JR_NEW:
+            p = restore_job(r);
+            if (p != 0)
+                link_job(p);
+            break;
+        case JR_START:
+            jobid = jr_int(r);
+            pid = jr_int(r);
+            ofname = jr_string(r);
+            jr_data(r, &t, sizeof(t));
+            p = findjob(jobid);
+            if (p == 0 || r->error) {
+                free(ofname);
+                break;
+            }
+            if (p->state != RUNNING) {
+                set_job_state(p, RUNNING);
+                add_busy(p, 1);
+            }
+            p->pid = pid;
+            free(p->output_filename);
+            p->output_filename = ofname;
+            p->info.start_time = t;
+            break;
+        case JR_FINISH:
+            jobid = jr_int(r);
+            jr_data(r, &result, sizeof(result));
+            jr_data(r, &t, sizeof(t));
+            p = findjob(jobid);
+            if (p == 0 || r->error)
+                break;
+            finish_job(p, &result, &t);
+            break;
+        case JR_DROP:
+            jobid = jr_int(r);
+            if (findjob(jobid) != 0)
+                s_removejob(jobid);
+            break;
+        case JR_REMOVE:
+            p = get_job(jr_int(r));
+            if (p != 0)
+                remove_job(p);
+            break;
+        case JR_FORGET:
+            p = find_finished_job(jr_int(r));
+            if (p != 0)
+                destroy_finished_job(p);
+            break;
+        case JR_CLEAR:
+            s_clear_finished();
+            break;
+        case JR_URGENT:
+            p = findjob(jr_int(r));
+            if (p != 0 && p != firstjob)
+                move_urgent(p);
+            break;
+        case JR_SWAP:
+            jobid = jr_int(r);
+            jobid2 = jr_int(r);
+            p = findjob(jobid);
+            p2 = findjob(jobid2);
+            if (p != 0 && p2 != 0 && p != p2 && p != firstjob && p2 != firstjob)
+                swap_jobs(p, p2);
+            break;
+        case JR_SLOTS:
+            s_set_max_slots(jr_int(r));
+            break;
+        case JR_LABEL_LIMIT:
+            data = jr_view(r, &size);
+            label = intern(data, size);
+            max_running = jr_int(r);
+            if (label != 0 && !r->error)
+                set_label_limit(label, max_running);
+            intern_release(label);
+            break;
+        case JR_RESOURCES:
+            spec = jr_string(r);
+            if (spec != 0 && !r->error)
+                set_resources(spec);
+            free(spec);
+            break;
+        case JR_PRIORITY:
+            jobid = jr_int(r);
+            priority = jr_int(r);
+            p = findjob(jobid);
+            if (p != 0 && !r->error)
+                set_priority(p, priority);
+            break;
+        case JR_WAITER:
+            s = jr_int(r);
+            jobid = jr_int(r);
+            request_id = jr_int(r);
+            if (!r->error && get_job(jobid) != 0)
+                add_to_notify_list(s, jobid, request_id);
+            break;
+        default:
+            warning("Unknown record %i in the journal", type);
+            break;
+    }
+}
+
+/* All the jobs, for a new snapshot of the journal */
+void s_journal_snapshot() {
+    struct Job *p;
+    struct Label *l;
+    char *resources;
+
+    journal_begin(JR_STATE);
+    journal_int(max_slots);
+    journal_int(jobids);
+    journal_int(last_errorlevel);
+    journal_int(last_finished_jobid);
+    journal_end();
+
+    for (p = first_finished_job; p != 0; p = p->next)
+        journal_job(JR_JOB, p);
+    for (p = firstjob; p != 0; p = p->next)
+        journal_job(JR_JOB, p);
+    resources = resources_text(0);
+    if (resources != 0) {
+        journal_begin(JR_RESOURCES);
+        journal_string(resources);
+        journal_end();
+        free(resources);
+    }
+    for (l = first_label; l != 0; l = l->next)
+        if (l->max_running > 0) {
+            journal_begin(JR_LABEL_LIMIT);
+            journal_bytes(l->label, intern_size(l->label));
+            journal_int(l->max_running);
+            journal_end();
+        }
+
+    journal_begin(JR_LINK);
+    journal_end();
+}
+
+/* After the replay. The jobs that were running, and those of ts clients,
+ * ended with the last server: as when their client leaves */
+void s_journal_recovered() {
+    struct Job *p, *next;
+    int lost = 0;
+
+    /* Up to the last of them; the queue behind may be long */
+    for (p = firstjob; p != 0 && (jobs_in_state[RUNNING] > 0 || client_jobs > 0);
+         p = next) {
+        next = p->next;
+        if (p->state == RUNNING || p->exec == 0) {
+            struct Result r = default_result();
+
+            r.errorlevel = -1;
+            r.died_by_signal = 1;
+            r.signal = SIGKILL;
+            finish_job(p, &r, 0);
+            ++lost;
+        }
+    }
+    if (lost > 0)
+        warning("%i jobs were lost with the last server.", lost);
+}
+
+static void handover_waiters_of(const struct Job *p) {
+    const struct Notify *n;
+
+    for (n = intmap_get(&notify_by_job, p->jobid); n != 0; n = n->next_of_job) {
+        journal_begin(JR_WAITER);
+        journal_int(n->socket);
+        journal_int(n->jobid);
+        journal_int(n->request_id);
+        journal_end();
+    }
+}
+
+/* The clients waiting for jobs, for the new server of ts --upgrade */
+void s_handover_waiters() {
+    struct Job *p;
+
+    for (p = first_finished_job; p != 0; p = p->next)
+        handover_waiters_of(p);
+    for (p = firstjob; p != 0; p = p->next)
+        handover_waiters_of(p);
+}
@@ -0,0 +1,594 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "main.h"
+
+/* With TS_JOURNAL, the jobs of the server outlive it in two files:
+ *  - TS_JOURNAL, where every change of the jobs is appended as a record,
+ *  - TS_JOURNAL.snap, with all the jobs at some moment, in the same records.
+ * A new server replays the snapshot and then the journal (see jobs.c for
+ * what each record does). Once the journal is much larger than the
+ * snapshot, a new snapshot is written and the journal starts again.
+ * Both files begin with a generation: a journal older than the snapshot
+ * was already in it, and it is ignored.
+ * The records of a round of the server loop are gathered in memory, and
+ * written with one write() and one fdatasync() at its end. The answers
+ * of the round wait for that in the connections; see conn_send().
+ * ts --upgrade dumps the jobs in the same records to a file of its own,
+ * for the new server to load (see server_upgrade()). */
+
+enum {
+    JOURNAL_VERSION = 1,
+    JOURNAL_MIN_COMPACT = 16 * 1024 * 1024, /* Bytes of journal */
+    JOURNAL_WRITE_CHUNK = 1024 * 1024,
+    JOURNAL_READ_CHUNK = 256 * 1024
+};
+
+struct Journal_file_header {
+    char magic[4];
+    int version;
+    int generation;
+};
+
+struct Journal_record {
+    int type; /* enum Journal_type */
+    int size; /* Of what follows */
+    unsigned int sum;
+};
+
+static struct {
+    int fd; /* -1 without journal */
+    int out_fd; /* Where the full buffer goes: fd, or the new snapshot */
+    char *path;
+    char *snap_path;
+    int generation;
+    char *buf; /* Records not written yet */
+    int size;
+    int alloc;
+    int record; /* Offset of the record being built, or -1 */
+    int unsynced; /* Written without fdatasync yet */
+    long long file_size;
+    long long snap_size;
+    int replaying;
+    int out_error; /* Writing to out_fd, when it is not the journal */
+} journal = { -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+static unsigned int checksum(const char *data, int size) {
+    unsigned int h = 2166136261u;
+    unsigned int w;
+    int i;
+
+    for (i = 0; i + 4 <= size; i += 4) {
+        memcpy(&w, data + i, 4);
+        h = (h ^ w) * 16777619u;
+    }
+    for (; i < size; ++i)
+        h = (h ^ (unsigned char) data[i]) * 16777619u;
+    return h;
+}
+
+static int write_all(int fd, const char *data, int size) {
+    int res;
+
+    while (size > 0) {
+        res = write(fd, data, size);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += res;
+        size -= res;
+    }
+    return 0;
+}
+
+static void reserve(int bytes) {
+    if (journal.size + bytes > journal.alloc) {
+        while (journal.size + bytes > journal.alloc)
+            journal.alloc = journal.alloc ? 2 * journal.alloc : 64 * 1024;
+        journal.buf = (char *) realloc(journal.buf, journal.alloc);
+        if (journal.buf == 0)
+            error("Cannot allocate %i bytes for the journal", journal.alloc);
+    }
+}
+
+static void write_buffer() {
+    if (journal.size == 0)
+        return;
+    if (write_all(journal.out_fd, journal.buf, journal.size) == -1) {
+        if (journal.out_fd == journal.fd)
+            error("Cannot write to the journal %s", journal.path);
+        journal.out_error = 1;
+    }
+    if (journal.out_fd == journal.fd) {
+        journal.file_size += journal.size;
+        journal.unsynced = 1;
+    }
+    journal.size = 0;
+}
+
+/* Records are written only out of the replay, to the journal or to a
+ * snapshot or a dump */
+int journal_active() {
+    return journal.out_fd != -1 && !journal.replaying;
+}
+
+void journal_begin(int type) {
+    struct Journal_record r;
+
+    if (!journal_active())
+        return;
+    r.type = type;
+    r.size = 0;
+    r.sum = 0;
+    reserve(sizeof(r));
+    journal.record = journal.size;
+    memcpy(journal.buf + journal.size, &r, sizeof(r));
+    journal.size += sizeof(r);
+}
+
+void journal_data(const void *data, int size) {
+    if (!journal_active() || size <= 0)
+        return;
+    reserve(size);
+    memcpy(journal.buf + journal.size, data, size);
+    journal.size += size;
+}
+
+void journal_int(int value) {
+    journal_data(&value, sizeof(value));
+}
+
+/* The size, -1 for null, and the bytes */
+void journal_bytes(const char *data, int size) {
+    journal_int(data ? size : -1);
+    if (data)
+        journal_data(data, size);
+}
+
+void journal_string(const char *str) {
+    journal_bytes(str, str ? strlen(str) : 0);
+}
+
+void journal_end() {
+    struct Journal_record r;
+    int start = journal.record + sizeof(r);
+
+    if (!journal_active())
+        return;
+    memcpy(&r, journal.buf + journal.record, sizeof(r));
+    r.size = journal.size - start;
+    r.sum = checksum(journal.buf + start, r.size);
+    memcpy(journal.buf + journal.record, &r, sizeof(r));
+    journal.record = -1;
+
+    /* The snapshot doesn't need to be all in memory */
+    if (journal.out_fd != journal.fd && journal.size >= JOURNAL_WRITE_CHUNK)
+        write_buffer();
+}
+
+int jr_int(struct Journal_reader *r) {
+    int value = 0;
+
+    jr_data(r, &value, sizeof(value));
+    return value;
+}
+
+void jr_data(struct Journal_reader *r, void *data, int size) {
+    if (r->pos + size > r->size) {
+        r->error = 1;
+        memset(data, 0, size);
+        return;
+    }
+    memcpy(data, r->data + r->pos, size);
+    r->pos += size;
+}
+
+/* What journal_bytes() wrote, null terminated, in malloc'd memory
+ * or in that of the jobs (pool.c) */
+static char *read_bytes(struct Journal_reader *r, int *size, int in_pool) {
+    char *str;
+    int n = jr_int(r);
+
+    if (size)
+        *size = 0;
+    if (n < 0 || r->error)
+        return 0;
+    if (r->pos + n > r->size) {
+        r->error = 1;
+        return 0;
+    }
+    if (in_pool)
+        str = pool_copy(r->data + r->pos, n);
+    else {
+        str = (char *) malloc(n + 1);
+        if (str == 0)
+            error("Cannot allocate %i bytes replaying the journal", n + 1);
+        memcpy(str, r->data + r->pos, n);
+        str[n] = '\0';
+    }
+    r->pos += n;
+    if (size)
+        *size = n;
+    return str;
+}
+
+char *jr_bytes(struct Journal_reader *r, int *size) {
+    return read_bytes(r, size, 0);
+}
+
+char *jr_string(struct Journal_reader *r) {
+    return read_bytes(r, 0, 0);
+}
+
+/* What journal_bytes() wrote, where it is in the record; null if it
+ * was null. Valid until the next record */
+const char *jr_view(struct Journal_reader *r, int *size) {
+    const char *data;
+    int n = jr_int(r);
+
+    *size = 0;
+    if (n < 0 || r->error)
+        return 0;
+    if (r->pos + n > r->size) {
+        r->error = 1;
+        return 0;
+    }
+    data = r->data + r->pos;
+    r->pos += n;
+    *size = n;
+    return data;
+}
+
+char *jr_pool_bytes(struct Journal_reader *r, int *size) {
+    return read_bytes(r, size, 1);
+}
+
+char *jr_pool_string(struct Journal_reader *r) {
+    return read_bytes(r, 0, 1);
+}
+
+/* The file being replayed, through a buffer much smaller than it: the
+ * pages of a buffer as large would cost more than the reading */
+static struct {
+    int fd;
+    char *data;
+    int alloc;
+    int pos; /* Of the next record in data */
+    int size; /* Bytes in data */
+    int eof;
+} input;
+
+/* Whether there are 'bytes' at input.pos, reading more if needed */
+static int input_fill(int bytes) {
+    int res;
+
+    if (input.size - input.pos >= bytes)
+        return 1;
+
+    memmove(input.data, input.data + input.pos, input.size - input.pos);
+    input.size -= input.pos;
+    input.pos = 0;
+    if (bytes > input.alloc) {
+        while (bytes > input.alloc)
+            input.alloc *= 2;
+        input.data = (char *) realloc(input.data, input.alloc);
+        if (input.data == 0)
+            error("Cannot allocate %i bytes replaying the journal", input.alloc);
+    }
+
+    while (input.size < bytes && !input.eof) {
+        res = read(input.fd, input.data + input.size, input.alloc - input.size);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            input.eof = 1;
+        else
+            input.size += res;
+    }
+    return input.size >= bytes;
+}
+
+/* Apply the records of fd, if it is of the generation given, or of any if
+ * it is -1. Returns the bytes up to the last good record, 0 if it has no
+ * header yet; or -1 if it cannot be read, is not a journal, or is of
+ * another generation, which is then in *generation */
+static long long replay_fd(int fd, const char *path, int *generation,
+                           void (*apply)(int type, struct Journal_reader *r)) {
+    struct Journal_file_header h;
+    struct Journal_record r;
+    struct stat st;
+    long long good = 0;
+
+    input.fd = fd;
+    if (fstat(input.fd, &st) == -1) {
+        warning("Cannot read the journal file %s", path);
+        return -1;
+    }
+    input.alloc = JOURNAL_READ_CHUNK;
+    input.data = (char *) malloc(input.alloc);
+    if (input.data == 0)
+        error("Cannot allocate %i bytes replaying the journal", input.alloc);
+    input.pos = 0;
+    input.size = 0;
+    input.eof = 0;
+
+    if (!input_fill(sizeof(h)))
+        goto end;
+    memcpy(&h, input.data, sizeof(h));
+    if (memcmp(h.magic, "TSJ", 4) != 0 || h.version != JOURNAL_VERSION) {
+        warning("The journal file %s is not of this version of ts", path);
+        good = -1;
+        goto end;
+    }
+    if (*generation != -1 && h.generation != *generation) {
+        *generation = h.generation;
+        good = -1;
+        goto end;
+    }
+    *generation = h.generation;
+    input.pos = sizeof(h);
+    good = sizeof(h);
+
+    while (input_fill(sizeof(r))) {
+        struct Journal_reader reader;
+
+        memcpy(&r, input.data + input.pos, sizeof(r));
+        if (r.size < 0 || r.size > st.st_size - good - (long long) sizeof(r)
+            || !input_fill(sizeof(r) + r.size)
+            || checksum(input.data + input.pos + sizeof(r), r.size) != r.sum)
+            break;
+
+        reader.data = input.data + input.pos + sizeof(r);
+        reader.size = r.size;
+        reader.pos = 0;
+        reader.error = 0;
+        apply(r.type, &reader);
+        if (reader.error)
+            warning("Wrong record %i in the journal file %s", r.type, path);
+        input.pos += sizeof(r) + r.size;
+        good += sizeof(r) + r.size;
+    }
+    if (good < st.st_size)
+        warning("The journal file %s ends in %lld bytes that don't make a record",
+                path, (long long) st.st_size - good);
+
+end:
+    free(input.data);
+    input.data = 0;
+    return good;
+}
+
+static long long replay_file(const char *path, int *generation) {
+    int fd;
+    long long good;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    good = replay_fd(fd, path, generation, s_journal_apply);
+    close(fd);
+    return good;
+}
+
+static int write_header(int fd, int generation) {
+    struct Journal_file_header h;
+
+    memcpy(h.magic, "TSJ", 4);
+    h.version = JOURNAL_VERSION;
+    h.generation = generation;
+    return write_all(fd, (const char *) &h, sizeof(h));
+}
+
+/* The names of the files, or 0 without TS_JOURNAL */
+static int journal_names() {
+    const char *name;
+
+    name = getenv("TS_JOURNAL");
+    if (name == NULL || name[0] == '\0')
+        return 0;
+
+    journal.path = strdup(name);
+    journal.snap_path = (char *) malloc(strlen(name) + sizeof(".snap"));
+    if (journal.path == 0 || journal.snap_path == 0)
+        error("Cannot allocate the names of the journal files");
+    sprintf(journal.snap_path, "%s.snap", name);
+    journal.record = -1;
+    return 1;
+}
+
+static void open_journal(int generation) {
+    journal.fd = open(journal.path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (journal.fd == -1)
+        error("Cannot open the journal %s", journal.path);
+    /* The jobs forked from this server must not inherit it */
+    fcntl(journal.fd, F_SETFD, FD_CLOEXEC);
+    journal.out_fd = journal.fd;
+    journal.generation = generation;
+}
+
+static void keep_stale_journal() {
+    char *old_path;
+
+    old_path = (char *) malloc(strlen(journal.path) + sizeof(".old"));
+    if (old_path == 0)
+        error("Cannot allocate the name of the old journal");
+    sprintf(old_path, "%s.old", journal.path);
+    if (rename(journal.path, old_path) == -1)
+        error("Cannot move the old journal %s to %s", journal.path, old_path);
+    warning("The journal %s was older than the snapshot; it is now %s",
+            journal.path, old_path);
+    free(old_path);
+}
+
+/* Rebuild the jobs from the files, and go on appending to the journal */
+void journal_open() {
+    int snap_generation = -1;
+    int generation;
+    long long good_size;
+
+    if (!journal_names())
+        return;
+
+    journal.replaying = 1;
+    journal.snap_size = replay_file(journal.snap_path, &snap_generation);
+    if (journal.snap_size < 0)
+        error("Cannot replay the snapshot %s; it is left as it was",
+              journal.snap_path);
+    if (snap_generation == -1)
+        snap_generation = 0;
+    generation = snap_generation;
+    good_size = replay_file(journal.path, &generation);
+    journal.replaying = 0;
+
+    if (good_size < 0) {
+        if (generation >= snap_generation)
+            error("Cannot replay the journal %s; it is left as it was",
+                  journal.path);
+        /* Older than the snapshot, which has all of it: kept aside */
+        keep_stale_journal();
+        good_size = 0;
+    }
+
+    open_journal(snap_generation);
+
+    /* Cut what didn't make a record, or start it again if it was stale */
+    if (ftruncate(journal.fd, good_size) == -1)
+        error("Cannot truncate the journal %s", journal.path);
+    if (good_size == 0 && write_header(journal.fd, snap_generation) == -1)
+        error("Cannot write to the journal %s", journal.path);
+    journal.file_size = good_size ? good_size
+                                  : (long long) sizeof(struct Journal_file_header);
+
+    s_journal_recovered();
+    journal_sync();
+}
+
+/* Go on appending to the journal of the server that handed its jobs
+ * over, which has them all */
+void journal_resume(int generation) {
+    struct stat st;
+
+    if (!journal_names())
+        return;
+    open_journal(generation);
+    if (fstat(journal.fd, &st) == 0)
+        journal.file_size = st.st_size;
+    if (stat(journal.snap_path, &st) == 0)
+        journal.snap_size = st.st_size;
+}
+
+int journal_generation() {
+    return journal.generation;
+}
+
+/* From here to journal_dump_end(), the records go to fd, which is not the
+ * journal */
+void journal_dump_begin(int fd) {
+    journal_sync();
+    journal.out_fd = fd;
+    journal.out_error = write_header(fd, journal.generation) == -1;
+}
+
+/* 0 if all went to the descriptor */
+int journal_dump_end() {
+    int res;
+
+    write_buffer();
+    res = journal.out_error ? -1 : 0;
+    journal.out_fd = journal.fd;
+    journal.out_error = 0;
+    return res;
+}
+
+/* Apply the records of a dump, from its start */
+void journal_load(int fd, void (*apply)(int type, struct Journal_reader *r)) {
+    int generation = -1;
+
+    journal.replaying = 1;
+    replay_fd(fd, "of the handover", &generation, apply);
+    journal.replaying = 0;
+}
+
+/* Whether there are records not on disk yet */
+int journal_pending() {
+    return journal.fd != -1 && (journal.size > 0 || journal.unsynced);
+}
+
+static void write_snapshot() {
+    struct stat st;
+    char *tmp_path;
+    int fd;
+
+    tmp_path = (char *) malloc(strlen(journal.snap_path) + sizeof(".new"));
+    if (tmp_path == 0)
+        error("Cannot allocate the name of the snapshot");
+    sprintf(tmp_path, "%s.new", journal.snap_path);
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1 || write_header(fd, journal.generation + 1) == -1) {
+        warning("Cannot write the snapshot %s", tmp_path);
+        if (fd != -1)
+            close(fd);
+        free(tmp_path);
+        return;
+    }
+
+    journal.out_fd = fd;
+    s_journal_snapshot();
+    write_buffer();
+    journal.out_fd = journal.fd;
+
+    if (!journal.out_error && fsync(fd) == -1)
+        journal.out_error = 1;
+    if (close(fd) == -1 || journal.out_error
+        || rename(tmp_path, journal.snap_path) == -1) {
+        warning("Cannot write the snapshot %s", journal.snap_path);
+        journal.out_error = 0;
+        unlink(tmp_path);
+        free(tmp_path);
+        return;
+    }
+    free(tmp_path);
+
+    /* Now all is in the snapshot; a crash before the journal starts again
+     * leaves it of the old generation */
+    ++journal.generation;
+    if (ftruncate(journal.fd, 0) == -1
+        || write_header(journal.fd, journal.generation) == -1
+        || fdatasync(journal.fd) == -1)
+        error("Cannot start the journal %s again", journal.path);
+    journal.file_size = sizeof(struct Journal_file_header);
+    if (stat(journal.snap_path, &st) == 0)
+        journal.snap_size = st.st_size;
+}
+
+/* The group commit, at the end of each round of the server loop */
+void journal_sync() {
+    if (journal.fd == -1)
+        return;
+
+    write_buffer();
+    if (journal.unsynced) {
+        if (fdatasync(journal.fd) == -1)
+            error("Cannot sync the journal %s", journal.path);
+        journal.unsynced = 0;
+    }
+
+    if (journal.file_size > JOURNAL_MIN_COMPACT
+        && journal.file_size > 2 * journal.snap_size)
+        write_snapshot();
+}
@@ -7,6 +7,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <time.h>
 #include <sys/time.h>
 #include "main.h"
 
@@ -14,38 +16,120 @@
 extern int busy_slots;
 extern int max_slots;
 
-static char *shorten(char *line, int len) {
-    char *newline = (char *) malloc((len + 1) * sizeof(char));
-    if (strlen(line) <= len)
-        strcpy(newline, line);
-    else {
-        snprintf(newline, len - 4, "%s", line);
-        strcat(newline, "...");
+/* The text of a list is rendered here, and sent or written at once.
+ * It is reused, so after the first lists it is not allocated again */
+static struct {
+    char *ptr;
+    int nchars;
+    int allocchars;
+} text;
+
+static void add_text(const char *fmt, ...) {
+    va_list ap;
+    int res;
+
+    while (1) {
+        va_start(ap, fmt);
+        res = vsnprintf(text.ptr + text.nchars, text.allocchars - text.nchars,
+                        fmt, ap);
+        va_end(ap);
+        if (res < 0)
+            error("Cannot render the job list");
+        if (text.nchars + res < text.allocchars)
+            break;
+
+        /* Grow and try again */
+        while (text.nchars + res >= text.allocchars)
+            text.allocchars = text.allocchars ? 2 * text.allocchars : 64 * 1024;
+        text.ptr = (char *) realloc(text.ptr, text.allocchars);
+        if (text.ptr == 0)
+            error("Cannot allocate %i bytes for the job list", text.allocchars);
     }
-    return newline;
+    text.nchars += res;
 }
 
-char *joblistdump_headers() {
-    char *line;
+/* The lines of the jobs are many: they are put together without printf */
+static void add_chars(const char *str, int len, int width) {
+    int size = len > width ? len : width;
 
-    line = malloc(600);
-    snprintf(line, 600, "#!/bin/sh\n# - task spooler (ts) job dump\n"
-                        "# This file has been created because a SIGTERM killed\n"
-                        "# your queue server.\n"
-                        "# The finished commands are listed first.\n"
-                        "# The commands running or to be run are stored as you would\n"
-                        "# probably run them. Take care - some quotes may have got"
-                        " broken\n\n");
+    if (text.nchars + size >= text.allocchars) {
+        while (text.nchars + size >= text.allocchars)
+            text.allocchars = text.allocchars ? 2 * text.allocchars : 64 * 1024;
+        text.ptr = (char *) realloc(text.ptr, text.allocchars);
+        if (text.ptr == 0)
+            error("Cannot allocate %i bytes for the job list", text.allocchars);
+    }
+    memcpy(text.ptr + text.nchars, str, len);
+    memset(text.ptr + text.nchars + len, ' ', size - len);
+    text.nchars += size;
+    text.ptr[text.nchars] = '\0';
+}
 
-    return line;
+/* As "%-*s" */
+static void add_string(const char *str, int width) {
+    add_chars(str, strlen(str), width);
 }
 
-char *joblist_headers() {
-    char *line;
+/* As "%-*i" */
+static void add_int(int value, int width) {
+    char digits[12];
+    char *p = digits + sizeof(digits);
+    unsigned int u = value < 0 ? -(unsigned int) value : (unsigned int) value;
+
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    if (value < 0)
+        *--p = '-';
+    add_chars(p, digits + sizeof(digits) - p, width);
+}
+
+/* 'line' in len chars at most, with "..." if cut. dest has room for len
+ * and the '\0' */
+static const char *shorten(char *dest, const char *line, int len) {
+    if (len < 3)
+        len = 3;
+    if (strlen(line) <= (size_t) len)
+        return line;
+    memcpy(dest, line, len - 3);
+    memcpy(dest + len - 3, "...", 4);
+    return dest;
+}
+
+void joblist_clear() {
+    text.nchars = 0;
+    if (text.ptr)
+        text.ptr[0] = '\0';
+}
+
+/* The list rendered since joblist_clear(), without the final 0 in *size */
+const char *joblist_text(int *size) {
+    if (text.ptr == 0)
+        add_text("%s", "");
+    *size = text.nchars;
+    return text.ptr;
+}
+
+void joblist_add(const char *str) {
+    add_text("%s", str);
+}
+
+void joblistdump_add_headers() {
+    add_text("#!/bin/sh\n# - task spooler (ts) job dump\n"
+             "# This file has been created because a SIGTERM killed\n"
+             "# your queue server.\n"
+             "# The finished commands are listed first.\n"
+             "# The commands running or to be run are stored as you would\n"
+             "# probably run them. Take care - some quotes may have got"
+             " broken\n\n");
+}
+
+void joblist_add_headers() {
+    char *res = resources_text(1);
 
-    line = malloc(100);
 #ifndef CPU
-    snprintf(line, 100, "%-4s %-10s %-20s %-8s %-6s %-5s %s [run=%i/%i]\n",
+    add_text("%-4s %-10s %-20s %-8s %-6s %-5s %s [run=%i/%i]",
              "ID",
              "State",
              "Output",
@@ -56,7 +140,7 @@ char *joblist_headers() {
              busy_slots,
              max_slots);
 #else
-    snprintf(line, 100, "%-4s %-10s %-20s %-8s %-6s %s [run=%i/%i]\n",
+    add_text("%-4s %-10s %-20s %-8s %-6s %s [run=%i/%i]",
              "ID",
              "State",
              "Output",
@@ -66,18 +150,21 @@ char *joblist_headers() {
              busy_slots,
              max_slots);
 #endif
-    return line;
+    if (res != 0)
+        add_text(" [%s]", res);
+    add_chars("\n", 1, 0);
+    free(res);
 }
 
-char *jobgpulist_header() {
-    return "ID   GPU-IDs\n";
+void jobgpulist_add_header() {
+    add_text("ID   GPU-IDs\n");
 }
 
 static int max(int a, int b) {
     return a > b ? a : b;
 }
 
-static const char *ofilename_shown(const struct Job *p) {
+static const char *ofilename_shown(const struct Job *p, char *dest) {
     const char *output_filename;
 
     if (p->state == SKIPPED) {
@@ -91,7 +178,7 @@ static const char *ofilename_shown(const struct Job *p) {
                  * problems */
                 output_filename = "(...)";
             else
-                output_filename = shorten(p->output_filename, 20);
+                output_filename = shorten(dest, p->output_filename, 20);
         }
     } else
         output_filename = "stdout";
@@ -99,240 +186,323 @@ static const char *ofilename_shown(const struct Job *p) {
     return output_filename;
 }
 
-static char *print_noresult(const struct Job *p) {
-    const char *jobstate;
-    const char *output_filename;
+/* As -D takes it: "5", "1000-25000" or "0-100:2" */
+static void add_range(const struct Interval *d) {
+    add_int(d->first, 0);
+    if (d->last == d->first)
+        return;
+    add_chars("-", 1, 0);
+    add_int(d->last, 0);
+    if (d->step != 1) {
+        add_chars(":", 1, 0);
+        add_int(d->step, 0);
+    }
+}
+
+static void add_depends(const struct Job *p) {
+    int i;
+
+    for (i = 0; i < p->depend_on_size; i++) {
+        add_chars(i ? "," : "[", 1, 0);
+        if (p->depend_on[i].first == -1)
+            add_chars(" ", 1, 0);
+        else
+            add_range(&p->depend_on[i]);
+    }
+    if (p->depend_on_size)
+        add_text("]&& ");
+}
+
+/* Label and command, in what is left of the terminal width */
+static void add_command(const struct Job *p) {
+    char label[21];
     int maxlen;
-    char *line;
-    /* 20 chars should suffice for a string like "[int,int,..]&& " */
-    char dependstr[20] = "";
     int cmd_len;
-
-    jobstate = jstate2string(p->state);
-    output_filename = ofilename_shown(p);
+    int size = strlen(p->command);
 
     maxlen = 4 + 1 + 10 + 1 + 20 + 1 + 8 + 1
-             + 25 + 1 + 5 + 1 + strlen(p->command) + 20; /* 20 is the margin for errors */
-
+             + 25 + 1 + 5 + 1 + size + 20; /* 20 is the margin for errors */
     if (p->label)
         maxlen += 3 + strlen(p->label);
-    if (p->depend_on_size) {
-        maxlen += sizeof(dependstr);
-        int pos = 0;
-        if (p->depend_on[0] == -1)
-            pos += snprintf(&dependstr[pos], sizeof(dependstr), "[ ");
-        else
-            pos += snprintf(&dependstr[pos], sizeof(dependstr), "[%i", p->depend_on[0]);
-
-        for (int i = 1; i < p->depend_on_size; i++) {
-            if (p->depend_on[i] == -1)
-                pos += snprintf(&dependstr[pos], sizeof(dependstr), ", ");
-            else
-                pos += snprintf(&dependstr[pos], sizeof(dependstr), ",%i", p->depend_on[i]);
-        }
-        pos += snprintf(&dependstr[pos], sizeof(dependstr), "]&& ");
-    }
+    if (p->depend_on_size)
+        maxlen += 20;
 
-    line = (char *) malloc(maxlen);
-    if (line == NULL)
-        error("Malloc for %i failed.\n", maxlen);
-
-    cmd_len = max((strlen(p->command) + (term_width - maxlen)), 20);
+    cmd_len = max((size + (term_width - maxlen)), 20);
     if (p->label) {
-        char *label = shorten(p->label, 20);
-        char *cmd = shorten(p->command, cmd_len);
-#ifndef CPU
-        snprintf(line, maxlen, "%-4i %-10s %-20s %-8s %6s %-5d %s[%s]%s\n",
-                 p->jobid,
-                 jobstate,
-                 output_filename,
-                 "",
-                 "",
-                 p->num_gpus,
-                 dependstr,
-                 label,
-                 cmd);
-#else
-        snprintf(line, maxlen, "%-4i %-10s %-20s %-8s %6s %s[%s]%s\n",
-                 p->jobid,
-                 jobstate,
-                 output_filename,
-                 "",
-                 "",
-                 dependstr,
-                 label,
-                 cmd);
-#endif
-        free(label);
-        free(cmd);
+        add_chars("[", 1, 0);
+        add_string(shorten(label, p->label, 20), 0);
+        add_chars("]", 1, 0);
     }
+    if (size <= cmd_len)
+        add_chars(p->command, size, 0);
     else {
-        char *cmd = shorten(p->command, cmd_len);
+        add_chars(p->command, cmd_len - 5, 0);
+        add_chars("...", 3, 0);
+    }
+    add_chars("\n", 1, 0);
+}
+
+/* ID, state and output */
+static void add_start(const struct Job *p) {
+    char ofilename[21];
+
+    add_int(p->jobid, 4);
+    add_chars(" ", 1, 0);
+    add_string(jstate2string(p->state), 10);
+    add_chars(" ", 1, 0);
+    add_string(ofilename_shown(p, ofilename), 20);
+    add_chars(" ", 1, 0);
+}
+
+/* GPUs, dependencies, label and command */
+static void add_end(const struct Job *p) {
 #ifndef CPU
-        snprintf(line, maxlen, "%-4i %-10s %-20s %-8s %6s %-5d %s%s\n",
-                 p->jobid,
-                 jobstate,
-                 output_filename,
-                 "",
-                 "",
-                 p->num_gpus,
-                 dependstr,
-                 cmd);
-#else
-        snprintf(line, maxlen, "%-4i %-10s %-20s %-8s %6s %s%s\n",
-                 p->jobid,
-                 jobstate,
-                 output_filename,
-                 "",
-                 "",
-                 dependstr,
-                 cmd);
+    add_int(p->num_gpus, 5);
+    add_chars(" ", 1, 0);
 #endif
-        free(cmd);
-    }
+    add_depends(p);
+    add_command(p);
+}
 
-    return line;
+static void add_noresult(const struct Job *p) {
+    add_start(p);
+    /* As "%-8s %6s " with empty strings */
+    add_chars("", 0, 8 + 1 + 6 + 1);
+    add_end(p);
 }
 
-static char *print_result(const struct Job *p) {
-    const char *jobstate;
-    int maxlen;
-    char *line;
-    const char *output_filename;
-    /* 20 chars should suffice for a string like "[int,int,..]&& " */
-    char dependstr[20] = "";
+static void add_result(const struct Job *p) {
     float real_ms = p->result.real_ms;
     char *unit = time_rep(&real_ms);
-    int cmd_len;
 
-    jobstate = jstate2string(p->state);
-    output_filename = ofilename_shown(p);
+    add_start(p);
+    add_int(p->result.errorlevel, 8);
+    add_text(" %5.2f%s ", real_ms, unit);
+    add_end(p);
+}
 
-    maxlen = 4 + 1 + 10 + 1 + 20 + 1 + 8 + 1
-             + 25 + 1 + 5 + 1 + strlen(p->command) + 20; /* 20 is the margin for errors */
+#ifndef CPU
+void jobgpulist_add_line(const struct Job *p) {
+    char *gpuIDs = ints_to_chars(p->gpu_ids, p->num_gpus, " ");
+    add_text("%-4i %s\n", p->jobid, gpuIDs);
+    free(gpuIDs);
+}
+#endif
 
-    if (p->label)
-        maxlen += 3 + strlen(p->label);
-    if (p->depend_on_size) {
-        maxlen += sizeof(dependstr);
-        int pos = 0;
-        if (p->depend_on[0] == -1)
-            pos += snprintf(&dependstr[pos], sizeof(dependstr), "[ ");
-        else
-            pos += snprintf(&dependstr[pos], sizeof(dependstr), "[%i", p->depend_on[0]);
+void joblist_add_line(const struct Job *p) {
+    if (p->state == FINISHED)
+        add_result(p);
+    else
+        add_noresult(p);
+}
 
-        for (int i = 1; i < p->depend_on_size; i++) {
-            if (p->depend_on[i] == -1)
-                pos += snprintf(&dependstr[pos], sizeof(dependstr), ", ");
-            else
-                pos += snprintf(&dependstr[pos], sizeof(dependstr), ",%i", p->depend_on[i]);
+void joblistdump_add_torun(const struct Job *p) {
+    add_text("ts %s\n", p->command);
+}
+
+/* The machine readable lists: a line per job, with the raw fields */
+
+/* Tabs and newlines in the field would break the line */
+static void add_tsv_string(const char *str) {
+    const char *start = str;
+
+    if (str == 0)
+        return;
+    for (; *str != '\0'; ++str) {
+        const char *esc;
+
+        switch (*str) {
+            case '\t': esc = "\\t"; break;
+            case '\n': esc = "\\n"; break;
+            case '\r': esc = "\\r"; break;
+            case '\\': esc = "\\\\"; break;
+            default: continue;
         }
-        pos += snprintf(&dependstr[pos], sizeof(dependstr), "]&& ");
+        add_chars(start, str - start, 0);
+        add_chars(esc, 2, 0);
+        start = str + 1;
     }
+    add_chars(start, str - start, 0);
+}
 
-    line = (char *) malloc(maxlen);
-    if (line == NULL)
-        error("Malloc for %i failed.\n", maxlen);
+static void add_json_string(const char *str) {
+    const char *start = str;
 
-    cmd_len = max((strlen(p->command) + (term_width - maxlen)), 20);
-    if (p->label) {
-        char *label = shorten(p->label, 20);
-        char *cmd = shorten(p->command, cmd_len);
-#ifndef CPU
-        snprintf(line, maxlen, "%-4i %-10s %-20s %-8i %5.2f%s %-5d %s[%s]%s\n",
-                 p->jobid,
-                 jobstate,
-                 output_filename,
-                 p->result.errorlevel,
-                 real_ms,
-                 unit,
-                 p->num_gpus,
-                 dependstr,
-                 label,
-                 cmd);
-#else
-        snprintf(line, maxlen, "%-4i %-10s %-20s %-8i %5.2f%s %s[%s]%s\n",
-                 p->jobid,
-                 jobstate,
-                 output_filename,
-                 p->result.errorlevel,
-                 real_ms,
-                 unit,
-                 dependstr,
-                 label,
-                 cmd);
-#endif
-        free(label);
-        free(cmd);
+    if (str == 0) {
+        add_chars("null", 4, 0);
+        return;
     }
-    else {
-        char *cmd = shorten(p->command, cmd_len);
-#ifndef CPU
-        snprintf(line, maxlen, "%-4i %-10s %-20s %-8i %5.2f%s %-5d %s%s\n",
-                 p->jobid,
-                 jobstate,
-                 output_filename,
-                 p->result.errorlevel,
-                 real_ms,
-                 unit,
-                 p->num_gpus,
-                 dependstr,
-                 cmd);
-#else
-        snprintf(line, maxlen, "%-4i %-10s %-20s %-8i %5.2f%s %s%s\n",
-                 p->jobid,
-                 jobstate,
-                 output_filename,
-                 p->result.errorlevel,
-                 real_ms,
-                 unit,
-                 dependstr,
-                 cmd);
-#endif
-        free(cmd);
+    add_chars("\"", 1, 0);
+    for (; *str != '\0'; ++str) {
+        unsigned char c = *str;
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        add_chars(start, str - start, 0);
+        if (c == '"' || c == '\\') {
+            add_chars("\\", 1, 0);
+            add_chars(str, 1, 0);
+        } else if (c == '\n')
+            add_chars("\\n", 2, 0);
+        else if (c == '\t')
+            add_chars("\\t", 2, 0);
+        else
+            add_text("\\u%04x", c);
+        start = str + 1;
     }
-
-    return line;
+    add_chars(start, str - start, 0);
+    add_chars("\"", 1, 0);
 }
 
-#ifndef CPU
-static char *print_gpu(const struct Job *p) {
-    char *line = malloc(1024);
-    char *gpuIDs = ints_to_chars(p->gpu_ids, p->num_gpus, " ");
-    sprintf(line, "%-4i %s\n", p->jobid, gpuIDs);
-    free(gpuIDs);
-    return line;
+static double seconds(const struct timeval *t) {
+    return t->tv_sec + t->tv_usec / 1e6;
 }
 
-char *jobgpulist_line(const struct Job *p) {
-    return print_gpu(p);
+/* The fields from errorlevel to end_time, separated by 'sep' */
+static void add_numbers(const struct Job *p, const char *sep) {
+    const struct Result *r = &p->result;
+
+    add_text("%i%s%i%s%i%s%i%s%.3f%s%.3f%s%.3f%s%i%s%i%s%i%s%i%s%i%s"
+             "%.6f%s%.6f%s%.6f",
+             r->errorlevel, sep, r->died_by_signal, sep, r->signal, sep,
+             r->skipped, sep, r->user_ms, sep, r->system_ms, sep,
+             r->real_ms, sep, p->pid, sep, p->num_slots, sep,
+             p->num_gpus, sep, p->priority, sep, p->store_output, sep,
+             seconds(&p->info.enqueue_time), sep,
+             seconds(&p->info.start_time), sep,
+             seconds(&p->info.end_time));
 }
-#endif
-
-char *joblist_line(const struct Job *p) {
-    char *line;
 
-    if (p->state == FINISHED)
-        line = print_result(p);
-    else
-        line = print_noresult(p);
+/* The ranges go in quotes, if given */
+static void add_depends_list(const struct Job *p, const char *sep,
+                             const char *quote) {
+    const struct Interval *d;
+    int i;
+
+    for (i = 0; i < p->depend_on_size; ++i) {
+        d = &p->depend_on[i];
+        if (i > 0)
+            add_string(sep, 0);
+        if (d->last == d->first)
+            add_int(d->first, 0);
+        else {
+            add_string(quote, 0);
+            add_range(d);
+            add_string(quote, 0);
+        }
+    }
+}
 
-    return line;
+void joblist_add_tsv_header() {
+    add_text("id\tstate\terrorlevel\tdied_by_signal\tsignal\tskipped\t"
+             "user_ms\tsystem_ms\treal_ms\tpid\tslots\tgpus\tpriority\t"
+             "store_output\tenqueue_time\tstart_time\tend_time\tdepends\t"
+             "output\tlabel\t"
+             "command\n");
 }
 
-char *joblistdump_torun(const struct Job *p) {
-    int maxlen;
-    char *line;
+void joblist_add_tsv(const struct Job *p) {
+    add_int(p->jobid, 0);
+    add_chars("\t", 1, 0);
+    add_string(jstate2string(p->state), 0);
+    add_chars("\t", 1, 0);
+    add_numbers(p, "\t");
+    add_chars("\t", 1, 0);
+    add_depends_list(p, ",", "");
+    add_chars("\t", 1, 0);
+    add_tsv_string(p->output_filename);
+    add_chars("\t", 1, 0);
+    add_tsv_string(p->label);
+    add_chars("\t", 1, 0);
+    add_tsv_string(p->command);
+    add_chars("\n", 1, 0);
+}
 
-    maxlen = 10 + strlen(p->command) + 20; /* 20 is the margin for errors */
+void joblist_add_json(const struct Job *p) {
+    const struct Result *r = &p->result;
+
+    add_text("{\"id\":%i,\"state\":\"%s\",\"errorlevel\":%i,"
+             "\"died_by_signal\":%i,\"signal\":%i,\"skipped\":%i,"
+             "\"user_ms\":%.3f,\"system_ms\":%.3f,\"real_ms\":%.3f,"
+             "\"pid\":%i,\"slots\":%i,\"gpus\":%i,\"priority\":%i,"
+             "\"store_output\":%i,"
+             "\"enqueue_time\":%.6f,\"start_time\":%.6f,\"end_time\":%.6f,"
+             "\"depends\":[",
+             p->jobid, jstate2string(p->state), r->errorlevel,
+             r->died_by_signal, r->signal, r->skipped,
+             r->user_ms, r->system_ms, r->real_ms,
+             p->pid, p->num_slots, p->num_gpus, p->priority, p->store_output,
+             seconds(&p->info.enqueue_time), seconds(&p->info.start_time),
+             seconds(&p->info.end_time));
+    add_depends_list(p, ",", "\"");
+    add_chars("],\"output\":", 11, 0);
+    add_json_string(p->output_filename);
+    add_chars(",\"label\":", 9, 0);
+    add_json_string(p->label);
+    add_chars(",\"command\":", 11, 0);
+    add_json_string(p->command);
+    add_chars("}\n", 2, 0);
+}
 
-    line = (char *) malloc(maxlen);
-    if (line == NULL)
-        error("Malloc for %i failed.\n", maxlen);
+/* What ts -i shows, from the fields of the job */
+void joblist_add_info(const struct Job *p) {
+    float t;
+    char *unit;
 
-    snprintf(line, maxlen, "ts %s\n", p->command);
+    if (p->env) {
+        add_chars("Environment:\n", 13, 0);
+        add_string(p->env, 0);
+    }
+    if (p->state == FINISHED || p->state == SKIPPED) {
+        if (p->result.died_by_signal)
+            add_text("Exit status: killed by signal %i\n", p->result.signal);
+        else
+            add_text("Exit status: died with exit code %i\n", p->result.errorlevel);
+    }
+    add_chars("Command: ", 9, 0);
+    add_depends(p);
+    add_string(p->command, 0);
+    add_chars("\n", 1, 0);
+    add_text("Slots required: %i\n", p->num_slots);
+    if (p->state != FINISHED && p->state != SKIPPED) {
+        add_text("Priority: %i", p->priority);
+        if (readyq_priority(p) != p->priority)
+            add_text(", %i with the aging", readyq_priority(p));
+        add_chars("\n", 1, 0);
+    }
+    if (p->runtime > 0)
+        add_text("Runtime declared: %is\n", p->runtime);
+    if (p->label != 0 && p->state != FINISHED && p->state != SKIPPED) {
+        int running;
+        int max_running = label_max_running(p->label, &running);
+
+        if (max_running > 0)
+            add_text("Label limit: %i running of %i\n", running, max_running);
+    }
+    if (p->resources != 0)
+        add_text("Resources: %s\n", p->resources);
+#ifndef CPU
+    int i;
 
-    return line;
+    add_text("GPUs required: %d\n", p->num_gpus);
+    add_chars("GPU IDs: ", 9, 0);
+    for (i = 0; i < (p->num_gpus ? p->num_gpus : 1); i++)
+        add_text(i ? ",%d" : "%d", p->gpu_ids[i]);
+    add_chars("\n", 1, 0);
+#endif
+    add_text("Enqueue time: %s", ctime(&p->info.enqueue_time.tv_sec));
+    if (p->state == RUNNING) {
+        add_text("Start time: %s", ctime(&p->info.start_time.tv_sec));
+        t = pinfo_time_until_now(&p->info);
+        unit = time_rep(&t);
+        add_text("Time running: %f%s\n", t, unit);
+    } else if (p->state == FINISHED) {
+        add_text("Start time: %s", ctime(&p->info.start_time.tv_sec));
+        add_text("End time: %s", ctime(&p->info.end_time.tv_sec));
+        t = pinfo_time_run(&p->info);
+        unit = time_rep(&t);
+        add_text("Time run: %f%s\n", t, unit);
+    }
 }
 
 char *time_rep(float *t) {
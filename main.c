@@ -12,6 +12,8 @@
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "version.h"
@@ -50,11 +52,15 @@ static void default_command_line() {
     command_line.wait_enqueuing = 1;
     command_line.stderr_apart = 0;
     command_line.num_slots = 1;
+    command_line.max_running = -1;
+    command_line.resources = NULL;
     command_line.require_elevel = 0;
     command_line.gpus = 0;
     command_line.gpu_nums = NULL;
     command_line.wait_free_gpus = 1;
     command_line.logfile = NULL;
+    command_line.server_exec = getenv("TS_SERVER_EXEC") != NULL;
+    command_line.batch_file = NULL;
 }
 
 struct Msg default_msg() {
@@ -107,6 +113,146 @@ int strtok_int(char* str, char* delim, int* ids) {
     return count;
 }
 
+/* "1,5-9,100-200:10" to the dependencies as sent to the server: the ids,
+ * and DEPEND_RANGE and its first, last and step for each range.
+ * ids must have room for 2 * (strlen(str) + 1). Returns how many, or -1
+ * if a range is wrong */
+int parse_depends(char *str, int *ids) {
+    int count = 0;
+    char *ptr;
+
+    for (ptr = strtok(str, ","); ptr != NULL; ptr = strtok(NULL, ",")) {
+        int first, last;
+        int step = 1;
+
+        if (sscanf(ptr, "%d-%d:%d", &first, &last, &step) < 2) {
+            ids[count++] = atoi(ptr);
+            continue;
+        }
+        if (first < 0 || last < first || step < 1)
+            return -1;
+        ids[count++] = DEPEND_RANGE;
+        ids[count++] = first;
+        ids[count++] = first + (last - first) / step * step;
+        ids[count++] = step;
+    }
+    return count;
+}
+
+/* "running,queued" to bits of the states */
+static int get_states(const char *str) {
+    char tmp[100];
+    char *name;
+    int states = 0;
+    int s;
+
+    if (strlen(str) >= sizeof(tmp))
+        return 0;
+    strcpy(tmp, str);
+
+    for (name = strtok(tmp, ","); name != NULL; name = strtok(NULL, ",")) {
+        for (s = QUEUED; s <= SKIPPED; ++s)
+            if (strcmp(name, jstate2string(s)) == 0)
+                break;
+        if (s > SKIPPED)
+            return 0;
+        states |= 1 << s;
+    }
+    return states;
+}
+
+/* "id", "id-id" or "id-" to the range of jobids of the list */
+static int get_list_ids(const char *str, struct List_filter *f) {
+    char *end;
+
+    f->first_jobid = strtol(str, &end, 10);
+    if (end == str || f->first_jobid < 0)
+        return 0;
+    if (*end == '\0')
+        f->end_jobid = f->first_jobid + 1;
+    else if (*end == '-' && end[1] == '\0')
+        f->end_jobid = 0;
+    else if (*end == '-') {
+        str = end + 1;
+        f->end_jobid = strtol(str, &end, 10) + 1;
+        if (end == str || *end != '\0' || f->end_jobid <= f->first_jobid)
+            return 0;
+    } else
+        return 0;
+    return 1;
+}
+
+/* "num", or "id=num" if jobid is given */
+static int get_priority(const char *str, int *jobid, int *priority) {
+    char *end;
+    long value;
+
+    if (jobid != NULL) {
+        *jobid = strtol(str, &end, 10);
+        if (end == str || *end != '=' || *jobid < 0)
+            return 0;
+        str = end + 1;
+    }
+    value = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || value < -1000000 || value > 1000000)
+        return 0;
+    *priority = value;
+    return 1;
+}
+
+/* "label=num", for --set_max_running */
+static int get_label_limit(const char *str, char **label, int *max_running) {
+    const char *eq = strrchr(str, '=');
+    char *end;
+    long value;
+
+    if (eq == NULL || eq == str)
+        return 0;
+    value = strtol(eq + 1, &end, 10);
+    if (end == eq + 1 || *end != '\0' || value < 0 || value > INT_MAX)
+        return 0;
+    *label = (char *) malloc(eq - str + 1);
+    if (*label == NULL)
+        return 0;
+    memcpy(*label, str, eq - str);
+    (*label)[eq - str] = '\0';
+    *max_running = value;
+    return 1;
+}
+
+/* Seconds, or minutes, hours or days with m, h or d after */
+static int get_runtime(const char *str, int *seconds) {
+    static const char suffixes[] = "smhd";
+    static const long factors[] = { 1, 60, 3600, 86400 };
+    long factor = 1;
+    char *end;
+    long value;
+
+    value = strtol(str, &end, 10);
+    if (end == str || value <= 0)
+        return 0;
+    if (*end != '\0') {
+        const char *suffix = strchr(suffixes, *end);
+
+        if (suffix == NULL || end[1] != '\0')
+            return 0;
+        factor = factors[suffix - suffixes];
+    }
+    if (value > INT_MAX / factor)
+        return 0;
+    *seconds = value * factor;
+    return 1;
+}
+
+/* Seconds of the epoch, or before now if negative */
+static time_t get_list_time(const char *str) {
+    time_t t = atol(str);
+
+    if (t < 0)
+        t += time(NULL);
+    return t;
+}
+
 static struct option longOptions[] = {
         {"get_label",         optional_argument, NULL, 'a'},
         {"count_running",     no_argument,       NULL, 'R'},
@@ -117,6 +263,24 @@ static struct option longOptions[] = {
         {"unsetenv",          required_argument, NULL, 0},
         {"get_logdir",        no_argument,       NULL, 0},
         {"set_logdir",        required_argument, NULL, 0},
+        {"server_exec",       no_argument,       NULL, 0},
+        {"batch",             required_argument, NULL, 0},
+        {"upgrade",           no_argument,       NULL, 0},
+        {"handover",          required_argument, NULL, 0},
+        {"state",             required_argument, NULL, 0},
+        {"ids",               required_argument, NULL, 0},
+        {"since",             required_argument, NULL, 0},
+        {"until",             required_argument, NULL, 0},
+        {"offset",            required_argument, NULL, 0},
+        {"limit",             required_argument, NULL, 0},
+        {"format",            required_argument, NULL, 0},
+        {"priority",          required_argument, NULL, 'P'},
+        {"set_priority",      required_argument, NULL, 0},
+        {"runtime",           required_argument, NULL, 0},
+        {"max_running",       required_argument, NULL, 0},
+        {"set_max_running",   required_argument, NULL, 0},
+        {"res",               required_argument, NULL, 0},
+        {"set_res",           required_argument, NULL, 0},
 #ifndef CPU
         {"gpus",              required_argument, NULL, 'G'},
         {"gpu_indices",       required_argument, NULL, 'g'},
@@ -136,10 +300,10 @@ void parse_opts(int argc, char **argv) {
     /* Parse options */
     while (1) {
 #ifndef CPU
-        c = getopt_long(argc, argv, ":RTVhKzClnfmBEr:a:F:t:c:o:p:w:k:u:s:U:qi:N:L:dS:D:G:W:g:O:",
+        c = getopt_long(argc, argv, ":RTVhKzClnfmBEr:a:F:t:c:o:p:w:k:u:s:U:qi:N:L:dS:D:G:W:g:O:P:",
                         longOptions, &optionIdx);
 #else
-        c = getopt_long(argc, argv, ":RTVhKzClnfmBEr:a:F:t:c:o:p:w:k:u:s:U:qi:N:L:dS:D:W:O:",
+        c = getopt_long(argc, argv, ":RTVhKzClnfmBEr:a:F:t:c:o:p:w:k:u:s:U:qi:N:L:dS:D:W:O:P:",
                         longOptions, &optionIdx);
 #endif
 
@@ -162,6 +326,80 @@ void parse_opts(int argc, char **argv) {
                 } else if (strcmp(longOptions[optionIdx].name, "set_logdir") == 0) {
                     command_line.request = c_SET_LOGDIR;
                     command_line.label = optarg; /* reuse this variable */
+                } else if (strcmp(longOptions[optionIdx].name, "server_exec") == 0) {
+                    command_line.server_exec = 1;
+                } else if (strcmp(longOptions[optionIdx].name, "batch") == 0) {
+                    command_line.request = c_QUEUE_BATCH;
+                    command_line.batch_file = optarg;
+                } else if (strcmp(longOptions[optionIdx].name, "upgrade") == 0) {
+                    command_line.request = c_UPGRADE;
+                } else if (strcmp(longOptions[optionIdx].name, "handover") == 0) {
+                    /* Only from the server, in ts --upgrade */
+                    command_line.request = c_HANDOVER;
+                    command_line.jobid = atoi(optarg); /* reuse this var */
+                } else if (strcmp(longOptions[optionIdx].name, "state") == 0) {
+                    command_line.list.states = get_states(optarg);
+                    if (command_line.list.states == 0) {
+                        fprintf(stderr, "Wrong states for --state.\n");
+                        exit(-1);
+                    }
+                } else if (strcmp(longOptions[optionIdx].name, "ids") == 0) {
+                    if (!get_list_ids(optarg, &command_line.list)) {
+                        fprintf(stderr, "Wrong <id-id> for --ids.\n");
+                        exit(-1);
+                    }
+                } else if (strcmp(longOptions[optionIdx].name, "since") == 0) {
+                    command_line.list.since = get_list_time(optarg);
+                } else if (strcmp(longOptions[optionIdx].name, "until") == 0) {
+                    command_line.list.until = get_list_time(optarg);
+                } else if (strcmp(longOptions[optionIdx].name, "offset") == 0) {
+                    command_line.list.offset = atoi(optarg);
+                } else if (strcmp(longOptions[optionIdx].name, "limit") == 0) {
+                    command_line.list.limit = atoi(optarg);
+                } else if (strcmp(longOptions[optionIdx].name, "format") == 0) {
+                    if (strcmp(optarg, "tsv") == 0)
+                        command_line.list.format = LIST_TSV;
+                    else if (strcmp(optarg, "json") == 0)
+                        command_line.list.format = LIST_JSON;
+                    else if (strcmp(optarg, "text") == 0)
+                        command_line.list.format = LIST_TEXT;
+                    else {
+                        fprintf(stderr, "Wrong format for --format: text, tsv or json.\n");
+                        exit(-1);
+                    }
+                } else if (strcmp(longOptions[optionIdx].name, "set_priority") == 0) {
+                    command_line.request = c_SET_PRIORITY;
+                    if (!get_priority(optarg, &command_line.jobid,
+                                      &command_line.priority)) {
+                        fprintf(stderr, "Wrong <id>=<num> for --set_priority.\n");
+                        exit(-1);
+                    }
+                } else if (strcmp(longOptions[optionIdx].name, "max_running") == 0) {
+                    command_line.max_running = atoi(optarg);
+                    if (command_line.max_running < 0)
+                        command_line.max_running = 0;
+                } else if (strcmp(longOptions[optionIdx].name, "set_max_running") == 0) {
+                    command_line.request = c_SET_LABEL_LIMIT;
+                    if (!get_label_limit(optarg, &command_line.label,
+                                         &command_line.max_running)) {
+                        fprintf(stderr, "Wrong <label>=<num> for --set_max_running.\n");
+                        exit(-1);
+                    }
+                } else if (strcmp(longOptions[optionIdx].name, "res") == 0
+                           || strcmp(longOptions[optionIdx].name, "set_res") == 0) {
+                    if (!resources_check(optarg) || optarg[0] == '\0') {
+                        fprintf(stderr, "Wrong resources for --%s: name=amount,... as mem=16G,license=1.\n",
+                                longOptions[optionIdx].name);
+                        exit(-1);
+                    }
+                    command_line.resources = optarg;
+                    if (strcmp(longOptions[optionIdx].name, "set_res") == 0)
+                        command_line.request = c_SET_RESOURCES;
+                } else if (strcmp(longOptions[optionIdx].name, "runtime") == 0) {
+                    if (!get_runtime(optarg, &command_line.runtime)) {
+                        fprintf(stderr, "Wrong time for --runtime: seconds, or with m, h or d.\n");
+                        exit(-1);
+                    }
 #ifndef CPU
                 } else if (strcmp(longOptions[optionIdx].name, "set_gpu_free_perc") == 0) {
                     command_line.request = c_SET_FREE_PERC;
@@ -270,6 +508,12 @@ void parse_opts(int argc, char **argv) {
                 command_line.request = c_SHOW_CMD;
                 command_line.jobid = atoi(optarg);
                 break;
+            case 'P':
+                if (!get_priority(optarg, NULL, &command_line.priority)) {
+                    fprintf(stderr, "Wrong number for -P.\n");
+                    exit(-1);
+                }
+                break;
             case 'N':
                 command_line.num_slots = atoi(optarg);
                 if (command_line.num_slots < 0)
@@ -300,13 +544,15 @@ void parse_opts(int argc, char **argv) {
                 }
                 break;
             case 'D':
-                command_line.depend_on = (int*) malloc(strlen(optarg) * sizeof(int));
-                command_line.depend_on_size = strtok_int(optarg, ",", command_line.depend_on);
-                break;
             case 'W':
-                command_line.depend_on = (int*) malloc(strlen(optarg) * sizeof(int));
-                command_line.depend_on_size = strtok_int(optarg, ",", command_line.depend_on);
-                command_line.require_elevel = 1;
+                command_line.depend_on = (int*) malloc(2 * (strlen(optarg) + 1) * sizeof(int));
+                command_line.depend_on_size = parse_depends(optarg, command_line.depend_on);
+                if (command_line.depend_on_size < 0) {
+                    fprintf(stderr, "Wrong range of job ids in -%c.\n", c);
+                    exit(-1);
+                }
+                if (c == 'W')
+                    command_line.require_elevel = 1;
                 break;
             case 'U':
                 command_line.request = c_SWAP_JOBS;
@@ -416,10 +662,13 @@ void parse_opts(int argc, char **argv) {
     }
 
     if (command_line.request != c_SHOW_HELP &&
-        command_line.request != c_SHOW_VERSION)
+        command_line.request != c_SHOW_VERSION &&
+        command_line.request != c_HANDOVER)
         command_line.need_server = 1;
 
-    if (!command_line.store_output && !command_line.should_go_background)
+    /* A server_exec job may end before -f asks for its result */
+    if (!command_line.store_output && !command_line.should_go_background
+        && !command_line.server_exec)
         command_line.should_keep_finished = 0;
 
     if (command_line.send_output_by_mail && ((!command_line.store_output) ||
@@ -428,6 +677,11 @@ void parse_opts(int argc, char **argv) {
                 "For e-mail, you should store the output (not through gzip)\n");
         exit(-1);
     }
+
+    if (command_line.max_running >= 0 && command_line.label == 0) {
+        fprintf(stderr, "--max_running needs the label of the jobs (-L).\n");
+        exit(-1);
+    }
 }
 
 static void fill_first_3_handles() {
@@ -475,11 +729,18 @@ static void print_help(const char *cmd) {
     printf("  TS_SOCKET  the path to the unix socket used by the ts command.\n");
     printf("  TS_MAILTO  where to mail the result (on -m). Local user by default.\n");
     printf("  TS_MAXFINISHED  maximum finished jobs in the queue.\n");
+    printf("  TS_MAXFINISHED_AGE  seconds (or m, h, d) a finished job stays in the queue.\n");
+    printf("  TS_MAXFINISHED_MEM  maximum memory (K, M, G) of the finished jobs in the queue.\n");
+    printf("  TS_HISTORY  file where the finished jobs go when they leave the queue.\n");
     printf("  TS_MAXCONN  maximum number of ts connections at once.\n");
     printf("  TS_ONFINISH  binary called on job end (passes jobid, error, outfile, command).\n");
     printf("  TS_ENV  command called on enqueue. Its output determines the job information.\n");
     printf("  TS_SAVELIST  filename which will store the list, if the server dies.\n");
+    printf("  TS_JOURNAL  file where the server keeps its jobs, to get them back on restart.\n");
     printf("  TS_SLOTS   amount of jobs which can run at once, read on server start.\n");
+    printf("  TS_RESOURCES  amounts of the resources for the jobs, as --set_res, read on server start.\n");
+    printf("  TS_AGING   seconds of waiting that add 1 to the priority of a job, read on server start.\n");
+    printf("  TS_SERVER_EXEC  if set, jobs are added as with --server_exec.\n");
     printf("  TMPDIR     directory where to place the output files and the default socket.\n");
     printf("Long option actions:\n");
     printf("  --getenv   [var]                get the value of the specified variable in server environment.\n");
@@ -491,13 +752,33 @@ static void print_help(const char *cmd) {
     printf("  --last_queue_id  || -q          show the job ID of the last added.\n");
     printf("  --get_logdir                    get the path containing log files.\n");
     printf("  --set_logdir [path]             set the path containing log files.\n");
+    printf("  --upgrade                       the server executes this ts, keeping its jobs and clients.\n");
+    printf("  --set_priority <id>=<num>       change the priority of a job in the queue.\n");
+    printf("  --set_max_running <lab>=<num>   run at most num jobs of the label at once (0 for no limit).\n");
+    printf("  --set_res <name>=<num>,...      set the amounts of the resources for the jobs (K, M, G, T of 1024).\n");
 #ifndef CPU
     printf("  --set_gpu_free_perc   [num]     set the value of GPU memory threshold above which GPUs are considered available (90 by default).\n");
     printf("  --get_gpu_free_perc             get the value of GPU memory threshold above which GPUs are considered available.\n");
+#endif
     printf("Long option adding jobs:\n");
+    printf("  --server_exec                   the server runs the job; ts returns after enqueuing it.\n");
+    printf("  --batch <file>                  queue the jobs in file (- for stdin), one per line, as with --server_exec.\n");
+    printf("  --max_running <num>             with -L, run at most num jobs of the label at once (0 for no limit).\n");
+    printf("  --res <name>=<num>,...          resources the job takes, as mem=16G,license=1; see --set_res.\n");
+    printf("  --runtime <time>                time the job takes at most (s, m, h, d), so it can run before a wider one.\n");
+#ifndef CPU
     printf("  --gpus           || -G [num]    number of GPUs required by the job (1 default).\n");
     printf("  --gpu_indices    || -g <id,...> the job will be on these GPU indices without checking whether they are free.\n");
 #endif
+    printf("Long option listing jobs (with -l):\n");
+    printf("  --state <st,...>                only the jobs in these states: queued, allocating, running, finished, skipped.\n");
+    printf("  --ids <id-id>                   only the jobs in this range of IDs (id, id-id or id-).\n");
+    printf("  --since <time>                  only the jobs enqueued since time, in seconds of the epoch or, if negative, before now.\n");
+    printf("  --until <time>                  only the jobs enqueued before time.\n");
+    printf("  --offset <num>                  skip the first num jobs that match.\n");
+    printf("  --limit <num>                   list num jobs at most.\n");
+    printf("  --format <fmt>                  text (default), tsv or json (a JSON object per line), with the raw fields.\n");
+    printf("  -L <label>                      only the jobs with this label.\n");
     printf("Actions (can be performed only one at a time):\n");
     printf("  -K           kill the task spooler server\n");
     printf("  -C           clear the list of finished jobs\n");
@@ -516,8 +797,8 @@ static void print_help(const char *cmd) {
     printf("  -w [id]      wait for a job. The last added, if not specified.\n");
     printf("  -k [id]      send SIGTERM to the job process group. The last run, if not specified.\n");
     printf("  -T           send SIGTERM to all running job groups.\n");
-    printf("  -u [id]      put that job first. The last added, if not specified.\n");
-    printf("  -U <id-id>   swap two jobs in the queue.\n");
+    printf("  -u [id]      put that job first among those of its priority. The last added, if not specified.\n");
+    printf("  -U <id-id>   swap two jobs in the queue, with their priorities.\n");
     printf("  -h           show this help\n");
     printf("  -V           show the program version\n");
     printf("Options adding jobs:\n");
@@ -531,8 +812,10 @@ static void print_help(const char *cmd) {
     printf("  -d           the job will be run after the last job ends.\n");
     printf("  -D <id,...>  the job will be run after the job of given IDs ends.\n");
     printf("  -W <id,...>  the job will be run after the job of given IDs ends well (exit code 0).\n");
+    printf("               An ID may be a range, as 1000-2000, or 0-100:2 for every other one.\n");
     printf("  -L [label]   name this task with a label, to be distinguished on listing.\n");
     printf("  -N [num]     number of slots required by the job (1 default).\n");
+    printf("  -P <num>     priority of the job: the higher run first, in the order queued (0 default).\n");
 }
 
 static void print_version() {
@@ -592,19 +875,32 @@ int main(int argc, char **argv) {
                       command_line.command.num);
             if (!command_line.need_server)
                 error("The command %i needs the server", command_line.request);
+            if (command_line.max_running >= 0)
+                c_set_label_limit();
             c_new_job();
             command_line.jobid = c_wait_newjob_ok();
             if (command_line.store_output) {
                 printf("%i\n", command_line.jobid);
                 fflush(stdout);
             }
-            if (command_line.should_go_background) {
+            if (command_line.server_exec) {
+                /* The server runs it; nothing to do, unless asked to wait */
+                if (!command_line.should_go_background)
+                    errorlevel = c_wait_job();
+            } else if (command_line.should_go_background) {
                 go_background();
                 c_wait_server_commands();
             } else {
                 errorlevel = c_wait_server_commands();
             }
             break;
+        case c_QUEUE_BATCH:
+            if (!command_line.need_server)
+                error("The command %i needs the server", command_line.request);
+            if (command_line.max_running >= 0)
+                c_set_label_limit();
+            c_queue_batch();
+            break;
         case c_LIST:
             if (!command_line.need_server)
                 error("The command %i needs the server", command_line.request);
@@ -705,6 +1001,21 @@ int main(int argc, char **argv) {
                 error("The command %i needs the server", command_line.request);
             c_swap_jobs();
             break;
+        case c_SET_PRIORITY:
+            if (!command_line.need_server)
+                error("The command %i needs the server", command_line.request);
+            c_set_priority();
+            break;
+        case c_SET_LABEL_LIMIT:
+            if (!command_line.need_server)
+                error("The command %i needs the server", command_line.request);
+            c_set_label_limit();
+            break;
+        case c_SET_RESOURCES:
+            if (!command_line.need_server)
+                error("The command %i needs the server", command_line.request);
+            c_set_resources();
+            break;
         case c_COUNT_RUNNING:
             if (!command_line.need_server)
                 error("The command %i needs the server", command_line.request);
@@ -747,9 +1058,20 @@ int main(int argc, char **argv) {
         case c_SET_LOGDIR:
             c_set_logdir();
             break;
+        case c_UPGRADE:
+            if (!command_line.need_server)
+                error("The command %i needs the server", command_line.request);
+            c_upgrade_server(argv[0]);
+            c_wait_server_lines();
+            break;
+        case c_HANDOVER:
+            server_handover(command_line.jobid);
+            break;
     }
 
     if (command_line.need_server) {
+        /* The last request, if nothing was read after it */
+        msg_flush(server_socket);
         close(server_socket);
     }
     free(command_line.gpu_nums);
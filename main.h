@@ -9,7 +9,41 @@
 
 enum {
     CMD_LEN = 500,
-    PROTOCOL_VERSION = 730
+    PROTOCOL_VERSION = 732
+};
+
+/* Framings of a connection, asked in GET_VERSION. In 1 the messages go one
+ * after the other, and the server closes the connection to end a list.
+ * In 2, after the VERSION answer, each request and each answer goes in a
+ * frame: a Frame_header and 'size' bytes with what would go in 1. The
+ * answers carry the request_id of their request, and the connection stays
+ * open after a list. */
+enum {
+    FRAMING_STREAM = 1,
+    FRAMING_FRAMES = 2,
+    FRAMING_DATA_QUERY = 3, /* Frames, and DATA_QUERY is known */
+    FRAMING_RANGES = 4, /* And DEPEND_RANGE in the dependencies */
+    FRAMING_PRIORITY = 5, /* And the priorities of the jobs */
+    FRAMING_LABEL_LIMIT = 6, /* And SET_LABEL_LIMIT */
+    FRAMING_RESOURCES = 7, /* And JOB_RESOURCES and SET_RESOURCES */
+    MAX_FRAME_SIZE = 64 * 1024 * 1024
+};
+
+/* In the dependencies of a job, as sent, it is followed by the first, the
+ * last and the step of a range of ids (-D 1000-25000, -D 0-100:2) */
+enum {
+    DEPEND_RANGE = -2
+};
+
+/* The data of a job that a client may not send again: see DATA_QUERY */
+enum {
+    DATA_ENV, /* What TS_ENV told */
+    DATA_ENVP /* The environment of a server_exec job */
+};
+
+struct Frame_header {
+    int size;
+    int request_id;
 };
 
 enum MsgTypes {
@@ -55,7 +89,18 @@ enum MsgTypes {
     SET_FREE_PERC,
     GET_FREE_PERC,
     GET_LOGDIR,
-    SET_LOGDIR
+    SET_LOGDIR,
+    NEWJOB_BATCH,
+    UPGRADE,
+    DATA_QUERY,
+    DATA_KNOWN,
+    SET_PRIORITY,
+    SET_PRIORITY_OK,
+    SET_LABEL_LIMIT,
+    SET_LABEL_LIMIT_OK,
+    JOB_RESOURCES, /* Those of the next NEWJOB or NEWJOB_BATCH */
+    SET_RESOURCES,
+    SET_RESOURCES_OK
 };
 
 enum Request {
@@ -90,7 +135,33 @@ enum Request {
     c_SET_FREE_PERC,
     c_GET_FREE_PERC,
     c_GET_LOGDIR,
-    c_SET_LOGDIR
+    c_SET_LOGDIR,
+    c_QUEUE_BATCH,
+    c_UPGRADE,
+    c_HANDOVER,
+    c_SET_PRIORITY,
+    c_SET_LABEL_LIMIT,
+    c_SET_RESOURCES
+};
+
+enum List_format {
+    LIST_TEXT,
+    LIST_TSV,
+    LIST_JSON
+};
+
+/* What LIST asks for. Zeros list all the jobs, as old clients send them */
+struct List_filter {
+    int term_width; /* The first, where old clients have it */
+    int format; /* enum List_format */
+    int states; /* Bits 1 << state; 0 for all */
+    int first_jobid;
+    int end_jobid; /* Past the last; 0 for no end */
+    time_t since; /* Enqueued since, in seconds of the epoch; 0 for any */
+    time_t until; /* Enqueued before */
+    int offset; /* Matching jobs to skip */
+    int limit; /* Matching jobs to list; 0 for all */
+    int label_size; /* The label follows the message */
 };
 
 struct CommandLine {
@@ -115,11 +186,18 @@ struct CommandLine {
     } command;
     char *label;
     int num_slots; /* Slots for the job to use. Default 1 */
+    int priority; /* Higher runs first. Default 0 */
+    int runtime; /* Seconds the job is told to take; 0 if not told */
+    int max_running; /* Of the jobs of the label; -1 if not told */
+    char *resources; /* --res, or the capacities of --set_res */
     int require_elevel;  /* whether requires error level of dependencies or not */
     int gpus;
     int *gpu_nums;
     int wait_free_gpus;
     char *logfile;
+    int server_exec; /* The server runs the job, no client waits for it */
+    char *batch_file; /* The jobs of --batch, one per line; "-" for stdin */
+    struct List_filter list; /* For -l. With it, 'label' filters too */
 };
 
 enum Process_type {
@@ -146,6 +224,9 @@ enum Jobstate {
 
 struct Msg {
     enum MsgTypes type;
+    /* NEWJOB and NEWJOB_BATCH: the seconds told with --runtime, 0 if not.
+     * It takes what was the padding before the union, 0 from old clients */
+    int runtime;
 
     union {
         struct {
@@ -159,6 +240,18 @@ struct Msg {
             int num_slots;
             int gpus;
             int wait_free_gpus;
+            int server_exec;
+            int argv_size;
+            int envp_size;
+            int cwd_size;
+            int logfile_size;
+            int gzip;
+            int stderr_apart;
+            int send_output_by_mail;
+            int require_elevel;
+            int batch_count; /* NEWJOB_BATCH: jobs in the payload */
+            int batch_size; /* NEWJOB_BATCH: bytes of the payload */
+            int priority; /* 0 from old clients */
         } newjob;
         struct {
             int ofilename_size;
@@ -181,45 +274,179 @@ struct Msg {
             int jobid1;
             int jobid2;
         } swap;
+        struct {
+            int jobid;
+            int priority;
+        } priority;
+        struct {
+            int max_running; /* 0 for no limit */
+            int label_size; /* The label follows */
+        } label_limit;
         int last_errorlevel;
         int max_slots;
-        int version;
+        struct {
+            int version;
+            int framing; /* 0 for old clients and servers */
+        } version;
         int count_running;
         char *label;
-        int term_width;
+        struct List_filter list;
+        /* DATA_QUERY: the environment and the envp of the next NEWJOB or
+         * NEWJOB_BATCH, by their hash (intern.c) and size; 0 if none.
+         * DATA_KNOWN: the size is 0 for those the server doesn't have.
+         * Those it has go as -1 in the sizes of the job, and not sent */
+        struct {
+            unsigned long long hash[2];
+            int size[2];
+        } data;
     } u;
 };
 
+/* The times of a job. The rest of what ts -i shows is rendered from the
+ * fields of the job when asked (joblist_add_info()) */
 struct Procinfo {
-    char *ptr;
-    int nchars;
-    int allocchars;
     struct timeval enqueue_time;
     struct timeval start_time;
     struct timeval end_time;
 };
 
+/* A job in the payload of NEWJOB_BATCH. Each one is followed by its
+ * dependencies, its command, its argv and its label. The rest of the
+ * fields of a NEWJOB go in the message, as they are the same for all */
+struct Batchjob {
+    int command_size;
+    int argv_size;
+    int label_size;
+    int depend_on_size;
+    int num_slots;
+    int gpus;
+    int require_elevel;
+};
+
+/* An amount of a named resource a job takes; see resources.c */
+struct Res_amount {
+    int resource;
+    long long amount;
+};
+
+/* The ids first, first + step, ... up to last, which is one of them.
+ * A single id is a range of one; -1 for the last job when it had none */
+struct Interval {
+    int first;
+    int last;
+    int step;
+};
+
+/* What the server keeps to run a job by itself (--server_exec). The strings
+ * are packed one after the other, each with its null. envp is shared by
+ * the jobs with the same (intern.c) */
+struct Execinfo {
+    char *argv;
+    int argv_size;
+    char *envp;
+    int envp_size;
+    char *cwd;
+    char *logfile;
+    int gzip;
+    int stderr_apart;
+    int send_output_by_mail;
+    int require_elevel;
+};
+
+/* The fields the scheduler and the walks of the lists look at come first,
+ * in one cache line; the rest, only read to list or run the job, after.
+ * The command, the label, the environment and the envp of exec are shared
+ * among the jobs (intern.c) */
+/* Ready jobs that wait out of the ready queue for a label or a resource
+ * (jobs.c), in the order they would run */
+struct Parked {
+    struct Job *first;
+    struct Job *last;
+};
+
 struct Job {
     struct Job *next;
+    struct Job *prev;
     int jobid;
-    char *command;
     enum Jobstate state;
+    int num_slots;
+    int num_gpus;
+    int wait_free_gpus;
+    int unmet_dependencies; /* Jobs in depend_on still in the queue */
+    int queue_pos; /* Orders the queue */
+    int ready_index; /* In the ready queue, or -1 */
+    struct Parked *parked_on; /* Ready, but waiting there; or 0 */
+    struct Job *park_prev;
+    struct Job *park_next;
+    int *gpu_ids;
+    struct Execinfo *exec; /* 0 if a ts client runs the job */
+
     struct Result result; /* Defined in msg.h */
-    char *output_filename;
-    int store_output;
     int pid;
+    int store_output;
     int should_keep_finished;
-    int *depend_on;
-    int depend_on_size;
+    int priority; /* Higher runs first; see readyq.c */
+    time_t waiting_since; /* For the aging of the priority */
+    int runtime; /* Seconds told with --runtime, for the backfill; 0 if not */
+    char *resources; /* What --res told; 0 if nothing */
+    struct Res_amount *res; /* The same, parsed (resources.c) */
+    int res_size;
+    struct Interval *depend_on;
+    int depend_on_size; /* Ranges in depend_on */
+    int dependency_errorlevel;
     int *notify_errorlevel_to;
     int notify_errorlevel_to_size;
-    int dependency_errorlevel;
+    int notify_errorlevel_to_alloc;
+    char *command;
     char *label;
+    char *env; /* What TS_ENV told, for ts -i */
+    char *output_filename;
     struct Procinfo info;
-    int num_slots;
-    int num_gpus;
-    int *gpu_ids;
-    int wait_free_gpus;
+};
+
+/* From an int key (a jobid, a socket) to a pointer; see intmap.c */
+struct Intmap {
+    struct Intmap_entry {
+        int key;
+        void *value; /* 0 means an empty bucket */
+    } *entries;
+    int size; /* A power of two */
+    int shift; /* 32 - log2(size), for the top bits of the hash */
+    int count;
+};
+
+/* The records of the journal; see journal.c, and jobs.c to replay them */
+enum Journal_type {
+    JR_STATE = 1, /* The counters of the server, first in a snapshot */
+    JR_JOB, /* A job as it is, in a snapshot */
+    JR_LINK, /* End of a snapshot: the queued jobs wait for their deps */
+    JR_NEW, /* A job queued */
+    JR_START,
+    JR_FINISH,
+    JR_DROP, /* The client of a queued job left */
+    JR_REMOVE, /* ts -r */
+    JR_FORGET, /* A finished job out of the list */
+    JR_CLEAR, /* ts -C */
+    JR_URGENT,
+    JR_SWAP,
+    JR_SLOTS,
+    /* Only in the handover of ts --upgrade */
+    JR_SERVER, /* The listen socket and the settings, first */
+    JR_CONN, /* A client connection */
+    JR_WAITER, /* A client waiting for a job */
+    JR_CHILD, /* A job the server forked */
+    /* Newer, in both */
+    JR_PRIORITY,
+    JR_LABEL_LIMIT,
+    JR_RESOURCES /* The capacities */
+};
+
+/* A record being replayed */
+struct Journal_reader {
+    const char *data;
+    int size;
+    int pos;
+    int error; /* Read past its end */
 };
 
 enum ExitCodes {
@@ -232,6 +459,8 @@ enum ExitCodes {
 /* main.c */
 int strtok_int(char* str, char* delim, int* ids);
 
+int parse_depends(char *str, int *ids);
+
 struct Msg default_msg();
 
 struct Result default_result();
@@ -275,10 +504,18 @@ void c_move_urgent();
 
 int c_wait_newjob_ok();
 
+void c_queue_batch();
+
 void c_get_state();
 
 void c_swap_jobs();
 
+void c_set_priority();
+
+void c_set_label_limit();
+
+void c_set_resources();
+
 void c_show_info();
 
 void c_show_last_id();
@@ -315,8 +552,10 @@ void c_set_logdir();
 
 char* get_logdir();
 
+void c_upgrade_server(const char *argv0);
+
 /* jobs.c */
-void s_list(int s);
+void s_list(int s, const struct List_filter *f, const char *label);
 
 #ifndef CPU
 void s_list_gpu(int s);
@@ -324,16 +563,22 @@ void s_list_gpu(int s);
 
 int s_newjob(int s, struct Msg *m);
 
+int s_newjob_batch(int s, struct Msg *m);
+
 void s_removejob(int jobid);
 
 void job_finished(const struct Result *result, int jobid);
 
-int next_run_job();
+int next_run_jobs(const int **jobids);
 
 void s_mark_job_running(int jobid);
 
 void s_clear_finished();
 
+void s_finished_init();
+
+void s_expire_finished();
+
 void s_process_runjob_ok(int jobid, char *oname, int pid);
 
 void s_send_output(int socket, int jobid);
@@ -354,6 +599,14 @@ void s_send_state(int s, int jobid);
 
 void s_swap_jobs(int s, int jobid1, int jobid2);
 
+void s_set_priority(int s, int jobid, int priority);
+
+void s_set_label_limit(int s, int max_running, int label_size);
+
+void s_set_resources(int s, int size);
+
+int label_max_running(char *label, int *running);
+
 void s_count_running_jobs(int s);
 
 int s_count_allocating_jobs();
@@ -400,13 +653,43 @@ void s_get_logdir(int s);
 
 void s_set_logdir(const char*);
 
+int job_is_server_exec(int jobid);
+
+void s_exec_job(int jobid);
+
+void s_exec_job_finished(int jobid, const struct Result *result);
+
+void s_journal_apply(int type, struct Journal_reader *r);
+
+void s_journal_snapshot();
+
+void s_journal_recovered();
+
+void s_handover_waiters();
+
+void send_list_line(int s, const char *str);
+
 /* server.c */
 void server_main(int notify_fd, char *_path);
 
+void server_handover(int fd);
+
 void dump_conns_struct(FILE *out);
 
 void s_send_cmd(int s, int jobid);
 
+void close_server_sockets();
+
+int conn_request_id(int s);
+
+char *conn_take_known(int s, int which);
+
+char *conn_take_resources(int s);
+
+void conn_frame_begin(int s);
+
+void conn_frame_end(int s, int request_id);
+
 /* server_start.c */
 int try_connect(int s);
 
@@ -421,6 +704,160 @@ void create_socket_path(char **path);
 /* execute.c */
 int run_job(struct Result *res);
 
+void run_gzip(int fd_out, int fd_in);
+
+/* server_exec.c */
+int server_exec_init();
+
+int server_exec_fork(const struct Job *p, char **ofname);
+
+void server_exec_reap();
+
+void server_exec_notify(const struct Job *p, int errorlevel);
+
+void server_exec_free(struct Execinfo *e);
+
+void server_exec_handover();
+
+void server_exec_adopt(struct Journal_reader *r);
+
+/* journal.c */
+void journal_open();
+
+void journal_resume(int generation);
+
+int journal_generation();
+
+void journal_dump_begin(int fd);
+
+int journal_dump_end();
+
+void journal_load(int fd, void (*apply)(int type, struct Journal_reader *r));
+
+int journal_active();
+
+int journal_pending();
+
+void journal_sync();
+
+void journal_begin(int type);
+
+void journal_data(const void *data, int size);
+
+void journal_int(int value);
+
+void journal_bytes(const char *data, int size);
+
+void journal_string(const char *str);
+
+void journal_end();
+
+int jr_int(struct Journal_reader *r);
+
+void jr_data(struct Journal_reader *r, void *data, int size);
+
+char *jr_bytes(struct Journal_reader *r, int *size);
+
+char *jr_string(struct Journal_reader *r);
+
+char *jr_pool_bytes(struct Journal_reader *r, int *size);
+
+char *jr_pool_string(struct Journal_reader *r);
+
+const char *jr_view(struct Journal_reader *r, int *size);
+
+/* history.c */
+void history_open();
+
+void history_add(const struct Job *p);
+
+struct Job *history_get(int jobid);
+
+int history_errorlevel(int jobid, int *errorlevel);
+
+int history_range(const struct Interval *d, int *errorlevels);
+
+int history_next_jobid();
+
+/* intmap.c */
+void intmap_init(struct Intmap *m);
+
+void intmap_free(struct Intmap *m);
+
+void *intmap_get(const struct Intmap *m, int key);
+
+void intmap_put(struct Intmap *m, int key, void *value);
+
+void intmap_del(struct Intmap *m, int key);
+
+/* pool.c */
+void *pool_alloc(int size);
+
+char *pool_copy(const char *data, int size);
+
+void pool_free(void *ptr);
+
+void pool_stats(int *alive, int *made);
+
+/* intern.c */
+unsigned long long intern_hash(const char *data, int size);
+
+char *intern_bytes(const char *data, int size);
+
+char *intern(const char *data, int size);
+
+char *intern_find(unsigned long long hash, int size);
+
+char *intern_ref(char *str);
+
+int intern_size(const char *str);
+
+unsigned long long intern_hash_of(const char *str);
+
+void intern_release(char *str);
+
+/* readyq.c */
+void readyq_init();
+
+int readyq_priority(const struct Job *p);
+
+int readyq_before(const struct Job *a, const struct Job *b);
+
+void readyq_add(struct Job *p);
+
+void readyq_remove(struct Job *p);
+
+void readyq_moved(struct Job *p);
+
+struct Job *readyq_pop();
+
+int readyq_size();
+
+int readyq_timed();
+
+/* resources.c */
+void resources_init();
+
+int resources_check(const char *spec);
+
+int resources_set(const char *spec);
+
+struct Res_amount *resources_of(const char *spec, int *size);
+
+int resources_short(const struct Res_amount *res, int size);
+
+long long resources_room(int resource);
+
+long long resources_capacity(int resource);
+
+int resources_count();
+
+struct Parked *resources_waiting(int resource);
+
+void resources_take(const struct Res_amount *res, int size, int sign);
+
+char *resources_text(int with_used);
+
 /* client_run.c */
 void c_run_tail(const char *filename);
 
@@ -462,6 +899,24 @@ void send_ints(int fd, const int *data, int num);
 
 int *recv_ints(int fd, int *num);
 
+int recv_stream(int fd, char *data, int bytes);
+
+void send_frame(int fd, int request_id, const char *body, int size);
+
+void msg_capture_begin(int fd);
+
+char *msg_capture_end(int fd, int *size);
+
+void msg_input_begin(int fd, char *data, int size);
+
+void msg_input_end();
+
+void msg_set_framed(int fd);
+
+void msg_flush(int fd);
+
+int msg_frame_done(int fd);
+
 /* msgdump.c */
 void msgdump(FILE *, const struct Msg *m);
 
@@ -471,18 +926,32 @@ void error_msg(const struct Msg *m, const char *str, ...);
 void warning_msg(const struct Msg *m, const char *str, ...);
 
 /* list.c */
-char *joblist_headers();
+void joblist_clear();
+
+const char *joblist_text(int *size);
 
-char *jobgpulist_header();
+void joblist_add(const char *str);
 
-char *joblist_line(const struct Job *p);
+void joblist_add_headers();
 
-char *joblistdump_torun(const struct Job *p);
+void jobgpulist_add_header();
 
-char *joblistdump_headers();
+void joblist_add_line(const struct Job *p);
+
+void joblistdump_add_torun(const struct Job *p);
+
+void joblistdump_add_headers();
+
+void joblist_add_tsv_header();
+
+void joblist_add_tsv(const struct Job *p);
+
+void joblist_add_json(const struct Job *p);
+
+void joblist_add_info(const struct Job *p);
 
 #ifndef CPU
-char *jobgpulist_line(const struct Job *p);
+void jobgpulist_add_line(const struct Job *p);
 #endif
 
 char *time_rep(float* t);
@@ -494,14 +963,6 @@ char *ints_to_chars(int *array, int n, const char *delim);
 
 /* info.c */
 
-void pinfo_dump(const struct Procinfo *p, int fd);
-
-void pinfo_addinfo(struct Procinfo *p, int maxsize, const char *line, ...);
-
-void pinfo_free(struct Procinfo *p);
-
-int pinfo_size(const struct Procinfo *p);
-
 void pinfo_set_enqueue_time(struct Procinfo *p);
 
 void pinfo_set_start_time(struct Procinfo *p);
@@ -522,6 +983,8 @@ int tail_file(const char *fname, int last_lines);
 
 #ifndef CPU
 /* gpu.c */
+int getTotalGpus();
+
 int *getGpuList(int *num);
 
 void initGPU();
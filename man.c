@@ -53,6 +53,10 @@ int main() {
                      ".BI \"[\\--set_gpu_free_perc ]\n"
                      ".BI \"[\\--get_logdir]\n"
                      ".BI \"[\\--set_logdir [\"path ]]\n"
+                     ".BI \"[\\--upgrade]\n"
+                     ".BI \"[\\--set_priority <\"id = num >]\n"
+                     ".BI \"[\\--set_max_running <\"label = num >]\n"
+                     ".BI \"[\\--set_res <\"name = num,... >]\n"
                      "\n"
                      ".sp\n"
                      "Options:\n"
@@ -62,6 +66,18 @@ int main() {
                      ".BI \"[\\-G/--gpus [\"num ]]\n"
                      ".BI \"[\\--gpus_indices [\"id1,id2,... ]]\n"
                      ".BI \"[\\-O [\"name ]]\n"
+                     ".BI \"[\\--server_exec]\n"
+                     ".BI \"[\\--batch \"file ]\n"
+                     ".BI \"[\\--runtime \"time ]\n"
+                     ".BI \"[\\--max_running \"num ]\n"
+                     ".BI \"[\\--res \"name=num,... ]\n"
+                     ".BI \"[\\--state \"st,... ]\n"
+                     ".BI \"[\\--ids \"id-id ]\n"
+                     ".BI \"[\\--since \"time ]\n"
+                     ".BI \"[\\--until \"time ]\n"
+                     ".BI \"[\\--offset \"num ]\n"
+                     ".BI \"[\\--limit \"num ]\n"
+                     ".BI \"[\\--format \"text|tsv|json ]\n"
                      "\n"
                      ".SH DESCRIPTION\n"
                      ".B ts\n"
@@ -118,6 +134,8 @@ int main() {
                      ".B \"\\-D [id,...]\"\n"
                      "Run the command only after the specified job IDs finished.\n"
                      "It does not depend on how its dependencies end.\n"
+                     "An id may be a range, \\fBfirst-last\\fR, or \\fBfirst-last:step\\fR for one of\n"
+                     "every \\fIstep\\fR ids, as \\fB\\-D 0-100:2\\fR.\n"
                      ".TP\n"
                      ".B \"\\-W [id,...]\"\n"
                      "Run the command only if the job of given id finished well (errorlevel = 0). This new\n"
@@ -141,12 +159,55 @@ int main() {
                      ".B \"\\-O [name]\"\n"
                      "Set the log name to the specified name. Do not include any path in the specified name.\n"
                      ".TP\n"
+                     ".B \"\\--server_exec\"\n"
+                     "The server runs the command itself, with the environment and working directory\n"
+                     "of the enqueuing\n"
+                     ".B ts,\n"
+                     "which returns as soon as the job is queued instead of waiting for it as a process.\n"
+                     "With \\fB\\-f\\fR it waits for the job to end and returns its exit code.\n"
+                     ".TP\n"
+                     ".B \"\\--batch [file]\"\n"
+                     "Queue many jobs at once, one per line of the file (or of the standard input,\n"
+                     "if the file is \\fB-\\fR), to be run by the server as with \\fB\\--server_exec\\fR.\n"
+                     "A line may start with \\fB\\-d\\fR, \\fB\\-D\\fR, \\fB\\-W\\fR, \\fB\\-L\\fR,\n"
+                     "\\fB\\-N\\fR or \\fB\\-G\\fR and their arguments, maybe ended by \\fB\\--\\fR;\n"
+                     "the rest is the command, run with \\fBsh \\-c\\fR. Empty lines and lines starting\n"
+                     "with # are skipped. The other options given to ts apply to all the jobs, and\n"
+                     "ts prints the id of each job queued.\n"
+                     ".TP\n"
                      ".B \"\\-N [num]\"\n"
                      "Run the command only if there are \\fbnum\\fB slots free in the queue. Without it,\n"
                      "the job will run if there is one slot free. For example, if you use the\n"
                      "queue to feed cpu cores, and you know that a job will take two cores, with \\fB\\-N\\fB\n"
                      "you can let ts know that.\n"
                      ".TP\n"
+                     ".B \"\\-P/--priority <num>\"\n"
+                     "The priority of the job, 0 if not given; it may be negative. The jobs of a higher\n"
+                     "priority run before, and those of the same priority in the order they were queued.\n"
+                     "Look at \\fBTS_AGING\\fR for the jobs of a low priority to run at last.\n"
+                     ".TP\n"
+                     ".B \"\\--max_running <num>\"\n"
+                     "With \\fB\\-L\\fR, run at most \\fInum\\fR jobs of that label at once, 0 for no\n"
+                     "limit. The jobs of other labels run as if those waiting were not there. It\n"
+                     "changes the limit of the label for all its jobs, as\n"
+                     ".B \\--set_max_running\n"
+                     "does.\n"
+                     ".TP\n"
+                     ".B \"\\--runtime <time>\"\n"
+                     "The time the job takes at most, in seconds, or with \\fBm\\fR, \\fBh\\fR or \\fBd\\fR\n"
+                     "after for minutes, hours or days. The first job that waits for more slots than\n"
+                     "there are free keeps them for when the running jobs should end. Until then, the\n"
+                     "jobs after it only run if they should end before, or if they take slots it will\n"
+                     "not need. Without \\fB\\--runtime\\fR, a job with a label is taken to last\n"
+                     "as the last one of its label that was not killed.\n"
+                     ".TP\n"
+                     ".B \"\\--res <name=num,...>\"\n"
+                     "The resources the job takes while it runs, as \\fBmem=16G,license=1\\fR: any\n"
+                     "names, with amounts that may end in \\fBK\\fR, \\fBM\\fR, \\fBG\\fR or \\fBT\\fR (of 1024).\n"
+                     "The job waits until all of them fit in what the server has of each, set with\n"
+                     ".B \\--set_res\n"
+                     "or \\fBTS_RESOURCES\\fR. A resource without an amount is only counted.\n"
+                     ".TP\n"
                      ".B \"\\-G/--gpus [num]\"\n"
                      "Run the job with \\fbnum\\fB GPUs.\n"
                      ".TP\n"
@@ -202,6 +263,14 @@ int main() {
                      "This is the default behaviour if\n"
                      ".B ts\n"
                      "is called without options.\n"
+                     "The server can leave jobs out of the list, with \\fB\\--state\\fR and a list\n"
+                     "of states (queued, allocating, running, finished, skipped), \\fB\\--ids\\fR and a range\n"
+                     "of ids (id, id-id or id-), \\fB\\--since\\fR and \\fB\\--until\\fR and the seconds of\n"
+                     "the epoch when the jobs were enqueued (negative ones go back from now), and\n"
+                     "\\fB\\-L\\fR and a label. Of the jobs left, \\fB\\--offset [num]\\fR skips the first\n"
+                     "num and \\fB\\--limit [num]\\fR lists num at most. \\fB\\--format tsv\\fR lists\n"
+                     "the raw fields of the jobs separated by tabs, after a line with their names,\n"
+                     "and \\fB\\--format json\\fR as a JSON object per line.\n"
                      ".TP\n"
                      ".B \"\\-g\"\n"
                      "list all jobs running on GPUs and the corresponding GPU IDs.\n"
@@ -224,6 +293,30 @@ int main() {
                      ".B \"\\--get_logdir [path]\"\n"
                      "Set the path containing log files to the specified path.\n"
                      ".TP\n"
+                     ".B \"\\--upgrade\"\n"
+                     "The server executes this ts in its place. The new server keeps the jobs,\n"
+                     "those running included, and the connected clients.\n"
+                     ".TP\n"
+                     ".B \"\\--set_priority <id=num>\"\n"
+                     "Change the priority of a job in the queue, as given with\n"
+                     ".B \\-P.\n"
+                     "\\fBts \\-i\\fR shows it.\n"
+                     ".TP\n"
+                     ".B \"\\--set_max_running <label=num>\"\n"
+                     "Run at most \\fInum\\fR jobs of the label at once, 0 for no limit, as with\n"
+                     ".B \\--max_running.\n"
+                     "The server keeps it across\n"
+                     ".B \\--upgrade\n"
+                     "and, with \\fBTS_JOURNAL\\fR, a restart. \\fBts \\-i\\fR shows it for the jobs of the label.\n"
+                     ".TP\n"
+                     ".B \"\\--set_res <name=num,...>\"\n"
+                     "Set the amounts the server has of the resources for\n"
+                     ".B \\--res.\n"
+                     "Those not named keep theirs. The header of \\fBts \\-l\\fR shows what the\n"
+                     "running jobs take of each, after the slots. The server keeps them across\n"
+                     ".B \\--upgrade\n"
+                     "and, with \\fBTS_JOURNAL\\fR, a restart.\n"
+                     ".TP\n"
                      ".B \"\\-t [id]\"\n"
                      "Show the last ten lines of the output file of the named job, or the last\n"
                      "running/run if not specified. If the job is still running, it will keep on\n"
@@ -260,7 +353,8 @@ int main() {
                      ".TP\n"
                      ".B \"\\-u [id]\"\n"
                      "Make the named job (or the last in the queue) urgent - this means that it goes\n"
-                     "forward in the queue so it can run as soon as possible.\n"
+                     "forward in the queue so it can run as soon as possible, before the others of its\n"
+                     "priority.\n"
                      ".TP\n"
                      ".B \"\\-i [id]\"\n"
                      "Show information about the named job (or the last run). It will show the command line,\n"
@@ -269,7 +363,7 @@ int main() {
                      ".TP\n"
                      ".B \"\\-U <id-id>\"\n"
                      "Interchange the queue positions of the named jobs (separated by a hyphen and no\n"
-                     "spaces).\n"
+                     "spaces), and their priorities.\n"
                      ".TP\n"
                      ".B \"\\-h\"\n"
                      "Show help on standard output.\n"
@@ -311,12 +405,32 @@ int main() {
                      "option if you are tired of\n"
                      ".B \\-C.\n"
                      ".TP\n"
+                     ".B \"TS_MAXFINISHED_AGE\"\n"
+                     "Seconds a job result stays in the queue after the job finishes; with a suffix\n"
+                     "m, h or d, minutes, hours or days.\n"
+                     ".TP\n"
+                     ".B \"TS_MAXFINISHED_MEM\"\n"
+                     "Limit the memory the server takes for the job results, in bytes, or with a\n"
+                     "suffix K, M or G. The last result always stays.\n"
+                     ".TP\n"
+                     ".B \"TS_HISTORY\"\n"
+                     "File where the job results go when they leave the queue, by the limits above or\n"
+                     ".B \\-C.\n"
+                     "Those still answer\n"
+                     ".B \\-i, \\-s, \\-w, \\-o\n"
+                     "and the dependencies on them. The server keeps an index of them in\n"
+                     "TS_HISTORY.idx.\n"
+                     ".TP\n"
                      ".B \"TS_MAXCONN\"\n"
                      "The maximum number of ts server connections to clients. This will make the ts clients\n"
                      "block until connections are freed. This helps, for example, on systems with a limited\n"
                      "number of processes, because each job waiting in the queue remains as a process. This\n"
                      "variable has to be set at server start, and cannot be modified later.\n"
                      ".TP\n"
+                     ".B \"TS_SERVER_EXEC\"\n"
+                     "If the variable exists, the jobs are queued as with\n"
+                     ".B \\--server_exec.\n"
+                     ".TP\n"
                      ".B \"TS_ONFINISH\"\n"
                      "If the variable exists pointing to an executable, it will be run by the client\n"
                      "after the queued job. It uses execlp, so\n"
@@ -351,6 +465,16 @@ int main() {
                      "the first instance of\n"
                      ".B ts.\n"
                      ".TP\n"
+                     ".B \"TS_RESOURCES\"\n"
+                     "The amounts of the resources for the jobs at the start of the server, as\n"
+                     ".B \\--set_res\n"
+                     "takes them.\n"
+                     ".TP\n"
+                     ".B \"TS_AGING\"\n"
+                     "Seconds after which a job waiting in the queue gains a point of priority, and so on\n"
+                     "for as long as it waits, so the jobs of a low priority are not left behind\n"
+                     "forever. Read when the server starts; without it the priorities don't change.\n"
+                     ".TP\n"
                      ".B \"TS_MAILTO\"\n"
                      "Send the letters with job results to the address specified in this variable.\n"
                      "Otherwise, they are sent to\n"
@@ -376,6 +500,13 @@ int main() {
                      "command run), on SIGTERM the queue status will be saved to the file pointed\n"
                      "by this environment variable - for example, at system shutdown.\n"
                      ".TP\n"
+                     ".B \"TS_JOURNAL\"\n"
+                     "If it is defined when starting the queue server, every change to the jobs\n"
+                     "is appended to the file pointed by it, and from time to time all of them are\n"
+                     "written to the same name ended in \\fB.snap\\fR. A new server started with the\n"
+                     "same value gets back the queue and the finished jobs, even after the last one\n"
+                     "was killed. The jobs that were running then are marked as killed.\n"
+                     ".TP\n"
                      ".B \"TS_ENV\"\n"
                      "This has a command to be run at enqueue time through\n"
                      "\\fB/bin/sh\\fR. The output of the command will be readable through the option\n"
@@ -450,6 +581,10 @@ int main() {
                      ".BI \"[\\--unsetenv [\"var ]]\n"
                      ".BI \"[\\--get_logdir]\n"
                      ".BI \"[\\--set_logdir [\"path ]]\n"
+                     ".BI \"[\\--upgrade]\n"
+                     ".BI \"[\\--set_priority <\"id = num >]\n"
+                     ".BI \"[\\--set_max_running <\"label = num >]\n"
+                     ".BI \"[\\--set_res <\"name = num,... >]\n"
                      "\n"
                      ".sp\n"
                      "Options:\n"
@@ -457,6 +592,18 @@ int main() {
                      ".BI \"[\\-L [\"label ]]\n"
                      ".BI \"[\\-D [\"id1,id2,... ]]\n"
                      ".BI \"[\\-O [\"name ]]\n"
+                     ".BI \"[\\--server_exec]\n"
+                     ".BI \"[\\--batch \"file ]\n"
+                     ".BI \"[\\--runtime \"time ]\n"
+                     ".BI \"[\\--max_running \"num ]\n"
+                     ".BI \"[\\--res \"name=num,... ]\n"
+                     ".BI \"[\\--state \"st,... ]\n"
+                     ".BI \"[\\--ids \"id-id ]\n"
+                     ".BI \"[\\--since \"time ]\n"
+                     ".BI \"[\\--until \"time ]\n"
+                     ".BI \"[\\--offset \"num ]\n"
+                     ".BI \"[\\--limit \"num ]\n"
+                     ".BI \"[\\--format \"text|tsv|json ]\n"
                      "\n"
                      ".SH DESCRIPTION\n"
                      ".B ts\n"
@@ -513,6 +660,8 @@ int main() {
                      ".B \"\\-D [id,...]\"\n"
                      "Run the command only after the specified job IDs finished.\n"
                      "It does not depend on how its dependencies end.\n"
+                     "An id may be a range, \\fBfirst-last\\fR, or \\fBfirst-last:step\\fR for one of\n"
+                     "every \\fIstep\\fR ids, as \\fB\\-D 0-100:2\\fR.\n"
                      ".TP\n"
                      ".B \"\\-W [id,...]\"\n"
                      "Run the command only if the job of given id finished well (errorlevel = 0). This new\n"
@@ -536,12 +685,55 @@ int main() {
                      ".B \"\\-O [name]\"\n"
                      "Set the log name to the specified name. Do not include any path in the specified name.\n"
                      ".TP\n"
+                     ".B \"\\--server_exec\"\n"
+                     "The server runs the command itself, with the environment and working directory\n"
+                     "of the enqueuing\n"
+                     ".B ts,\n"
+                     "which returns as soon as the job is queued instead of waiting for it as a process.\n"
+                     "With \\fB\\-f\\fR it waits for the job to end and returns its exit code.\n"
+                     ".TP\n"
+                     ".B \"\\--batch [file]\"\n"
+                     "Queue many jobs at once, one per line of the file (or of the standard input,\n"
+                     "if the file is \\fB-\\fR), to be run by the server as with \\fB\\--server_exec\\fR.\n"
+                     "A line may start with \\fB\\-d\\fR, \\fB\\-D\\fR, \\fB\\-W\\fR, \\fB\\-L\\fR,\n"
+                     "\\fB\\-N\\fR or \\fB\\-G\\fR and their arguments, maybe ended by \\fB\\--\\fR;\n"
+                     "the rest is the command, run with \\fBsh \\-c\\fR. Empty lines and lines starting\n"
+                     "with # are skipped. The other options given to ts apply to all the jobs, and\n"
+                     "ts prints the id of each job queued.\n"
+                     ".TP\n"
                      ".B \"\\-N [num]\"\n"
                      "Run the command only if there are \\fbnum\\fB slots free in the queue. Without it,\n"
                      "the job will run if there is one slot free. For example, if you use the\n"
                      "queue to feed cpu cores, and you know that a job will take two cores, with \\fB\\-N\\fB\n"
                      "you can let ts know that.\n"
                      ".TP\n"
+                     ".B \"\\-P/--priority <num>\"\n"
+                     "The priority of the job, 0 if not given; it may be negative. The jobs of a higher\n"
+                     "priority run before, and those of the same priority in the order they were queued.\n"
+                     "Look at \\fBTS_AGING\\fR for the jobs of a low priority to run at last.\n"
+                     ".TP\n"
+                     ".B \"\\--max_running <num>\"\n"
+                     "With \\fB\\-L\\fR, run at most \\fInum\\fR jobs of that label at once, 0 for no\n"
+                     "limit. The jobs of other labels run as if those waiting were not there. It\n"
+                     "changes the limit of the label for all its jobs, as\n"
+                     ".B \\--set_max_running\n"
+                     "does.\n"
+                     ".TP\n"
+                     ".B \"\\--runtime <time>\"\n"
+                     "The time the job takes at most, in seconds, or with \\fBm\\fR, \\fBh\\fR or \\fBd\\fR\n"
+                     "after for minutes, hours or days. The first job that waits for more slots than\n"
+                     "there are free keeps them for when the running jobs should end. Until then, the\n"
+                     "jobs after it only run if they should end before, or if they take slots it will\n"
+                     "not need. Without \\fB\\--runtime\\fR, a job with a label is taken to last\n"
+                     "as the last one of its label that was not killed.\n"
+                     ".TP\n"
+                     ".B \"\\--res <name=num,...>\"\n"
+                     "The resources the job takes while it runs, as \\fBmem=16G,license=1\\fR: any\n"
+                     "names, with amounts that may end in \\fBK\\fR, \\fBM\\fR, \\fBG\\fR or \\fBT\\fR (of 1024).\n"
+                     "The job waits until all of them fit in what the server has of each, set with\n"
+                     ".B \\--set_res\n"
+                     "or \\fBTS_RESOURCES\\fR. A resource without an amount is only counted.\n"
+                     ".TP\n"
                      "\n"
                      ".SH ACTIONS\n"
                      "Instead of giving a new command, we can use the parameters for other purposes:\n"
@@ -585,6 +777,14 @@ int main() {
                      "This is the default behaviour if\n"
                      ".B ts\n"
                      "is called without options.\n"
+                     "The server can leave jobs out of the list, with \\fB\\--state\\fR and a list\n"
+                     "of states (queued, allocating, running, finished, skipped), \\fB\\--ids\\fR and a range\n"
+                     "of ids (id, id-id or id-), \\fB\\--since\\fR and \\fB\\--until\\fR and the seconds of\n"
+                     "the epoch when the jobs were enqueued (negative ones go back from now), and\n"
+                     "\\fB\\-L\\fR and a label. Of the jobs left, \\fB\\--offset [num]\\fR skips the first\n"
+                     "num and \\fB\\--limit [num]\\fR lists num at most. \\fB\\--format tsv\\fR lists\n"
+                     "the raw fields of the jobs separated by tabs, after a line with their names,\n"
+                     "and \\fB\\--format json\\fR as a JSON object per line.\n"
                      ".TP\n"
                      ".B \"\\-q/--last_queue_id\"\n"
                      "Show the job ID of the last added.\n"
@@ -604,6 +804,30 @@ int main() {
                      ".B \"\\--get_logdir [path]\"\n"
                      "Set the path containing log files to the specified path.\n"
                      ".TP\n"
+                     ".B \"\\--upgrade\"\n"
+                     "The server executes this ts in its place. The new server keeps the jobs,\n"
+                     "those running included, and the connected clients.\n"
+                     ".TP\n"
+                     ".B \"\\--set_priority <id=num>\"\n"
+                     "Change the priority of a job in the queue, as given with\n"
+                     ".B \\-P.\n"
+                     "\\fBts \\-i\\fR shows it.\n"
+                     ".TP\n"
+                     ".B \"\\--set_max_running <label=num>\"\n"
+                     "Run at most \\fInum\\fR jobs of the label at once, 0 for no limit, as with\n"
+                     ".B \\--max_running.\n"
+                     "The server keeps it across\n"
+                     ".B \\--upgrade\n"
+                     "and, with \\fBTS_JOURNAL\\fR, a restart. \\fBts \\-i\\fR shows it for the jobs of the label.\n"
+                     ".TP\n"
+                     ".B \"\\--set_res <name=num,...>\"\n"
+                     "Set the amounts the server has of the resources for\n"
+                     ".B \\--res.\n"
+                     "Those not named keep theirs. The header of \\fBts \\-l\\fR shows what the\n"
+                     "running jobs take of each, after the slots. The server keeps them across\n"
+                     ".B \\--upgrade\n"
+                     "and, with \\fBTS_JOURNAL\\fR, a restart.\n"
+                     ".TP\n"
                      ".B \"\\-t [id]\"\n"
                      "Show the last ten lines of the output file of the named job, or the last\n"
                      "running/run if not specified. If the job is still running, it will keep on\n"
@@ -640,7 +864,8 @@ int main() {
                      ".TP\n"
                      ".B \"\\-u [id]\"\n"
                      "Make the named job (or the last in the queue) urgent - this means that it goes\n"
-                     "forward in the queue so it can run as soon as possible.\n"
+                     "forward in the queue so it can run as soon as possible, before the others of its\n"
+                     "priority.\n"
                      ".TP\n"
                      ".B \"\\-i [id]\"\n"
                      "Show information about the named job (or the last run). It will show the command line,\n"
@@ -649,7 +874,7 @@ int main() {
                      ".TP\n"
                      ".B \"\\-U <id-id>\"\n"
                      "Interchange the queue positions of the named jobs (separated by a hyphen and no\n"
-                     "spaces).\n"
+                     "spaces), and their priorities.\n"
                      ".TP\n"
                      ".B \"\\-h\"\n"
                      "Show help on standard output.\n"
@@ -687,12 +912,32 @@ int main() {
                      "option if you are tired of\n"
                      ".B \\-C.\n"
                      ".TP\n"
+                     ".B \"TS_MAXFINISHED_AGE\"\n"
+                     "Seconds a job result stays in the queue after the job finishes; with a suffix\n"
+                     "m, h or d, minutes, hours or days.\n"
+                     ".TP\n"
+                     ".B \"TS_MAXFINISHED_MEM\"\n"
+                     "Limit the memory the server takes for the job results, in bytes, or with a\n"
+                     "suffix K, M or G. The last result always stays.\n"
+                     ".TP\n"
+                     ".B \"TS_HISTORY\"\n"
+                     "File where the job results go when they leave the queue, by the limits above or\n"
+                     ".B \\-C.\n"
+                     "Those still answer\n"
+                     ".B \\-i, \\-s, \\-w, \\-o\n"
+                     "and the dependencies on them. The server keeps an index of them in\n"
+                     "TS_HISTORY.idx.\n"
+                     ".TP\n"
                      ".B \"TS_MAXCONN\"\n"
                      "The maximum number of ts server connections to clients. This will make the ts clients\n"
                      "block until connections are freed. This helps, for example, on systems with a limited\n"
                      "number of processes, because each job waiting in the queue remains as a process. This\n"
                      "variable has to be set at server start, and cannot be modified later.\n"
                      ".TP\n"
+                     ".B \"TS_SERVER_EXEC\"\n"
+                     "If the variable exists, the jobs are queued as with\n"
+                     ".B \\--server_exec.\n"
+                     ".TP\n"
                      ".B \"TS_ONFINISH\"\n"
                      "If the variable exists pointing to an executable, it will be run by the client\n"
                      "after the queued job. It uses execlp, so\n"
@@ -727,6 +972,16 @@ int main() {
                      "the first instance of\n"
                      ".B ts.\n"
                      ".TP\n"
+                     ".B \"TS_RESOURCES\"\n"
+                     "The amounts of the resources for the jobs at the start of the server, as\n"
+                     ".B \\--set_res\n"
+                     "takes them.\n"
+                     ".TP\n"
+                     ".B \"TS_AGING\"\n"
+                     "Seconds after which a job waiting in the queue gains a point of priority, and so on\n"
+                     "for as long as it waits, so the jobs of a low priority are not left behind\n"
+                     "forever. Read when the server starts; without it the priorities don't change.\n"
+                     ".TP\n"
                      ".B \"TS_MAILTO\"\n"
                      "Send the letters with job results to the address specified in this variable.\n"
                      "Otherwise, they are sent to\n"
@@ -752,6 +1007,13 @@ int main() {
                      "command run), on SIGTERM the queue status will be saved to the file pointed\n"
                      "by this environment variable - for example, at system shutdown.\n"
                      ".TP\n"
+                     ".B \"TS_JOURNAL\"\n"
+                     "If it is defined when starting the queue server, every change to the jobs\n"
+                     "is appended to the file pointed by it, and from time to time all of them are\n"
+                     "written to the same name ended in \\fB.snap\\fR. A new server started with the\n"
+                     "same value gets back the queue and the finished jobs, even after the last one\n"
+                     "was killed. The jobs that were running then are marked as killed.\n"
+                     ".TP\n"
                      ".B \"TS_ENV\"\n"
                      "This has a command to be run at enqueue time through\n"
                      "\\fB/bin/sh\\fR. The output of the command will be readable through the option\n"
@@ -6,110 +6,392 @@
 */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "main.h"
 
-void send_bytes(const int fd, const char *data, int bytes)
+/* Everything goes through write_out() and read_in(). By default they use
+ * the descriptor, but:
+ *  - while a capture of a descriptor is open, what is sent to it is kept
+ *    in memory, to go later in a frame (protocol v2). Captures nest.
+ *  - while an input of a descriptor is set, what is received from it comes
+ *    from memory: a whole request, which the server has already received.
+ * The client, once it agreed on v2 with the server, keeps its requests in
+ * a capture until it needs an answer, and reads the answers frame by frame,
+ * straight from the socket.
+ */
+
+enum {
+    MAX_CAPTURES = 4
+};
+
+struct Capture {
+    int fd;
+    char *data;
+    int size;
+    int alloc;
+};
+
+static struct Capture captures[MAX_CAPTURES];
+static int ncaptures;
+
+static struct {
+    int fd;
+    char *data;
+    int size;
+    int pos;
+} input = { -1, 0, 0, 0 };
+
+/* The client side of v2 */
+static int framed_fd = -1;
+static int next_request_id = 1;
+static int frame_left; /* Bytes of the current answer frame not read yet */
+static int frame_read; /* A frame was started, and no request sent since */
+
+static struct Capture *find_capture(int fd)
+{
+    int i;
+
+    for (i = ncaptures - 1; i >= 0; --i)
+        if (captures[i].fd == fd)
+            return &captures[i];
+    return 0;
+}
+
+static void write_fd(int fd, const char *data, int bytes)
 {
     int res;
-    int offset = 0;
 
-    while(1)
+    while (bytes > 0)
     {
-        res = send(fd, data + offset, bytes, 0);
-        if(res == -1)
+        res = write(fd, data, bytes);
+        if (res == -1)
         {
+            if (errno == EINTR)
+                continue;
             warning("Sending %i bytes to %i.", bytes, fd);
             break;
         }
-        if(res == bytes)
-            break;
-        offset += res;
+        data += res;
         bytes -= res;
     }
 }
 
-int recv_bytes(const int fd, char *data, int bytes)
+static void capture_append(struct Capture *c, const char *data, int bytes)
+{
+    if (c->size + bytes > c->alloc)
+    {
+        while (c->size + bytes > c->alloc)
+            c->alloc = c->alloc ? 2 * c->alloc : 4096;
+        c->data = (char *) realloc(c->data, c->alloc);
+        if (c->data == 0)
+            error("Cannot allocate %i bytes for a message frame", c->alloc);
+    }
+    memcpy(c->data + c->size, data, bytes);
+    c->size += bytes;
+}
+
+static void write_out(int fd, const char *data, int bytes)
+{
+    struct Capture *c;
+
+    if (bytes <= 0)
+        return;
+
+    /* A new request of the client */
+    if (fd == framed_fd && find_capture(fd) == 0)
+        msg_capture_begin(fd);
+
+    c = find_capture(fd);
+    if (c != 0)
+        capture_append(c, data, bytes);
+    else
+        write_fd(fd, data, bytes);
+}
+
+/* Exactly 'bytes' bytes from the descriptor. Returns them, 0 on the end of
+ * file before any, or -1 */
+static int read_fd(int fd, char *data, int bytes)
 {
     int res;
     int offset = 0;
 
-    while(1)
+    while (offset < bytes)
     {
-        res = recv(fd, data + offset, bytes, 0);
-        if(res == -1)
+        res = recv(fd, data + offset, bytes - offset, 0);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res == -1)
         {
             warning("Receiving %i bytes from %i.", bytes, fd);
-            break;
+            return -1;
         }
-        if(res == bytes)
-            break;
+        if (res == 0)
+            return offset == 0 ? 0 : -1;
         offset += res;
-        bytes -= res;
     }
+    return offset;
+}
 
-    return res;
+/* The header of the next non-empty frame of the server. 0 on the end of
+ * file */
+static int read_frame_header(int fd)
+{
+    struct Frame_header h;
+    int res;
+
+    do
+    {
+        res = read_fd(fd, (char *) &h, sizeof(h));
+        if (res <= 0)
+            return res;
+        if (h.size < 0)
+        {
+            warning("Wrong frame of %i bytes from %i.", h.size, fd);
+            return -1;
+        }
+    } while (h.size == 0);
+
+    frame_left = h.size;
+    frame_read = 1;
+    return 1;
 }
 
-void send_msg(const int fd, const struct Msg *m)
+static int read_in(int fd, char *data, int bytes)
 {
     int res;
 
+    if (fd == input.fd)
+    {
+        if (bytes > input.size - input.pos)
+        {
+            if (input.pos == input.size)
+                return 0;
+            warning("Receiving %i bytes from %i, past the end of its request.",
+                    bytes, fd);
+            return -1;
+        }
+        memcpy(data, input.data + input.pos, bytes);
+        input.pos += bytes;
+        return bytes;
+    }
+
+    if (fd != framed_fd)
+        return read_fd(fd, data, bytes);
+
+    msg_flush(fd);
+    if (frame_left == 0)
+    {
+        res = read_frame_header(fd);
+        if (res <= 0)
+            return res;
+    }
+    if (bytes > frame_left)
+    {
+        warning("Receiving %i bytes from %i, past the end of its frame.",
+                bytes, fd);
+        return -1;
+    }
+    res = read_fd(fd, data, bytes);
+    if (res > 0)
+        frame_left -= res;
+    return res;
+}
+
+void send_bytes(const int fd, const char *data, int bytes)
+{
+    write_out(fd, data, bytes);
+}
+
+int recv_bytes(const int fd, char *data, int bytes)
+{
+    if (bytes <= 0)
+        return 0;
+    return read_in(fd, data, bytes);
+}
+
+void send_msg(const int fd, const struct Msg *m)
+{
     if (0)
         msgdump(stderr, m);
-    res = send(fd, m, sizeof(*m), 0);
-    if(res == -1 || res != sizeof(*m))
-        warning_msg(m, "Sending a message to %i, sent %i bytes, should "
-                "send %i.", fd,
-                res, sizeof(*m));
+
+    /* Each message of the client starts a new request */
+    if (fd == framed_fd)
+        msg_flush(fd);
+    write_out(fd, (const char *) m, sizeof(*m));
 }
 
 int recv_msg(const int fd, struct Msg *m)
 {
     int res;
 
-    res = recv(fd, m, sizeof(*m), 0);
-    if(res == -1)
+    res = read_in(fd, (char *) m, sizeof(*m));
+    if (res == -1)
         warning_msg(m, "Receiving a message from %i.", fd);
     if (res == sizeof(*m) && 0)
         msgdump(stderr, m);
-    if (res != sizeof(*m) && res > 0)
-        warning_msg(m, "Receiving a message from %i, received %i bytes, "
-                "should have received %i.", fd,
-                res, sizeof(*m));
 
     return res;
 }
 
 void send_ints(const int fd, const int* data, int num) {
-    int res;
-    res = write(fd, &num, sizeof(int));
-    if (res == -1)
-        warning("Sending to %i.", fd);
-
-    if (num) {
-        res = write(fd, data, num * sizeof(int));
-        if (res == -1)
-            warning("Sending %i bytes to %i.", num * sizeof(int), fd);
-    }
+    write_out(fd, (const char *) &num, sizeof(int));
+    if (num)
+        write_out(fd, (const char *) data, num * sizeof(int));
 }
 
 int *recv_ints(const int fd, int *num) {
     int res;
-    res = read(fd, num, sizeof(int));
-    if (res == -1)
+    int *data = 0;
+
+    *num = 0;
+    res = read_in(fd, (char *) num, sizeof(int));
+    if (res != sizeof(int)) {
         warning("Receiving from %i.", fd);
+        *num = 0;
+        return 0;
+    }
 
-    int *data = 0;
-    if (*num) {
+    if (*num > 0) {
         data = (int *) malloc(*num * sizeof(int));
-        res = read(fd, data, sizeof(int) * *num);
-        if (res == -1)
+        if (data == 0)
+            error("Cannot allocate %i ints from %i", *num, fd);
+        res = read_in(fd, (char *) data, sizeof(int) * *num);
+        if (res != (int) sizeof(int) * *num)
             warning("Receiving %i bytes from %i.", sizeof(int) * *num, fd);
     }
     return data;
 }
+
+/* Up to 'bytes' of an answer that ends with the connection (v1) or with
+ * its frame (v2). 0 at its end */
+int recv_stream(int fd, char *data, int bytes)
+{
+    int res;
+
+    if (fd == framed_fd)
+    {
+        msg_flush(fd);
+        if (frame_left == 0)
+            return 0;
+        if (bytes > frame_left)
+            bytes = frame_left;
+    }
+
+    do
+        res = recv(fd, data, bytes, 0);
+    while (res == -1 && errno == EINTR);
+    if (res > 0 && fd == framed_fd)
+        frame_left -= res;
+    return res;
+}
+
+/* Whether the answer to the last request of the client ended: the frame
+ * read for it is over. Only in v2, where the server doesn't close the
+ * connection to mark the end of a list */
+int msg_frame_done(int fd)
+{
+    return fd == framed_fd && frame_read && frame_left == 0;
+}
+
+void send_frame(int fd, int request_id, const char *body, int size)
+{
+    struct Frame_header h;
+    struct iovec iov[2];
+    int res;
+    int total;
+
+    h.size = size;
+    h.request_id = request_id;
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    iov[1].iov_base = (void *) body;
+    iov[1].iov_len = size;
+    total = sizeof(h) + size;
+
+    do
+        res = writev(fd, iov, 2);
+    while (res == -1 && errno == EINTR);
+    if (res == -1)
+    {
+        warning("Sending a frame of %i bytes to %i.", size, fd);
+        return;
+    }
+
+    /* The rest, if the socket didn't take it all at once */
+    if (res < total)
+    {
+        if (res < (int) sizeof(h))
+        {
+            write_fd(fd, (const char *) &h + res, sizeof(h) - res);
+            res = sizeof(h);
+        }
+        write_fd(fd, body + (res - sizeof(h)), total - res);
+    }
+}
+
+void msg_capture_begin(int fd)
+{
+    struct Capture *c;
+
+    if (ncaptures == MAX_CAPTURES)
+        error("Too many nested message frames");
+    c = &captures[ncaptures++];
+    c->fd = fd;
+    c->size = 0;
+}
+
+/* What was sent to fd since its capture began. It is valid until the
+ * next capture begins */
+char *msg_capture_end(int fd, int *size)
+{
+    struct Capture *c;
+
+    if (ncaptures == 0 || captures[ncaptures - 1].fd != fd)
+        error("Ending the message frame of %i, which is not the last", fd);
+    c = &captures[--ncaptures];
+    *size = c->size;
+    return c->data;
+}
+
+/* Receive from memory what comes from fd */
+void msg_input_begin(int fd, char *data, int size)
+{
+    input.fd = fd;
+    input.data = data;
+    input.size = size;
+    input.pos = 0;
+}
+
+void msg_input_end()
+{
+    input.fd = -1;
+    input.data = 0;
+}
+
+/* The client and the server agreed on v2 for fd */
+void msg_set_framed(int fd)
+{
+    framed_fd = fd;
+    frame_left = 0;
+    frame_read = 0;
+}
+
+/* Send the request the client has been gathering, in one frame */
+void msg_flush(int fd)
+{
+    char *body;
+    int size;
+
+    if (fd != framed_fd || find_capture(fd) == 0)
+        return;
+    body = msg_capture_end(fd, &size);
+    send_frame(fd, next_request_id++, body, size);
+    frame_read = 0;
+}
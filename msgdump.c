@@ -20,6 +20,11 @@ void msgdump(FILE *f, const struct Msg *m)
             fprintf(f, " NEWJOB\n");
             fprintf(f, " Commandsize: %i\n", m->u.newjob.command_size);
             break;
+        case NEWJOB_BATCH:
+            fprintf(f, " NEWJOB_BATCH\n");
+            fprintf(f, " Jobs: %i\n", m->u.newjob.batch_count);
+            fprintf(f, " Payloadsize: %i\n", m->u.newjob.batch_size);
+            break;
         case NEWJOB_OK:
             fprintf(f, " NEWJOB_OK\n");
             fprintf(f, " JobID: '%i'\n", m->u.jobid);
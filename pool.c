@@ -0,0 +1,201 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "main.h"
+
+/* The memory of the jobs: the struct Job and what doesn't change once it
+ * is queued (command, label, dependencies, GPU ids, exec info).
+ * It comes from slabs, each one cut in pieces of one size class. A freed
+ * piece goes to the free list of its slab, and is taken again before the
+ * room never used; so the jobs that stay long (running, or kept finished)
+ * don't keep the rest of their slab unused. A slab whose pieces are all
+ * free, as many are after s_clear_finished(), goes back to the system
+ * whole, instead of leaving holes all over the heap.
+ * Each piece has its slab just before it. Those larger than the largest
+ * class are malloc'd on their own. */
+
+enum {
+    POOL_SLAB_SIZE = 256 * 1024,
+    POOL_GRAIN = 16, /* Of the sizes of the classes */
+    POOL_LARGEST = 8192 /* Class, header included */
+};
+
+struct Pool_slab {
+    struct Pool_slab *next; /* In the slabs of the class with free room */
+    struct Pool_slab *prev;
+    void *free; /* Pieces freed, each pointing to the next */
+    int used; /* Bytes of data ever cut in pieces */
+    int live; /* Pieces given and not freed */
+    int size_class;
+    int in_list;
+};
+
+union Pool_header {
+    struct Pool_slab *slab; /* 0 if malloc'd on its own */
+    long long align_ll;
+    double align_d;
+};
+
+/* From 16 to 128 by 16, then four classes every time the size doubles:
+ * a piece wastes less than a quarter of it */
+static int class_size[40];
+static int nclasses;
+static unsigned char class_of_grains[POOL_LARGEST / POOL_GRAIN + 1];
+static struct Pool_slab *partial[40];
+static int slabs;
+static int slabs_made;
+
+static void init_classes() {
+    int size = POOL_GRAIN;
+    int step = POOL_GRAIN;
+    int grains;
+    int c = 0;
+
+    while (size <= POOL_LARGEST) {
+        class_size[nclasses++] = size;
+        if (size >= 8 * step)
+            step *= 2;
+        size += step;
+    }
+    for (grains = 0; grains <= POOL_LARGEST / POOL_GRAIN; ++grains) {
+        while (class_size[c] < grains * POOL_GRAIN)
+            ++c;
+        class_of_grains[grains] = c;
+    }
+
+#ifdef M_MMAP_THRESHOLD
+    /* Slabs mapped apart, so a free one is given back to the system.
+     * Otherwise glibc raises the threshold after the first is freed */
+    mallopt(M_MMAP_THRESHOLD, POOL_SLAB_SIZE);
+#endif
+}
+
+static char *slab_data(struct Pool_slab *s) {
+    return (char *) s + (sizeof(*s) + POOL_GRAIN - 1) / POOL_GRAIN * POOL_GRAIN;
+}
+
+static void list_add(struct Pool_slab *s) {
+    s->prev = 0;
+    s->next = partial[s->size_class];
+    if (s->next)
+        s->next->prev = s;
+    partial[s->size_class] = s;
+    s->in_list = 1;
+}
+
+static void list_del(struct Pool_slab *s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        partial[s->size_class] = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->in_list = 0;
+}
+
+static struct Pool_slab *new_slab(int size_class) {
+    struct Pool_slab *s;
+
+    s = (struct Pool_slab *) malloc(POOL_SLAB_SIZE);
+    if (s == 0)
+        error("Cannot allocate a slab of %i bytes for the jobs", POOL_SLAB_SIZE);
+    s->free = 0;
+    s->used = 0;
+    s->live = 0;
+    s->size_class = size_class;
+    list_add(s);
+    ++slabs;
+    ++slabs_made;
+    return s;
+}
+
+void *pool_alloc(int size) {
+    int need = size + sizeof(union Pool_header);
+    union Pool_header *h;
+    struct Pool_slab *s;
+    int c;
+
+    if (nclasses == 0)
+        init_classes();
+
+    if (need > POOL_LARGEST) {
+        h = (union Pool_header *) malloc(need);
+        if (h == 0)
+            error("Cannot allocate %i bytes for a job", size);
+        h->slab = 0;
+        return h + 1;
+    }
+
+    c = class_of_grains[(need + POOL_GRAIN - 1) / POOL_GRAIN];
+    s = partial[c];
+    if (s == 0)
+        s = new_slab(c);
+
+    if (s->free) {
+        h = (union Pool_header *) s->free;
+        s->free = *(void **) s->free;
+    } else {
+        h = (union Pool_header *) (slab_data(s) + s->used);
+        s->used += class_size[c];
+    }
+    ++s->live;
+    if (s->free == 0
+        && slab_data(s) + s->used + class_size[c] > (char *) s + POOL_SLAB_SIZE)
+        list_del(s);
+
+    h->slab = s;
+    return h + 1;
+}
+
+/* size bytes of data, and a '\0' after them */
+char *pool_copy(const char *data, int size) {
+    char *str = (char *) pool_alloc(size + 1);
+
+    memcpy(str, data, size);
+    str[size] = '\0';
+    return str;
+}
+
+void pool_free(void *ptr) {
+    union Pool_header *h;
+    struct Pool_slab *s;
+
+    if (ptr == 0)
+        return;
+    h = (union Pool_header *) ptr - 1;
+    s = h->slab;
+    if (s == 0) {
+        free(h);
+        return;
+    }
+
+    --s->live;
+    if (s->live == 0 && (partial[s->size_class] != s || s->next != 0)) {
+        /* Unless it is the only one with room in its class */
+        if (s->in_list)
+            list_del(s);
+        free(s);
+        --slabs;
+        return;
+    }
+    *(void **) h = s->free;
+    s->free = h;
+    if (!s->in_list)
+        list_add(s);
+}
+
+/* Slabs alive, and made since the start */
+void pool_stats(int *alive, int *made) {
+    *alive = slabs;
+    *made = slabs_made;
+}
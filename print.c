@@ -19,7 +19,6 @@ int fd_nprintf(int fd, int maxsize, const char *fmt, ...)
     va_list ap;
     char *out;
     int size;
-    int rest;
 
     va_start(ap, fmt);
 
@@ -31,19 +30,11 @@ int fd_nprintf(int fd, int maxsize, const char *fmt, ...)
     }
 
     size = vsnprintf(out, maxsize, fmt, ap);
+    if (size >= maxsize)
+        size = maxsize - 1;
 
-    rest = size; /* We don't want the last null character */
-    while (rest > 0)
-    {
-        int res;
-        res = write(fd, out, rest);
-        if (res == -1)
-        {
-            warning("Cannot write more chars in pinfo_dump");
-            break;
-        }
-        rest -= res;
-    }
+    /* We don't want the last null character */
+    send_bytes(fd, out, size);
 
     free(out);
 
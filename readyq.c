@@ -0,0 +1,178 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdlib.h>
+#include <time.h>
+
+#include "main.h"
+
+/* The jobs that could run as soon as they fit in the free slots, kept in a
+ * binary heap by their priority, and then by their place in the queue
+ * (queue_pos). Each job knows its place in the heap (ready_index), so it
+ * can leave or move in O(log n).
+ * The heap has the key of each job next to it: the comparisons don't go
+ * to the jobs, only the moves do, to tell them their new place.
+ * With TS_AGING, a job gains a point of priority for each so many seconds
+ * it waits. The points come at the same ticks of the clock for all, so
+ * they don't change the order of the jobs already waiting: the key is the
+ * priority less the ticks before the job started to wait, and it is the
+ * same all the time the job is in the heap. */
+
+struct Ready {
+    long long rank; /* Higher first */
+    int queue_pos;
+    struct Job *job;
+};
+
+static struct Ready *heap;
+static int heap_size;
+static int heap_alloc;
+static int aging; /* Seconds for a point of priority; 0 for none */
+static int timed; /* Jobs in the heap that may know how long they take */
+
+void readyq_init() {
+    char *str = getenv("TS_AGING");
+
+    aging = str != NULL ? abs(atoi(str)) : 0;
+}
+
+/* Told with --runtime, or it may be that of the last job of its label */
+static int may_be_timed(const struct Job *p) {
+    return p->runtime > 0 || p->label != 0;
+}
+
+static long long rank(const struct Job *p) {
+    if (aging == 0)
+        return p->priority;
+    return p->priority - (long long) p->waiting_since / aging;
+}
+
+/* The priority of p with the points of its aging, as of now */
+int readyq_priority(const struct Job *p) {
+    if (aging == 0 || (p->state != QUEUED && p->state != ALLOCATING
+                       && p->state != HOLDING_CLIENT))
+        return p->priority;
+    return rank(p) + (long long) time(NULL) / aging;
+}
+
+static int before(const struct Ready *a, const struct Ready *b) {
+    if (a->rank != b->rank)
+        return a->rank > b->rank;
+    return a->queue_pos < b->queue_pos;
+}
+
+/* Whether a runs before b, as in the heap */
+int readyq_before(const struct Job *a, const struct Job *b) {
+    struct Ready ra, rb;
+
+    ra.rank = rank(a);
+    ra.queue_pos = a->queue_pos;
+    rb.rank = rank(b);
+    rb.queue_pos = b->queue_pos;
+    return before(&ra, &rb);
+}
+
+static void place(int i, struct Ready r) {
+    heap[i] = r;
+    r.job->ready_index = i;
+}
+
+static void sift_up(int i) {
+    struct Ready r = heap[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!before(&r, &heap[parent]))
+            break;
+        place(i, heap[parent]);
+        i = parent;
+    }
+    place(i, r);
+}
+
+static void sift_down(int i) {
+    struct Ready r = heap[i];
+
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= heap_size)
+            break;
+        if (child + 1 < heap_size && before(&heap[child + 1], &heap[child]))
+            ++child;
+        if (!before(&heap[child], &r))
+            break;
+        place(i, heap[child]);
+        i = child;
+    }
+    place(i, r);
+}
+
+void readyq_add(struct Job *p) {
+    if (p->ready_index != -1)
+        return;
+
+    if (heap_size == heap_alloc) {
+        heap_alloc = heap_alloc ? 2 * heap_alloc : 64;
+        heap = (struct Ready *) realloc(heap, heap_alloc * sizeof(*heap));
+        if (heap == 0)
+            error("Cannot allocate the ready queue of %i jobs", heap_alloc);
+    }
+    heap[heap_size].rank = rank(p);
+    heap[heap_size].queue_pos = p->queue_pos;
+    heap[heap_size].job = p;
+    sift_up(heap_size++);
+    if (may_be_timed(p))
+        ++timed;
+}
+
+void readyq_remove(struct Job *p) {
+    int i = p->ready_index;
+
+    if (i == -1)
+        return;
+
+    p->ready_index = -1;
+    if (may_be_timed(p))
+        --timed;
+    if (i == --heap_size)
+        return;
+    place(i, heap[heap_size]);
+    readyq_moved(heap[i].job);
+}
+
+/* After a change of p->queue_pos, its priority or its waiting_since */
+void readyq_moved(struct Job *p) {
+    int i = p->ready_index;
+
+    if (i == -1)
+        return;
+    heap[i].rank = rank(p);
+    heap[i].queue_pos = p->queue_pos;
+    if (i > 0 && before(&heap[i], &heap[(i - 1) / 2]))
+        sift_up(i);
+    else
+        sift_down(i);
+}
+
+/* The first ready job, out of the ready queue; 0 if none */
+struct Job *readyq_pop() {
+    struct Job *p;
+
+    if (heap_size == 0)
+        return 0;
+    p = heap[0].job;
+    readyq_remove(p);
+    return p;
+}
+
+int readyq_size() {
+    return heap_size;
+}
+
+/* Of them, those that may have a runtime for the backfill */
+int readyq_timed() {
+    return timed;
+}
@@ -0,0 +1,255 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+
+/* The named resources the jobs take besides the slots and the GPUs, as
+ * 'ts --res mem=16G,license=1' tells: a name, and an amount that may end
+ * in K, M, G or T (of 1024). Each resource has a capacity, from
+ * TS_RESOURCES or --set_res, and the amount the running jobs take; a job
+ * only starts when all of its resources fit. Those without a capacity
+ * are only counted. They are few: the jobs keep the index of each in the
+ * table, which only grows. Each has the list of the jobs that wait for
+ * it, which stays where it is. */
+
+struct Resource {
+    char *name;
+    long long capacity; /* -1 if not set */
+    long long used;
+    struct Parked waiting;
+};
+
+static struct Resource **table;
+static int table_count;
+static int table_alloc;
+
+static const char suffixes[] = "KMGT";
+
+static int name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+           || (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.';
+}
+
+/* The name=amount at *str, and *str after it and its comma. 0 if wrong */
+static int next_item(const char **str, const char **name, int *name_len,
+                     long long *amount) {
+    const char *p = *str;
+    const char *suffix;
+    char *end;
+
+    *name = p;
+    while (name_char(*p))
+        ++p;
+    *name_len = p - *name;
+    if (*name_len == 0 || *p != '=' || p[1] < '0' || p[1] > '9')
+        return 0;
+    *amount = strtoll(p + 1, &end, 10);
+    if (*end != '\0' && (suffix = strchr(suffixes, *end)) != NULL) {
+        int i;
+
+        for (i = 0; i <= suffix - suffixes; ++i) {
+            if (*amount > (1LL << 53))
+                return 0;
+            *amount *= 1024;
+        }
+        ++end;
+    }
+    if (*end == ',' && end[1] != '\0')
+        ++end;
+    else if (*end != '\0')
+        return 0;
+    *str = end;
+    return 1;
+}
+
+/* Whether spec is a good list of name=amount */
+int resources_check(const char *spec) {
+    const char *name;
+    int len;
+    long long amount;
+
+    while (*spec != '\0')
+        if (!next_item(&spec, &name, &len, &amount))
+            return 0;
+    return 1;
+}
+
+static int find(const char *name, int len) {
+    struct Resource *r;
+    int i;
+
+    for (i = 0; i < table_count; ++i)
+        if (strncmp(table[i]->name, name, len) == 0 && table[i]->name[len] == '\0')
+            return i;
+
+    if (table_count == table_alloc) {
+        table_alloc = table_alloc ? 2 * table_alloc : 8;
+        table = (struct Resource **) realloc(table, table_alloc * sizeof(*table));
+        if (table == 0)
+            error("Cannot allocate %i resources", table_alloc);
+    }
+    r = (struct Resource *) malloc(sizeof(*r));
+    if (r != 0)
+        r->name = (char *) malloc(len + 1);
+    if (r == 0 || r->name == 0)
+        error("Cannot allocate the resource %.*s", len, name);
+    memcpy(r->name, name, len);
+    r->name[len] = '\0';
+    r->capacity = -1;
+    r->used = 0;
+    r->waiting.first = 0;
+    r->waiting.last = 0;
+    table[i] = r;
+    return table_count++;
+}
+
+/* The capacities of spec. 0 if it is wrong, and then nothing changes */
+int resources_set(const char *spec) {
+    const char *name;
+    int len;
+    long long amount;
+
+    if (!resources_check(spec))
+        return 0;
+    while (*spec != '\0') {
+        int i;
+
+        next_item(&spec, &name, &len, &amount);
+        i = find(name, len);
+        table[i]->capacity = amount;
+    }
+    return 1;
+}
+
+void resources_init() {
+    char *str = getenv("TS_RESOURCES");
+
+    if (str != NULL && !resources_set(str))
+        warning("Wrong value of TS_RESOURCES: %s", str);
+}
+
+/* The amounts of spec, for a job, in the memory of the jobs (pool.c).
+ * Null with *size 0 if none, or if spec is wrong */
+struct Res_amount *resources_of(const char *spec, int *size) {
+    struct Res_amount *res;
+    const char *s = spec;
+    const char *name;
+    int len;
+    long long amount;
+    int n = 0;
+
+    *size = 0;
+    if (spec == 0 || !resources_check(spec))
+        return 0;
+    while (*s != '\0') {
+        next_item(&s, &name, &len, &amount);
+        ++n;
+    }
+    if (n == 0)
+        return 0;
+
+    res = (struct Res_amount *) pool_alloc(n * sizeof(*res));
+    for (s = spec; *s != '\0'; ++*size) {
+        next_item(&s, &name, &len, &amount);
+        res[*size].resource = find(name, len);
+        res[*size].amount = amount;
+    }
+    return res;
+}
+
+/* The first resource of res that has no room for it now; -1 if all fit */
+int resources_short(const struct Res_amount *res, int size) {
+    int i;
+
+    for (i = 0; i < size; ++i) {
+        const struct Resource *r = table[res[i].resource];
+
+        if (r->capacity != -1 && r->used + res[i].amount > r->capacity)
+            return res[i].resource;
+    }
+    return -1;
+}
+
+/* What the jobs may take more of it; -1 if it has no capacity */
+long long resources_room(int resource) {
+    const struct Resource *r = table[resource];
+
+    if (r->capacity == -1)
+        return -1;
+    return r->used < r->capacity ? r->capacity - r->used : 0;
+}
+
+long long resources_capacity(int resource) {
+    return table[resource]->capacity;
+}
+
+int resources_count() {
+    return table_count;
+}
+
+struct Parked *resources_waiting(int resource) {
+    return &table[resource]->waiting;
+}
+
+/* A job takes them (sign 1), or gives them back (-1) */
+void resources_take(const struct Res_amount *res, int size, int sign) {
+    int i;
+
+    for (i = 0; i < size; ++i)
+        table[res[i].resource]->used += sign * res[i].amount;
+}
+
+static int print_amount(char *buf, int size, long long amount) {
+    int i = -1;
+
+    while (i < 3 && amount >= 1024 && amount % 1024 == 0) {
+        amount /= 1024;
+        ++i;
+    }
+    if (i == -1)
+        return snprintf(buf, size, "%lld", amount);
+    return snprintf(buf, size, "%lld%c", amount, suffixes[i]);
+}
+
+/* "name=used/capacity,..." of all, or "name=capacity,..." of those with
+ * one, as resources_set() takes it. Malloc'd; null if there are none */
+char *resources_text(int with_used) {
+    char *text;
+    int size = 0;
+    int pos = 0;
+    int i;
+
+    for (i = 0; i < table_count; ++i)
+        size += strlen(table[i]->name) + 2 * 24 + 3;
+    text = (char *) malloc(size + 1);
+    if (text == 0)
+        error("Cannot allocate the text of the resources");
+
+    for (i = 0; i < table_count; ++i) {
+        const struct Resource *r = table[i];
+
+        if (!with_used && r->capacity == -1)
+            continue;
+        pos += snprintf(text + pos, size + 1 - pos, "%s%s=",
+                        pos > 0 ? "," : "", r->name);
+        if (with_used) {
+            pos += print_amount(text + pos, size + 1 - pos, r->used);
+            if (r->capacity != -1)
+                pos += snprintf(text + pos, size + 1 - pos, "/");
+        }
+        if (r->capacity != -1)
+            pos += print_amount(text + pos, size + 1 - pos, r->capacity);
+    }
+    if (pos == 0) {
+        free(text);
+        return 0;
+    }
+    return text;
+}
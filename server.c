@@ -6,7 +6,14 @@
 */
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#else
+#include <poll.h>
+#endif
 
 #ifdef linux
 
@@ -28,9 +35,25 @@
 #include <stdio.h>
 
 #include "main.h"
+#include "version.h"
+
+enum {
+    MAXEVENTS = 256,
+    /* Bytes asked to recv() at least, for the input of a connection */
+    CONN_READ_SIZE = 64 * 1024,
+    /* A connection with more output than this waiting for the client to
+     * read it is not read from, until the client catches up */
+    CONN_OUTPUT_LIMIT = 1024 * 1024,
+    /* Buffers of a closed connection larger than this are not kept for the
+     * next connection in its slot */
+    CONN_BUFFER_KEEP = 1024 * 1024
+};
 
+/* What the event loop watches for, and reports, in a connection */
 enum {
-    MAXCONN = 1000
+    EV_READ = 1,
+    EV_WRITE = 2,
+    EV_HUP = 4
 };
 
 enum Break {
@@ -46,8 +69,14 @@ static void server_loop(int ls);
 
 static enum Break client_read(int index);
 
+static enum Break client_process_input(int index);
+
+static enum Break client_process(int index);
+
 static void end_server(int ls);
 
+static void send_newjob_ok(int s, int jobid);
+
 static void s_newjob_ok(int index);
 
 static void s_newjob_nok(int index);
@@ -56,26 +85,97 @@ static void s_runjob(int jobid, int index);
 
 static void clean_after_client_disappeared(int socket, int index);
 
+static void remove_connection(int index);
+
+static void conn_send_pending(int index);
+
+static void events_init();
+
+static void server_upgrade();
+
+/* socket is -1 for the slots in the free list. The generation is bumped
+ * every time a slot is reused, so a stale event of a closed connection is
+ * never delivered to the connection that took its slot.
+ * The sockets are non-blocking. What arrives is kept in 'in' until a whole
+ * request is there, and then handled from memory. What is sent goes to
+ * 'out' if the socket doesn't take it, until the client reads it. */
 struct Client_conn {
     int socket;
     int hasjob;
     int jobid;
+    unsigned int generation;
+    int next_free;
+    int framed; /* FRAMING_FRAMES agreed in GET_VERSION */
+    int framed_next; /* Agreed in the request being handled */
+    int in_request; /* Handling a request: answers are captured */
+    int request_id; /* Of the last request frame */
+    int job_request_id; /* Of the NEWJOB, for NEWJOB_OK and RUNJOB */
+    char *known[2]; /* Pinned by DATA_QUERY for the next job (intern.c) */
+    char *resources; /* Pinned by JOB_RESOURCES for the next job, the same */
+    char *in;
+    int in_size;
+    int in_alloc;
+    int in_need; /* Bytes to have in 'in' before parsing it again */
+    char *out;
+    int out_pos;
+    int out_size;
+    int out_alloc;
+    int closing; /* Close once 'out' is sent; v1 end of lines */
+    int watching; /* EV_READ and EV_WRITE, as set in the event loop */
+};
+
+/* What the event loop reports: index -1 is the listen socket,
+ * and -2 the notification of finished children (server_exec.c) */
+struct Ready_conn {
+    int index;
+    unsigned int generation;
+    int events;
 };
 
 /* Globals */
-static struct Client_conn client_cs[MAXCONN];
+static struct Client_conn *client_cs;
+static int client_cs_alloc;
+/* The index in client_cs of each socket, or -1 */
+static int *conn_of_fd;
+static int conn_of_fd_alloc;
+/* The connection of the ts client that runs each job; they move with
+ * client_cs */
+static struct Intmap conn_of_job;
+static int first_free_conn = -1;
 static int nconnections;
 static char *path;
 static int max_descriptors;
+static int listen_socket = -1;
+static int listening;
+/* ts --upgrade: the new ts to execute after this round, and who asked.
+ * The socket is -1 if that client left */
+static char *upgrade_path;
+static int upgrade_index;
+static unsigned int upgrade_generation;
+static int upgrade_socket = -1;
+static int upgrade_request_id;
+static int handover_generation; /* Of the journal */
+#ifdef USE_EPOLL
+static int epoll_fd;
+#else
+/* [0] is the listen socket, [1] the children notification */
+static struct pollfd *poll_fds;
+#endif
 
 /* in jobs.c */
 extern int max_jobs;
 
-static void s_send_version(int s) {
+static void s_send_version(int s, int framing) {
     struct Msg m = default_msg();
 
     m.type = VERSION;
-    m.u.version = PROTOCOL_VERSION;
+    m.u.version.version = PROTOCOL_VERSION;
+    /* The highest that both know */
+    if (framing > FRAMING_RESOURCES)
+        framing = FRAMING_RESOURCES;
+    else if (framing < FRAMING_FRAMES)
+        framing = FRAMING_STREAM;
+    m.u.version.framing = framing;
 
     send_msg(s, &m);
 }
@@ -136,7 +236,24 @@ static int get_max_descriptors() {
     int res;
     const char *str;
 
-    max = MAXCONN;
+    /* The connection table grows on demand, so the only real limit is the
+     * number of descriptors the system lets us open. Ask for all of it. */
+    res = getrlimit(RLIMIT_NOFILE, &rlim);
+    if (res != 0) {
+        warning("getrlimit for open files");
+        max = 1024 - MARGIN;
+    } else {
+        if (rlim.rlim_cur < rlim.rlim_max) {
+            rlim_t old_cur = rlim.rlim_cur;
+            rlim.rlim_cur = rlim.rlim_max;
+            if (setrlimit(RLIMIT_NOFILE, &rlim) != 0)
+                rlim.rlim_cur = old_cur;
+        }
+        if (rlim.rlim_cur == RLIM_INFINITY || rlim.rlim_cur > INT_MAX)
+            max = INT_MAX - MARGIN;
+        else
+            max = rlim.rlim_cur - MARGIN;
+    }
 
     str = getenv("TS_MAXCONN");
     if (str != NULL) {
@@ -146,20 +263,6 @@ static int get_max_descriptors() {
             max = user_maxconn;
     }
 
-    if (max > FD_SETSIZE)
-        max = FD_SETSIZE - MARGIN;
-
-    /* I'd like to use OPEN_MAX or NR_OPEN, but I don't know if any
-     * of them is POSIX compliant */
-
-    res = getrlimit(RLIMIT_NOFILE, &rlim);
-    if (res != 0)
-        warning("getrlimit for open files");
-    else {
-        if (max > rlim.rlim_cur)
-            max = rlim.rlim_cur - MARGIN;
-    }
-
     if (max < 1)
         error("Too few opened descriptors available");
 
@@ -192,6 +295,8 @@ void server_main(int notify_fd, char *_path) {
     ls = socket(AF_UNIX, SOCK_STREAM, 0);
     if (ls == -1)
         error("cannot create the listen socket in the server");
+    fcntl(ls, F_SETFD, FD_CLOEXEC);
+    listen_socket = ls;
 
     addr.sun_family = AF_UNIX;
     strcpy(addr.sun_path, path);
@@ -200,103 +305,383 @@ void server_main(int notify_fd, char *_path) {
     if (res == -1)
         error("Error binding.");
 
-    res = listen(ls, 0);
+    res = listen(ls, SOMAXCONN);
     if (res == -1)
         error("Error listening.");
 
     install_sigterm_handler();
 
+#ifndef CPU
+    initGPU();
+#endif
+
+    readyq_init();
+    resources_init();
+
+    /* The jobs of the last server, if it had a journal */
+    journal_open();
+    s_finished_init();
+
     set_default_maxslots();
 
     initialize_log_dir();
 
     notify_parent(notify_fd);
 
-#ifndef CPU
-    initGPU();
-#endif
-
+    events_init();
     server_loop(ls);
 }
 
 static int get_conn_of_jobid(int jobid) {
+    const struct Client_conn *c = intmap_get(&conn_of_job, jobid);
+
+    return c ? c - client_cs : -1;
+}
+
+static void conn_set_job(int index, int jobid) {
+    client_cs[index].jobid = jobid;
+    client_cs[index].hasjob = 1;
+    intmap_put(&conn_of_job, jobid, &client_cs[index]);
+}
+
+static void conn_drop_job(int index) {
+    if (client_cs[index].hasjob)
+        intmap_del(&conn_of_job, client_cs[index].jobid);
+    client_cs[index].hasjob = 0;
+}
+
+#ifdef USE_EPOLL
+static void events_init() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        error("Cannot create the epoll descriptor");
+}
+
+static void events_set_listen(int ls, int enable) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    if (epoll_ctl(epoll_fd, enable ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, ls, &ev) == -1)
+        error("epoll_ctl on the listen socket");
+}
+
+static void events_watch_children(int fd) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0xffffffffu; /* index -2 */
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        error("epoll_ctl on the children notification");
+}
+
+static void events_ctl(int index, int op, int watch) {
+    struct epoll_event ev;
+
+    ev.events = ((watch & EV_READ) ? EPOLLIN : 0)
+                | ((watch & EV_WRITE) ? EPOLLOUT : 0);
+    /* 0 is reserved for the listen socket */
+    ev.data.u64 = ((unsigned long long) client_cs[index].generation << 32)
+                  | (unsigned int) (index + 1);
+    if (epoll_ctl(epoll_fd, op, client_cs[index].socket, &ev) == -1)
+        error("epoll_ctl on the socket %i", client_cs[index].socket);
+}
+
+static void events_add(int index) {
+    events_ctl(index, EPOLL_CTL_ADD, EV_READ);
+}
+
+static void events_set(int index, int watch) {
+    events_ctl(index, EPOLL_CTL_MOD, watch);
+}
+
+static void events_del(int index) {
+    struct epoll_event ev; /* Non-null for kernels before 2.6.9 */
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_cs[index].socket, &ev);
+}
+
+static void events_resize(int old_alloc) {
+    (void) old_alloc; /* epoll needs no table of its own */
+}
+
+/* Returns the number of entries in 'ready', or -1 */
+static int events_wait(struct Ready_conn *ready, int timeout_ms) {
+    struct epoll_event evs[MAXEVENTS];
+    int i, n;
+
+    n = epoll_wait(epoll_fd, evs, MAXEVENTS, timeout_ms);
+    for (i = 0; i < n; ++i) {
+        ready[i].index = (int) (unsigned int) (evs[i].data.u64 & 0xffffffffu) - 1;
+        ready[i].generation = (unsigned int) (evs[i].data.u64 >> 32);
+        ready[i].events = ((evs[i].events & EPOLLIN) ? EV_READ : 0)
+                          | ((evs[i].events & EPOLLOUT) ? EV_WRITE : 0)
+                          | ((evs[i].events & (EPOLLHUP | EPOLLERR)) ? EV_HUP : 0);
+    }
+    return n;
+}
+
+static void events_end() {
+    close(epoll_fd);
+}
+#else
+static void events_init() {
+    poll_fds = (struct pollfd *) malloc(2 * sizeof(*poll_fds));
+    if (poll_fds == 0)
+        error("Cannot allocate the poll descriptors");
+    poll_fds[0].fd = -1;
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = -1;
+    poll_fds[1].events = POLLIN;
+}
+
+static void events_set_listen(int ls, int enable) {
+    poll_fds[0].fd = enable ? ls : -1;
+}
+
+static void events_watch_children(int fd) {
+    poll_fds[1].fd = fd;
+}
+
+static void events_add(int index) {
+    poll_fds[index + 2].fd = client_cs[index].socket;
+    poll_fds[index + 2].events = POLLIN;
+}
+
+static void events_set(int index, int watch) {
+    poll_fds[index + 2].events = ((watch & EV_READ) ? POLLIN : 0)
+                                 | ((watch & EV_WRITE) ? POLLOUT : 0);
+}
+
+static void events_del(int index) {
+    poll_fds[index + 2].fd = -1;
+}
+
+static void events_resize(int old_alloc) {
     int i;
-    for (i = 0; i < nconnections; ++i)
-        if (client_cs[i].hasjob && client_cs[i].jobid == jobid)
-            return i;
-    return -1;
+
+    poll_fds = (struct pollfd *) realloc(poll_fds,
+                                         (client_cs_alloc + 2) * sizeof(*poll_fds));
+    if (poll_fds == 0)
+        error("Cannot grow the poll descriptors to %i", client_cs_alloc);
+    for (i = old_alloc; i < client_cs_alloc; ++i)
+        poll_fds[i + 2].fd = -1;
+}
+
+static int events_wait(struct Ready_conn *ready, int timeout_ms) {
+    int i, n, res;
+
+    res = poll(poll_fds, client_cs_alloc + 2, timeout_ms);
+    if (res <= 0)
+        return res;
+
+    n = 0;
+    for (i = 0; i < client_cs_alloc + 2 && n < MAXEVENTS; ++i) {
+        if (poll_fds[i].fd != -1 && poll_fds[i].revents) {
+            short r = poll_fds[i].revents;
+
+            ready[n].index = (i < 2) ? -1 - i : i - 2;
+            ready[n].generation = (i < 2) ? 0 : client_cs[i - 2].generation;
+            ready[n].events = ((r & POLLIN) ? EV_READ : 0)
+                              | ((r & POLLOUT) ? EV_WRITE : 0)
+                              | ((r & (POLLHUP | POLLERR)) ? EV_HUP : 0);
+            ++n;
+        }
+    }
+    return n;
+}
+
+static void events_end() {
+    free(poll_fds);
+}
+#endif
+
+/* Returns the index of the new connection */
+static int add_connection(int cs) {
+    int index;
+
+    if (first_free_conn == -1) {
+        int i;
+        int old_alloc = client_cs_alloc;
+
+        client_cs_alloc = old_alloc ? old_alloc * 2 : 64;
+        client_cs = (struct Client_conn *) realloc(client_cs,
+                    client_cs_alloc * sizeof(*client_cs));
+        if (client_cs == 0)
+            error("Cannot grow the connection table to %i", client_cs_alloc);
+
+        /* Chain the new slots in the free list, in order */
+        for (i = old_alloc; i < client_cs_alloc; ++i) {
+            client_cs[i].socket = -1;
+            client_cs[i].generation = 0;
+            client_cs[i].next_free = (i + 1 < client_cs_alloc) ? i + 1 : -1;
+            client_cs[i].in = 0;
+            client_cs[i].in_alloc = 0;
+            client_cs[i].out = 0;
+            client_cs[i].out_alloc = 0;
+        }
+        first_free_conn = old_alloc;
+        events_resize(old_alloc);
+        for (i = 0; i < old_alloc; ++i)
+            if (client_cs[i].socket != -1 && client_cs[i].hasjob)
+                intmap_put(&conn_of_job, client_cs[i].jobid, &client_cs[i]);
+    }
+
+    index = first_free_conn;
+    first_free_conn = client_cs[index].next_free;
+
+    client_cs[index].socket = cs;
+    client_cs[index].hasjob = 0;
+    client_cs[index].framed = 0;
+    client_cs[index].framed_next = 0;
+    client_cs[index].in_request = 0;
+    client_cs[index].request_id = 0;
+    client_cs[index].job_request_id = 0;
+    client_cs[index].known[DATA_ENV] = 0;
+    client_cs[index].known[DATA_ENVP] = 0;
+    client_cs[index].resources = 0;
+    client_cs[index].in_size = 0;
+    client_cs[index].in_need = 0;
+    client_cs[index].out_pos = 0;
+    client_cs[index].out_size = 0;
+    client_cs[index].closing = 0;
+    client_cs[index].watching = EV_READ;
+    if (client_cs[index].in_alloc > CONN_BUFFER_KEEP) {
+        free(client_cs[index].in);
+        client_cs[index].in = 0;
+        client_cs[index].in_alloc = 0;
+    }
+    client_cs[index].generation++;
+    ++nconnections;
+
+    if (cs >= conn_of_fd_alloc) {
+        int i;
+        int old_alloc = conn_of_fd_alloc;
+
+        while (cs >= conn_of_fd_alloc)
+            conn_of_fd_alloc = conn_of_fd_alloc ? conn_of_fd_alloc * 2 : 64;
+        conn_of_fd = (int *) realloc(conn_of_fd,
+                                     conn_of_fd_alloc * sizeof(int));
+        if (conn_of_fd == 0)
+            error("Cannot grow the socket table to %i", conn_of_fd_alloc);
+        for (i = old_alloc; i < conn_of_fd_alloc; ++i)
+            conn_of_fd[i] = -1;
+    }
+    conn_of_fd[cs] = index;
+
+    events_add(index);
+    return index;
 }
 
 static void server_loop(int ls) {
-    fd_set readset;
+    struct Ready_conn ready[MAXEVENTS];
     int i;
-    int maxfd;
     int keep_loop = 1;
-    int newjob;
+    const int *newjobs;
+    int nrun;
     int res;
+
+    events_watch_children(server_exec_init());
+    /* Those that ended while a new ts was being executed */
+    server_exec_reap();
+    listening = 0;
+
     while (keep_loop) {
-        struct timeval tv;
+        /* If we can accept more connections, go on.
+         * Otherwise, the system block them (no accept will be done). */
+        if (listening != (nconnections < max_descriptors)) {
+            listening = !listening;
+            events_set_listen(ls, listening);
+        }
+
         /* Wait up to 30 secs before checking whether a job can run.
          * This is needed for GPU jobs because if GPUs are occupied and
          * released outside of `ts`, `ts` will not notice until new commands
-         * from users come. */
-        tv.tv_sec = 30;
-        tv.tv_usec = 0;
+         * from users come.
+         * timeout mode if there are queued GPU jobs only */
+        res = events_wait(ready, s_count_allocating_jobs() > 0 ? 30000 : -1);
 
-        FD_ZERO(&readset);
-        maxfd = 0;
-        /* If we can accept more connections, go on.
-         * Otherwise, the system block them (no accept will be done). */
-        if (nconnections < max_descriptors) {
-            FD_SET(ls, &readset);
-            maxfd = ls;
-        }
-        for (i = 0; i < nconnections; ++i) {
-            FD_SET(client_cs[i].socket, &readset);
-            if (client_cs[i].socket > maxfd)
-                maxfd = client_cs[i].socket;
-        }
+        /* The finished jobs too old, before anyone lists them */
+        s_expire_finished();
 
-        /* timeout mode if there are queued GPU jobs only */
-        if (s_count_allocating_jobs() > 0)
-            res = select(maxfd + 1, &readset, NULL, NULL, &tv);
-        else
-            res = select(maxfd + 1, &readset, NULL, NULL, NULL);
+        for (i = 0; i < res && keep_loop; ++i) {
+            int index = ready[i].index;
 
-        if (res != -1) {
-            if (FD_ISSET(ls, &readset)) {
+            if (index == -2) {
+                server_exec_reap();
+                continue;
+            }
+
+            if (index == -1) {
                 int cs;
                 cs = accept(ls, NULL, NULL);
                 if (cs == -1)
                     error("Accepting from %i", ls);
-                client_cs[nconnections].hasjob = 0;
-                client_cs[nconnections].socket = cs;
-                ++nconnections;
+                /* The jobs forked from this server must not inherit it */
+                fcntl(cs, F_SETFD, FD_CLOEXEC);
+                /* A client that doesn't read or write must not stop us */
+                fcntl(cs, F_SETFL, fcntl(cs, F_GETFL) | O_NONBLOCK);
+                add_connection(cs);
+                continue;
             }
-            for (i = 0; i < nconnections; ++i) {
-                if (FD_ISSET(client_cs[i].socket, &readset)) {
-                    enum Break b;
-                    b = client_read(i);
-                    /* Check if we should break */
-                    if (b == CLOSE) {
-                        warning("Closing");
-                        /* On unknown message, we close the client,
-                           or it may hang waiting for an answer */
-                        clean_after_client_disappeared(client_cs[i].socket, i);
-                    } else if (b == BREAK)
-                        keep_loop = 0;
+
+            /* Closed while handling an earlier event of this round */
+            if (client_cs[index].socket == -1
+                || client_cs[index].generation != ready[i].generation)
+                continue;
+
+            {
+                enum Break b = NOBREAK;
+
+                if (ready[i].events & EV_WRITE) {
+                    conn_send_pending(index);
+                    if (client_cs[index].socket == -1)
+                        continue;
+                    /* Requests received while the client didn't read */
+                    if ((client_cs[index].watching & EV_READ)
+                        && client_cs[index].in_size > 0)
+                        b = client_process_input(index);
                 }
+
+                if (b == NOBREAK && client_cs[index].socket != -1
+                    && client_cs[index].generation == ready[i].generation
+                    && (ready[i].events & (EV_READ | EV_HUP))) {
+                    /* Hung up while we didn't want to read from it */
+                    if (!(client_cs[index].watching & EV_READ))
+                        clean_after_client_disappeared(client_cs[index].socket,
+                                                       index);
+                    else
+                        b = client_read(index);
+                }
+                /* Check if we should break */
+                if (b == CLOSE && client_cs[index].socket != -1) {
+                    warning("Closing");
+                    /* On unknown message, we close the client,
+                       or it may hang waiting for an answer */
+                    clean_after_client_disappeared(client_cs[index].socket, index);
+                } else if (b == BREAK)
+                    keep_loop = 0;
             }
         }
 
-        /* This will return firstjob->jobid or -1 */
-        newjob = next_run_job();
-        if (newjob != -1) {
+        /* All the jobs that fit in the free slots, in this round: their
+         * RUNJOBs go one after the other, without waiting for the answers */
+        nrun = next_run_jobs(&newjobs);
+        if (nrun > 0) {
             int conn, awaken_job;
-            conn = get_conn_of_jobid(newjob);
-            /* This next marks the firstjob state to RUNNING */
-            s_mark_job_running(newjob);
-            s_runjob(newjob, conn);
+
+            for (i = 0; i < nrun; ++i) {
+                int newjob = newjobs[i];
+
+                /* This next marks the job state to RUNNING */
+                s_mark_job_running(newjob);
+                if (job_is_server_exec(newjob))
+                    s_exec_job(newjob);
+                else {
+                    conn = get_conn_of_jobid(newjob);
+                    s_runjob(newjob, conn);
+                }
+            }
 
             while ((awaken_job = wake_hold_client()) != -1) {
                 int wake_conn = get_conn_of_jobid(awaken_job);
@@ -305,12 +690,29 @@ static void server_loop(int ls) {
                 s_newjob_ok(wake_conn);
             }
         }
+
+        /* Before the answers of this round go, in the next */
+        journal_sync();
+
+        if (upgrade_path != 0)
+            server_upgrade();
     }
 
     end_server(ls);
 }
 
+/* For processes forked from the server that don't exec */
+void close_server_sockets() {
+    int i;
+
+    for (i = 0; i < client_cs_alloc; ++i)
+        if (client_cs[i].socket != -1)
+            close(client_cs[i].socket);
+    close(listen_socket);
+}
+
 static void end_server(int ls) {
+    events_end();
     close(ls);
     unlink(path);
     /* This comes from the parent, in the fork after server_main.
@@ -322,16 +724,259 @@ static void end_server(int ls) {
 #endif
 }
 
-static void remove_connection(int index) {
+static int conn_of_socket(int s) {
+    if (s < 0 || s >= conn_of_fd_alloc)
+        return -1;
+    return conn_of_fd[s];
+}
+
+/* Read from it unless it is closing or the client doesn't read the
+ * answers; wait to write if there is something to send */
+static void conn_update_events(int index) {
+    struct Client_conn *c = &client_cs[index];
+    int pending = c->out_size - c->out_pos;
+    int watch = 0;
+
+    if (!c->closing && pending <= CONN_OUTPUT_LIMIT)
+        watch |= EV_READ;
+    if (pending > 0)
+        watch |= EV_WRITE;
+    if (watch != c->watching) {
+        events_set(index, watch);
+        c->watching = watch;
+    }
+}
+
+static void conn_append_out(int index, const char *data, int size) {
+    struct Client_conn *c = &client_cs[index];
+
+    if (size <= 0)
+        return;
+
+    /* Reuse the room of what was already sent */
+    if (c->out_pos > 0 && c->out_size + size > c->out_alloc) {
+        memmove(c->out, c->out + c->out_pos, c->out_size - c->out_pos);
+        c->out_size -= c->out_pos;
+        c->out_pos = 0;
+    }
+    if (c->out_size + size > c->out_alloc) {
+        while (c->out_size + size > c->out_alloc)
+            c->out_alloc = c->out_alloc ? c->out_alloc * 2 : 4096;
+        c->out = (char *) realloc(c->out, c->out_alloc);
+        if (c->out == 0)
+            error("Cannot grow the output of a connection to %i", c->out_alloc);
+    }
+    memcpy(c->out + c->out_size, data, size);
+    c->out_size += size;
+}
+
+/* Send to the client what the socket takes now, and keep the rest */
+static void conn_send(int index, const char *head, int head_size,
+                      const char *body, int size) {
+    struct Client_conn *c = &client_cs[index];
+    struct iovec iov[2];
+    int res = 0;
+
+    /* Records of the journal not on disk yet: the answer waits for them,
+     * until the end of the round of the server loop */
+    if (c->out_size == c->out_pos && !journal_pending()) {
+        iov[0].iov_base = (void *) head;
+        iov[0].iov_len = head_size;
+        iov[1].iov_base = (void *) body;
+        iov[1].iov_len = size;
+        do
+            res = writev(c->socket, iov, 2);
+        while (res == -1 && errno == EINTR);
+        if (res == -1) {
+            /* It will be noticed when reading from it */
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return;
+            res = 0;
+        }
+    }
+
+    if (res < head_size) {
+        conn_append_out(index, head + res, head_size - res);
+        res = head_size;
+    }
+    conn_append_out(index, body + (res - head_size), size - (res - head_size));
+}
+
+/* On writability: send what was kept */
+static void conn_send_pending(int index) {
+    struct Client_conn *c = &client_cs[index];
+    int res;
+
+    while (c->out_pos < c->out_size) {
+        res = send(c->socket, c->out + c->out_pos, c->out_size - c->out_pos, 0);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            /* The client went away; forget the rest */
+            c->out_pos = c->out_size;
+            break;
+        }
+        c->out_pos += res;
+    }
+    if (c->out_pos == c->out_size)
+        c->out_pos = c->out_size = 0;
+
+    if (c->closing && c->out_size == 0) {
+        remove_connection(index);
+        return;
+    }
+    conn_update_events(index);
+}
+
+/* Queue what was captured for s as one answer */
+static void conn_queue_capture(int index, int request_id) {
+    struct Frame_header h;
+    char *body;
+    int size;
+
+    body = msg_capture_end(client_cs[index].socket, &size);
+    if (size <= 0)
+        return;
+    if (client_cs[index].framed) {
+        h.size = size;
+        h.request_id = request_id;
+        conn_send(index, (const char *) &h, sizeof(h), body, size);
+    } else
+        conn_send(index, 0, 0, body, size);
+    conn_update_events(index);
+}
+
+/* The request frame being handled for s, or 0 in v1 */
+int conn_request_id(int s) {
+    int index = conn_of_socket(s);
+
+    if (index == -1 || !client_cs[index].framed)
+        return 0;
+    return client_cs[index].request_id;
+}
+
+/* What DATA_QUERY pinned for the job being received from s, or null.
+ * The reference goes to the caller */
+char *conn_take_known(int s, int which) {
+    int index = conn_of_socket(s);
+    char *str;
+
+    if (index == -1)
+        return 0;
+    str = client_cs[index].known[which];
+    client_cs[index].known[which] = 0;
+    return str;
+}
+
+/* What JOB_RESOURCES pinned for the job being received from s, or null.
+ * The reference goes to the caller */
+char *conn_take_resources(int s) {
+    int index = conn_of_socket(s);
+    char *str;
+
+    if (index == -1)
+        return 0;
+    str = client_cs[index].resources;
+    client_cs[index].resources = 0;
+    return str;
+}
+
+/* Keep the resources of the next job of the connection */
+static void s_job_resources(int index, int size) {
+    struct Client_conn *c = &client_cs[index];
+    char *str;
+
+    intern_release(c->resources);
+    c->resources = 0;
+    if (size <= 0)
+        return;
+    str = (char *) malloc(size);
+    if (str == 0)
+        error("Cannot allocate %i bytes for the resources of a job", size);
+    if (recv_bytes(c->socket, str, size) != size)
+        error("Receiving the resources of a job");
+    c->resources = intern(str, size);
+    free(str);
+}
+
+/* Tell which of the data of its next job the server has, and keep them
+ * for it. The hash and the size name them, as in intern.c */
+static void s_data_query(int index, const struct Msg *m) {
+    struct Client_conn *c = &client_cs[index];
+    struct Msg a = default_msg();
     int i;
 
-    if (client_cs[index].hasjob) {
-        s_removejob(client_cs[index].jobid);
+    a.type = DATA_KNOWN;
+    for (i = DATA_ENV; i <= DATA_ENVP; ++i) {
+        intern_release(c->known[i]);
+        c->known[i] = 0;
+        if (m->u.data.size[i] > 0)
+            c->known[i] = intern_find(m->u.data.hash[i], m->u.data.size[i]);
+        a.u.data.hash[i] = m->u.data.hash[i];
+        a.u.data.size[i] = c->known[i] ? m->u.data.size[i] : 0;
+    }
+    send_msg(c->socket, &a);
+}
+
+/* What is sent to s from here to conn_frame_end is queued in the
+ * connection, in one frame if it is framed. For answers outside the
+ * handling of its request */
+void conn_frame_begin(int s) {
+    if (conn_of_socket(s) != -1)
+        msg_capture_begin(s);
+}
+
+void conn_frame_end(int s, int request_id) {
+    int index = conn_of_socket(s);
+
+    if (index != -1)
+        conn_queue_capture(index, request_id);
+}
+
+/* Queue the answers to the request being handled */
+static void end_request(int index) {
+    if (!client_cs[index].in_request)
+        return;
+    client_cs[index].in_request = 0;
+    msg_input_end();
+    conn_queue_capture(index, client_cs[index].request_id);
+}
+
+/* Closes the socket and puts the slot back in the free list.
+ * What the socket doesn't take of the pending output is lost. */
+static void remove_connection(int index) {
+    struct Client_conn *c = &client_cs[index];
+
+    if (c->hasjob) {
+        s_removejob(c->jobid);
+        conn_drop_job(index);
     }
 
-    for (i = index; i < (nconnections - 1); ++i) {
-        memcpy(&client_cs[i], &client_cs[i + 1], sizeof(client_cs[0]));
+    end_request(index);
+    intern_release(c->known[DATA_ENV]);
+    intern_release(c->known[DATA_ENVP]);
+    intern_release(c->resources);
+    if (c->out_pos < c->out_size)
+        send(c->socket, c->out + c->out_pos, c->out_size - c->out_pos, 0);
+    events_del(index);
+    close(c->socket);
+    conn_of_fd[c->socket] = -1;
+
+    /* The buffers stay for the next connection, unless they are large.
+     * 'in' may still be in use by the request that closed it. */
+    if (c->out_alloc > CONN_BUFFER_KEEP) {
+        free(c->out);
+        c->out = 0;
+        c->out_alloc = 0;
     }
+    c->in_size = 0;
+    c->out_pos = c->out_size = 0;
+
+    c->socket = -1;
+    c->next_free = first_free_conn;
+    first_free_conn = index;
     nconnections--;
 }
 
@@ -357,18 +1002,212 @@ clean_after_client_disappeared(int socket, int index) {
         /* We don't want this connection to do anything
          * more related to the jobid, secially on remove_connection
          * when we receive the EOC. */
-        client_cs[index].hasjob = 0;
+        conn_drop_job(index);
     } else
         /* If it doesn't have a running job,
          * it may well be a notification */
         s_remove_notification(socket);
 
-    close(socket);
     remove_connection(index);
 }
 
+/* Size of a counted list of ints at *need, added to *need.
+ * 0 if its count hasn't arrived */
+static int add_ints_size(const char *data, int size, long long *need) {
+    int num;
+
+    if (size < *need + (long long) sizeof(int)) {
+        *need += sizeof(int);
+        return 0;
+    }
+    memcpy(&num, data + *need, sizeof(int));
+    *need += sizeof(int) + (num > 0 ? (long long) num * sizeof(int) : 0);
+    return 1;
+}
+
+static long long add_sizes(int a, int b, int c, int d, int e) {
+    if (a < 0 || b < 0 || c < 0 || d < 0 || e < 0)
+        return (long long) MAX_FRAME_SIZE + 1;
+    return (long long) a + b + c + d + e;
+}
+
+/* The parser of the input of a connection. Returns the size of the request
+ * at data, or more than 'size' if it is not all there: the bytes needed
+ * to know more about it. -1 if it cannot be right.
+ * In v1 that needs the sizes of what follows each message, as the
+ * functions receiving them read it. */
+static int request_size(const char *data, int size, int framed) {
+    struct Frame_header h;
+    struct Msg m;
+    long long need;
+
+    if (framed) {
+        if (size < (int) sizeof(h))
+            return sizeof(h);
+        memcpy(&h, data, sizeof(h));
+        if (h.size < (int) sizeof(m) || h.size > MAX_FRAME_SIZE)
+            return -1;
+        return sizeof(h) + h.size;
+    }
+
+    if (size < (int) sizeof(m))
+        return sizeof(m);
+    memcpy(&m, data, sizeof(m));
+    need = sizeof(m);
+
+    switch (m.type) {
+        case NEWJOB:
+            if (!m.u.newjob.wait_free_gpus && !add_ints_size(data, size, &need))
+                break;
+            if (m.u.newjob.depend_on_size && !add_ints_size(data, size, &need))
+                break;
+            need += add_sizes(m.u.newjob.command_size,
+                              m.u.newjob.label_size, m.u.newjob.env_size, 0, 0);
+            if (m.u.newjob.server_exec)
+                need += add_sizes(m.u.newjob.argv_size, m.u.newjob.envp_size,
+                                  m.u.newjob.cwd_size, m.u.newjob.logfile_size, 0);
+            break;
+        case NEWJOB_BATCH:
+            need += add_sizes(m.u.newjob.env_size, m.u.newjob.envp_size,
+                              m.u.newjob.cwd_size, m.u.newjob.logfile_size,
+                              m.u.newjob.batch_size);
+            break;
+        case RUNJOB_OK:
+            if (m.u.output.store_output)
+                need += add_sizes(m.u.output.ofilename_size, 0, 0, 0, 0);
+            break;
+        case LIST:
+            need += add_sizes(m.u.list.label_size, 0, 0, 0, 0);
+            break;
+        case SET_LABEL_LIMIT:
+            need += add_sizes(m.u.label_limit.label_size, 0, 0, 0, 0);
+            break;
+        case JOB_RESOURCES:
+        case SET_RESOURCES:
+            need += add_sizes(m.u.size, 0, 0, 0, 0);
+            break;
+        case SET_LOGDIR:
+        case UPGRADE:
+        case GET_ENV:
+        case SET_ENV:
+        case UNSET_ENV:
+            need += add_sizes(m.u.size, 0, 0, 0, 0);
+            break;
+        default:
+            break;
+    }
+
+    if (need > MAX_FRAME_SIZE)
+        return -1;
+    return (int) need;
+}
+
+/* Handle one whole request, from memory */
+static enum Break
+client_request(int index, char *data, int size) {
+    struct Frame_header h;
+    int s = client_cs[index].socket;
+    enum Break b;
+
+    if (client_cs[index].framed) {
+        memcpy(&h, data, sizeof(h));
+        client_cs[index].request_id = h.request_id;
+        data += sizeof(h);
+        size -= sizeof(h);
+    }
+
+    msg_input_begin(s, data, size);
+    msg_capture_begin(s);
+    client_cs[index].in_request = 1;
+
+    b = client_process(index);
+
+    /* Unless the connection was closed while handling it */
+    end_request(index);
+    if (client_cs[index].framed_next)
+        client_cs[index].framed = 1;
+    return b;
+}
+
+/* Handle the requests all in 'in', while the client reads the answers */
+static enum Break
+client_process_input(int index) {
+    struct Client_conn *c = &client_cs[index];
+    unsigned int generation = c->generation;
+    enum Break b = NOBREAK;
+    int pos = 0;
+    int n;
+
+    while (c->in_size - pos >= c->in_need) {
+        if (c->closing || c->out_size - c->out_pos > CONN_OUTPUT_LIMIT)
+            break;
+
+        n = request_size(c->in + pos, c->in_size - pos, c->framed);
+        if (n == -1) {
+            warning("Wrong request from the socket %i", c->socket);
+            return CLOSE;
+        }
+        if (n > c->in_size - pos) {
+            c->in_need = n;
+            break;
+        }
+
+        b = client_request(index, c->in + pos, n);
+        if (c->socket == -1 || c->generation != generation)
+            return b;
+        pos += n;
+        c->in_need = 0;
+        if (b != NOBREAK)
+            break;
+    }
+
+    if (pos > 0) {
+        memmove(c->in, c->in + pos, c->in_size - pos);
+        c->in_size -= pos;
+    }
+
+    if (c->closing && c->out_size == c->out_pos) {
+        remove_connection(index);
+        return b;
+    }
+    conn_update_events(index);
+    return b;
+}
+
 static enum Break
 client_read(int index) {
+    struct Client_conn *c = &client_cs[index];
+    int room;
+    int res;
+
+    room = c->in_need - c->in_size;
+    if (room < CONN_READ_SIZE)
+        room = CONN_READ_SIZE;
+    if (c->in_size + room > c->in_alloc) {
+        c->in_alloc = c->in_size + room;
+        c->in = (char *) realloc(c->in, c->in_alloc);
+        if (c->in == 0)
+            error("Cannot grow the input of a connection to %i", c->in_alloc);
+    }
+
+    res = recv(c->socket, c->in + c->in_size, c->in_alloc - c->in_size, 0);
+    if (res == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return NOBREAK;
+        warning("client recv failed");
+        clean_after_client_disappeared(c->socket, index);
+        return NOBREAK;
+    } else if (res == 0) {
+        clean_after_client_disappeared(c->socket, index);
+        return NOBREAK;
+    }
+    c->in_size += res;
+
+    return client_process_input(index);
+}
+
+static enum Break
+client_process(int index) {
     struct Msg m = default_msg();
     int s;
     int res;
@@ -392,8 +1231,13 @@ client_read(int index) {
             return BREAK; /* break in the parent*/
             break;
         case NEWJOB:
-            client_cs[index].jobid = s_newjob(s, &m);
-            client_cs[index].hasjob = 1;
+            if (m.u.newjob.server_exec) {
+                /* Fire and forget: this connection does not hold the job */
+                send_newjob_ok(s, s_newjob(s, &m));
+                break;
+            }
+            conn_set_job(index, s_newjob(s, &m));
+            client_cs[index].job_request_id = client_cs[index].request_id;
             if (!job_is_holding_client(client_cs[index].jobid))
                 s_newjob_ok(index);
             else if (!m.u.newjob.wait_enqueuing) {
@@ -401,6 +1245,19 @@ client_read(int index) {
                 clean_after_client_disappeared(s, index);
             }
             break;
+        case NEWJOB_BATCH:
+            /* All run by the server, as with server_exec */
+            send_newjob_ok(s, s_newjob_batch(s, &m));
+            break;
+        case DATA_QUERY:
+            s_data_query(index, &m);
+            break;
+        case JOB_RESOURCES:
+            s_job_resources(index, m.u.size);
+            break;
+        case SET_RESOURCES:
+            s_set_resources(s, m.u.size);
+            break;
         case RUNJOB_OK: {
             char *buffer = 0;
             if (m.u.output.store_output) {
@@ -418,24 +1275,34 @@ client_read(int index) {
         case KILL_ALL:
             s_kill_all_jobs(s);
             break;
-        case LIST:
-            term_width = m.u.term_width;
-            s_list(s);
-            /* We must actively close, meaning End of Lines */
-            close(s);
-            remove_connection(index);
+        case LIST: {
+            char *label = 0;
+
+            if (m.u.list.label_size > 0) {
+                label = malloc(m.u.list.label_size);
+                recv_bytes(s, label, m.u.list.label_size);
+                label[m.u.list.label_size - 1] = '\0';
+            }
+            term_width = m.u.list.term_width;
+            s_list(s, &m.u.list, label);
+            free(label);
+        }
+            /* We must actively close, meaning End of Lines.
+             * In frames, the end of the frame is the end of lines. */
+            if (!client_cs[index].framed)
+                client_cs[index].closing = 1;
             break;
 #ifndef CPU
         case LIST_GPU:
             s_list_gpu(s);
-            close(s);
-            remove_connection(index);
+            if (!client_cs[index].framed)
+                client_cs[index].closing = 1;
             break;
 #endif
         case INFO:
             s_job_info(s, m.u.jobid);
-            close(s);
-            remove_connection(index);
+            if (!client_cs[index].framed)
+                client_cs[index].closing = 1;
             break;
         case LAST_ID:
             s_send_last_id(s);
@@ -453,7 +1320,7 @@ client_read(int index) {
             /* We don't want this connection to do anything
              * more related to the jobid, secially on remove_connection
              * when we receive the EOC. */
-            client_cs[index].hasjob = 0;
+            conn_drop_job(index);
             break;
         case CLEAR_FINISHED:
             s_clear_finished();
@@ -466,18 +1333,15 @@ client_read(int index) {
             /* Will update the jobid. If it's -1, will set the jobid found */
             went_ok = s_remove_job(s, &m.u.jobid);
             if (went_ok) {
-                int i;
-                for (i = 0; i < nconnections; ++i) {
-                    if (client_cs[i].hasjob && client_cs[i].jobid == m.u.jobid) {
-                        close(client_cs[i].socket);
-
-                        /* So remove_connection doesn't call s_removejob again */
-                        client_cs[i].hasjob = 0;
-
-                        /* We don't try to remove any notification related to
-                         * 'i', because it will be for sure a ts client for a job */
-                        remove_connection(i);
-                    }
+                int i = get_conn_of_jobid(m.u.jobid);
+
+                if (i != -1) {
+                    /* So remove_connection doesn't call s_removejob again */
+                    conn_drop_job(i);
+
+                    /* We don't try to remove any notification related to
+                     * 'i', because it will be for sure a ts client for a job */
+                    remove_connection(i);
                 }
             }
         }
@@ -504,6 +1368,13 @@ client_read(int index) {
             s_swap_jobs(s, m.u.swap.jobid1,
                         m.u.swap.jobid2);
             break;
+        case SET_PRIORITY:
+            s_set_priority(s, m.u.priority.jobid, m.u.priority.priority);
+            break;
+        case SET_LABEL_LIMIT:
+            s_set_label_limit(s, m.u.label_limit.max_running,
+                              m.u.label_limit.label_size);
+            break;
         case GET_STATE:
             s_send_state(s, m.u.jobid);
             break;
@@ -525,7 +1396,10 @@ client_read(int index) {
             break;
 #endif
         case GET_VERSION:
-            s_send_version(s);
+            s_send_version(s, m.u.version.framing);
+            /* The answer goes as in v1; what follows, in frames */
+            if (m.u.version.framing >= FRAMING_FRAMES)
+                client_cs[index].framed_next = 1;
             break;
         case GET_LOGDIR:
             s_get_logdir(s);
@@ -535,8 +1409,20 @@ client_read(int index) {
             recv_bytes(s, path, m.u.size);
             s_set_logdir(path);
         }
-            close(s);
-            remove_connection(index);
+            if (!client_cs[index].framed)
+                client_cs[index].closing = 1;
+            break;
+        case UPGRADE:
+            /* At the end of the round, with all its answers queued */
+            if (m.u.size <= 0)
+                return CLOSE;
+            free(upgrade_path);
+            upgrade_path = malloc(m.u.size);
+            recv_bytes(s, upgrade_path, m.u.size);
+            upgrade_path[m.u.size - 1] = '\0';
+            upgrade_index = index;
+            upgrade_generation = client_cs[index].generation;
+            upgrade_request_id = client_cs[index].request_id;
             break;
         default:
             /* Command not supported */
@@ -557,24 +1443,29 @@ static void s_runjob(int jobid, int index) {
 
     s = client_cs[index].socket;
 
+    conn_frame_begin(s);
     s_send_runjob(s, jobid);
+    conn_frame_end(s, client_cs[index].job_request_id);
 }
 
-static void s_newjob_ok(int index) {
-    int s;
+static void send_newjob_ok(int s, int jobid) {
     struct Msg m = default_msg();
 
-    if (!client_cs[index].hasjob)
-        error("Run job of the client %i which doesn't have any job", index);
-
-    s = client_cs[index].socket;
-
     m.type = NEWJOB_OK;
-    m.u.jobid = client_cs[index].jobid;
+    m.u.jobid = jobid;
 
     send_msg(s, &m);
 }
 
+static void s_newjob_ok(int index) {
+    if (!client_cs[index].hasjob)
+        error("Run job of the client %i which doesn't have any job", index);
+
+    conn_frame_begin(client_cs[index].socket);
+    send_newjob_ok(client_cs[index].socket, client_cs[index].jobid);
+    conn_frame_end(client_cs[index].socket, client_cs[index].job_request_id);
+}
+
 static void s_newjob_nok(int index) {
     int s;
     struct Msg m = default_msg();
@@ -586,7 +1477,266 @@ static void s_newjob_nok(int index) {
 
     m.type = NEWJOB_NOK;
 
+    conn_frame_begin(s);
     send_msg(s, &m);
+    conn_frame_end(s, client_cs[index].job_request_id);
+}
+
+/* The answer to ts --upgrade, from the old server or from the new one */
+static void answer_upgrade(int s, const char *text) {
+    int index = conn_of_socket(s);
+
+    if (index == -1)
+        return;
+    conn_frame_begin(s);
+    send_list_line(s, text);
+    conn_frame_end(s, upgrade_request_id);
+    /* In v1, the end of the lines */
+    if (!client_cs[index].framed) {
+        client_cs[index].closing = 1;
+        if (client_cs[index].out_size == client_cs[index].out_pos)
+            remove_connection(index);
+        else
+            conn_update_events(index);
+    }
+}
+
+/* Whether the sockets that go to the new ts are closed on exec */
+static void set_sockets_cloexec(int cloexec) {
+    int i;
+
+    fcntl(listen_socket, F_SETFD, cloexec ? FD_CLOEXEC : 0);
+    for (i = 0; i < client_cs_alloc; ++i)
+        if (client_cs[i].socket != -1)
+            fcntl(client_cs[i].socket, F_SETFD, cloexec ? FD_CLOEXEC : 0);
+}
+
+static void handover_conn(const struct Client_conn *c) {
+    journal_begin(JR_CONN);
+    journal_int(c->socket);
+    journal_int(c->hasjob);
+    journal_int(c->jobid);
+    journal_int(c->framed);
+    journal_int(c->request_id);
+    journal_int(c->job_request_id);
+    journal_int(c->closing);
+    journal_int(c->in_need);
+    journal_bytes(c->in, c->in_size);
+    journal_bytes(c->out + c->out_pos, c->out_size - c->out_pos);
+    journal_bytes(c->known[DATA_ENV], intern_size(c->known[DATA_ENV]));
+    journal_bytes(c->known[DATA_ENVP], intern_size(c->known[DATA_ENVP]));
+    journal_bytes(c->resources, intern_size(c->resources));
+    journal_end();
+}
+
+/* ts --upgrade. The new ts runs in this process: it keeps the listen
+ * socket, the connections, and the jobs the server forked, which go on
+ * being its children. The rest goes in a file, in records as those of the
+ * journal. If the new ts cannot be run, this server goes on */
+static void server_upgrade() {
+    char *new_path = upgrade_path;
+    char fd_arg[20];
+    char *argv[4];
+    sigset_t mask;
+    FILE *f;
+    int fd;
+    int i;
+
+    upgrade_path = 0;
+    upgrade_socket = -1;
+    if (client_cs[upgrade_index].socket != -1
+        && client_cs[upgrade_index].generation == upgrade_generation)
+        upgrade_socket = client_cs[upgrade_index].socket;
+
+    f = tmpfile();
+    if (f == 0) {
+        warning("Cannot create the file for the upgrade");
+        answer_upgrade(upgrade_socket, "Cannot create the file for the new server.\n");
+        free(new_path);
+        return;
+    }
+    fd = fileno(f);
+
+    journal_dump_begin(fd);
+    journal_begin(JR_SERVER);
+    journal_int(listen_socket);
+    journal_string(path);
+    journal_string(logdir);
+    journal_int(journal_generation());
+    journal_int(upgrade_socket);
+    journal_int(upgrade_request_id);
+#ifndef CPU
+    journal_int(getFreePercentage());
+#else
+    journal_int(0);
+#endif
+    journal_end();
+    s_journal_snapshot();
+    for (i = 0; i < client_cs_alloc; ++i)
+        if (client_cs[i].socket != -1)
+            handover_conn(&client_cs[i]);
+    s_handover_waiters();
+    server_exec_handover();
+
+    if (journal_dump_end() == 0 && lseek(fd, 0, SEEK_SET) == 0) {
+        sprintf(fd_arg, "%i", fd);
+        argv[0] = new_path;
+        argv[1] = "--handover";
+        argv[2] = fd_arg;
+        argv[3] = 0;
+
+        set_sockets_cloexec(0);
+        /* As the first server got it */
+        sigprocmask(SIG_SETMASK, NULL, &mask);
+        restore_sigmask();
+        execv(new_path, argv);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        set_sockets_cloexec(1);
+    }
+
+    warning("Cannot run %s for the upgrade", new_path);
+    {
+        char text[PATH_MAX + 50];
+
+        snprintf(text, sizeof(text), "Cannot run %s as the new server.\n", new_path);
+        answer_upgrade(upgrade_socket, text);
+    }
+    fclose(f);
+    free(new_path);
+}
+
+static void handover_server(struct Journal_reader *r) {
+    listen_socket = jr_int(r);
+    path = jr_string(r);
+    free(logdir);
+    logdir = jr_string(r);
+    handover_generation = jr_int(r);
+    upgrade_socket = jr_int(r);
+    upgrade_request_id = jr_int(r);
+#ifndef CPU
+    setFreePercentage(jr_int(r));
+#else
+    jr_int(r);
+#endif
+}
+
+static void handover_conn_back(struct Journal_reader *r) {
+    struct Client_conn *c;
+    char *in, *out;
+    int index;
+    int in_size, out_size;
+    int s;
+
+    s = jr_int(r);
+    if (s < 0 || r->error)
+        return;
+    index = add_connection(s);
+    c = &client_cs[index];
+    c->hasjob = jr_int(r);
+    c->jobid = jr_int(r);
+    if (c->hasjob)
+        conn_set_job(index, c->jobid);
+    c->framed = jr_int(r);
+    c->request_id = jr_int(r);
+    c->job_request_id = jr_int(r);
+    c->closing = jr_int(r);
+    c->in_need = jr_int(r);
+
+    in = jr_bytes(r, &in_size);
+    if (in_size > 0) {
+        c->in_alloc = in_size + CONN_READ_SIZE;
+        c->in = (char *) realloc(c->in, c->in_alloc);
+        if (c->in == 0)
+            error("Cannot grow the input of a connection to %i", c->in_alloc);
+        memcpy(c->in, in, in_size);
+        c->in_size = in_size;
+    }
+    free(in);
+    out = jr_bytes(r, &out_size);
+    conn_append_out(index, out, out_size);
+    free(out);
+    /* Not in the records of older servers */
+    if (r->pos < r->size) {
+        const char *data;
+        int size;
+
+        data = jr_view(r, &size);
+        c->known[DATA_ENV] = intern_bytes(data, size);
+        data = jr_view(r, &size);
+        c->known[DATA_ENVP] = intern_bytes(data, size);
+    }
+    if (r->pos < r->size) {
+        const char *data;
+        int size;
+
+        data = jr_view(r, &size);
+        c->resources = intern_bytes(data, size);
+    }
+    conn_update_events(index);
+}
+
+static void handover_apply(int type, struct Journal_reader *r) {
+    switch (type) {
+        case JR_SERVER:
+            handover_server(r);
+            break;
+        case JR_CONN:
+            handover_conn_back(r);
+            break;
+        case JR_CHILD:
+            server_exec_adopt(r);
+            break;
+        default:
+            s_journal_apply(type, r);
+    }
+}
+
+/* The start of the new ts in ts --upgrade, in the process of the server
+ * that executed it. fd has what that one handed over */
+void server_handover(int fd) {
+    char text[100];
+    int i;
+
+    process_type = SERVER;
+    max_descriptors = get_max_descriptors();
+    max_jobs = max_descriptors - 5;
+    nconnections = 0;
+
+    install_sigterm_handler();
+
+#ifndef CPU
+    initGPU();
+#endif
+
+    events_init();
+    readyq_init();
+    resources_init();
+    journal_load(fd, handover_apply);
+    close(fd);
+    if (listen_socket == -1 || path == 0)
+        error("The old server did not hand its socket over");
+    set_sockets_cloexec(1);
+    journal_resume(handover_generation);
+    s_finished_init();
+
+    snprintf(text, sizeof(text), "Upgraded the server to Task Spooler %s.\n",
+             TS_MAKE_STR(TS_VERSION));
+    answer_upgrade(upgrade_socket, text);
+
+    /* Requests that arrived in the same round as the upgrade */
+    for (i = 0; i < client_cs_alloc; ++i)
+        if (client_cs[i].socket != -1 && client_cs[i].in_size > 0) {
+            enum Break b = client_process_input(i);
+
+            if (b == CLOSE && client_cs[i].socket != -1)
+                clean_after_client_disappeared(client_cs[i].socket, i);
+            else if (b == BREAK) {
+                end_server(listen_socket);
+                return;
+            }
+        }
+
+    server_loop(listen_socket);
 }
 
 static void dump_conn_struct(FILE *out, const struct Client_conn *p) {
@@ -601,7 +1751,8 @@ void dump_conns_struct(FILE *out) {
 
     fprintf(out, "New_conns");
 
-    for (i = 0; i < nconnections; ++i) {
-        dump_conn_struct(out, &client_cs[i]);
+    for (i = 0; i < client_cs_alloc; ++i) {
+        if (client_cs[i].socket != -1)
+            dump_conn_struct(out, &client_cs[i]);
     }
 }
@@ -0,0 +1,394 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
+
+#include "main.h"
+
+extern char **environ;
+
+/* The jobs the server forked itself, and when they started */
+struct Exec_child {
+    int pid;
+    int jobid;
+    struct timeval start;
+};
+
+static struct Exec_child *children;
+static int nchildren;
+static int children_alloc;
+
+/* Readable when some child may have died */
+static int child_fd = -1;
+
+#ifndef __linux__
+static int child_pipe_write = -1;
+
+static void sigchld_handler(int n) {
+    int saved_errno = errno;
+    char c = 0;
+
+    write(child_pipe_write, &c, 1);
+    errno = saved_errno;
+}
+#endif
+
+/* Returns the descriptor to watch in the server loop */
+int server_exec_init() {
+#ifdef __linux__
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    child_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (child_fd == -1)
+        error("Cannot create the signalfd for SIGCHLD");
+#else
+    struct sigaction act;
+    int p[2];
+
+    if (pipe(p) == -1)
+        error("Cannot create the SIGCHLD pipe");
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    fcntl(p[1], F_SETFL, O_NONBLOCK);
+    fcntl(p[0], F_SETFD, FD_CLOEXEC);
+    fcntl(p[1], F_SETFD, FD_CLOEXEC);
+    child_fd = p[0];
+    child_pipe_write = p[1];
+
+    act.sa_handler = sigchld_handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &act, NULL);
+#endif
+    return child_fd;
+}
+
+void server_exec_free(struct Execinfo *e) {
+    if (e == 0)
+        return;
+    pool_free(e->argv);
+    intern_release(e->envp);
+    pool_free(e->cwd);
+    pool_free(e->logfile);
+    pool_free(e);
+}
+
+/* From the packed "a\0b\0" form to a null terminated array */
+static char **unpack_strings(char *packed, int size) {
+    char **array;
+    int count = 0;
+    int i, j;
+
+    for (i = 0; i < size; ++i)
+        if (packed[i] == '\0')
+            ++count;
+
+    array = (char **) malloc((count + 1) * sizeof(char *));
+    if (array == 0)
+        error("Cannot allocate the array of %i strings", count);
+
+    for (i = 0, j = 0; j < count; ++j) {
+        array[j] = packed + i;
+        i += strlen(packed + i) + 1;
+    }
+    array[count] = 0;
+    return array;
+}
+
+static int open_output_file(const struct Job *p, char **ofname) {
+    const char *name = p->exec->logfile ? p->exec->logfile : "ts-out";
+    const char *dir = logdir ? logdir : "/tmp";
+    char *path;
+    int fd;
+
+    path = (char *) malloc(strlen(dir) + 1 + strlen(name) + strlen(".XXXXXX") + 1);
+    if (path == 0)
+        error("Cannot allocate the output filename");
+    sprintf(path, "%s/%s.XXXXXX", dir, name);
+
+    fd = mkstemp(path);
+    if (fd == -1) {
+        warning("Cannot create the output file %s", path);
+        free(path);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    /* The first line tells the command, as the client does */
+    write(fd, p->command, strlen(p->command));
+    write(fd, "\n", 1);
+
+    *ofname = path;
+    return fd;
+}
+
+/* Set up stdout/stderr like run_child() in execute.c, and exec the command */
+static void exec_child(const struct Job *p, int outfd, const char *ofname) {
+    const struct Execinfo *e = p->exec;
+    char **argv;
+    int fd;
+
+    restore_sigmask();
+    signal(SIGCHLD, SIG_DFL);
+
+    /* We create a new session, so we can kill process groups as:
+         kill -- -`ts -p` */
+    setsid();
+
+    fd = open("/dev/null", O_RDWR);
+    dup2(fd, 0);
+
+    if (outfd != -1) {
+        int errfd = -1;
+
+        if (e->stderr_apart) {
+            char *errfname = (char *) malloc(strlen(ofname) + 3);
+            sprintf(errfname, "%s.e", ofname);
+            errfd = open(errfname, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+            free(errfname);
+        }
+
+        if (e->gzip) {
+            int pp[2];
+
+            pipe(pp);
+            dup2(pp[1], 1);
+            dup2(errfd != -1 ? errfd : pp[1], 2);
+            close(pp[1]);
+            /* gzip reads the pipe and writes to the output file */
+            run_gzip(outfd, pp[0]);
+        } else {
+            dup2(outfd, 1);
+            dup2(errfd != -1 ? errfd : outfd, 2);
+            close(outfd);
+        }
+        if (errfd != -1)
+            close(errfd);
+    } else {
+        dup2(fd, 1);
+        dup2(fd, 2);
+    }
+    if (fd > 2)
+        close(fd);
+
+    if (chdir(e->cwd) == -1)
+        fprintf(stderr, "ts could not change to the directory %s\n", e->cwd);
+
+    /* The environment of the enqueuing ts */
+    environ = unpack_strings(e->envp, e->envp_size);
+    if (p->num_gpus) {
+        char *ids = ints_to_chars(p->gpu_ids, p->num_gpus, ",");
+        char *var = (char *) malloc(strlen(ids) + strlen("CUDA_VISIBLE_DEVICES=") + 1);
+        sprintf(var, "CUDA_VISIBLE_DEVICES=%s", ids);
+        putenv(var);
+    } else
+        putenv("CUDA_VISIBLE_DEVICES=-1");
+    putenv("PYTHONUNBUFFERED=1");
+
+    argv = unpack_strings(e->argv, e->argv_size);
+    execvp(argv[0], argv);
+
+    fprintf(stderr, "ts could not run the command\n");
+    _exit(-1);
+}
+
+static void add_child(int pid, int jobid, const struct timeval *start) {
+    if (nchildren == children_alloc) {
+        children_alloc = children_alloc ? children_alloc * 2 : 16;
+        children = (struct Exec_child *) realloc(children,
+                    children_alloc * sizeof(*children));
+        if (children == 0)
+            error("Cannot allocate the list of %i children", children_alloc);
+    }
+    children[nchildren].pid = pid;
+    children[nchildren].jobid = jobid;
+    children[nchildren].start = *start;
+    ++nchildren;
+}
+
+/* Returns the pid of the job, or -1. *ofname gets the output file, if any */
+int server_exec_fork(const struct Job *p, char **ofname) {
+    int pid;
+    int outfd = -1;
+
+    *ofname = 0;
+    if (p->store_output)
+        outfd = open_output_file(p, ofname);
+
+    pid = fork();
+    switch (pid) {
+        case 0:
+            close(child_fd);
+            exec_child(p, outfd, *ofname);
+            /* Not reachable */
+            break;
+        case -1:
+            warning("Cannot fork the job %i", p->jobid);
+            break;
+        default: {
+            struct timeval start;
+
+            gettimeofday(&start, NULL);
+            add_child(pid, p->jobid, &start);
+        }
+    }
+
+    if (outfd != -1)
+        close(outfd);
+    return pid;
+}
+
+/* The children go on being of this process after ts --upgrade: the new
+ * server only needs to know them */
+void server_exec_handover() {
+    int i;
+
+    for (i = 0; i < nchildren; ++i) {
+        journal_begin(JR_CHILD);
+        journal_int(children[i].pid);
+        journal_int(children[i].jobid);
+        journal_data(&children[i].start, sizeof(children[i].start));
+        journal_end();
+    }
+}
+
+void server_exec_adopt(struct Journal_reader *r) {
+    struct timeval start;
+    int pid, jobid;
+
+    pid = jr_int(r);
+    jobid = jr_int(r);
+    jr_data(r, &start, sizeof(start));
+    if (!r->error)
+        add_child(pid, jobid, &start);
+}
+
+static void fill_result(struct Result *result, int status,
+                        const struct rusage *ru, const struct timeval *start) {
+    struct timeval endtv;
+
+    *result = default_result();
+
+    /* Set the errorlevel, the same way as run_parent() */
+    if (WIFEXITED(status)) {
+        /* We force the proper cast */
+        signed char tmp;
+        tmp = WEXITSTATUS(status);
+        result->errorlevel = tmp;
+        result->died_by_signal = 0;
+    } else if (WIFSIGNALED(status)) {
+        signed char tmp;
+        tmp = WTERMSIG(status);
+        result->signal = tmp;
+        result->errorlevel = -1;
+        result->died_by_signal = 1;
+    } else {
+        result->died_by_signal = 0;
+        result->errorlevel = -1;
+    }
+
+    gettimeofday(&endtv, NULL);
+    result->real_ms = endtv.tv_sec - start->tv_sec +
+                      ((float) (endtv.tv_usec - start->tv_usec) / 1000000.);
+    result->user_ms = ru->ru_utime.tv_sec +
+                      (float) ru->ru_utime.tv_usec / 1000000.;
+    result->system_ms = ru->ru_stime.tv_sec +
+                        (float) ru->ru_stime.tv_usec / 1000000.;
+}
+
+/* Called when child_fd is readable */
+void server_exec_reap() {
+    char buffer[256];
+    int pid;
+    int status;
+    struct rusage ru;
+
+    /* Drain the notifications; waitpid below tells the real story */
+    while (read(child_fd, buffer, sizeof(buffer)) > 0)
+        ;
+
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+        struct Result result;
+        int i;
+
+        for (i = 0; i < nchildren; ++i)
+            if (children[i].pid == pid)
+                break;
+
+        /* Mail or TS_ONFINISH helpers */
+        if (i == nchildren)
+            continue;
+
+        fill_result(&result, status, &ru, &children[i].start);
+        {
+            int jobid = children[i].jobid;
+
+            children[i] = children[--nchildren];
+            s_exec_job_finished(jobid, &result);
+        }
+    }
+}
+
+static int packed_has_var(const char *packed, int size, const char *name) {
+    int i = 0;
+    int len = strlen(name);
+
+    while (i < size) {
+        if (strncmp(packed + i, name, len) == 0 && packed[i + len] == '=')
+            return 1;
+        i += strlen(packed + i) + 1;
+    }
+    return 0;
+}
+
+/* The mail and TS_ONFINISH duties of the client, in a helper process so
+ * the server never waits for them */
+void server_exec_notify(const struct Job *p, int errorlevel) {
+    const struct Execinfo *e = p->exec;
+    int pid;
+
+    if (!e->send_output_by_mail
+        && !packed_has_var(e->envp, e->envp_size, "TS_ONFINISH"))
+        return;
+
+    pid = fork();
+    switch (pid) {
+        case 0:
+            restore_sigmask();
+            signal(SIGCHLD, SIG_DFL);
+            close(child_fd);
+            close_server_sockets();
+            /* TS_MAILTO, TS_ONFINISH... as the job saw them */
+            environ = unpack_strings(e->envp, e->envp_size);
+            if (e->send_output_by_mail && p->output_filename)
+                send_mail(p->jobid, errorlevel, p->output_filename, p->command);
+            hook_on_finish(p->jobid, errorlevel, p->output_filename, p->command);
+            _exit(0);
+        case -1:
+            warning("Cannot fork the notification of job %i", p->jobid);
+            break;
+        default:
+            break;
+    }
+}
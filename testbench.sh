@@ -149,3 +149,281 @@ if [ $? -ne 0 ]; then
 fi
 
 ./ts -K
+
+# Test a client that stops reading a long list
+./ts -S 1
+J0=`./ts sleep 100`
+seq 20000 | sed "s/^/-D $J0 true /" | ./ts --batch - > /dev/null
+./ts -l | sleep 60 &
+READER=$!
+sleep 1
+J1=`timeout 5 ./ts true` &&
+timeout 5 ./ts -S 2 &&
+timeout 5 ./ts -w $J1 &&
+timeout 5 ./ts -l > /dev/null
+if [ $? -ne 0 ]; then
+  echo "Error with a stalled reader."
+  exit 1
+fi
+kill $READER
+wait
+
+./ts -k $J0
+./ts -K
+
+# The server of so many jobs takes a while to go
+sleep 1
+
+# Test that a job of unknown end doesn't let others pass a wide one
+./ts -S 2
+J0=`./ts sleep 2`
+J1=`./ts -N 2 true`
+J2=`./ts --runtime 1000 sleep 10`
+sleep 1
+STATE=`./ts -s $J2`
+if [ "$STATE" != "queued" ]; then
+  echo "Error in the backfill without a known end."
+  exit 1
+fi
+./ts -w $J1
+./ts -k $J2
+./ts -K
+
+# Test that a short job backfills after a labeled job has run
+./ts -S 2
+J0=`./ts -L foo true`
+./ts -w $J0
+J1=`./ts --runtime 4 sleep 4`
+J2=`./ts -N 2 true`
+J3=`./ts --runtime 1 sleep 1`
+sleep 1
+STATE=`./ts -s $J3`
+if [ "$STATE" != "running" ] && [ "$STATE" != "finished" ]; then
+  echo "Error in the backfill after a labeled job."
+  exit 1
+fi
+./ts -k $J1
+./ts -w $J2
+./ts -K
+
+# Test the limit of running jobs of a label
+./ts -S 3
+./ts --set_max_running foo=1
+J0=`./ts -L foo sleep 2`
+J1=`./ts -L foo true`
+J2=`./ts -L bar sleep 1`
+J3=`./ts -L baz --max_running 1 sleep 2`
+J4=`./ts -L baz true`
+sleep 1
+if [ "`./ts -s $J1`" != "queued" ] || [ "`./ts -s $J4`" != "queued" ] ||
+   [ "`./ts -s $J2`" = "queued" ]; then
+  echo "Error keeping the jobs of a full label queued."
+  exit 1
+fi
+./ts -w $J0
+./ts -w $J1
+if [ $? -ne 0 ] || [ "`./ts -s $J1`" != "finished" ]; then
+  echo "Error running the job of a label that has room again."
+  exit 1
+fi
+./ts -w $J4
+./ts -K
+
+# Test the resources of the jobs
+TS_RESOURCES=lic=1 ./ts -S 2
+J0=`./ts --res lic=1 sleep 2`
+J1=`./ts --res lic=1 true`
+sleep 1
+HEADER=`./ts -l | head -n 1`
+STATE=`./ts -s $J1`
+case "$HEADER" in
+  *"[lic=1/1]"*) ;;
+  *) echo "Error in the header of the resources."
+     exit 1 ;;
+esac
+if [ "$STATE" != "queued" ]; then
+  echo "Error waiting for a resource."
+  exit 1
+fi
+./ts -w $J1
+if [ $? -ne 0 ]; then
+  echo "Error running a job after its resource is released."
+  exit 1
+fi
+./ts --set_res lic=2
+J2=`./ts --res lic=1 sleep 2`
+J3=`./ts --res lic=1 sleep 2`
+sleep 1
+STATE=`./ts -s $J3`
+if [ "$STATE" != "running" ]; then
+  echo "Error in --set_res."
+  exit 1
+fi
+./ts -w
+./ts -K
+
+# Test that the queue outlives a crash of the server, with TS_JOURNAL
+export TS_JOURNAL=`mktemp -u /tmp/ts-journal.XXXXXX`
+./ts -S 1
+J0=`./ts --server_exec sh -c 'echo $PPID; sleep 2'`
+J1=`./ts --server_exec true`
+J2=`./ts --server_exec -L kept true`
+sleep 1
+kill -9 `tail -n 1 \`./ts -o $J0\``
+sleep 1
+./ts -w $J2
+if [ $? -ne 0 ] || [ "`./ts -s $J1`" != "finished" ] ||
+   [ `./ts -l | grep -c '\[kept\]true'` -ne 1 ]; then
+  echo "Error restoring the queue from the journal."
+  exit 1
+fi
+./ts -K
+rm -f $TS_JOURNAL $TS_JOURNAL.snap
+unset TS_JOURNAL
+
+# Test a batch of jobs
+./ts -S 2
+JOBS=`printf 'true\n# A comment\n\n-L batch false\n-N 2 true\n' | ./ts --batch -`
+if [ `echo "$JOBS" | wc -l` -ne 3 ]; then
+  echo "Error queueing a batch."
+  exit 1
+fi
+for J in $JOBS; do ./ts -w $J; done
+if [ `./ts -l | grep finished | wc -l` -ne 3 ] ||
+   [ `./ts -l | grep -c '\[batch\]false'` -ne 1 ]; then
+  echo "Error running a batch."
+  exit 1
+fi
+printf 'true\n-N 0 true\n' | ./ts --batch - 2> /dev/null
+if [ $? -eq 0 ] || [ `./ts -l | wc -l` -ne 4 ]; then
+  echo "Error rejecting a wrong batch."
+  exit 1
+fi
+./ts -K
+
+# Test the dependencies on ranges of jobs
+./ts -S 3
+J0=`./ts sleep 1`
+J1=`./ts false`
+J2=`./ts sleep 1`
+J3=`./ts -W $J0-$J2:2 true`
+J4=`./ts -W $J0-$J2 true`
+J5=`./ts sleep 1`
+J6=`./ts -D 0-1000000 true`
+if [ "`./ts -s $J6`" != "queued" ]; then
+  echo "Error waiting for a wide range of jobs."
+  exit 1
+fi
+./ts -w $J3
+if [ $? -ne 0 ] || [ "`./ts -s $J4`" = "finished" ]; then
+  echo "Error depending on a range of jobs."
+  exit 1
+fi
+./ts -w $J6
+if [ "`./ts -s $J6`" != "finished" ] || [ "`./ts -s $J4`" != "skipped" ]; then
+  echo "Error depending on a range of jobs."
+  exit 1
+fi
+./ts -K
+
+# Test the history of the jobs that left the list, with TS_HISTORY
+export TS_HISTORY=`mktemp -u /tmp/ts-history.XXXXXX`
+export TS_MAXFINISHED=1
+./ts -S 1
+J0=`./ts sh -c 'exit 3'`
+J1=`./ts true`
+J2=`./ts true`
+./ts -w $J2
+./ts -w $J0
+if [ $? -ne 3 ] || [ "`./ts -s $J0`" != "finished" ] ||
+   ! ./ts -i $J0 | grep -q 'exit code 3' || ./ts -l | grep -q 'exit 3'; then
+  echo "Error keeping an evicted job in the history."
+  exit 1
+fi
+./ts -K
+# The index is rebuilt from the records
+SIZE=`wc -c < $TS_HISTORY.idx`
+head -c 20 $TS_HISTORY.idx > $TS_HISTORY.part
+mv $TS_HISTORY.part $TS_HISTORY.idx
+./ts -w $J1
+if [ $? -ne 0 ] || [ "`./ts -s $J0`" != "finished" ] ||
+   [ `wc -c < $TS_HISTORY.idx` -ne $SIZE ]; then
+  echo "Error rebuilding the index of the history."
+  exit 1
+fi
+./ts -K
+rm -f $TS_HISTORY $TS_HISTORY.idx
+unset TS_HISTORY TS_MAXFINISHED
+
+# Test the order of the jobs of several priorities behind a blocker
+ORDER=`mktemp /tmp/ts-order.XXXXXX`
+./ts -S 1
+./ts sleep 1 > /dev/null
+./ts sh -c "echo a >> $ORDER" > /dev/null
+./ts -P 5 sh -c "echo b >> $ORDER" > /dev/null
+J0=`./ts -P -1 sh -c "echo c >> $ORDER"`
+./ts -P 5 sh -c "echo d >> $ORDER" > /dev/null
+J1=`./ts -P -2 sh -c "echo e >> $ORDER"`
+./ts --set_priority $J0=10
+./ts -w $J1
+if [ "`cat $ORDER | tr -d '\n'`" != "cbdae" ]; then
+  echo "Error running the jobs by their priority."
+  exit 1
+fi
+./ts -K
+rm -f $ORDER
+
+# Test that ts --upgrade keeps the running and the queued jobs
+./ts -S 2
+J0=`./ts --server_exec sh -c 'sleep 2; exit 4'`
+J1=`./ts sh -c 'sleep 2; exit 5'`
+J2=`./ts -L kept sh -c 'exit 2'`
+sleep 1
+./ts --upgrade > /dev/null
+if [ $? -ne 0 ] || [ "`./ts -s $J0`" != "running" ] ||
+   [ "`./ts -s $J1`" != "running" ] || [ "`./ts -s $J2`" != "queued" ]; then
+  echo "Error keeping the jobs through an upgrade."
+  exit 1
+fi
+./ts -w $J0
+E0=$?
+./ts -w $J1
+E1=$?
+./ts -w $J2
+E2=$?
+if [ $E0 -ne 4 ] || [ $E1 -ne 5 ] || [ $E2 -ne 2 ] ||
+   [ `./ts -l | grep -c '\[kept\]sh'` -ne 1 ]; then
+  echo "Error finishing the jobs adopted through an upgrade."
+  exit 1
+fi
+./ts -K
+
+# Test that the limits of the labels outlive a crash and an upgrade
+export TS_JOURNAL=`mktemp -u /tmp/ts-journal.XXXXXX`
+./ts -S 3
+./ts --set_max_running foo=1
+J0=`./ts -L baz --max_running 1 --server_exec sh -c 'echo $PPID'`
+./ts -w $J0
+kill -9 `tail -n 1 \`./ts -o $J0\``
+sleep 1
+J1=`./ts -L foo sleep 3`
+J2=`./ts -L foo true`
+J3=`./ts -L baz sleep 3`
+J4=`./ts -L baz true`
+sleep 1
+if [ "`./ts -s $J2`" != "queued" ] || [ "`./ts -s $J4`" != "queued" ]; then
+  echo "Error keeping the limits of the labels through a crash."
+  exit 1
+fi
+./ts --upgrade > /dev/null
+J5=`./ts -L foo true`
+if [ "`./ts -s $J2`" != "queued" ] || [ "`./ts -s $J4`" != "queued" ] ||
+   [ "`./ts -s $J5`" != "queued" ]; then
+  echo "Error keeping the limits of the labels through an upgrade."
+  exit 1
+fi
+./ts -w $J5
+./ts -w $J4
+./ts -K
+rm -f $TS_JOURNAL $TS_JOURNAL.snap
+unset TS_JOURNAL